@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "status.h"
+#include "type.h"
+
+// Asynchronous reads and writes of whole files, so that decoding threads never wait for the disk.
+// On Linux, requests go through io_uring, which keeps all of them in flight with a single thread
+// reaping their completions. On other systems, when the kernel refuses io_uring, or when the
+// JPEG_ASYNC_IO environment variable is "threads", a pool of threads does blocking I/O instead.
+
+// A read or write that AsyncFileIO has finished.
+struct IOCompletion
+{
+    uint64_t tag = 0;
+    bool write = false;
+    Status status;
+    // The contents of the file, for a read.
+    std::vector<unsigned char> data;
+};
+
+// Called with every finished request, from an I/O thread, as soon as it finishes. It may submit
+// more requests without blocking: the first takes the place of the finished request, and any more
+// briefly go over the queue depth.
+typedef std::function<void(IOCompletion& completion)> IOCallback;
+
+struct AsyncIOState;
+
+class AsyncFileIO
+{
+public:
+    // Keep up to queueDepth requests in flight. Submitting more blocks until one finishes.
+    explicit AsyncFileIO(const IOCallback& callback, uint queueDepth = 32);
+    // Wait for every request in flight.
+    ~AsyncFileIO();
+    AsyncFileIO(const AsyncFileIO&) = delete;
+    AsyncFileIO& operator=(const AsyncFileIO&) = delete;
+
+    // Read a whole file, or write data to one, passing tag to the callback. Requests may be
+    // submitted from any thread.
+    void read(const std::string& filename, uint64_t tag);
+    void write(const std::string& filename, std::vector<unsigned char> data, uint64_t tag);
+
+    // Wait until no request is in flight and the callback has returned for all of them.
+    void wait();
+
+    // "io_uring" or "threads".
+    const char* backend() const;
+
+private:
+    AsyncIOState* state;
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <istream>
+#include <string>
+
+#include "index.h"
+#include "jpeg.h"
+#include "status.h"
+
+// Parsing
+Header* readJPG(const std::string& filename, const RestartIndex* index = nullptr);
+Header* readJPG(std::istream& input, const RestartIndex* index = nullptr);
+Header* readJPGHeader(std::istream& input);
+Header* readJPGFrame(std::istream& input, Header* previous = nullptr);
+Header* checkJPG(std::istream& input, ErrorLocation* location = nullptr);
+Header* readDCValues(std::istream& input, DCPlanes& dc);
+bool readScanData(Header* header, const unsigned char* data, std::size_t size);
+void readMarker(std::istream& inFile, Header* header, byte marker);
+void validateHeader(Header* header);
+bool parseExif(const unsigned char* data, std::size_t size, uint64_t offset, Exif& exif);
+void setFrameGeometry(Header* header);
+void printHeader(const Header* header);
+void printStatistics(const Header* header);
+bool setCrop(Header* header, const Crop& crop);
+
+// Entropy decoding
+void generateCodes(HuffmanTable& hTable);
+bool sameHuffmanTable(const HuffmanTable& a, const HuffmanTable& b);
+ScanUnits getScanUnits(const Header* header, const Scan& scan);
+bool intervalNeeded(const ScanUnits& units, uint first, uint count);
+int* componentBlock(const Header* header, MCU* mcus, uint component, uint x, uint y);
+bool findCheckpoints(const Header* header, Scan& scan, uint interval);
+MCU* decodeHuffmanData(Header* header, bool dequantized = false);
+void setDecodeThreads(uint threads);
+bool decodeHuffmanData(Header* header, MCU* mcus, bool dequantized);
+Status decodeScanUnits(const Header* header,
+                       const Scan& scan,
+                       MCU* mcus,
+                       Checkpoint& state,
+                       uint last,
+                       bool dequantized);
+
+// Reconstruction
+void dequantize(const Header* header, MCU* mcus);
+void inverseDCT(const Header* header, MCU* mcus);
+void inverseDCT(const Header* header, MCU* mcus, uint firstRow, uint lastRow);
+void YCbCrToRGB(const Header* header, MCU* mcus);
+void YCbCrToRGB(const Header* header, MCU* mcus, uint firstRow, uint lastRow);
+void scaledInverseDCT(const Header* header, MCU* mcus, uint firstRow, uint lastRow, uint size);
+void scaledYCbCrToRGB(const Header* header, MCU* mcus, uint firstRow, uint lastRow, uint size);
+void DCToRGB(const Header* header, const DCPlanes& dc, unsigned char* rgb);
+
+// Output
+void writeBMP(const Header* header, const MCU* mcus, std::vector<unsigned char>& bmp);
+bool writeBMP(const Header* header, const MCU* mcus, const std::string& filename);
+
+// Diagnostics
+void setError(const Header* header, StatusCode code, const std::string& message);
@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "jpeg.h"
+
+void setQualityQuantizationTables(Header* header, uint quality);
+HuffmanTable standardHuffmanTable(bool acTable, bool chrominance);
+void setStandardHuffmanTables(Header* header);
+HuffmanTable optimalHuffmanTable(const uint* frequencies);
+void optimizeHuffmanTables(Header* header, MCU* mcus);
+bool writeJPG(const Header* header, MCU* mcus, std::vector<unsigned char>& jpg, uint threads = 1);
+bool writeJPG(const Header* header, MCU* mcus, const std::string& filename, uint threads = 1);
+bool setEncoderHeader(Header* header, uint width, uint height, uint quality, uint subsampling);
+bool encodePixels(const Header* header, const unsigned char* rgb, std::vector<unsigned char>& jpg);
+MCU* transformPixels(const Header* header, const unsigned char* rgb, uint threads = 1);
@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+
+#include "type.h"
+
+// The Huffman tables suggested by the JPEG standard, and the codes and lookup table the decoder
+// builds for every table. Most encoders use the standard tables, so their codes are computed at
+// compile time and a DHT that matches one needs no setup at all.
+
+// Numbers of codes of each length from 1 to 16 bits and symbols of the Huffman tables suggested by
+// the JPEG standard (Annex K.3), which can code any baseline coefficient.
+constexpr unsigned char standardDCLuminanceLengths[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+constexpr unsigned char standardDCChrominanceLengths[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+constexpr unsigned char standardDCSymbols[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+constexpr unsigned char standardACLuminanceLengths[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D};
+constexpr unsigned char standardACLuminanceSymbols[162]
+    = {0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61,
+       0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52,
+       0xD1, 0xF0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25,
+       0x26, 0x27, 0x28, 0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45,
+       0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64,
+       0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83,
+       0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+       0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+       0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3,
+       0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8,
+       0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA};
+
+constexpr unsigned char standardACChrominanceLengths[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+constexpr unsigned char standardACChrominanceSymbols[162]
+    = {0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61,
+       0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33,
+       0x52, 0xF0, 0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18,
+       0x19, 0x1A, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44,
+       0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63,
+       0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A,
+       0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+       0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+       0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA,
+       0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7,
+       0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA};
+
+// The codes of a table in the order of its symbols, and for every value of the next 8 bits of
+// data the code they start with, as (length << 8) | symbol, or 0 when that code is longer than 8
+// bits.
+struct HuffmanCodes
+{
+    uint codes[162] = {0};
+    uint16_t lookup[256] = {0};
+};
+
+// Build the codes of a table with lengths[i] codes of i + 1 bits, at most 162 in all.
+constexpr HuffmanCodes buildHuffmanCodes(const unsigned char* const lengths,
+                                         const unsigned char* const symbols)
+{
+    HuffmanCodes result;
+    uint code = 0;
+    uint k = 0;
+    for (uint i = 0; i < 16; ++i)
+    {
+        for (uint j = 0; j < lengths[i]; ++j, ++k)
+        {
+            result.codes[k] = code;
+            // A code of at most 8 bits fills every entry it is a prefix of. Where the codes of a
+            // malformed table overlap, the shortest and then the first one wins, the same code a
+            // search through the codes would find.
+            if (i < 8 && code < (1u << (i + 1)))
+            {
+                const uint first = code << (7 - i);
+                for (uint entry = first; entry < first + (1u << (7 - i)); ++entry)
+                {
+                    if (result.lookup[entry] == 0)
+                    {
+                        result.lookup[entry] = ((i + 1) << 8) | symbols[k];
+                    }
+                }
+            }
+            code += 1;
+        }
+        code <<= 1;
+    }
+    return result;
+}
+
+constexpr HuffmanCodes standardDCLuminanceCodes
+    = buildHuffmanCodes(standardDCLuminanceLengths, standardDCSymbols);
+constexpr HuffmanCodes standardDCChrominanceCodes
+    = buildHuffmanCodes(standardDCChrominanceLengths, standardDCSymbols);
+constexpr HuffmanCodes standardACLuminanceCodes
+    = buildHuffmanCodes(standardACLuminanceLengths, standardACLuminanceSymbols);
+constexpr HuffmanCodes standardACChrominanceCodes
+    = buildHuffmanCodes(standardACChrominanceLengths, standardACChrominanceSymbols);
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "jpeg.h"
+#include "status.h"
+
+// A restart index records where every restart interval of a JPG file begins, and optionally the
+// decoder state at more points in between, so that a crop region can be decoded by reading only
+// the parts of the file that cover it and a whole image can be decoded on many threads. It is
+// saved next to the JPG with the layout below, in native byte order, so that a saved index can be
+// memory-mapped and used in place:
+//
+//     RestartIndexHeader
+//     RestartIndexScan[numScans]
+//     RestartIndexEntry[numEntries]
+
+const char restartIndexMagic[4] = {'J', 'R', 'I', 'X'};
+const uint32_t restartIndexVersion = 1;
+
+struct RestartIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize; // Size of the JPG file the index was built for.
+    uint32_t numScans;
+    uint32_t numEntries;
+};
+
+struct RestartIndexScan
+{
+    uint64_t end; // File offset of the marker that ends the scan.
+    uint32_t firstEntry;
+    uint32_t numEntries;
+};
+
+struct RestartIndexEntry
+{
+    uint64_t offset;        // File offset of the first byte of compressed data.
+    uint32_t unit;          // Index of the first coding unit decoded from that byte.
+    uint32_t bit;           // Bit of that byte to start reading at, always 0 at a restart marker.
+    int32_t previousDCs[3]; // DC predictions at the start of the entry.
+    uint32_t reserved;
+};
+
+struct RestartIndex
+{
+    const RestartIndexHeader* header = nullptr;
+    const RestartIndexScan* scans = nullptr;
+    const RestartIndexEntry* entries = nullptr;
+
+    // The index is either built in memory or memory-mapped from a file.
+    std::vector<char> buffer;
+    void* mapping = nullptr;
+    std::size_t mappingSize = 0;
+
+    RestartIndex() = default;
+    RestartIndex(const RestartIndex&) = delete;
+    RestartIndex& operator=(const RestartIndex&) = delete;
+    ~RestartIndex();
+};
+
+RestartIndex* buildRestartIndex(Header* header, const std::string& filename, uint interval = 0);
+Status writeRestartIndex(const RestartIndex* index, const std::string& filename);
+RestartIndex* loadRestartIndex(const std::string& filename, Status* status = nullptr);
+bool readIndexedHuffmanData(const std::string& filename,
+                            Header* header,
+                            const RestartIndex* index);
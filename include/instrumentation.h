@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+
+#ifdef JPEG_INSTRUMENTATION
+#include <chrono>
+#endif
+
+// Optional instrumentation of the decoder. Timings and counters are only recorded when the library
+// is built with JPEG_INSTRUMENTATION defined; otherwise the timers and counters below compile to
+// nothing and the statistics of every header stay 0.
+
+// Stages of decoding whose wall time is recorded.
+enum DecodeStage
+{
+    MarkerStage,            // Reading the markers, tables and headers of the file
+    EntropyExtractionStage, // Reading the compressed data and removing byte stuffing
+    HuffmanDecodeStage,     // decodeHuffmanData
+    DequantizeStage,        // dequantize
+    InverseDCTStage,        // inverseDCT
+    ColorStage,             // YCbCrToRGB
+    OutputStage,            // writeBMP
+    numDecodeStages
+};
+
+struct DecodeCounters
+{
+    uint64_t symbolsDecoded = 0;
+    // Huffman codes longer than 8 bits, which a lookup table indexed by the next 8 bits of data
+    // could not resolve.
+    uint64_t slowHuffmanLookups = 0;
+    uint64_t stuffedBytesRemoved = 0;
+    // Tables of DHT markers that matched a standard table, whose codes needed no setup.
+    uint64_t standardHuffmanTables = 0;
+    // Number of blocks whose end of block symbol followed i coefficients. Blocks coded without an
+    // end of block symbol are counted at 64.
+    uint64_t endOfBlockPositions[65] = {0};
+};
+
+struct DecodeStatistics
+{
+    double stageSeconds[numDecodeStages] = {0.0};
+    DecodeCounters counters;
+};
+
+// Lookups of a DecodeCache (see jpegdec.h). An image that is not cached is looked up again among
+// the parsed headers, so every miss is also a header hit or a header miss.
+struct CacheCounters
+{
+    uint64_t hits = 0, misses = 0;
+    uint64_t headerHits = 0, headerMisses = 0;
+    // Entries removed to keep the images and the headers within their memory budgets.
+    uint64_t evictions = 0, headerEvictions = 0;
+    uint64_t bytesHashed = 0;
+};
+
+#ifdef JPEG_INSTRUMENTATION
+
+const bool instrumentationEnabled = true;
+
+#define JPEG_COUNT(counter, n) ((counter) += (n))
+
+// Add the wall time from construction to destruction to seconds.
+class StageTimer
+{
+private:
+    double& seconds;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    StageTimer(double& s) : seconds(s)
+    {
+    }
+
+    ~StageTimer()
+    {
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+#else
+
+const bool instrumentationEnabled = false;
+
+#define JPEG_COUNT(counter, n) ((void)0)
+
+class StageTimer
+{
+public:
+    StageTimer(double&)
+    {
+    }
+};
+
+#endif
@@ -1,5 +1,8 @@
 #pragma once
+#include "instrumentation.h"
+#include "status.h"
 #include "type.h"
+#include <cstdint>
 #include <vector>
 
 // Start of Frame markers, non-differential, Huffman coding
@@ -101,7 +104,11 @@ struct HuffmanTable
     byte offsets[17] = {0};
     byte symbols[162] = {0};
     uint codes[162] = {0};
+    // The code the next 8 bits of data start with, as built by buildHuffmanCodes.
+    uint16_t lookup[256] = {0};
     bool set = false;
+    // Whether codes and lookup have been generated from the current offsets and symbols.
+    bool generated = false;
 };
 
 struct ColorComponent
@@ -114,6 +121,95 @@ struct ColorComponent
     bool used = false;
 };
 
+// State of the decoder at the start of a coding unit.
+struct Checkpoint
+{
+    uint unit = 0;           // Index of the coding unit in its scan.
+    uint offset = 0;         // Position of the next bit in Scan::huffmanData...
+    uint bit = 0;            // ...and within that byte.
+    uint64_t fileOffset = 0; // Position of the same byte in the file.
+    int previousDCs[3] = {0};
+};
+
+struct Scan
+{
+    byte numComponents = 0;
+    // Index into Header::colorComponents of each component in this scan, in the order they are
+    // interleaved.
+    uint componentIDs[3] = {0};
+
+    // Huffman tables may be redefined between scans, so every scan keeps a copy of the tables
+    // that were in effect when its SOS marker was read.
+    HuffmanTable huffmanDCTables[3];
+    HuffmanTable huffmanACTables[3];
+
+    uint restartInterval = 0;
+
+    std::vector<unsigned char> huffmanData;
+    // Positions that decoding can start from, in order. There is one at the start of every
+    // restart interval, and more can be added by findCheckpoints or a restart index.
+    std::vector<Checkpoint> checkpoints;
+
+    // Position in the file of the marker that ends the scan.
+    uint64_t endFileOffset = 0;
+};
+
+// Rectangle of the image in pixels.
+struct Crop
+{
+    uint x = 0, y = 0;
+    uint width = 0, height = 0;
+};
+
+// Coding units of a scan, which are MCUs for an interleaved scan and blocks of its one component
+// otherwise, and the columns [left, right) and rows [top, bottom) of them that cover the crop
+// region.
+struct ScanUnits
+{
+    uint wide = 0, high = 0;
+    uint left = 0, right = 0;
+    uint top = 0, bottom = 0;
+};
+
+// Metadata of an APP1 EXIF segment.
+struct Exif
+{
+    bool present = false;
+    // Orientation tag of IFD0, from 1 to 8 as in TIFF; 1 means the rows are stored from the top
+    // down and the columns from the left.
+    uint orientation = 1;
+    // JPG thumbnail of IFD1, empty when there is none, and its position in the stream it was read
+    // from when that stream reports positions.
+    std::vector<unsigned char> thumbnail;
+    uint64_t thumbnailOffset = 0;
+};
+
+// Where the first error in a JPG was found by checkJPG.
+struct ErrorLocation
+{
+    // The marker being read, or whose scan's compressed data was being decoded, and its position
+    // in the stream when the stream reports positions. 0 when the JPG does not start with SOI.
+    uint marker = 0;
+    uint64_t markerOffset = 0;
+    // For an error in compressed data: the scan, counting from 0, the coding unit of the scan
+    // being decoded, which is an MCU when the scan is interleaved, and the position of the bit
+    // decoding stopped at, counting from the start of the stream.
+    bool inScan = false;
+    uint scan = 0;
+    uint unit = 0;
+    uint64_t bitOffset = 0;
+};
+
+// The dequantized DC coefficient of every block of a JPG, read by readDCValues. Plane i holds
+// width[i] x height[i] values of component i, one for each of its blocks that contains pixels,
+// with rows from top to bottom. The DC coefficient of a block whose samples average a is
+// 8 * (a - 128).
+struct DCPlanes
+{
+    uint width[3] = {0}, height[3] = {0};
+    std::vector<int> planes[3];
+};
+
 struct Header
 {
     QuantizationTable quantizationTables[4];
@@ -126,6 +222,25 @@ struct Header
     byte numComponents;
     bool zeroBased = false;
 
+    // Largest sampling factors of all components. An MCU covers (8 * horizontalSamplingFactor) x
+    // (8 * verticalSamplingFactor) pixels.
+    byte horizontalSamplingFactor = 1;
+    byte verticalSamplingFactor = 1;
+
+    // Size of the image in 8x8 blocks of the full resolution component, and the same size
+    // padded to a whole number of MCUs.
+    uint blockHeight = 0, blockWidth = 0;
+    uint blockHeightReal = 0, blockWidthReal = 0;
+
+    // Size of the image in MCUs.
+    uint mcuHeight = 0, mcuWidth = 0;
+
+    // Region of the image to decode, the whole image unless setCrop is called. Only the MCUs in
+    // the rows [mcuTop, mcuBottom) and columns [mcuLeft, mcuRight) are stored and processed.
+    Crop crop;
+    uint mcuTop = 0, mcuBottom = 0;
+    uint mcuLeft = 0, mcuRight = 0;
+
     byte startOfSelection = 0;
     byte endOfSelection = 63;
     byte successiveApproximationHigh = 0;
@@ -135,11 +250,25 @@ struct Header
 
     ColorComponent colorComponents[3];
 
-    std::vector<byte> huffmanData;
+    std::vector<Scan> scans;
+    // Scans of an earlier frame, whose buffers the scans of this one take over (see
+    // readJPGFrame).
+    std::vector<Scan> spareScans;
+
+    Exif exif;
+
+    // Stage timings and counters of the decode, when the library is built with instrumentation.
+    // Every stage adds to them, including the stages that take a const Header.
+    mutable DecodeStatistics statistics;
 
     bool valid = true;
+
+    // The first error of any operation on the header, including those that take a const Header.
+    mutable Status status;
 };
 
+// One MCU is stored for every 8x8 block of the full resolution component. When the chroma
+// components are subsampled, their block for an MCU is stored in the top left MCU it covers.
 struct MCU
 {
     // Union are for representing the YCbCr component but also RGB for the X & Y
@@ -0,0 +1,432 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "jpeg.h"
+#include "kernels.h"
+#include "status.h"
+
+// Interface for programs that embed the decoder. A JPG is read from a file, a block of memory or
+// any stream, and the whole image or a crop region of it is decoded to 8-bit RGB pixels, 3 bytes
+// per pixel and rows from top to bottom. Grayscale images are decoded to RGB as well. Pixels in the
+// same layout can be encoded as a baseline JPG. The functions of decoder.h and encoder.h remain
+// available for finer control over each stage, and those of kernels.h select the instruction set
+// the decoder and encoder use.
+
+// Properties of a JPG that are known without decoding it.
+struct ImageInfo
+{
+    uint width = 0, height = 0;
+    uint numComponents = 0;
+    uint horizontalSamplingFactor = 1, verticalSamplingFactor = 1;
+    uint restartInterval = 0;
+};
+
+// Called with each row of decoded pixels, y counting from the top of the width x height region
+// being decoded. Returning false stops decoding with an error.
+typedef std::function<bool(uint y, const unsigned char* rgb, uint width, uint height)> RowCallback;
+
+// Read the properties of a JPG from its markers, without reading its compressed data.
+Status probeJPG(std::istream& input, ImageInfo& info);
+Status probeJPG(const std::string& filename, ImageInfo& info);
+Status probeJPG(const unsigned char* data, std::size_t size, ImageInfo& info);
+
+// Check that a JPG can be decoded in full, without decoding it. Its markers are parsed and all of
+// its compressed data is entropy decoded, but no coefficients are stored and nothing is
+// reconstructed, in memory that does not depend on the size of the image. The status is the one
+// decoding would fail with, and location, when not null, tells where the error was found.
+Status validateJPG(std::istream& input, ErrorLocation* location = nullptr);
+Status validateJPG(const std::string& filename, ErrorLocation* location = nullptr);
+Status validateJPG(const unsigned char* data, std::size_t size, ErrorLocation* location = nullptr);
+
+// Decode a JPG, or the crop region of it when crop is not null, passing the pixels to callback one
+// row at a time so that they never have to be held in a separate buffer.
+Status decodeJPG(std::istream& input,
+                 const RowCallback& callback,
+                 const Crop* crop = nullptr,
+                 ImageInfo* info = nullptr);
+Status decodeJPG(const unsigned char* data,
+                 std::size_t size,
+                 const RowCallback& callback,
+                 const Crop* crop = nullptr,
+                 ImageInfo* info = nullptr);
+
+// Decode a JPG, or the crop region of it when crop is not null, into pixels.
+Status decodeJPG(const std::string& filename,
+                 std::vector<unsigned char>& pixels,
+                 const Crop* crop = nullptr,
+                 ImageInfo* info = nullptr);
+Status decodeJPG(const unsigned char* data,
+                 std::size_t size,
+                 std::vector<unsigned char>& pixels,
+                 const Crop* crop = nullptr,
+                 ImageInfo* info = nullptr);
+
+// The components of a JPG as 8-bit planes, each width[i] x height[i] samples with rows from top
+// to bottom. A color JPG has Y, Cb and Cr planes, the chroma planes subsampled as they were coded;
+// a grayscale JPG has only a Y plane.
+struct PlanarImage
+{
+    uint numComponents = 0;
+    uint width[3] = {0}, height[3] = {0};
+    std::vector<unsigned char> planes[3];
+};
+
+// Decode a JPG to its planes, without converting it to RGB.
+Status decodePlanar(std::istream& input, PlanarImage& image);
+Status decodePlanar(const std::string& filename, PlanarImage& image);
+Status decodePlanar(const unsigned char* data, std::size_t size, PlanarImage& image);
+
+enum class TensorLayout
+{
+    CHW, // The whole red plane, then green, then blue
+    HWC, // Interleaved RGB pixels
+};
+
+struct TensorOptions
+{
+    // Size of the tensor, the size of the image when 0. The image is resized to it with bilinear
+    // filtering otherwise.
+    uint width = 0, height = 0;
+    // Each channel value v, scaled to [0, 1], is stored as (v - mean) / std.
+    float mean[3] = {0.0f, 0.0f, 0.0f};
+    float std[3] = {1.0f, 1.0f, 1.0f};
+    TensorLayout layout = TensorLayout::CHW;
+};
+
+// Decode a JPG to a tensor of 3 x height x width floats in the caller's buffer of tensorSize
+// floats. Resizing, normalization and the layout are applied as each row of MCUs is converted to
+// RGB, so no 8-bit image is stored in between. info, when not null, describes the JPG.
+Status decodeTensor(std::istream& input,
+                    const TensorOptions& options,
+                    float* tensor,
+                    std::size_t tensorSize,
+                    ImageInfo* info = nullptr);
+Status decodeTensor(const std::string& filename,
+                    const TensorOptions& options,
+                    float* tensor,
+                    std::size_t tensorSize,
+                    ImageInfo* info = nullptr);
+Status decodeTensor(const unsigned char* data,
+                    std::size_t size,
+                    const TensorOptions& options,
+                    float* tensor,
+                    std::size_t tensorSize,
+                    ImageInfo* info = nullptr);
+
+enum class ResizeFilter
+{
+    Area,     // Each output pixel is the average of the source pixels it covers
+    Lanczos3, // Sharper, with a support of 3 output pixels on each side
+};
+
+struct ResizeOptions
+{
+    // Size of the output. When one of them is 0 it is chosen to keep the aspect ratio of the
+    // image, and when both are the image is not resized.
+    uint width = 0, height = 0;
+    ResizeFilter filter = ResizeFilter::Area;
+};
+
+// Decode a JPG resized to any size. The image is decoded at the smallest of 1/8, 1/4, 1/2 and 1
+// of its size that is not smaller than the output, with a scaled inverse DCT, and each row of
+// MCUs is filtered down to the output as soon as it is converted to RGB. Neither the full size
+// nor the scaled image is ever held in a buffer. info, when not null, describes the JPG.
+Status decodeResized(std::istream& input,
+                     const ResizeOptions& options,
+                     const RowCallback& callback,
+                     ImageInfo* info = nullptr);
+Status decodeResized(const unsigned char* data,
+                     std::size_t size,
+                     const ResizeOptions& options,
+                     const RowCallback& callback,
+                     ImageInfo* info = nullptr);
+Status decodeResized(const std::string& filename,
+                     const ResizeOptions& options,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* info = nullptr);
+Status decodeResized(const unsigned char* data,
+                     std::size_t size,
+                     const ResizeOptions& options,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* info = nullptr);
+
+// What a JPG looks like, from the DC coefficients of its blocks alone.
+struct ImageSummary
+{
+    // The image at 1/8 of its size, rounded up: one RGB pixel for the average of each 8x8 block.
+    uint previewWidth = 0, previewHeight = 0;
+    std::vector<unsigned char> preview;
+    // The average of the preview's pixels, and the average of those in the most common of the
+    // 4096 colors with 4 bits per channel.
+    unsigned char averageColor[3] = {0};
+    unsigned char dominantColor[3] = {0};
+    // Perceptual hash of the luma: bit v * 8 + u is set when DCT coefficient (u, v) of the luma
+    // resized to 32x32 is above the median of the 64 with u, v < 8. Copies of an image that is
+    // resized, recompressed or slightly altered have hashes a small hashDistance apart.
+    uint64_t hash = 0;
+};
+
+// Summarize a JPG without decoding it. Only the DC coefficient of each block is read: the AC
+// coefficients are skipped over without storing them, and there is no inverse DCT.
+Status summarizeJPG(std::istream& input, ImageSummary& summary, ImageInfo* info = nullptr);
+Status summarizeJPG(const std::string& filename,
+                    ImageSummary& summary,
+                    ImageInfo* info = nullptr);
+Status summarizeJPG(const unsigned char* data,
+                    std::size_t size,
+                    ImageSummary& summary,
+                    ImageInfo* info = nullptr);
+
+// The number of bits two perceptual hashes differ in, from 0 to 64.
+uint hashDistance(uint64_t a, uint64_t b);
+
+// Read the EXIF metadata of a JPG, which precedes its frame header, without reading anything
+// else. exif.present is false if the JPG has none.
+Status readExif(std::istream& input, Exif& exif);
+Status readExif(const std::string& filename, Exif& exif);
+Status readExif(const unsigned char* data, std::size_t size, Exif& exif);
+
+// Decode a preview of a JPG at least minWidth x minHeight pixels in size. This is the EXIF
+// thumbnail when the JPG has one that large, which spares decoding a large image at all, and the
+// image itself otherwise. info, when not null, describes the one decoded.
+Status decodePreview(const std::string& filename,
+                     uint minWidth,
+                     uint minHeight,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* info = nullptr);
+Status decodePreview(const unsigned char* data,
+                     std::size_t size,
+                     uint minWidth,
+                     uint minHeight,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* info = nullptr);
+
+struct IncrementalState;
+
+// Decodes a JPG whose data arrives in pieces of any size, such as the body of a network request.
+// Rows of pixels are passed to the callback as soon as the data they depend on has been pushed,
+// so the top of a large image is available long before the rest of its data. The whole image is
+// decoded; crop regions and restart indexes are not supported in this mode.
+class IncrementalDecoder
+{
+public:
+    explicit IncrementalDecoder(const RowCallback& callback);
+    ~IncrementalDecoder();
+    IncrementalDecoder(const IncrementalDecoder&) = delete;
+    IncrementalDecoder& operator=(const IncrementalDecoder&) = delete;
+
+    // Append the next piece of the JPG and decode as much of the image as the data so far allows.
+    // Once an error is returned, every later call returns it as well.
+    Status push(const unsigned char* data, std::size_t size);
+
+    // Signal that all of the JPG has been pushed, failing if the image is not complete.
+    Status finish();
+
+    // True once the frame and first scan headers have been read, after which info describes the
+    // image.
+    bool headerRead() const;
+    const ImageInfo& info() const;
+
+    // Number of rows passed to the callback so far.
+    uint rowsDecoded() const;
+
+private:
+    IncrementalState* state;
+};
+
+struct MotionJPEGState;
+
+// Decodes the frames of a Motion JPEG stream, a sequence of complete JPGs such as a capture file.
+// Frames that leave out their Huffman tables use the standard ones (Annex K.3), as Motion JPEG
+// frames commonly do. The MCUs of a frame are reused by the next, and so are the Huffman codes of
+// tables that stay the same from frame to frame.
+class MotionJPEGDecoder
+{
+public:
+    explicit MotionJPEGDecoder(std::istream& input);
+    ~MotionJPEGDecoder();
+    MotionJPEGDecoder(const MotionJPEGDecoder&) = delete;
+    MotionJPEGDecoder& operator=(const MotionJPEGDecoder&) = delete;
+
+    // Decode the next frame into pixels, which keep their storage from frame to frame. Return
+    // false at the end of the stream, and when the frame cannot be decoded, in which case status
+    // describes why and the next call continues with the frame after it.
+    bool nextFrame(std::vector<unsigned char>& pixels, ImageInfo* info = nullptr);
+
+    // Result of the last call to nextFrame.
+    const Status& status() const;
+    uint framesDecoded() const;
+
+private:
+    MotionJPEGState* state;
+};
+
+// How encodeJPG compresses an image. Quality goes from 1 to 100 and scales the example tables of
+// the standard (Annex K.1), as the IJG library does. Subsampling is 444, 422 or 420 for the
+// chroma of a color JPG, or 400 for a grayscale JPG of the luma alone. A restart interval of 0
+// writes no restart markers.
+struct EncodeOptions
+{
+    uint quality = 75;
+    uint subsampling = 420;
+    uint restartInterval = 0;
+    // Code the image with Huffman tables built for it rather than the standard ones, which takes
+    // a second pass over its coefficients and usually saves several percent.
+    bool optimizeHuffmanTables = false;
+    // Threads to transform the image on, 0 for one per hardware thread. Its restart intervals are
+    // coded on them as well, so they only help the entropy coding with a restart interval.
+    uint threads = 1;
+};
+
+// Encode width x height RGB pixels as a baseline JPG. With the default options, the image is
+// converted, transformed and coded one row of MCUs at a time, so no other copy of it is made;
+// optimizing the Huffman tables or using several threads stores its coefficients first.
+Status encodeJPG(const unsigned char* rgb,
+                 uint width,
+                 uint height,
+                 const EncodeOptions& options,
+                 std::vector<unsigned char>& jpg);
+Status encodeJPG(const unsigned char* rgb,
+                 uint width,
+                 uint height,
+                 const EncodeOptions& options,
+                 const std::string& filename);
+
+// Code the coefficients of a JPG again with Huffman tables built for them, which makes it smaller
+// without changing a single pixel. The result is a baseline JPG with one interleaved scan and the
+// restart interval of the original; metadata such as EXIF is not copied.
+Status optimizeJPG(std::istream& input, std::vector<unsigned char>& jpg);
+Status optimizeJPG(const std::string& filename, std::vector<unsigned char>& jpg);
+Status optimizeJPG(const unsigned char* data, std::size_t size, std::vector<unsigned char>& jpg);
+
+// How decodeBatch runs.
+struct BatchOptions
+{
+    // Files read or written at once. It also bounds the files that have been read and not yet
+    // written, and so the memory of the batch.
+    uint queueDepth = 32;
+    // Threads decoding, 0 for one per hardware thread.
+    uint threads = 0;
+};
+
+// Decode JPGs to BMP files, inputs[i] to outputs[i], returning the status of each. The files are
+// read and written asynchronously (see asyncio.h): every file is passed to a decoding thread as
+// soon as it has been read, and its BMP is submitted for writing without waiting for the write,
+// so that the disk and the decoding threads are kept busy at the same time.
+std::vector<Status> decodeBatch(const std::vector<std::string>& inputs,
+                                const std::vector<std::string>& outputs,
+                                const BatchOptions& options = BatchOptions());
+
+struct DecodeCacheState;
+
+// Keeps the images of recent decodes in memory, so that decoding the same JPG again with the same
+// options copies its pixels instead of decoding it. Entries are found by a 128-bit keyed hash of
+// the bytes of the JPG (SipHash-2-4 under a key drawn for every cache), its size and the options,
+// so two different JPGs are only confused if their hashes collide, which no input can be made to
+// do and which is not expected by chance. A JPG decoded again with different options, such as
+// another crop region, still skips parsing its markers and building its Huffman codes: the parsed
+// headers are kept as well, within a budget of their own, without the compressed data of their
+// scans, which is read again from the JPG passed in. The least recently used entries are removed
+// to stay within the budgets, and an entry larger than its budget is never kept. Every function
+// may be called from several threads at once. Hits and misses are counted when the library is
+// built with instrumentation (see instrumentation.h).
+class DecodeCache
+{
+public:
+    explicit DecodeCache(std::size_t memoryBudget = 256 << 20, std::size_t headerBudget = 32 << 20);
+    ~DecodeCache();
+    DecodeCache(const DecodeCache&) = delete;
+    DecodeCache& operator=(const DecodeCache&) = delete;
+
+    // The decodes of the functions above, for a JPG in memory.
+    Status decodeJPG(const unsigned char* data,
+                     std::size_t size,
+                     std::vector<unsigned char>& pixels,
+                     const Crop* crop = nullptr,
+                     ImageInfo* info = nullptr);
+    Status decodeResized(const unsigned char* data,
+                         std::size_t size,
+                         const ResizeOptions& options,
+                         std::vector<unsigned char>& pixels,
+                         ImageInfo* info = nullptr);
+    Status decodePlanar(const unsigned char* data, std::size_t size, PlanarImage& image);
+
+    // Remove every entry.
+    void clear();
+
+    // Bytes held by the images and the headers.
+    std::size_t memoryUsed() const;
+    CacheCounters counters() const;
+
+private:
+    DecodeCacheState* state;
+};
+
+// How decodeWithBudget decodes a JPG.
+enum class DecodeStrategy
+{
+    FullFrame,    // Every MCU of the image is stored at once
+    RowStreaming, // Bands of MCU rows as wide as the image are decoded one after the other
+    Tiled,        // Every MCU row is decoded in tiles narrower than the image
+    Scaled,       // Bands of MCU rows, reconstructed at 1/2, 1/4 or 1/8 of the size of the image
+};
+
+struct BudgetOptions
+{
+    // Bytes the decode may hold at once, 0 for no limit.
+    std::size_t memoryBudget = 0;
+    // Whether the image may be decoded at a smaller size when it does not fit at its own.
+    bool allowScaling = false;
+};
+
+// The strategy decodeWithBudget chose and the memory it used.
+struct DecodePlan
+{
+    DecodeStrategy strategy = DecodeStrategy::FullFrame;
+    // The output is scale / 8 of the size of the image, width x height pixels.
+    uint scale = 8;
+    uint width = 0, height = 0;
+    // MCU rows decoded at once, and MCU columns for a tiled decode.
+    uint bandRows = 0, tileColumns = 0;
+    // Bytes the plan was expected to take, and the most the decode held at once: the parsed
+    // header with the compressed data and the checkpoints, the MCUs, the buffers of pixels and
+    // the output.
+    std::size_t plannedBytes = 0, peakBytes = 0;
+};
+
+// Decode a JPG holding at most options.memoryBudget bytes at once. Its markers and compressed data
+// are read first, and the size of the image and of its data decide the strategy: the whole image
+// when its MCUs fit, otherwise bands of as many MCU rows as fit, or tiles of a single MCU row when
+// not even one row of the image fits. When allowed, an image whose pixels are too large for the
+// budget is decoded at the largest of 1/2, 1/4 and 1/8 of its size that fits. Decoding in bands
+// or tiles takes an extra pass over the compressed data to find where each of them starts. A JPG
+// that does not fit in any way fails with a memory error before its compressed data is read, or
+// before any MCU is stored. The pixels passed to the callback are not counted against the budget;
+// the output of the functions that store the pixels is.
+Status decodeWithBudget(std::istream& input,
+                        const BudgetOptions& options,
+                        const RowCallback& callback,
+                        DecodePlan* plan = nullptr,
+                        ImageInfo* info = nullptr);
+Status decodeWithBudget(const unsigned char* data,
+                        std::size_t size,
+                        const BudgetOptions& options,
+                        const RowCallback& callback,
+                        DecodePlan* plan = nullptr,
+                        ImageInfo* info = nullptr);
+Status decodeWithBudget(const std::string& filename,
+                        const BudgetOptions& options,
+                        std::vector<unsigned char>& pixels,
+                        DecodePlan* plan = nullptr,
+                        ImageInfo* info = nullptr);
+Status decodeWithBudget(const unsigned char* data,
+                        std::size_t size,
+                        const BudgetOptions& options,
+                        std::vector<unsigned char>& pixels,
+                        DecodePlan* plan = nullptr,
+                        ImageInfo* info = nullptr);
@@ -0,0 +1,254 @@
+#ifndef JPEGDEC_C_H
+#define JPEGDEC_C_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// C interface to the decoder, for programs that cannot use the C++ interface of jpegdec.h. Every
+// function returns one of the status codes below, and the message of the last error on the
+// calling thread is returned by jpegdec_error_message.
+
+enum
+{
+    JPEGDEC_OK = 0,
+    JPEGDEC_FILE_ERROR = 1,
+    JPEGDEC_MEMORY_ERROR = 2,
+    JPEGDEC_INVALID_DATA = 3,
+    JPEGDEC_UNSUPPORTED = 4,
+    JPEGDEC_INDEX_ERROR = 5,
+    JPEGDEC_INVALID_ARGUMENT = 6
+};
+
+typedef struct jpegdec_info
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int num_components;
+} jpegdec_info;
+
+int jpegdec_probe_file(const char* filename, jpegdec_info* info);
+int jpegdec_probe_memory(const unsigned char* data, size_t size, jpegdec_info* info);
+
+// Check that a JPG can be decoded, without decoding it. On an error, location, when not NULL,
+// tells where it was found: the marker being read and its offset, and for an error in compressed
+// data, the scan, the coding unit of the scan and the offset of the bit decoding stopped at.
+typedef struct jpegdec_error_location
+{
+    unsigned int marker;
+    size_t marker_offset;
+    int in_scan;
+    unsigned int scan;
+    unsigned int unit;
+    unsigned long long bit_offset;
+} jpegdec_error_location;
+
+int jpegdec_validate_file(const char* filename, jpegdec_error_location* location);
+int jpegdec_validate_memory(const unsigned char* data,
+                            size_t size,
+                            jpegdec_error_location* location);
+
+// Decode a JPG to 8-bit RGB pixels, rows from top to bottom, into a buffer of at least
+// width * height * 3 bytes as reported by the probe functions.
+int jpegdec_decode_file(const char* filename, unsigned char* pixels, size_t pixels_size);
+int jpegdec_decode_memory(const unsigned char* data,
+                          size_t size,
+                          unsigned char* pixels,
+                          size_t pixels_size);
+
+// Decode a JPG to a tensor of 3 x height x width floats, each channel value v in [0, 1] stored as
+// (v - mean) / std. The tensor has the size of the image when width and height are 0, and the
+// image is resized to it with bilinear filtering otherwise. tensor_size counts floats.
+enum
+{
+    JPEGDEC_LAYOUT_CHW = 0,
+    JPEGDEC_LAYOUT_HWC = 1
+};
+
+typedef struct jpegdec_tensor_options
+{
+    unsigned int width;
+    unsigned int height;
+    float mean[3];
+    float std[3];
+    int layout;
+} jpegdec_tensor_options;
+
+int jpegdec_decode_tensor_file(const char* filename,
+                               const jpegdec_tensor_options* options,
+                               float* tensor,
+                               size_t tensor_size);
+int jpegdec_decode_tensor_memory(const unsigned char* data,
+                                 size_t size,
+                                 const jpegdec_tensor_options* options,
+                                 float* tensor,
+                                 size_t tensor_size);
+
+// Decode a JPG resized to width x height pixels into a buffer of at least width * height * 3
+// bytes. When one of width and height is 0 it is chosen to keep the aspect ratio of the image.
+enum
+{
+    JPEGDEC_FILTER_AREA = 0,
+    JPEGDEC_FILTER_LANCZOS3 = 1
+};
+
+int jpegdec_decode_resized_file(const char* filename,
+                                unsigned int width,
+                                unsigned int height,
+                                int filter,
+                                unsigned char* pixels,
+                                size_t pixels_size);
+int jpegdec_decode_resized_memory(const unsigned char* data,
+                                  size_t size,
+                                  unsigned int width,
+                                  unsigned int height,
+                                  int filter,
+                                  unsigned char* pixels,
+                                  size_t pixels_size);
+
+// Decode a JPG holding at most memory_budget bytes at once, besides the buffer of pixels (see
+// decodeWithBudget in jpegdec.h). With allow_scaling non-zero, an image that does not fit at its
+// own size may be decoded at 1/2, 1/4 or 1/8 of it. plan, when not NULL, tells how the image was
+// decoded, and the size of the pixels it was decoded to.
+enum
+{
+    JPEGDEC_FULL_FRAME = 0,
+    JPEGDEC_ROW_STREAMING = 1,
+    JPEGDEC_TILED = 2,
+    JPEGDEC_SCALED = 3
+};
+
+typedef struct jpegdec_decode_plan
+{
+    int strategy;
+    unsigned int width;
+    unsigned int height;
+    unsigned int band_rows;
+    unsigned int tile_columns;
+    size_t planned_bytes;
+    size_t peak_bytes;
+} jpegdec_decode_plan;
+
+int jpegdec_decode_budget_file(const char* filename,
+                               size_t memory_budget,
+                               int allow_scaling,
+                               unsigned char* pixels,
+                               size_t pixels_size,
+                               jpegdec_decode_plan* plan);
+int jpegdec_decode_budget_memory(const unsigned char* data,
+                                 size_t size,
+                                 size_t memory_budget,
+                                 int allow_scaling,
+                                 unsigned char* pixels,
+                                 size_t pixels_size,
+                                 jpegdec_decode_plan* plan);
+
+// Summarize a JPG from the DC coefficients of its blocks alone, without decoding it: its average
+// and dominant colors and a 64-bit perceptual hash, whose jpegdec_hash_distance to the hash of a
+// resized or recompressed copy is small. When preview is not NULL, the image at 1/8 of its size,
+// preview_width * preview_height RGB pixels with both rounded up, is stored in it as well.
+typedef struct jpegdec_summary
+{
+    unsigned int preview_width;
+    unsigned int preview_height;
+    unsigned char average_color[3];
+    unsigned char dominant_color[3];
+    unsigned long long hash;
+} jpegdec_summary;
+
+int jpegdec_summarize_file(const char* filename,
+                           jpegdec_summary* summary,
+                           unsigned char* preview,
+                           size_t preview_size);
+int jpegdec_summarize_memory(const unsigned char* data,
+                             size_t size,
+                             jpegdec_summary* summary,
+                             unsigned char* preview,
+                             size_t preview_size);
+unsigned int jpegdec_hash_distance(unsigned long long a, unsigned long long b);
+
+// EXIF metadata of a JPG. The embedded JPG thumbnail, if any, is the thumbnail_size bytes at
+// thumbnail_offset in the file or block of memory, and can be passed to the functions above
+// without decoding the image itself.
+typedef struct jpegdec_exif
+{
+    int present;
+    unsigned int orientation;
+    size_t thumbnail_offset;
+    size_t thumbnail_size;
+} jpegdec_exif;
+
+int jpegdec_read_exif_file(const char* filename, jpegdec_exif* exif);
+int jpegdec_read_exif_memory(const unsigned char* data, size_t size, jpegdec_exif* exif);
+
+// Encode width * height RGB pixels, rows from top to bottom, as a baseline JPG of a quality from 1
+// to 100, with chroma subsampling 444, 422 or 420, or 400 for a grayscale JPG. In memory, the JPG
+// is stored in the jpg_size bytes of jpg and its size in written.
+int jpegdec_encode_file(const unsigned char* pixels,
+                        unsigned int width,
+                        unsigned int height,
+                        int quality,
+                        int subsampling,
+                        const char* filename);
+int jpegdec_encode_memory(const unsigned char* pixels,
+                          unsigned int width,
+                          unsigned int height,
+                          int quality,
+                          int subsampling,
+                          unsigned char* jpg,
+                          size_t jpg_size,
+                          size_t* written);
+
+// Code a JPG again with Huffman tables built for its coefficients, which makes it smaller without
+// changing its pixels. Metadata is not copied.
+int jpegdec_optimize_file(const char* filename, const char* output_filename);
+int jpegdec_optimize_memory(const unsigned char* data,
+                            size_t size,
+                            unsigned char* jpg,
+                            size_t jpg_size,
+                            size_t* written);
+
+// Decoding of a JPG whose data arrives in pieces. Every piece is passed to jpegdec_decoder_push,
+// which passes each row of pixels to the callback as soon as the data it depends on has arrived.
+// Returning 0 from the callback stops decoding with an error.
+typedef struct jpegdec_decoder jpegdec_decoder;
+typedef int (*jpegdec_row_callback)(unsigned int y,
+                                    const unsigned char* rgb,
+                                    unsigned int width,
+                                    unsigned int height,
+                                    void* user_data);
+
+jpegdec_decoder* jpegdec_decoder_create(jpegdec_row_callback callback, void* user_data);
+int jpegdec_decoder_push(jpegdec_decoder* decoder, const unsigned char* data, size_t size);
+// Signal the end of the data, failing if the image is not complete.
+int jpegdec_decoder_finish(jpegdec_decoder* decoder);
+void jpegdec_decoder_destroy(jpegdec_decoder* decoder);
+
+// A cache of decoded images, from which decoding a JPG in memory again copies its pixels (see
+// DecodeCache in jpegdec.h). The images are kept within memory_budget bytes and the parsed headers
+// within header_budget bytes. A cache may be used from several threads at once.
+typedef struct jpegdec_cache jpegdec_cache;
+
+jpegdec_cache* jpegdec_cache_create(size_t memory_budget, size_t header_budget);
+int jpegdec_cache_decode_memory(jpegdec_cache* cache,
+                                const unsigned char* data,
+                                size_t size,
+                                unsigned char* pixels,
+                                size_t pixels_size);
+void jpegdec_cache_destroy(jpegdec_cache* cache);
+
+const char* jpegdec_error_message(void);
+
+// Select the kernels of an instruction set level, "scalar", "sse2", "ssse3", "avx2" or "avx512",
+// which the processor must support. This overrides the JPEG_CPU_LEVEL environment variable and
+// must not be called while decoding.
+int jpegdec_set_cpu_level(const char* level);
+const char* jpegdec_cpu_level(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
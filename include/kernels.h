@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+#include "jpeg.h"
+
+// The inner loops of the decoder and encoder are selected at run time from the instruction set
+// extensions of the processor, so that one binary uses the fastest kernels every host supports.
+// The level is detected on first use. The JPEG_CPU_LEVEL environment variable (scalar, sse2,
+// ssse3, avx2 or avx512) or setCpuLevel can lower it, for example to test or compare every level
+// on one host. All levels produce exactly the same output.
+
+enum class CpuLevel
+{
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+    AVX512, // AVX-512F and AVX-512BW
+};
+
+struct Kernels
+{
+    // Inverse DCT of one 8x8 block of dequantized coefficients in place.
+    void (*inverseDCT)(int* block);
+    // Convert one block from YCbCr to RGB in place, given the Cb and Cr values of its pixels.
+    void (*YCbCrToRGB)(MCU& mcu, const int* cb, const int* cr);
+    // Expand the chroma of the top left block of an MCU to the 8x8 pixels of its block (h, v).
+    void (*upsample)(const int* chroma, uint h, uint v, uint hMax, uint vMax, int* out);
+    // Return the index of the first 0xFF byte of data, or size if there is none.
+    std::size_t (*findMarker)(const unsigned char* data, std::size_t size);
+    // Interleave count samples of three channels into 3-byte pixels.
+    void (*packPixels)(const int* first,
+                       const int* second,
+                       const int* third,
+                       uint count,
+                       unsigned char* out);
+    // Add count floats of in, multiplied by weight, to out.
+    void (*addWeightedRow)(const float* in, float weight, uint count, float* out);
+
+    // The kernels of the encoder.
+    // Convert count 3-byte RGB pixels to Y, Cb and Cr samples, all centered on 0.
+    void (*RGBToYCbCr)(const unsigned char* rgb, uint count, int* y, int* cb, int* cr);
+    // Average each h x v group of the 8h x 8v samples at in, rows stride samples apart, into one
+    // sample of an 8x8 block.
+    void (*downsample)(const int* in, uint stride, uint h, uint v, int* out);
+    // Forward DCT of one 8x8 block of samples in place, giving 8 times its coefficients.
+    void (*forwardDCT)(int* block);
+    // Multiply the coefficients of a block by reciprocals, in natural order, and round them.
+    void (*quantize)(int* block, const float* reciprocals);
+};
+
+// The highest level the processor and operating system support.
+CpuLevel detectCpuLevel();
+
+// The level the kernels are currently selected for.
+CpuLevel getCpuLevel();
+
+// Select the kernels of a level, which must not be decoding at the same time. Return false, and
+// keep the current level, if the processor does not support it.
+bool setCpuLevel(CpuLevel level);
+
+const char* cpuLevelName(CpuLevel level);
+bool parseCpuLevel(const std::string& name, CpuLevel& level);
+
+const Kernels& getKernels();
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+
+enum class StatusCode
+{
+    Ok,
+    FileError,       // A file could not be opened, read or written.
+    MemoryError,     // An allocation failed.
+    InvalidData,     // The JPG data is malformed or truncated.
+    Unsupported,     // The JPG uses a feature the decoder does not support.
+    IndexError,      // A restart index is malformed or does not match its JPG.
+    InvalidArgument, // A parameter such as a crop region is out of range.
+};
+
+// Result of a library operation. Operations on a Header record their first error in
+// Header::status; other operations return a Status or take one to fill in.
+struct Status
+{
+    StatusCode code = StatusCode::Ok;
+    std::string message;
+
+    bool ok() const
+    {
+        return code == StatusCode::Ok;
+    }
+};
+
+enum class LogLevel
+{
+    Debug,   // Progress through the markers of a file.
+    Info,
+    Warning,
+    Error,   // Every error recorded in a Status.
+    None
+};
+
+typedef void (*LogCallback)(LogLevel level, const char* message, void* userData);
+
+// Pass every message of at least minimumLevel to callback. No callback is set by default, so the
+// library writes nothing to the console. The callback may be called from several decoding threads
+// at once, and must not be changed while anything is being decoded.
+void setLogCallback(LogCallback callback,
+                    void* userData = nullptr,
+                    LogLevel minimumLevel = LogLevel::Warning);
+bool logEnabled(LogLevel level);
+
+// A log callback for command line tools that prints every message to std::cout, with errors
+// prefixed by "Error - ".
+void printLogMessage(LogLevel level, const char* message, void* userData);
+void logMessage(LogLevel level, const char* message);
+
+// Log an error and return it as a Status.
+Status makeError(StatusCode code, const std::string& message);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "jpeg.h"
+
+enum class Transform
+{
+    None,
+    FlipHorizontal,
+    FlipVertical,
+    Transpose,
+    Rotate90,
+    Rotate180,
+    Rotate270
+};
+
+Header* transformCoefficients(const Header* header,
+                              MCU* mcus,
+                              Transform transform,
+                              const Crop* crop,
+                              MCU** transformedMCUs);
@@ -0,0 +1,662 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#include "asyncio.h"
+
+// io_uring is used on Linux whenever its kernel headers are available, and the pool of threads
+// everywhere else.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define JPEG_IO_URING
+#endif
+#endif
+
+#ifdef JPEG_IO_URING
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// A request from submission until the callback has seen it.
+struct IORequest
+{
+    IOCompletion completion;
+    std::string filename;
+#ifdef JPEG_IO_URING
+    int fd = -1;
+    // Bytes of completion.data transferred so far, and the rest of them for the next transfer.
+    std::size_t done = 0;
+    iovec vector;
+    // The operation of the next transfer, while it waits for an entry of the ring.
+    uint8_t opcode = 0;
+#endif
+};
+
+#ifdef JPEG_IO_URING
+// The rings shared with the kernel, as io_uring_setup and mmap describe them.
+struct IORing
+{
+    int fd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    std::size_t sqRingSize = 0, cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    std::size_t sqesSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+};
+#endif
+
+struct AsyncIOState
+{
+    IOCallback callback;
+    uint queueDepth = 0;
+
+    std::mutex mutex;
+    // Signalled whenever a request finishes or a thread of the pool has work.
+    std::condition_variable changed;
+    uint inFlight = 0;
+    // Callbacks running. A callback that hands its place to a request of its own is no longer
+    // counted in flight, but wait() still waits for it to return.
+    uint callbacks = 0;
+    bool stopping = false;
+
+    // The pool of threads doing blocking I/O, and the requests waiting for them, or for an entry
+    // of the ring.
+    std::vector<std::thread> threads;
+    std::deque<IORequest*> queue;
+
+#ifdef JPEG_IO_URING
+    bool uring = false;
+    IORing ring;
+    // Reaps the completions of the ring.
+    std::thread reaper;
+    // The requests with an entry in the ring. There are at most queueDepth of them, even when
+    // callbacks go over the queue depth, so that the completion queue never overflows.
+    std::unordered_set<IORequest*> submitted;
+    // Set once the reaper can no longer wait for completions, after which every request fails.
+    bool ringFailed = false;
+#endif
+};
+
+// The state whose callback this thread is running, if any, and whether the finished request
+// still holds its place in flight for the first request the callback submits.
+thread_local AsyncIOState* callbackState = nullptr;
+thread_local bool callbackHoldsPlace = false;
+
+// Pass a request to the callback, and let the next one be submitted. The place of the request
+// stays taken until the callback returns, unless the callback hands it to a request of its own,
+// and wait() sees the callback finish either way.
+void finishRequest(AsyncIOState& s, IORequest* const request)
+{
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.callbacks += 1;
+    }
+    AsyncIOState* const outerState = callbackState;
+    const bool outerHoldsPlace = callbackHoldsPlace;
+    callbackState = &s;
+    callbackHoldsPlace = true;
+    s.callback(request->completion);
+    delete request;
+    const bool holdsPlace = callbackHoldsPlace;
+    callbackState = outerState;
+    callbackHoldsPlace = outerHoldsPlace;
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (holdsPlace)
+    {
+        s.inFlight -= 1;
+    }
+    s.callbacks -= 1;
+    s.changed.notify_all();
+}
+
+// Read or write a whole file with blocking I/O.
+void transferFile(IORequest& request)
+{
+    IOCompletion& completion = request.completion;
+    if (completion.write)
+    {
+        std::ofstream outFile = std::ofstream(request.filename, std::ios::out | std::ios::binary);
+        if (!outFile.is_open())
+        {
+            completion.status = makeError(StatusCode::FileError, "Failed opening output file");
+            return;
+        }
+        outFile.write(reinterpret_cast<const char*>(completion.data.data()),
+                      completion.data.size());
+        outFile.close();
+        if (!outFile)
+        {
+            completion.status = makeError(StatusCode::FileError, "Failed writing output file");
+        }
+        return;
+    }
+    std::ifstream inFile = std::ifstream(request.filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        completion.status = makeError(StatusCode::FileError, "Error opening input file");
+        return;
+    }
+    inFile.seekg(0, std::ios::end);
+    const std::streamoff size = inFile.tellg();
+    inFile.seekg(0, std::ios::beg);
+    completion.data.resize(std::max<std::streamoff>(size, 0));
+    inFile.read(reinterpret_cast<char*>(completion.data.data()), completion.data.size());
+    if (size < 0 || !inFile)
+    {
+        completion.status = makeError(StatusCode::FileError, "Error reading input file");
+    }
+}
+
+void runIOThread(AsyncIOState& s)
+{
+    while (true)
+    {
+        IORequest* request;
+        {
+            std::unique_lock<std::mutex> lock(s.mutex);
+            s.changed.wait(lock, [&s]() { return s.stopping || !s.queue.empty(); });
+            if (s.queue.empty())
+            {
+                return;
+            }
+            request = s.queue.front();
+            s.queue.pop_front();
+        }
+        transferFile(*request);
+        finishRequest(s, request);
+    }
+}
+
+#ifdef JPEG_IO_URING
+int ioUringSetup(const unsigned entries, io_uring_params* const params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(const int fd,
+                 const unsigned toSubmit,
+                 const unsigned minComplete,
+                 const unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+void closeRing(IORing& ring)
+{
+    if (ring.sqes != nullptr)
+    {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    if (ring.cqRing != nullptr && ring.cqRing != ring.sqRing)
+    {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    if (ring.sqRing != nullptr)
+    {
+        munmap(ring.sqRing, ring.sqRingSize);
+    }
+    if (ring.fd >= 0)
+    {
+        close(ring.fd);
+    }
+    ring = IORing();
+}
+
+// Set up a ring with room for entries requests, returning false if the kernel does not allow it.
+bool openRing(IORing& ring, const unsigned entries)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring.fd = ioUringSetup(entries, &params);
+    if (ring.fd < 0)
+    {
+        ring.fd = -1;
+        return false;
+    }
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap)
+    {
+        ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize, ring.cqRingSize);
+    }
+    void* const sqRing = mmap(nullptr,
+                              ring.sqRingSize,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              ring.fd,
+                              IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        closeRing(ring);
+        return false;
+    }
+    ring.sqRing = sqRing;
+    void* cqRing = sqRing;
+    if (!singleMap)
+    {
+        cqRing = mmap(nullptr,
+                      ring.cqRingSize,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring.fd,
+                      IORING_OFF_CQ_RING);
+    }
+    if (cqRing == MAP_FAILED)
+    {
+        closeRing(ring);
+        return false;
+    }
+    ring.cqRing = cqRing;
+    ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* const sqes = mmap(nullptr,
+                            ring.sqesSize,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE,
+                            ring.fd,
+                            IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        closeRing(ring);
+        return false;
+    }
+    ring.sqes = static_cast<io_uring_sqe*>(sqes);
+
+    char* const sq = static_cast<char*>(sqRing);
+    char* const cq = static_cast<char*>(cqRing);
+    ring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring.sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring.cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Queue the next transfer of a request, or a no-op that completes it as it is, and submit it.
+// The mutex of the state must be held. Return false, with the status of the request set, if the
+// kernel does not accept it.
+bool submitRequest(AsyncIOState& s, IORequest* const request, const uint8_t opcode)
+{
+    IORing& ring = s.ring;
+    if (s.ringFailed)
+    {
+        if (request != nullptr)
+        {
+            request->completion.status = makeError(StatusCode::FileError,
+                                                   "Asynchronous I/O failed");
+        }
+        return false;
+    }
+    const unsigned tail = *ring.sqTail;
+    const unsigned index = tail & *ring.sqMask;
+    io_uring_sqe& sqe = ring.sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.user_data = reinterpret_cast<uint64_t>(request);
+    if (opcode != IORING_OP_NOP)
+    {
+        std::vector<unsigned char>& data = request->completion.data;
+        request->vector.iov_base = data.data() + request->done;
+        request->vector.iov_len = data.size() - request->done;
+        sqe.fd = request->fd;
+        sqe.addr = reinterpret_cast<uint64_t>(&request->vector);
+        sqe.len = 1;
+        sqe.off = request->done;
+    }
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    int result;
+    while ((result = ioUringEnter(ring.fd, 1, 0, 0)) < 0 && (errno == EINTR || errno == EAGAIN))
+    {
+    }
+    if (result < 1)
+    {
+        // The kernel did not take the entry, so it is taken back.
+        __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+        if (request != nullptr)
+        {
+            request->completion.status = makeError(StatusCode::FileError,
+                                                   "Failed submitting asynchronous I/O");
+        }
+        return false;
+    }
+    if (request != nullptr)
+    {
+        s.submitted.insert(request);
+    }
+    return true;
+}
+
+// Submit the next transfer of a request, or leave it waiting behind the others until an entry of
+// the ring is free. The mutex of the state must be held.
+bool submitTransfer(AsyncIOState& s, IORequest* const request, const uint8_t opcode)
+{
+    if (s.submitted.size() >= s.queueDepth || !s.queue.empty())
+    {
+        request->opcode = opcode;
+        s.queue.push_back(request);
+        return true;
+    }
+    return submitRequest(s, request, opcode);
+}
+
+// Close the file of a request and pass it to the callback.
+void completeRequest(AsyncIOState& s, IORequest* const request)
+{
+    if (request->fd >= 0)
+    {
+        close(request->fd);
+    }
+    finishRequest(s, request);
+}
+
+// Submit the requests waiting for entries of the ring while there are free ones.
+void submitWaitingRequests(AsyncIOState& s)
+{
+    while (true)
+    {
+        IORequest* request;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (s.queue.empty() || s.submitted.size() >= s.queueDepth)
+            {
+                return;
+            }
+            request = s.queue.front();
+            s.queue.pop_front();
+            if (submitRequest(s, request, request->opcode))
+            {
+                continue;
+            }
+        }
+        completeRequest(s, request);
+    }
+}
+
+// Open the file of a request and queue its first transfer.
+void startRequest(AsyncIOState& s, IORequest* const request)
+{
+    IOCompletion& completion = request->completion;
+    if (completion.write)
+    {
+        request->fd = open(request->filename.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                           0644);
+        if (request->fd < 0)
+        {
+            completion.status = makeError(StatusCode::FileError, "Failed opening output file");
+        }
+    }
+    else
+    {
+        request->fd = open(request->filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (request->fd < 0 || fstat(request->fd, &info) != 0)
+        {
+            completion.status = makeError(StatusCode::FileError, "Error opening input file");
+        }
+        else
+        {
+            completion.data.resize(info.st_size);
+        }
+    }
+    // Failures and empty files complete through the ring as well, so that the callback is only
+    // called from the reaper unless the ring itself fails.
+    uint8_t opcode = completion.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    if (!completion.status.ok() || completion.data.empty())
+    {
+        opcode = IORING_OP_NOP;
+    }
+    bool submitted;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        submitted = submitTransfer(s, request, opcode);
+    }
+    if (!submitted)
+    {
+        completeRequest(s, request);
+    }
+}
+
+// Handle the completion of one transfer, returning true once the request is finished. The mutex
+// orders this after the submission, which the kernel does not make visible to thread sanitizers.
+bool continueRequest(AsyncIOState& s, IORequest* const request, const int result)
+{
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.submitted.erase(request);
+    IOCompletion& completion = request->completion;
+    if (!completion.status.ok() || completion.data.empty())
+    {
+        return true;
+    }
+    if (result < 0)
+    {
+        completion.status = makeError(StatusCode::FileError,
+                                      completion.write ? "Failed writing output file"
+                                                       : "Error reading input file");
+        return true;
+    }
+    if (result == 0)
+    {
+        // The file is shorter than it was when it was opened.
+        if (completion.write)
+        {
+            completion.status = makeError(StatusCode::FileError, "Failed writing output file");
+        }
+        completion.data.resize(request->done);
+        return true;
+    }
+    request->done += result;
+    if (request->done < completion.data.size())
+    {
+        return !submitTransfer(s, request, completion.write ? IORING_OP_WRITEV : IORING_OP_READV);
+    }
+    return true;
+}
+
+// Fail the requests in the ring and those waiting for it, once the reaper can no longer wait for
+// their completions, and every request after them.
+void failRequests(AsyncIOState& s)
+{
+    std::vector<IORequest*> stranded;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.ringFailed = true;
+        stranded.assign(s.submitted.begin(), s.submitted.end());
+        stranded.insert(stranded.end(), s.queue.begin(), s.queue.end());
+        s.submitted.clear();
+        s.queue.clear();
+    }
+    for (IORequest* const request : stranded)
+    {
+        request->completion.status = makeError(StatusCode::FileError, "Asynchronous I/O failed");
+        completeRequest(s, request);
+    }
+}
+
+void runReaper(AsyncIOState& s)
+{
+    IORing& ring = s.ring;
+    while (true)
+    {
+        // Completions already in the queue are still reaped when waiting fails.
+        const bool waited = ioUringEnter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) >= 0
+                            || errno == EINTR;
+        unsigned head = *ring.cqHead;
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+            IORequest* const request = reinterpret_cast<IORequest*>(cqe.user_data);
+            const int result = cqe.res;
+            head += 1;
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+            // The request without a request is the destructor's signal to stop.
+            if (request == nullptr)
+            {
+                return;
+            }
+            if (continueRequest(s, request, result))
+            {
+                completeRequest(s, request);
+            }
+            submitWaitingRequests(s);
+        }
+        if (!waited)
+        {
+            failRequests(s);
+            return;
+        }
+    }
+}
+#endif
+
+AsyncFileIO::AsyncFileIO(const IOCallback& callback, const uint queueDepth)
+    : state(new AsyncIOState)
+{
+    AsyncIOState& s = *state;
+    s.callback = callback;
+    s.queueDepth = std::max(1u, queueDepth);
+    const char* const backend = std::getenv("JPEG_ASYNC_IO");
+    const bool threadsOnly = backend != nullptr && std::string(backend) == "threads";
+#ifdef JPEG_IO_URING
+    // One more entry than requests in the ring, for the destructor's signal to the reaper.
+    if (!threadsOnly && openRing(s.ring, s.queueDepth + 1))
+    {
+        s.uring = true;
+        s.reaper = std::thread(runReaper, std::ref(s));
+        return;
+    }
+#endif
+    (void)threadsOnly;
+    // Every thread of the pool has one blocking request in flight.
+    for (uint i = 0; i < std::min(s.queueDepth, 64u); ++i)
+    {
+        s.threads.push_back(std::thread(runIOThread, std::ref(s)));
+    }
+}
+
+AsyncFileIO::~AsyncFileIO()
+{
+    AsyncIOState& s = *state;
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.stopping = true;
+#ifdef JPEG_IO_URING
+        if (s.uring)
+        {
+            submitRequest(s, nullptr, IORING_OP_NOP);
+        }
+#endif
+        s.changed.notify_all();
+    }
+#ifdef JPEG_IO_URING
+    if (s.uring)
+    {
+        s.reaper.join();
+        closeRing(s.ring);
+    }
+#endif
+    for (std::thread& thread : s.threads)
+    {
+        thread.join();
+    }
+    delete state;
+}
+
+// Wait for room for one more request in flight, and make a request. A callback never waits, as
+// the room it would wait for may only be made by its own thread: its first request takes the
+// place of the request that finished, and any more go over the queue depth.
+IORequest* newRequest(AsyncIOState& s, const std::string& filename, const uint64_t tag)
+{
+    if (callbackState == &s && callbackHoldsPlace)
+    {
+        callbackHoldsPlace = false;
+    }
+    else if (callbackState == &s)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.inFlight += 1;
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.changed.wait(lock, [&s]() { return s.inFlight < s.queueDepth; });
+        s.inFlight += 1;
+    }
+    IORequest* const request = new IORequest;
+    request->filename = filename;
+    request->completion.tag = tag;
+    return request;
+}
+
+// Pass a request to the ring, or to the pool of threads.
+void queueRequest(AsyncIOState& s, IORequest* const request)
+{
+#ifdef JPEG_IO_URING
+    if (s.uring)
+    {
+        startRequest(s, request);
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.queue.push_back(request);
+    s.changed.notify_all();
+}
+
+void AsyncFileIO::read(const std::string& filename, const uint64_t tag)
+{
+    IORequest* const request = newRequest(*state, filename, tag);
+    queueRequest(*state, request);
+}
+
+void AsyncFileIO::write(const std::string& filename,
+                        std::vector<unsigned char> data,
+                        const uint64_t tag)
+{
+    IORequest* const request = newRequest(*state, filename, tag);
+    request->completion.write = true;
+    request->completion.data = std::move(data);
+    queueRequest(*state, request);
+}
+
+void AsyncFileIO::wait()
+{
+    AsyncIOState& s = *state;
+    std::unique_lock<std::mutex> lock(s.mutex);
+    s.changed.wait(lock, [&s]() { return s.inFlight == 0 && s.callbacks == 0; });
+}
+
+const char* AsyncFileIO::backend() const
+{
+#ifdef JPEG_IO_URING
+    if (state->uring)
+    {
+        return "io_uring";
+    }
+#endif
+    return "threads";
+}
@@ -1,14 +1,64 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
-#include "jpeg.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "huffman.h"
+#include "kernels.h"
 
-void readStartOfFrame(std::ifstream& inFile, Header* const header)
+// Record the first error of an operation on a header in its status, and log every error.
+void setError(const Header* const header, const StatusCode code, const std::string& message)
 {
-    std::cout << "Reading SOF Marker\n";
+    const Status status = makeError(code, message);
+    if (header->status.ok())
+    {
+        header->status = status;
+    }
+}
+
+std::string hexString(const uint v)
+{
+    char buffer[16];
+    std::snprintf(buffer, sizeof(buffer), "%x", v);
+    return buffer;
+}
+
+// Compute the size of the image in blocks and MCUs from its dimensions and sampling factors, and
+// reset the crop region to the whole image.
+void setFrameGeometry(Header* const header)
+{
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    header->blockHeight = (header->height + 7) / 8;
+    header->blockWidth = (header->width + 7) / 8;
+    header->mcuHeight = (header->blockHeight + vMax - 1) / vMax;
+    header->mcuWidth = (header->blockWidth + hMax - 1) / hMax;
+    header->blockHeightReal = header->mcuHeight * vMax;
+    header->blockWidthReal = header->mcuWidth * hMax;
+
+    header->crop.x = 0;
+    header->crop.y = 0;
+    header->crop.width = header->width;
+    header->crop.height = header->height;
+    header->mcuTop = 0;
+    header->mcuBottom = header->mcuHeight;
+    header->mcuLeft = 0;
+    header->mcuRight = header->mcuWidth;
+}
+
+void readStartOfFrame(std::istream& inFile, Header* const header)
+{
+    logMessage(LogLevel::Debug, "Reading SOF Marker");
     if (header->numComponents.to_ulong() != 0)
     {
-        std::cout << "Error - Multiple SOFs detected\n";
+        setError(header, StatusCode::InvalidData, "Multiple SOFs detected");
         header->valid = false;
         return;
     }
@@ -18,7 +68,9 @@ void readStartOfFrame(std::ifstream& inFile, Header* const header)
     byte precision = inFile.get();
     if (precision.to_ulong() != 8)
     {
-        std::cout << "Error - Invalid precision: " << precision.to_ulong() << "\n";
+        setError(header,
+                 StatusCode::InvalidData,
+                 "Invalid precision: " + std::to_string(precision.to_ulong()));
         header->valid = false;
         return;
     }
@@ -27,19 +79,19 @@ void readStartOfFrame(std::ifstream& inFile, Header* const header)
     header->width = (inFile.get() << 8) + inFile.get();
     if (header->height == 0 || header->width == 0)
     {
-        std::cout << "Error - Invalid dimension\n";
+        setError(header, StatusCode::InvalidData, "Invalid dimension");
     }
 
     header->numComponents = inFile.get();
     if (header->numComponents.to_ulong() == 4)
     {
-        std::cout << "Error - CMYK color mode not supported\n";
+        setError(header, StatusCode::Unsupported, "CMYK color mode not supported");
         header->valid = false;
         return;
     }
     if (header->numComponents.to_ulong() == 0)
     {
-        std::cout << "Error - Number of color components must not be 0\n";
+        setError(header, StatusCode::InvalidData, "Number of color components must not be 0");
         header->valid = false;
         return;
     }
@@ -57,20 +109,22 @@ void readStartOfFrame(std::ifstream& inFile, Header* const header)
         }
         if (componentID.to_ulong() == 4 || componentID.to_ulong() == 5)
         {
-            std::cout << "Error - YIQ color mode not supported\n";
+            setError(header, StatusCode::Unsupported, "YIQ color mode not supported");
             header->valid = false;
             return;
         }
         if (componentID.to_ulong() == 0 || componentID.to_ulong() > 3)
         {
-            std::cout << "Error - Invalid component ID: " << componentID.to_ulong() << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid component ID: " + std::to_string(componentID.to_ulong()));
             header->valid = false;
             return;
         }
         ColorComponent* component = &header->colorComponents[componentID.to_ulong() - 1];
         if (component->used)
         {
-            std::cout << "Error - Duplicate color component ID\n";
+            setError(header, StatusCode::InvalidData, "Duplicate color component ID");
             header->valid = false;
             return;
         }
@@ -82,36 +136,61 @@ void readStartOfFrame(std::ifstream& inFile, Header* const header)
         component->verticalSamplingFactor = SamplingFactor.to_ulong()
                                             & 0x0F; // Last four bits has the vertical sampling
                                                     // factor.
-        // if (component->horizontalSamplingFactor.to_ulong() != 1 ||
-        // component->verticalSamplingFactor.to_ulong() != 1)
-        // {
-        // 	std::cout << "Error - Sampling factors not supported\n";
-        // 	std::cout << "Horizontal Sampling Factor: " <<
-        // component->horizontalSamplingFactor.to_ulong() << "\n"; 	std::cout <<
-        // "Vertical Sampling Facotr: " <<
-        // component->verticalSamplingFactor.to_ulong() << "\n"; 	header->valid =
-        // false; 	return;
-        // }
+        if (header->numComponents.to_ulong() == 1)
+        {
+            // A single component image is never interleaved, so an MCU is always one block.
+            component->horizontalSamplingFactor = 1;
+            component->verticalSamplingFactor = 1;
+        }
+        if (componentID.to_ulong() == 1)
+        {
+            if ((component->horizontalSamplingFactor.to_ulong() != 1
+                 && component->horizontalSamplingFactor.to_ulong() != 2)
+                || (component->verticalSamplingFactor.to_ulong() != 1
+                    && component->verticalSamplingFactor.to_ulong() != 2))
+            {
+                setError(header, StatusCode::Unsupported, "Sampling factors not supported");
+                header->valid = false;
+                return;
+            }
+            header->horizontalSamplingFactor = component->horizontalSamplingFactor;
+            header->verticalSamplingFactor = component->verticalSamplingFactor;
+        }
+        else
+        {
+            // Only the luminance component may be sampled at a higher rate.
+            if (component->horizontalSamplingFactor.to_ulong() != 1
+                || component->verticalSamplingFactor.to_ulong() != 1)
+            {
+                setError(header, StatusCode::Unsupported, "Sampling factors not supported");
+                header->valid = false;
+                return;
+            }
+        }
 
         component->quantizationTableID = inFile.get();
         if (component->quantizationTableID.to_ulong() > 3)
         {
-            std::cout << "Error - Invalid quantization table ID in frame component\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid quantization table ID in frame component");
             header->valid = false;
             return;
         }
     }
     if (length - 8 - (3 * header->numComponents.to_ulong()) != 0)
     {
-        std::cout << "Error - SOF invalid\n";
+        setError(header, StatusCode::InvalidData, "SOF invalid");
         header->valid = false;
         return;
     }
+
+    setFrameGeometry(header);
 }
 
-void readQuantizationTable(std::ifstream& inFile, Header* const header)
+void readQuantizationTable(std::istream& inFile, Header* const header)
 {
-    std::cout << "Reading DQT marker\n";
+    logMessage(LogLevel::Debug, "Reading DQT marker");
 
     /*
   The reason why we are using a signed int is so that the while condition
@@ -133,8 +212,9 @@ void readQuantizationTable(std::ifstream& inFile, Header* const header)
 
         if (tableID.to_ullong() > 3)
         {
-            std::cout << "Error - Invalid quantization table ID: " << (uint)tableID.to_ulong()
-                      << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid quantization table ID: " + std::to_string(tableID.to_ulong()));
             header->valid = false;
             return;
         }
@@ -170,14 +250,62 @@ void readQuantizationTable(std::ifstream& inFile, Header* const header)
 
     if (length != 0)
     {
-        std::cout << "Error - DQT invalid\n";
+        setError(header, StatusCode::InvalidData, "DQT invalid");
         header->valid = false;
     }
 }
 
-void readHuffmanTable(std::ifstream& inFile, Header* const header)
+// Give a table just read from a DHT the codes of the standard table it matches, if any, which were
+// built at compile time.
+bool useStandardCodes(HuffmanTable& hTable)
+{
+    struct StandardTable
+    {
+        const unsigned char* lengths;
+        const unsigned char* symbols;
+        const HuffmanCodes* codes;
+    };
+    static const StandardTable standardTables[4]
+        = {{standardDCLuminanceLengths, standardDCSymbols, &standardDCLuminanceCodes},
+           {standardDCChrominanceLengths, standardDCSymbols, &standardDCChrominanceCodes},
+           {standardACLuminanceLengths, standardACLuminanceSymbols, &standardACLuminanceCodes},
+           {standardACChrominanceLengths,
+            standardACChrominanceSymbols,
+            &standardACChrominanceCodes}};
+    for (const StandardTable& standard : standardTables)
+    {
+        uint i = 0;
+        while (i < 16
+               && hTable.offsets[i + 1].to_ulong() - hTable.offsets[i].to_ulong()
+                      == standard.lengths[i])
+        {
+            ++i;
+        }
+        if (i < 16)
+        {
+            continue;
+        }
+        uint j = 0;
+        while (j < hTable.offsets[16].to_ulong()
+               && hTable.symbols[j].to_ulong() == standard.symbols[j])
+        {
+            ++j;
+        }
+        if (j < hTable.offsets[16].to_ulong())
+        {
+            continue;
+        }
+        std::copy(standard.codes->codes, standard.codes->codes + 162, hTable.codes);
+        std::copy(standard.codes->lookup, standard.codes->lookup + 256, hTable.lookup);
+        hTable.generated = true;
+        return true;
+    }
+    return false;
+}
+
+void readHuffmanTable(std::istream& inFile, Header* const header)
 {
-    std::cout << "Reading DHT Marker\n";
+    logMessage(LogLevel::Debug, "Reading DHT Marker");
     int length = (inFile.get() << 8)
                  + inFile.get(); // Left bit shift since JPEG is read in big endian.
     length -= 2;
@@ -190,7 +318,9 @@ void readHuffmanTable(std::ifstream& inFile, Header* const header)
 
         if (tableID.to_ulong() > 3)
         {
-            std::cout << "Error - Invalid Huffman table ID: " << tableID.to_ulong() << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid Huffman table ID: " + std::to_string(tableID.to_ulong()));
             header->valid = false;
             return;
         }
@@ -205,6 +335,7 @@ void readHuffmanTable(std::ifstream& inFile, Header* const header)
             hTable = &header->huffmanDCTables[tableID.to_ulong()];
         }
         hTable->set = true;
+        hTable->generated = false;
 
         hTable->offsets[0] = 0;
         uint allSymbols = 0;
@@ -215,7 +346,7 @@ void readHuffmanTable(std::ifstream& inFile, Header* const header)
         }
         if (allSymbols > 162)
         {
-            std::cout << "Error - Too many symbols in Huffman table\n";
+            setError(header, StatusCode::InvalidData, "Too many symbols in Huffman table");
             header->valid = false;
             return;
         }
@@ -224,22 +355,26 @@ void readHuffmanTable(std::ifstream& inFile, Header* const header)
         {
             hTable->symbols[i] = inFile.get();
         }
+        if (useStandardCodes(*hTable))
+        {
+            JPEG_COUNT(header->statistics.counters.standardHuffmanTables, 1);
+        }
 
         length -= 17 + allSymbols;
     }
     if (length != 0)
     {
-        std::cout << "Error - DHT invalid\n";
+        setError(header, StatusCode::InvalidData, "DHT invalid");
         header->valid = false;
     }
 }
 
-void readStartOfScan(std::ifstream& inFile, Header* const header)
+void readStartOfScan(std::istream& inFile, Header* const header)
 {
-    std::cout << "Reading SOS Marker\n";
+    logMessage(LogLevel::Debug, "Reading SOS Marker");
     if (header->numComponents == 0)
     {
-        std::cout << "Error - SOS detected before SOF\n";
+        setError(header, StatusCode::InvalidData, "SOS detected before SOF");
         header->valid = false;
         return;
     }
@@ -251,47 +386,125 @@ void readStartOfScan(std::ifstream& inFile, Header* const header)
         header->colorComponents[i].used = false;
     }
 
-    byte numComponents = inFile.get();
-    for (uint i = 0; i < numComponents.to_ulong(); ++i)
+    header->scans.emplace_back();
+    Scan& scan = header->scans.back();
+    if (!header->spareScans.empty())
+    {
+        Scan& spare = header->spareScans.back();
+        scan.huffmanData = std::move(spare.huffmanData);
+        scan.huffmanData.clear();
+        scan.checkpoints = std::move(spare.checkpoints);
+        scan.checkpoints.clear();
+        header->spareScans.pop_back();
+    }
+    scan.restartInterval = header->restartInterval;
+
+    scan.numComponents = inFile.get();
+    if (scan.numComponents.to_ulong() == 0
+        || scan.numComponents.to_ulong() > header->numComponents.to_ulong())
+    {
+        setError(header,
+                 StatusCode::InvalidData,
+                 "Invalid number of components in scan: "
+                     + std::to_string(scan.numComponents.to_ulong()));
+        header->valid = false;
+        return;
+    }
+
+    uint blocksPerMCU = 0;
+    for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
     {
         byte componentID = inFile.get();
         if (header->zeroBased)
         {
             componentID = componentID.to_ulong() + 1;
         }
-        if (componentID.to_ulong() > header->numComponents.to_ulong())
+        if (componentID.to_ulong() == 0
+            || componentID.to_ulong() > header->numComponents.to_ulong())
         {
-            std::cout << "Error - Invalid color compoentID: " << componentID.to_ulong() << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid color component ID: " + std::to_string(componentID.to_ulong()));
             header->valid = false;
             return;
         }
         ColorComponent* component = &header->colorComponents[componentID.to_ulong() - 1];
         if (component->used)
         {
-            std::cout << "Error - Duplicate color component ID: " << componentID.to_ulong() << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Duplicate color component ID: " + std::to_string(componentID.to_ulong()));
             header->valid = false;
             return;
         }
+        // Every component of a sequential image is coded in exactly one scan.
+        for (uint j = 0; j + 1 < header->scans.size(); ++j)
+        {
+            for (uint k = 0; k < header->scans[j].numComponents.to_ulong(); ++k)
+            {
+                if (header->scans[j].componentIDs[k] == componentID.to_ulong() - 1)
+                {
+                    setError(header,
+                             StatusCode::InvalidData,
+                             "Color component coded in multiple scans: "
+                                 + std::to_string(componentID.to_ulong()));
+                    header->valid = false;
+                    return;
+                }
+            }
+        }
         component->used = true;
+        scan.componentIDs[i] = componentID.to_ulong() - 1;
+        blocksPerMCU += component->horizontalSamplingFactor.to_ulong()
+                        * component->verticalSamplingFactor.to_ulong();
 
         byte huffmanTableIDs = inFile.get();
         component->huffmanDCTableID = huffmanTableIDs.to_ulong() >> 4;
         component->huffmanACTableID = huffmanTableIDs.to_ulong() & 0x0F;
         if (component->huffmanDCTableID.to_ulong() > 3)
         {
-            std::cout << "Error - Huffman DC rable ID: " << component->huffmanDCTableID.to_ulong()
-                      << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid Huffman DC table ID: "
+                         + std::to_string(component->huffmanDCTableID.to_ulong()));
             header->valid = false;
             return;
         }
         if (component->huffmanACTableID.to_ulong() > 3)
         {
-            std::cout << "Error - Huffman AC rable ID: " << component->huffmanACTableID.to_ulong()
-                      << "\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Invalid Huffman AC table ID: "
+                         + std::to_string(component->huffmanACTableID.to_ulong()));
+            header->valid = false;
+            return;
+        }
+        if (header->huffmanDCTables[component->huffmanDCTableID.to_ulong()].set == false)
+        {
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Color component using uninitialized Huffman DC table");
+            header->valid = false;
+            return;
+        }
+        if (header->huffmanACTables[component->huffmanACTableID.to_ulong()].set == false)
+        {
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Color component using uninitialized Huffman AC table");
             header->valid = false;
             return;
         }
+        scan.huffmanDCTables[i] = header->huffmanDCTables[component->huffmanDCTableID.to_ulong()];
+        scan.huffmanACTables[i] = header->huffmanACTables[component->huffmanACTableID.to_ulong()];
+    }
+    if (scan.numComponents.to_ulong() > 1 && blocksPerMCU > 10)
+    {
+        setError(header, StatusCode::InvalidData, "Too many blocks in an interleaved MCU");
+        header->valid = false;
+        return;
     }
+
     header->startOfSelection = inFile.get();
     header->endOfSelection = inFile.get();
     byte successiveApproximation = inFile.get();
@@ -301,28 +514,184 @@ void readStartOfScan(std::ifstream& inFile, Header* const header)
     // Baseline JPEGs don't use spectral selection or successive approximation
     if (header->startOfSelection.to_ulong() != 0 || header->endOfSelection.to_ulong() != 63)
     {
-        std::cout << "Error - Invalid spectral selection\n";
+        setError(header, StatusCode::InvalidData, "Invalid spectral selection");
         header->valid = false;
         return;
     }
     if (header->successiveApproximationHigh.to_ulong() != 0
         || header->successiveApproximationLow.to_ulong() != 0)
     {
-        std::cout << "Error - Invalid successive approximation\n";
+        setError(header, StatusCode::InvalidData, "Invalid successive approximation");
         header->valid = false;
         return;
     }
 
-    if (length - 6 - (2 * numComponents.to_ulong()) != 0)
+    if (length - 6 - (2 * scan.numComponents.to_ulong()) != 0)
     {
-        std::cout << "Error - SOS invalid\n";
+        setError(header, StatusCode::InvalidData, "SOS invalid");
         header->valid = false;
     }
 }
 
-void readRestartInterval(std::ifstream& inFile, Header* const header)
+// Consumes the compressed data of the last scan as readHuffmanData reads it, rather than letting
+// all of it be kept in the scan. ended is true once the marker that ends the scan has been
+// reached. Returning false, with the header invalid, stops parsing.
+typedef std::function<bool(Header* header, bool ended)> ScanDataConsumer;
+
+// Read the entropy coded data of the last scan, up to the first marker that is not a restart
+// marker. Return that marker so the caller can continue parsing from it.
+byte readHuffmanData(std::istream& inFile,
+                     Header* const header,
+                     const ScanDataConsumer& consume = nullptr)
+{
+    StageTimer timer(header->statistics.stageSeconds[EntropyExtractionStage]);
+    const Kernels& kernels = getKernels();
+    Scan& scan = header->scans.back();
+    Checkpoint start;
+    start.fileOffset = inFile.tellg();
+    scan.checkpoints.push_back(start);
+
+    // The data is read in chunks and searched for 0xFF bytes, which start every marker and byte
+    // stuffing. A stream that cannot seek is read one byte at a time, so that it is never read
+    // past the marker that ends the scan.
+    const std::streamoff chunkSize = (start.fileOffset == static_cast<uint64_t>(-1)) ? 1 : 65536;
+    std::vector<unsigned char> chunk(chunkSize);
+    std::streamoff chunkOffset = start.fileOffset;
+    std::size_t position = 0;
+    std::size_t size = 0;
+    bool markerStarted = false;
+    uint intervals = 1;
+    while (true)
+    {
+        if (position == size)
+        {
+            if (consume && scan.huffmanData.size() >= 65536 && !consume(header, false))
+            {
+                return 0;
+            }
+            chunkOffset += size;
+            inFile.read(reinterpret_cast<char*>(chunk.data()), chunkSize);
+            size = inFile.gcount();
+            position = 0;
+            if (size == 0)
+            {
+                // Whatever can be decoded is, so that the error is located after it.
+                if (consume && !consume(header, false))
+                {
+                    return 0;
+                }
+                setError(header, StatusCode::InvalidData, "File ended prematurely");
+                header->valid = false;
+                return 0;
+            }
+        }
+
+        if (!markerStarted)
+        {
+            const std::size_t length = kernels.findMarker(&chunk[position], size - position);
+            scan.huffmanData.insert(scan.huffmanData.end(),
+                                    chunk.begin() + position,
+                                    chunk.begin() + position + length);
+            position += length;
+            if (position < size)
+            {
+                markerStarted = true;
+                position += 1;
+            }
+            continue;
+        }
+
+        const byte current = chunk[position++];
+        // 0xFF 0x00 means put a literal 0xFF in image data and ignore 0x00
+        if (current == 0x00)
+        {
+            scan.huffmanData.push_back(0xFF);
+            JPEG_COUNT(header->statistics.counters.stuffedBytesRemoved, 1);
+            markerStarted = false;
+        }
+        // If current happens to be a restart marker
+        else if (current.to_ulong() >= RST0.to_ulong() && current.to_ulong() <= RST7.to_ulong())
+        {
+            // Decoding can start over at every restart interval.
+            if (scan.restartInterval != 0)
+            {
+                Checkpoint restart;
+                restart.unit = intervals++ * scan.restartInterval;
+                restart.offset = scan.huffmanData.size();
+                restart.fileOffset = chunkOffset + position;
+                scan.checkpoints.push_back(restart);
+            }
+            markerStarted = false;
+        }
+        // Ignore multiple 0xFF's in a row
+        else if (current != 0xFF)
+        {
+            // Any other marker ends the scan, and parsing continues right after it.
+            scan.endFileOffset = chunkOffset + position - 2;
+            inFile.clear();
+            if (position < size)
+            {
+                inFile.seekg(chunkOffset + position);
+            }
+            if (consume && !consume(header, true))
+            {
+                return 0;
+            }
+            return current;
+        }
+    }
+}
+
+// Read the compressed data of every scan again from data, the whole JPG in memory, for a header
+// whose scans were read from the same bytes and have since dropped their data. Each scan runs from
+// its first checkpoint to the marker that ends it, and byte stuffing and restart markers are
+// removed as readHuffmanData removes them, so its checkpoints stay valid. Return false if a scan
+// does not fit in data or holds a marker that would have ended it.
+bool readScanData(Header* const header, const unsigned char* const data, const std::size_t size)
+{
+    StageTimer timer(header->statistics.stageSeconds[EntropyExtractionStage]);
+    const Kernels& kernels = getKernels();
+    for (Scan& scan : header->scans)
+    {
+        if (scan.checkpoints.empty() || scan.checkpoints[0].fileOffset > scan.endFileOffset
+            || scan.endFileOffset > size)
+        {
+            return false;
+        }
+        const std::size_t end = scan.endFileOffset;
+        scan.huffmanData.clear();
+        for (std::size_t k = scan.checkpoints[0].fileOffset; k < end; ++k)
+        {
+            const std::size_t length = kernels.findMarker(data + k, end - k);
+            scan.huffmanData.insert(scan.huffmanData.end(), data + k, data + k + length);
+            k += length;
+            // Multiple 0xFF's in a row are ignored, up to the marker that ends the scan.
+            while (k + 1 < end && data[k + 1] == 0xFF)
+            {
+                ++k;
+            }
+            if (k + 1 >= end)
+            {
+                break;
+            }
+            if (data[k + 1] == 0x00)
+            {
+                scan.huffmanData.push_back(0xFF);
+                JPEG_COUNT(header->statistics.counters.stuffedBytesRemoved, 1);
+            }
+            else if (data[k + 1] < RST0.to_ulong() || data[k + 1] > RST7.to_ulong())
+            {
+                return false;
+            }
+            ++k;
+        }
+    }
+    return true;
+}
+
+void readRestartInterval(std::istream& inFile, Header* const header)
 {
-    std::cout << "Reading DRI Marker\n";
+    logMessage(LogLevel::Debug, "Reading DRI Marker");
     uint length = (inFile.get() << 8)
                   + inFile.get(); // Left bit shift since JPEG is read in big endian.
 
@@ -331,26 +700,137 @@ void readRestartInterval(std::ifstream& inFile, Header* const header)
 
     if (length - 4 != 0)
     {
-        std::cout << "Error - DRI invalid\n";
+        setError(header, StatusCode::InvalidData, "DRI invalid");
         header->valid = false;
     }
 }
 
-void readAPPN(std::ifstream& inFile, Header* const header)
+// Read an unsigned integer of size bytes from the TIFF structure of an EXIF segment.
+uint readExifValue(const unsigned char* const data, const uint size, const bool bigEndian)
+{
+    uint value = 0;
+    for (uint i = 0; i < size; ++i)
+    {
+        value |= data[i] << (8 * (bigEndian ? size - 1 - i : i));
+    }
+    return value;
+}
+
+// Parse the contents of an APP1 segment, which is EXIF metadata if it starts with "Exif\0\0"
+// followed by a TIFF structure. IFD0 holds the tags of the image itself and the IFD after it,
+// IFD1, those of the thumbnail. offset is the position of data in its stream. Return false if the
+// segment is not EXIF or is malformed, leaving exif unchanged.
+bool parseExif(const unsigned char* const data,
+               const std::size_t size,
+               const uint64_t offset,
+               Exif& exif)
+{
+    static const unsigned char exifSignature[6] = {'E', 'x', 'i', 'f', 0, 0};
+    if (size < 14 || !std::equal(exifSignature, exifSignature + 6, data))
+    {
+        return false;
+    }
+    // Offsets in the TIFF structure count from its start.
+    const unsigned char* const tiff = data + 6;
+    const std::size_t tiffSize = size - 6;
+    bool bigEndian;
+    if (tiff[0] == 'M' && tiff[1] == 'M')
+    {
+        bigEndian = true;
+    }
+    else if (tiff[0] == 'I' && tiff[1] == 'I')
+    {
+        bigEndian = false;
+    }
+    else
+    {
+        return false;
+    }
+    if (readExifValue(tiff + 2, 2, bigEndian) != 42)
+    {
+        return false;
+    }
+
+    uint orientation = 1;
+    uint thumbnailStart = 0, thumbnailLength = 0;
+    uint ifdOffset = readExifValue(tiff + 4, 4, bigEndian);
+    for (uint ifd = 0; ifd < 2 && ifdOffset != 0; ++ifd)
+    {
+        if (ifdOffset > tiffSize - 2)
+        {
+            return false;
+        }
+        const uint numEntries = readExifValue(tiff + ifdOffset, 2, bigEndian);
+        if (numEntries * 12 + 4 > tiffSize - ifdOffset - 2)
+        {
+            return false;
+        }
+        for (uint i = 0; i < numEntries; ++i)
+        {
+            const unsigned char* const entry = tiff + ifdOffset + 2 + i * 12;
+            const uint tag = readExifValue(entry, 2, bigEndian);
+            const uint type = readExifValue(entry + 2, 2, bigEndian);
+            // A SHORT value is stored in the first 2 bytes of the value field, a LONG in all 4.
+            const uint value = readExifValue(entry + 8, type == 3 ? 2 : 4, bigEndian);
+            if (ifd == 0 && tag == 0x0112 && value >= 1 && value <= 8)
+            {
+                orientation = value;
+            }
+            else if (ifd == 1 && tag == 0x0201)
+            {
+                thumbnailStart = value;
+            }
+            else if (ifd == 1 && tag == 0x0202)
+            {
+                thumbnailLength = value;
+            }
+        }
+        ifdOffset = readExifValue(tiff + ifdOffset + 2 + numEntries * 12, 4, bigEndian);
+    }
+
+    exif.present = true;
+    exif.orientation = orientation;
+    exif.thumbnail.clear();
+    exif.thumbnailOffset = 0;
+    if (thumbnailLength != 0 && thumbnailStart < tiffSize
+        && thumbnailLength <= tiffSize - thumbnailStart)
+    {
+        exif.thumbnail.assign(tiff + thumbnailStart, tiff + thumbnailStart + thumbnailLength);
+        exif.thumbnailOffset = offset + 6 + thumbnailStart;
+    }
+    return true;
+}
+
+void readAPPN(std::istream& inFile, Header* const header, const byte marker)
 {
-    std::cout << "Reading APPN Marker\n";
+    logMessage(LogLevel::Debug, "Reading APPN Marker");
+    const std::streamoff start = inFile.tellg();
     uint length = (inFile.get() << 8)
                   + inFile.get(); // Left bit shift since JPEG is read in big endian.
+    if (length < 2)
+    {
+        setError(header, StatusCode::InvalidData, "APPN invalid");
+        header->valid = false;
+        return;
+    }
 
-    for (uint i = 0; i < length - 2; ++i)
+    // Only the first EXIF segment is read; every other APPN segment is skipped over.
+    if (marker == APP1 && !header->exif.present)
     {
-        inFile.get();
+        std::vector<unsigned char> data(length - 2);
+        inFile.read(reinterpret_cast<char*>(data.data()), data.size());
+        if (inFile.gcount() == static_cast<std::streamsize>(data.size()))
+        {
+            parseExif(data.data(), data.size(), start < 0 ? 0 : start + 2, header->exif);
+        }
+        return;
     }
+    inFile.ignore(length - 2);
 }
 
-void readComment(std::ifstream& inFile, Header* const header)
+void readComment(std::istream& inFile, Header* const header)
 {
-    std::cout << "Reading COM Marker\n";
+    logMessage(LogLevel::Debug, "Reading COM Marker");
     uint length = (inFile.get() << 8)
                   + inFile.get(); // Left bit shift since JPEG is read in big endian.
 
@@ -360,246 +840,335 @@ void readComment(std::ifstream& inFile, Header* const header)
     }
 }
 
-Header* readJPG(const std::string& filename)
+// Read the segment that follows a marker other than EOI, and for SOS without the compressed data
+// that follows the segment. Markers that are not supported make the header invalid.
+void readMarker(std::istream& inFile, Header* const header, const byte marker)
 {
-    // Open file
-    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
-    if (!inFile.is_open())
+    if (marker == SOF0)
     {
-        std::cout << "Error - Error opening input file\n";
-        return nullptr;
+        header->frameType = SOF0;
+        readStartOfFrame(inFile, header);
     }
-
-    Header* header = new (std::nothrow) Header;
-    if (header == nullptr)
+    else if (marker == DQT)
     {
-        std::cout << "Error - Memory error\n";
-        inFile.close();
-        return nullptr;
+        readQuantizationTable(inFile, header);
+    }
+    else if (marker == DHT)
+    {
+        readHuffmanTable(inFile, header);
+    }
+    else if (marker == SOS)
+    {
+        readStartOfScan(inFile, header);
+    }
+    else if (marker == DRI)
+    {
+        readRestartInterval(inFile, header);
+    }
+    else if (marker.to_ulong() >= APP0.to_ulong() && marker.to_ulong() <= APP15.to_ulong())
+    {
+        readAPPN(inFile, header, marker);
+    }
+    else if (marker == COM)
+    {
+        readComment(inFile, header);
+    }
+    // Unused markers that can be skipped
+    else if (marker.to_ulong() >= JPG0.to_ulong() && marker.to_ulong() <= JPG13.to_ulong()
+             || marker == DNL || marker == DHP || marker == EXP)
+    {
+        readComment(inFile, header);
+    }
+    else if (marker == TEM)
+    {
+        // TEM has no size
+    }
+    else if (marker == SOI)
+    {
+        setError(header, StatusCode::Unsupported, "Embedded JPGs not supported");
+        header->valid = false;
+    }
+    else if (marker == DAC)
+    {
+        setError(header, StatusCode::Unsupported, "Arithmetic Coding mode not supported");
+        header->valid = false;
+    }
+    else if (marker.to_ulong() >= SOF0.to_ulong() && marker.to_ulong() <= SOF15.to_ulong())
+    {
+        setError(header,
+                 StatusCode::Unsupported,
+                 "SOF marker not supported: 0x" + hexString(marker.to_ulong()));
+        header->valid = false;
     }
+    else if (marker.to_ulong() >= RST0.to_ulong() && marker.to_ulong() <= RST7.to_ulong())
+    {
+        setError(header, StatusCode::InvalidData, "RSTN detected before SOS");
+        header->valid = false;
+    }
+    else
+    {
+        setError(header,
+                 StatusCode::InvalidData,
+                 "Unknown marker: 0x" + hexString(marker.to_ulong()));
+        header->valid = false;
+    }
+}
 
-    byte last = inFile.get();
-    byte current = inFile.get();
-    if (last != 0xFF || current.to_ulong() != SOI.to_ullong())
+// Check that a header read up to its EOI marker describes a complete image.
+void validateHeader(Header* const header)
+{
+    if (header->numComponents.to_ulong() != 1 && header->numComponents.to_ulong() != 3)
     {
+        setError(header,
+                 StatusCode::Unsupported,
+                 std::to_string(header->numComponents.to_ulong())
+                     + " color components given (1 or 3 required)");
         header->valid = false;
-        inFile.close();
-        return header;
+        return;
     }
 
-    last = inFile.get();
-    current = inFile.get();
-    while (header->valid)
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
     {
-        if (!inFile)
+        if (header->quantizationTables[header->colorComponents[i].quantizationTableID.to_ulong()].set
+            == false)
         {
-            std::cout << "Error - File ended prematurely\n";
+            setError(header,
+                     StatusCode::InvalidData,
+                     "Color component using uninitialized quantization table");
             header->valid = false;
-            inFile.close();
-            return header;
+            return;
         }
-        if (last != 0xFF)
+        bool scanned = false;
+        for (const Scan& scan : header->scans)
         {
-            std::cout << "Error - Expected a marker\n";
-            header->valid = false;
-            inFile.close();
-            return header;
+            for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
+            {
+                scanned = scanned || scan.componentIDs[j] == i;
+            }
         }
-        if (current == SOF0)
+        if (!scanned)
         {
-            header->frameType = SOF0;
-            readStartOfFrame(inFile, header);
+            setError(header, StatusCode::InvalidData, "Color component not coded in any scan");
+            header->valid = false;
+            return;
         }
-        else if (current == DQT)
+    }
+}
+
+// Make a header ready to read another JPG into, keeping its scans as spares whose buffers the
+// scans of that JPG take over.
+void resetHeader(Header* const header)
+{
+    std::vector<Scan> spareScans = std::move(header->spareScans);
+    for (Scan& scan : header->scans)
+    {
+        spareScans.push_back(std::move(scan));
+    }
+    std::vector<Scan> scans = std::move(header->scans);
+    scans.clear();
+    *header = Header();
+    header->scans = std::move(scans);
+    header->spareScans = std::move(spareScans);
+}
+
+// Parse a JPG. When location is not null, it is kept at the marker being read, for checkJPG, and
+// when consume is not null it is passed the compressed data of every scan instead of the scan
+// keeping it. When reused is not null, the JPG is read into it rather than into a new header.
+Header* parseJPG(std::istream& inFile,
+                 const RestartIndex* const index,
+                 const bool headerOnly,
+                 const bool standardTables = false,
+                 ErrorLocation* const location = nullptr,
+                 const ScanDataConsumer& consume = nullptr,
+                 Header* const reused = nullptr)
+{
+    Header* header = reused;
+    if (header != nullptr)
+    {
+        resetHeader(header);
+    }
+    else
+    {
+        header = new (std::nothrow) Header;
+        if (header == nullptr)
         {
-            readQuantizationTable(inFile, header);
+            makeError(StatusCode::MemoryError, "Memory error");
+            return nullptr;
         }
-        else if (current == DHT)
+    }
+    if (standardTables)
+    {
+        setStandardHuffmanTables(header);
+    }
+
+    if (index != nullptr)
+    {
+        inFile.seekg(0, std::ios::end);
+        if (static_cast<uint64_t>(inFile.tellg()) != index->header->fileSize)
         {
-            readHuffmanTable(inFile, header);
-        }
-        else if (current == SOS)
-        {
-            readStartOfScan(inFile, header);
-            break;
-        }
-        else if (current == DRI)
-        {
-            readRestartInterval(inFile, header);
-        }
-        else if (current.to_ulong() >= APP0.to_ulong() && current.to_ulong() <= APP15.to_ulong())
-        {
-            readAPPN(inFile, header);
-        }
-        else if (current == COM)
-        {
-            readComment(inFile, header);
-        }
-        // Unused markers that can be skipped
-        else if (current.to_ulong() >= JPG0.to_ulong() && current.to_ulong() <= JPG13.to_ulong()
-                 || current == DNL || current == DHP || current == EXP)
-        {
-            readComment(inFile, header);
-        }
-        else if (current == TEM)
-        {
-            // TEM has no size
-        }
-        // Any number of 0xFF in a  row is allowed and should be ignored
-        else if (current == 0xFF)
-        {
-            current == inFile.get();
-            continue;
-        }
-        else if (current == SOI)
-        {
-            std::cout << "Error - Embedded JPGs not supported\n";
-            header->valid = false;
-            inFile.close();
-            return header;
-        }
-        else if (current == EOI)
-        {
-            std::cout << "Error - EOI detected before SOS\n";
-            header->valid = false;
-            inFile.close();
-            return header;
-        }
-        else if (current == DAC)
-        {
-            std::cout << "Error - Arithmetic Coding mode not supported\n";
+            setError(header, StatusCode::IndexError, "Restart index does not match file");
             header->valid = false;
-            inFile.close();
             return header;
         }
-        else if (current.to_ulong() >= SOF0.to_ulong() && current.to_ulong() <= SOF15.to_ulong())
+        inFile.seekg(0);
+    }
+
+    byte last = inFile.get();
+    byte current = inFile.get();
+    if (last != 0xFF || current.to_ulong() != SOI.to_ullong())
+    {
+        setError(header, StatusCode::InvalidData, "Missing SOI marker");
+        header->valid = false;
+        return header;
+    }
+
+    last = inFile.get();
+    current = inFile.get();
+    while (header->valid)
+    {
+        if (!inFile)
         {
-            std::cout << "Error - SOF marker not supported: 0x" << std::hex << current.to_ulong()
-                      << std::dec << "\n";
+            setError(header, StatusCode::InvalidData, "File ended prematurely");
             header->valid = false;
-            inFile.close();
             return header;
         }
-        else if (current.to_ulong() >= RST0.to_ulong() && current.to_ulong() <= RST7.to_ulong())
+        if (last != 0xFF)
         {
-            std::cout << "Error - RSTN detected before SOS\n";
+            setError(header, StatusCode::InvalidData, "Expected a marker");
             header->valid = false;
-            inFile.close();
             return header;
         }
-        else
+        if (location != nullptr)
         {
-            std::cout << "Error - Unknown marker: 0x" << std::hex << current.to_ulong() << std::dec
-                      << "\n";
-            header->valid = false;
-            inFile.close();
-            return header;
+            location->marker = current.to_ulong();
+            location->markerOffset = static_cast<uint64_t>(inFile.tellg()) - 2;
         }
-
-        last = inFile.get();
-        current = inFile.get();
-    }
-    // After SOS
-    if (header->valid)
-    {
-        current = inFile.get();
-        // Read compressed image data
-        while (true)
+        if (current == SOS)
         {
-            if (!inFile)
+            readMarker(inFile, header, current);
+            if (!header->valid)
+            {
+                break;
+            }
+            // Everything about the frame is known by the first scan.
+            if (headerOnly)
             {
-                std::cout << "Error - File ended prematurely\n";
-                header->valid = false;
-                inFile.close();
                 return header;
             }
-
-            last = current;
-            current = inFile.get();
-            // If marker is found
-            if (last == 0xFF)
+            if (index != nullptr)
             {
-                // End of Image
-                if (current == EOI)
-                {
-                    break;
-                }
-                // 0xFF 0x00 means put a literal 0xFF in image data and ignore 0x00
-                else if (current == 0x00)
-                {
-                    header->huffmanData.push_back(last);
-                    current = inFile.get();
-                }
-                // If current happens to be a restart marker
-                else if (current.to_ulong() >= RST0.to_ulong()
-                         && current.to_ulong() <= RST7.to_ulong())
-                {
-                    // Overwrite marker with next byte
-                    current = inFile.get();
-                }
-                // Ignore multiple 0xFF's in a row
-                else if (current == 0xFF)
-                {
-                    // Do nothing
-                    continue;
-                }
-                else
+                const uint scan = header->scans.size() - 1;
+                if (scan >= index->header->numScans)
                 {
-                    std::cout << "Error - Invalid marker during compressed data scan: 0x"
-                              << std::hex << current.to_ulong() << std::dec << "|n";
+                    setError(header, StatusCode::IndexError, "Restart index does not match file");
                     header->valid = false;
-                    inFile.close();
-                    return header;
+                    break;
                 }
+                inFile.seekg(index->scans[scan].end);
+                last = inFile.get();
+                current = inFile.get();
+                continue;
             }
-            else
+            // The scan's compressed data runs up to the next marker, which is handled by the
+            // next iteration.
+            last = 0xFF;
+            current = readHuffmanData(inFile, header, consume);
+            continue;
+        }
+        // Any number of 0xFF in a  row is allowed and should be ignored
+        if (current == 0xFF)
+        {
+            current = inFile.get();
+            continue;
+        }
+        if (current == EOI)
+        {
+            if (header->scans.empty())
             {
-                header->huffmanData.push_back(last);
+                setError(header, StatusCode::InvalidData, "EOI detected before SOS");
+                header->valid = false;
+                return header;
             }
+            break;
         }
-    }
+        readMarker(inFile, header, current);
 
-    // Validate header info
-    if (header->numComponents.to_ulong() != 1 && header->numComponents.to_ulong() != 3)
+        last = inFile.get();
+        current = inFile.get();
+    }
+    if (!header->valid)
     {
-        std::cout << "Error - " << header->numComponents.to_ulong()
-                  << "color components given (1 or 3 required)"
-                  << "\n";
-        header->valid = false;
-        inFile.close();
         return header;
     }
 
-    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    validateHeader(header);
+    return header;
+}
+
+// Parse a JPG, recording the time spent reading its markers apart from its compressed data.
+Header* readJPG(std::istream& input,
+                const RestartIndex* const index,
+                const bool standardTables,
+                Header* const reused = nullptr)
+{
+    double seconds = 0.0;
+    Header* header = nullptr;
     {
-        if (header->quantizationTables[header->colorComponents[i].quantizationTableID.to_ulong()].set
-            == false)
-        {
-            std::cout << "Error - Color component using uninitialized quantization table\n";
-            header->valid = false;
-            inFile.close();
-            return header;
-        }
-        if (header->huffmanDCTables[header->colorComponents[i].huffmanDCTableID.to_ulong()].set
-            == false)
-        {
-            std::cout << "Error - Color component using uninitialized Huffman DC table\n";
-            header->valid = false;
-            inFile.close();
-            return header;
-        }
-        if (header->huffmanACTables[header->colorComponents[i].huffmanACTableID.to_ulong()].set
-            == false)
+        StageTimer timer(seconds);
+        header = parseJPG(input, index, false, standardTables, nullptr, nullptr, reused);
+    }
+    if (header != nullptr)
+    {
+        // Reading the compressed data is recorded as its own stage.
+        header->statistics.stageSeconds[MarkerStage]
+            += seconds - header->statistics.stageSeconds[EntropyExtractionStage];
+    }
+    return header;
+}
+
+// Read the markers of a JPG and the compressed data of its scans from a stream positioned at the
+// start of the JPG. When a restart index is given, the compressed data is skipped instead; it can
+// be read later with readIndexedHuffmanData. Return nullptr if the header cannot be allocated, and
+// otherwise a header that is only valid if the whole JPG could be read. Its status describes why it
+// is not.
+Header* readJPG(std::istream& input, const RestartIndex* const index)
+{
+    return readJPG(input, index, false);
+}
+
+// Read the next frame of a Motion JPEG stream, which is a JPG that may leave out its Huffman
+// tables. Tables a frame does not define are the standard ones (Annex K.3), tables 0 for
+// luminance and 1 for chrominance. The stream is left right after the frame's EOI marker. When
+// previous is not null, the header of an earlier frame, the frame is read into it instead of a new
+// header, and its scans reuse the buffers of the scans of that frame.
+Header* readJPGFrame(std::istream& input, Header* const previous)
+{
+    return readJPG(input, nullptr, true, previous);
+}
+
+// Read the markers of a JPG up to its first scan, which is enough to know the size, components and
+// tables of the frame without reading any compressed data.
+Header* readJPGHeader(std::istream& input)
+{
+    return parseJPG(input, nullptr, true);
+}
+
+Header* readJPG(const std::string& filename, const RestartIndex* const index)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        Header* header = new (std::nothrow) Header;
+        if (header == nullptr)
         {
-            std::cout << "Error - Color component using uninitialized Huffman AC table\n";
-            header->valid = false;
-            inFile.close();
-            return header;
+            makeError(StatusCode::MemoryError, "Memory error");
+            return nullptr;
         }
+        setError(header, StatusCode::FileError, "Error opening input file");
+        header->valid = false;
+        return header;
     }
-
-    inFile.close();
-    return header;
+    return readJPG(inFile, index);
 }
 
 void printHeader(const Header* const header)
@@ -698,24 +1267,94 @@ void printHeader(const Header* const header)
         std::cout << "Huffman AC Table ID: "
                   << header->colorComponents[i].huffmanACTableID.to_ulong() << "\n";
     }
-    std::cout << "Size of Huffman Data: " << header->huffmanData.size() << " Bytes\n";
+    std::cout << "Number of Scans: " << header->scans.size() << "\n";
+    for (uint i = 0; i < header->scans.size(); ++i)
+    {
+        std::cout << "Scan " << i << " Component IDs:";
+        for (uint j = 0; j < header->scans[i].numComponents.to_ulong(); ++j)
+        {
+            std::cout << " " << (header->scans[i].componentIDs[j] + 1);
+        }
+        std::cout << "\n";
+        std::cout << "Size of Huffman Data: " << header->scans[i].huffmanData.size() << " Bytes\n";
+    }
     std::cout << "DRI============\n";
     std::cout << "Restart Interval: " << header->restartInterval << "\n";
+    if (header->exif.present)
+    {
+        std::cout << "EXIF===========\n";
+        std::cout << "Orientation: " << header->exif.orientation << "\n";
+        std::cout << "Size of Thumbnail: " << header->exif.thumbnail.size() << " Bytes\n";
+    }
+}
+
+// Print the stage timings and counters recorded while decoding an image.
+void printStatistics(const Header* const header)
+{
+    if (header == nullptr)
+        return;
+    if (!instrumentationEnabled)
+    {
+        std::cout << "Statistics unavailable, the decoder was built without instrumentation\n";
+        return;
+    }
+    static const char* const stageNames[numDecodeStages] = {"Markers",
+                                                            "Entropy extraction",
+                                                            "Huffman decode",
+                                                            "Dequantize",
+                                                            "Inverse DCT",
+                                                            "Color conversion",
+                                                            "Output"};
+    const DecodeStatistics& statistics = header->statistics;
+    std::cout << "Statistics=====\n";
+    for (uint i = 0; i < numDecodeStages; ++i)
+    {
+        std::cout << stageNames[i] << ": " << statistics.stageSeconds[i] * 1e3 << " ms\n";
+    }
+    std::cout << "Symbols decoded: " << statistics.counters.symbolsDecoded << "\n";
+    std::cout << "Huffman codes longer than 8 bits: " << statistics.counters.slowHuffmanLookups
+              << "\n";
+    std::cout << "Stuffed bytes removed: " << statistics.counters.stuffedBytesRemoved << "\n";
+    std::cout << "Standard Huffman tables: " << statistics.counters.standardHuffmanTables << "\n";
+    std::cout << "End of block positions:";
+    for (uint i = 0; i < 65; ++i)
+    {
+        if (statistics.counters.endOfBlockPositions[i] != 0)
+        {
+            std::cout << " " << i << ":" << statistics.counters.endOfBlockPositions[i];
+        }
+    }
+    std::cout << "\n";
 }
 
 void generateCodes(HuffmanTable& hTable) // Generate all Huffman codes based on symbols from a
                                          // Huffman table.
 {
-    uint code = 0;
+    if (hTable.generated)
+    {
+        return;
+    }
+    unsigned char lengths[16];
+    unsigned char symbols[162];
     for (uint i = 0; i < 16; ++i)
     {
-        for (uint j = hTable.offsets[i].to_ulong(); j < hTable.offsets[i + 1].to_ulong(); ++j)
-        {
-            hTable.codes[j] = code;
-            code += 1;
-        }
-        code <<= 1;
+        lengths[i] = hTable.offsets[i + 1].to_ulong() - hTable.offsets[i].to_ulong();
+    }
+    for (uint i = 0; i < hTable.offsets[16].to_ulong(); ++i)
+    {
+        symbols[i] = hTable.symbols[i].to_ulong();
     }
+    const HuffmanCodes codes = buildHuffmanCodes(lengths, symbols);
+    std::copy(codes.codes, codes.codes + 162, hTable.codes);
+    std::copy(codes.lookup, codes.lookup + 256, hTable.lookup);
+    hTable.generated = true;
+}
+
+// Whether two tables define the same codes, so that the codes generated for one serve the other.
+bool sameHuffmanTable(const HuffmanTable& a, const HuffmanTable& b)
+{
+    return std::equal(a.offsets, a.offsets + 17, b.offsets)
+           && std::equal(a.symbols, a.symbols + a.offsets[16].to_ulong(), b.symbols);
 }
 
 // Helper class to read bits from a byte vector.
@@ -724,10 +1363,18 @@ class BitReader
 private:
     uint nextByte = 0;
     uint nextBit = 0;
-    const std::vector<byte>& data;
+    const std::vector<unsigned char>& data;
 
 public:
-    BitReader(const std::vector<byte>& d) : data(d)
+    // Description of the first error found in the data read, if any.
+    const char* error = nullptr;
+
+#ifdef JPEG_INSTRUMENTATION
+    // Counters of everything decoded through this reader.
+    DecodeCounters counters;
+#endif
+
+    BitReader(const std::vector<unsigned char>& d) : data(d)
     {
     }
 
@@ -738,7 +1385,7 @@ public:
         {
             return -1;
         }
-        int bit = (data[nextByte].to_ulong() >> (7 - nextBit)) & 1;
+        int bit = (data[nextByte] >> (7 - nextBit)) & 1;
         nextBit += 1;
         if (nextBit == 8)
         {
@@ -764,6 +1411,48 @@ public:
         return bits;
     }
 
+    // Return the next 8 bits without reading them, or -1 if fewer than 8 bits remain.
+    int peekByte() const
+    {
+        if (nextByte >= data.size())
+        {
+            return -1;
+        }
+        uint bits = data[nextByte] << 8;
+        if (nextByte + 1 < data.size())
+        {
+            bits |= data[nextByte + 1];
+        }
+        else if (nextBit != 0)
+        {
+            return -1;
+        }
+        return (bits >> (8 - nextBit)) & 0xFF;
+    }
+
+    // Advance past length bits that are known to remain.
+    void skipBits(const uint length)
+    {
+        nextBit += length;
+        nextByte += nextBit / 8;
+        nextBit %= 8;
+    }
+
+    // Advance past length bits like readBits, without reading them. If fewer remain, advance past
+    // all of them and return false.
+    bool skipAvailableBits(const uint length)
+    {
+        const std::size_t remaining = (data.size() - nextByte) * 8 - nextBit;
+        if (length > remaining)
+        {
+            nextByte = data.size();
+            nextBit = 0;
+            return false;
+        }
+        skipBits(length);
+        return true;
+    }
+
     // If there are bits remaining, advance to the 0th bit of the next byte.
     void align()
     {
@@ -777,12 +1466,38 @@ public:
             nextByte += 1;
         }
     }
+
+    // Continue reading from the given bit of the given byte.
+    void seek(const uint position, const uint bit)
+    {
+        nextByte = position;
+        nextBit = bit;
+    }
+
+    uint position() const
+    {
+        return nextByte;
+    }
+
+    uint bit() const
+    {
+        return nextBit;
+    }
 };
 
 // Return the symbol from the Huffman table that corresponds to the next Huffman code read from the
 // BitReader.
 byte getNextSymbol(BitReader& b, const HuffmanTable& hTable)
 {
+    // Codes of at most 8 bits are looked up from the next 8 bits at once.
+    const int next = b.peekByte();
+    if (next != -1 && hTable.lookup[next] != 0)
+    {
+        JPEG_COUNT(b.counters.symbolsDecoded, 1);
+        b.skipBits(hTable.lookup[next] >> 8);
+        return hTable.lookup[next] & 0xFF;
+    }
+
     uint currentCode = 0;
     for (uint i = 0; i < 16; ++i)
     {
@@ -796,6 +1511,8 @@ byte getNextSymbol(BitReader& b, const HuffmanTable& hTable)
         {
             if (currentCode == hTable.codes[j])
             {
+                JPEG_COUNT(b.counters.symbolsDecoded, 1);
+                JPEG_COUNT(b.counters.slowHuffmanLookups, i >= 8);
                 return hTable.symbols[j].to_ulong();
             }
         }
@@ -803,37 +1520,41 @@ byte getNextSymbol(BitReader& b, const HuffmanTable& hTable)
     return -1;
 }
 
-// Fill the coefficient of an MCU component based on Huffman codes read from the BitReader.
+// Fill the coefficient of an MCU component based on Huffman codes read from the BitReader. When
+// quantization is not nullptr, every coefficient is multiplied by that table, in natural order, as
+// it is written.
 bool decodeMCUComponent(BitReader& b,
                         int* const component,
                         int& previousDC,
                         const HuffmanTable& dcTable,
-                        const HuffmanTable& acTable)
+                        const HuffmanTable& acTable,
+                        const uint* const quantization)
 {
     byte length = getNextSymbol(b, dcTable).to_ulong(); // Get the DC Value for this MCU Component.
     if (length.to_ulong() == -1)
     {
-        std::cout << "Error - Invalid DC value\n";
+        b.error = "Invalid DC value";
         return false;
     }
     if (length.to_ulong() > 11)
     {
-        std::cout << "Error - DC coefficient length greater than 11\n";
+        b.error = "DC coefficient length greater than 11";
         return false;
     }
 
     int coeff = b.readBits(length.to_ulong());
     if (coeff == -1)
     {
-        std::cout << "Error - Invalid DC value\n";
+        b.error = "Invalid DC value";
         return false;
     }
     if (length.to_ulong() != 0 && coeff < (1 << (length.to_ulong() - 1)))
     {
         coeff -= (1 << length.to_ulong()) - 1;
     }
-    component[0] = coeff + previousDC;
-    previousDC = component[0];
+    previousDC += coeff;
+    component[0] = (quantization != nullptr) ? previousDC * static_cast<int>(quantization[0])
+                                             : previousDC;
 
     // Get the AC value for this MCU component.
     uint i = 1;
@@ -842,13 +1563,14 @@ bool decodeMCUComponent(BitReader& b,
         byte symbol = getNextSymbol(b, acTable).to_ulong();
         if (symbol.to_ulong() == -1)
         {
-            std::cout << "Error - Invalid AC value\n";
+            b.error = "Invalid AC value";
             return false;
         }
 
         // Symbol 0x00 means fill remainder of compoenent with 0.
         if (symbol.to_ulong() == 0x00)
         {
+            JPEG_COUNT(b.counters.endOfBlockPositions[i], 1);
             for (; i < 64; ++i)
             {
                 component[zigZagMap[i]] = 0;
@@ -869,7 +1591,7 @@ bool decodeMCUComponent(BitReader& b,
 
         if (i + numZeroes.to_ulong() >= 64)
         {
-            std::cout << "Error - Zero run-length exceeded MCU\n";
+            b.error = "Zero run-length exceeded MCU";
             return false;
         }
         for (uint j = 0; j < numZeroes.to_ulong(); ++j, ++i)
@@ -878,7 +1600,7 @@ bool decodeMCUComponent(BitReader& b,
         }
         if (coeffLength.to_ulong() > 10)
         {
-            std::cout << "Error - AC coefficient length greater than 10\n";
+            b.error = "AC coefficient length greater than 10";
             return false;
         }
         if (coeffLength.to_ulong() != 0)
@@ -886,183 +1608,1469 @@ bool decodeMCUComponent(BitReader& b,
             coeff = b.readBits(coeffLength.to_ulong());
             if (coeff == -1)
             {
-                std::cout << "Error - Invalid AC value\n";
+                b.error = "Invalid AC value";
                 return false;
             }
             if (coeff < (1 << (coeffLength.to_ulong() - 1)))
             {
                 coeff -= (1 << coeffLength.to_ulong()) - 1;
             }
-            component[zigZagMap[i]] = coeff;
+            const uint k = zigZagMap[i];
+            component[k] = (quantization != nullptr) ? coeff * static_cast<int>(quantization[k])
+                                                     : coeff;
             i += 1;
         }
     }
+    JPEG_COUNT(b.counters.endOfBlockPositions[64], 1);
     return true;
 }
 
-MCU* decodeHuffmanData(Header* const header) // Decode all the Huffman data and fill all MCUs.
+// Restrict decoding to a rectangle of the image. Entropy decoding still has to read the Huffman
+// data up to the last MCU row of the rectangle, but only the MCUs covering it are stored and passed
+// through the later stages.
+bool setCrop(Header* const header, const Crop& crop)
 {
-    const uint mcuHeight = (header->height + 7) / 8;
-    const uint mcuWidth = (header->width + 7) / 8;
-    MCU* mcus = new (std::nothrow) MCU[mcuHeight * mcuWidth];
-    if (mcus == nullptr)
+    if (crop.width == 0 || crop.height == 0 || crop.x >= header->width
+        || crop.y >= header->height || crop.width > header->width - crop.x
+        || crop.height > header->height - crop.y)
+    {
+        setError(header, StatusCode::InvalidArgument, "Crop region outside of image");
+        return false;
+    }
+
+    const uint mcuPixelWidth = 8 * header->horizontalSamplingFactor.to_ulong();
+    const uint mcuPixelHeight = 8 * header->verticalSamplingFactor.to_ulong();
+    header->crop = crop;
+    header->mcuTop = crop.y / mcuPixelHeight;
+    header->mcuBottom = (crop.y + crop.height + mcuPixelHeight - 1) / mcuPixelHeight;
+    header->mcuLeft = crop.x / mcuPixelWidth;
+    header->mcuRight = (crop.x + crop.width + mcuPixelWidth - 1) / mcuPixelWidth;
+    return true;
+}
+
+// Return the coefficients of block (x, y) of the given color component, where x and y count blocks
+// of that component rather than of the full resolution image. Return nullptr if the block lies
+// outside of the crop region and is therefore not stored.
+int* componentBlock(const Header* const header, MCU* const mcus, uint component, uint x, uint y)
+{
+    const ColorComponent& c = header->colorComponents[component];
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint column = x * (hMax / c.horizontalSamplingFactor.to_ulong());
+    const uint row = y * (vMax / c.verticalSamplingFactor.to_ulong());
+    if (row < header->mcuTop * vMax || row >= header->mcuBottom * vMax
+        || column < header->mcuLeft * hMax || column >= header->mcuRight * hMax)
     {
-        std::cout << "Error - Memory error\n";
         return nullptr;
     }
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * hMax;
+    return mcus[(row - header->mcuTop * vMax) * blockWidth + column - header->mcuLeft * hMax]
+               [component];
+}
 
-    for (uint i = 0; i < 4; ++i)
+// Return the coding units of a scan and the part of them that covers the crop region.
+ScanUnits getScanUnits(const Header* const header, const Scan& scan)
+{
+    // An interleaved scan codes one MCU at a time. A non-interleaved scan codes the blocks of its
+    // component in raster order, covering only the blocks that contain pixels of that component.
+    ScanUnits units;
+    units.wide = header->mcuWidth;
+    units.high = header->mcuHeight;
+    units.left = header->mcuLeft;
+    units.right = header->mcuRight;
+    units.top = header->mcuTop;
+    units.bottom = header->mcuBottom;
+    if (scan.numComponents.to_ulong() == 1)
     {
-        if (header->huffmanDCTables[i].set)
-        {
-            generateCodes(header->huffmanDCTables[i]);
-        }
-        if (header->huffmanACTables[i].set)
+        const ColorComponent& c = header->colorComponents[scan.componentIDs[0]];
+        const uint h = c.horizontalSamplingFactor.to_ulong();
+        const uint v = c.verticalSamplingFactor.to_ulong();
+        const uint hMax = header->horizontalSamplingFactor.to_ulong();
+        const uint vMax = header->verticalSamplingFactor.to_ulong();
+        const uint componentHeight = (header->height * v + vMax - 1) / vMax;
+        const uint componentWidth = (header->width * h + hMax - 1) / hMax;
+        units.wide = (componentWidth + 7) / 8;
+        units.high = (componentHeight + 7) / 8;
+        units.left *= h;
+        units.right = std::min(units.right * h, units.wide);
+        units.top *= v;
+        units.bottom = std::min(units.bottom * v, units.high);
+    }
+    return units;
+}
+
+// Return true if any of the count coding units starting at first lies within the crop region.
+bool intervalNeeded(const ScanUnits& units, const uint first, const uint count)
+{
+    const uint last = std::min(first + count, units.wide * units.high) - 1;
+    for (uint row = std::max(first / units.wide, units.top);
+         row <= last / units.wide && row < units.bottom;
+         ++row)
+    {
+        const uint start = (row == first / units.wide) ? first % units.wide : 0;
+        const uint end = (row == last / units.wide) ? last % units.wide : units.wide - 1;
+        if (start < units.right && end >= units.left)
         {
-            generateCodes(header->huffmanACTables[i]);
+            return true;
         }
     }
+    return false;
+}
 
-    BitReader b(header->huffmanData);
-
-    int previousDCs[3] = {0};
+// Decode one coding unit of a scan into the MCUs, or throw its coefficients away if it lies
+// outside of the crop region. quantization holds the table each scan component is dequantized
+// with, or nullptr entries to store the quantized coefficients.
+bool decodeUnit(const Header* const header,
+                const Scan& scan,
+                const ScanUnits& units,
+                const uint i,
+                BitReader& b,
+                int* const previousDCs,
+                const uint* const* const quantization,
+                MCU* const mcus)
+{
+    // Blocks outside of the crop region still have to be decoded to keep the bit position and DC
+    // predictions correct, but their coefficients are thrown away.
+    int discarded[64];
 
-    for (uint i = 0; i < mcuHeight * mcuWidth; ++i)
+    const uint unitRow = i / units.wide;
+    const uint unitColumn = i % units.wide;
+    for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
     {
-        if (header->restartInterval != 0 && i % header->restartInterval == 0)
+        const uint component = scan.componentIDs[j];
+        const ColorComponent& c = header->colorComponents[component];
+        uint v = c.verticalSamplingFactor.to_ulong();
+        uint h = c.horizontalSamplingFactor.to_ulong();
+        if (scan.numComponents.to_ulong() == 1)
         {
-            previousDCs[0] = 0;
-            previousDCs[1] = 0;
-            previousDCs[2] = 0;
-            b.align();
+            v = 1;
+            h = 1;
         }
-        for (uint j = 0; j < header->numComponents.to_ulong(); ++j)
+        for (uint y = 0; y < v; ++y)
         {
-            if (!decodeMCUComponent(b,
-                                    mcus[i][j],
-                                    previousDCs[j],
-                                    header->huffmanDCTables[header->colorComponents[j].huffmanDCTableID.to_ulong()],
-                                    header->huffmanACTables[header->colorComponents[j].huffmanACTableID.to_ulong()]))
+            for (uint x = 0; x < h; ++x)
             {
-                delete[] mcus;
-                return nullptr;
+                int* block = nullptr;
+                if (mcus != nullptr)
+                {
+                    block = componentBlock(header,
+                                           mcus,
+                                           component,
+                                           unitColumn * h + x,
+                                           unitRow * v + y);
+                }
+                if (block == nullptr)
+                {
+                    block = discarded;
+                }
+                if (!decodeMCUComponent(b,
+                                        block,
+                                        previousDCs[j],
+                                        scan.huffmanDCTables[j],
+                                        scan.huffmanACTables[j],
+                                        quantization[j]))
+                {
+                    return false;
+                }
             }
         }
     }
-
-    return mcus;
+    return true;
 }
 
-void putInt(std::ofstream& outFile,
-            const uint v) // Helper function to write a 4-byte integer in little-endian
+// Decode one coding unit with the component layout fixed at compile time: numComponents
+// components in frame order, lumaH x lumaV luma blocks and one block of each chroma component per
+// MCU. This covers grayscale images and interleaved 4:4:4, 4:2:2 and 4:2:0 scans. The crop region
+// is MCU aligned, so a unit is either stored whole or thrown away whole.
+template <uint numComponents, uint lumaH, uint lumaV>
+bool decodeUnitLayout(const Header* const header,
+                      const Scan& scan,
+                      const ScanUnits& units,
+                      const uint i,
+                      BitReader& b,
+                      int* const previousDCs,
+                      const uint* const* const quantization,
+                      MCU* const mcus)
 {
-    outFile.put((v >> 0) & 0xFF);
-    outFile.put((v >> 0) & 0xFF);
-    outFile.put((v >> 0) & 0xFF);
-    outFile.put((v >> 0) & 0xFF);
+    int discarded[64];
+
+    const uint unitRow = i / units.wide;
+    const uint unitColumn = i % units.wide;
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * lumaH;
+    MCU* mcu = nullptr;
+    if (mcus != nullptr && unitRow >= units.top && unitRow < units.bottom
+        && unitColumn >= units.left && unitColumn < units.right)
+    {
+        mcu = mcus + (unitRow - units.top) * lumaV * blockWidth + (unitColumn - units.left) * lumaH;
+    }
+    for (uint y = 0; y < lumaV; ++y)
+    {
+        for (uint x = 0; x < lumaH; ++x)
+        {
+            if (!decodeMCUComponent(b,
+                                    (mcu != nullptr) ? mcu[y * blockWidth + x].y : discarded,
+                                    previousDCs[0],
+                                    scan.huffmanDCTables[0],
+                                    scan.huffmanACTables[0],
+                                    quantization[0]))
+            {
+                return false;
+            }
+        }
+    }
+    if (numComponents == 3)
+    {
+        if (!decodeMCUComponent(b,
+                                (mcu != nullptr) ? mcu->cb : discarded,
+                                previousDCs[1],
+                                scan.huffmanDCTables[1],
+                                scan.huffmanACTables[1],
+                                quantization[1])
+            || !decodeMCUComponent(b,
+                                   (mcu != nullptr) ? mcu->cr : discarded,
+                                   previousDCs[2],
+                                   scan.huffmanDCTables[2],
+                                   scan.huffmanACTables[2],
+                                   quantization[2]))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-void putShort(std::ofstream& outFile,
-              const uint v) // Helper function to write a 4-byte integer in little-endian
+typedef bool (*UnitDecoder)(const Header* header,
+                            const Scan& scan,
+                            const ScanUnits& units,
+                            uint i,
+                            BitReader& b,
+                            int* previousDCs,
+                            const uint* const* quantization,
+                            MCU* mcus);
+
+// Choose the unit decoder for a scan once, using a specialized one for the common layouts and
+// decodeUnit for everything else, such as non-interleaved scans of color images.
+UnitDecoder selectUnitDecoder(const Header* const header, const Scan& scan)
 {
-    outFile.put((v >> 0) & 0xFF);
-    outFile.put((v >> 8) & 0xFF);
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    if (header->numComponents.to_ulong() == 1 && hMax == 1 && vMax == 1)
+    {
+        return decodeUnitLayout<1, 1, 1>;
+    }
+    if (scan.numComponents.to_ulong() != 3 || scan.componentIDs[0] != 0
+        || scan.componentIDs[1] != 1 || scan.componentIDs[2] != 2)
+    {
+        return decodeUnit;
+    }
+    // Chroma components always have sampling factors of 1, and luma has the largest.
+    if (hMax == 1 && vMax == 1)
+    {
+        return decodeUnitLayout<3, 1, 1>;
+    }
+    if (hMax == 2 && vMax == 1)
+    {
+        return decodeUnitLayout<3, 2, 1>;
+    }
+    if (hMax == 2 && vMax == 2)
+    {
+        return decodeUnitLayout<3, 2, 2>;
+    }
+    return decodeUnit;
 }
 
-void writeBMP(const Header* const header,
-              const MCU* const mcus,
-              const std::string& filename) // This function writes all the
-                                           // pixels in the bitmap file.
+#ifdef JPEG_INSTRUMENTATION
+// Add the counters of one thread to the counters of a header, which other threads may be adding
+// to at the same time.
+void addCounters(DecodeCounters& total, const DecodeCounters& counters)
 {
-    // Open file
-    std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
-    if (!outFile.is_open())
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    total.symbolsDecoded += counters.symbolsDecoded;
+    total.slowHuffmanLookups += counters.slowHuffmanLookups;
+    total.stuffedBytesRemoved += counters.stuffedBytesRemoved;
+    total.standardHuffmanTables += counters.standardHuffmanTables;
+    for (uint i = 0; i < 65; ++i)
     {
-        std::cout << "Error - Failed opening output file\n";
-        return;
+        total.endOfBlockPositions[i] += counters.endOfBlockPositions[i];
     }
+}
+#endif
 
-    const uint mcuHeight = (header->height + 7) / 8;
-    const uint mcuWidth = (header->height + 7) / 8;
-    const uint paddingSize = header->width % 4;
-    const uint size = 14 + 12 + header->height * header->width + paddingSize * header->height;
+// Point quantization at the quantization table of each component of a scan.
+void getScanQuantization(const Header* const header,
+                         const Scan& scan,
+                         const uint** const quantization)
+{
+    for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
+    {
+        const ColorComponent& c = header->colorComponents[scan.componentIDs[j]];
+        quantization[j] = header->quantizationTables[c.quantizationTableID.to_ulong()].table;
+    }
+}
 
-    outFile.put('B');
-    outFile.put('M');
+// Decode the Huffman data of one scan from the checkpoints [first, last) into the components it
+// covers, dequantizing them if dequantized is true. The Huffman codes of the scan's tables must
+// already be generated.
+Status decodeScan(const Header* const header,
+                  const Scan& scan,
+                  MCU* const mcus,
+                  const uint first,
+                  const uint last,
+                  const bool dequantized)
+{
+    BitReader b(scan.huffmanData);
+    const ScanUnits units = getScanUnits(header, scan);
+    const UnitDecoder decode = selectUnitDecoder(header, scan);
+    const uint* quantization[3] = {nullptr, nullptr, nullptr};
+    if (dequantized)
+    {
+        getScanQuantization(header, scan, quantization);
+    }
 
-    putInt(outFile, size);
-    putInt(outFile, 0);
-    putInt(outFile, 0x1A);
-    putInt(outFile, 12);
-    putShort(outFile, header->width);
-    putShort(outFile, header->height);
-    putShort(outFile, 1);
-    putShort(outFile, 24);
+    int previousDCs[3] = {0};
 
-    for (uint y = header->height - 1; y < header->height; --y) // Loop through the Y coordinate
+    for (uint k = first; k < last; ++k)
     {
-        const uint mcuRow = y / 8;
-        const uint pixelRow = y % 8;
-        for (uint x = 0; x < header->width; ++x) // Loop through the X coordinate
+        const Checkpoint& checkpoint = scan.checkpoints[k];
+        const uint end = (k + 1 < scan.checkpoints.size()) ? scan.checkpoints[k + 1].unit
+                                                           : units.high * units.wide;
+        // Nothing after the last row of the crop region is needed.
+        if (checkpoint.unit / units.wide >= units.bottom)
         {
-            const uint mcuColumn = x / 8;
-            const uint pixelColumn = x % 8;
-            const uint mcuIndex = mcuRow * mcuWidth + mcuColumn;
-            const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            outFile.put(mcus[mcuIndex].b[pixelIndex]);
-            outFile.put(mcus[mcuIndex].g[pixelIndex]);
-            outFile.put(mcus[mcuIndex].r[pixelIndex]);
+            break;
         }
-        for (uint i = 0; i < paddingSize; ++i)
+        // Decoding can start at any checkpoint, so the parts of the scan between checkpoints
+        // that lie outside of the crop region are skipped without decoding them.
+        if (!intervalNeeded(units, checkpoint.unit, end - checkpoint.unit))
         {
-            outFile.put(0);
+            continue;
+        }
+
+        b.seek(checkpoint.offset, checkpoint.bit);
+        previousDCs[0] = checkpoint.previousDCs[0];
+        previousDCs[1] = checkpoint.previousDCs[1];
+        previousDCs[2] = checkpoint.previousDCs[2];
+        for (uint i = checkpoint.unit; i < end && i / units.wide < units.bottom; ++i)
+        {
+            if (scan.restartInterval != 0 && i % scan.restartInterval == 0
+                && i != checkpoint.unit)
+            {
+                previousDCs[0] = 0;
+                previousDCs[1] = 0;
+                previousDCs[2] = 0;
+                b.align();
+            }
+            if (!decode(header, scan, units, i, b, previousDCs, quantization, mcus))
+            {
+                return {StatusCode::InvalidData, b.error};
+            }
         }
     }
+#ifdef JPEG_INSTRUMENTATION
+    addCounters(header->statistics.counters, b.counters);
+#endif
+    return Status();
+}
 
-    outFile.close();
+// Decode the coding units of a scan from state up to unit last, for a scan whose compressed data
+// is still arriving. Running out of data is not an error: state is left at the first coding unit
+// that could not be decoded in full, so decoding can resume there once more data is appended.
+Status decodeScanUnits(const Header* const header,
+                       const Scan& scan,
+                       MCU* const mcus,
+                       Checkpoint& state,
+                       const uint last,
+                       const bool dequantized)
+{
+    BitReader b(scan.huffmanData);
+    const ScanUnits units = getScanUnits(header, scan);
+    const UnitDecoder decode = selectUnitDecoder(header, scan);
+    const uint* quantization[3] = {nullptr, nullptr, nullptr};
+    if (dequantized)
+    {
+        getScanQuantization(header, scan, quantization);
+    }
+
+    b.seek(state.offset, state.bit);
+    int previousDCs[3] = {state.previousDCs[0], state.previousDCs[1], state.previousDCs[2]};
+    Status status;
+    for (uint i = state.unit; i < last; ++i)
+    {
+        if (scan.restartInterval != 0 && i % scan.restartInterval == 0 && i != 0)
+        {
+            previousDCs[0] = 0;
+            previousDCs[1] = 0;
+            previousDCs[2] = 0;
+            b.align();
+        }
+        if (!decode(header, scan, units, i, b, previousDCs, quantization, mcus))
+        {
+            if (b.position() < scan.huffmanData.size())
+            {
+                status = {StatusCode::InvalidData, b.error};
+            }
+            break;
+        }
+        state.unit = i + 1;
+        state.offset = b.position();
+        state.bit = b.bit();
+        state.previousDCs[0] = previousDCs[0];
+        state.previousDCs[1] = previousDCs[1];
+        state.previousDCs[2] = previousDCs[2];
+    }
+#ifdef JPEG_INSTRUMENTATION
+    addCounters(header->statistics.counters, b.counters);
+#endif
+    return status;
 }
 
-int main(int argc, char* argv[])
+// Check the Huffman codes of one block the way decodeMCUComponent reads them, with the same
+// errors, but skip over the bits of the coefficients rather than reading their values. When
+// previousDC is not nullptr, the DC coefficient is read after all and added to it.
+bool skipMCUComponent(BitReader& b,
+                      const HuffmanTable& dcTable,
+                      const HuffmanTable& acTable,
+                      int* const previousDC)
 {
-    if (argc < 2)
+    const byte length = getNextSymbol(b, dcTable).to_ulong();
+    if (length.to_ulong() > 11)
     {
-        std::cout << "Error - Invalid arguments\n";
-        return 1;
+        b.error = "DC coefficient length greater than 11";
+        return false;
     }
-    for (int i = 1; i < argc; ++i)
+    if (previousDC != nullptr)
     {
-        const std::string filename(argv[i]);
-        Header* header = readJPG(filename);
-        if (header == nullptr)
+        int coeff = b.readBits(length.to_ulong());
+        if (coeff == -1)
         {
-            continue;
+            b.error = "Invalid DC value";
+            return false;
         }
-        if (header->valid == false)
+        if (length.to_ulong() != 0 && coeff < (1 << (length.to_ulong() - 1)))
         {
-            std::cout << "Error - Invalid JPG\n";
-            delete header;
-            continue;
+            coeff -= (1 << length.to_ulong()) - 1;
         }
+        *previousDC += coeff;
+    }
+    else if (!b.skipAvailableBits(length.to_ulong()))
+    {
+        b.error = "Invalid DC value";
+        return false;
+    }
 
-        printHeader(header);
+    uint i = 1;
+    while (i < 64)
+    {
+        const byte symbol = getNextSymbol(b, acTable).to_ulong();
+        if (symbol.to_ulong() == 0x00)
+        {
+            return true;
+        }
+        uint numZeroes = symbol.to_ulong() >> 4;
+        const uint coeffLength = symbol.to_ulong() & 0x0F;
+        if (symbol.to_ulong() == 0xF0)
+        {
+            numZeroes = 16;
+        }
+        if (i + numZeroes >= 64)
+        {
+            b.error = "Zero run-length exceeded MCU";
+            return false;
+        }
+        i += numZeroes;
+        if (coeffLength > 10)
+        {
+            b.error = "AC coefficient length greater than 10";
+            return false;
+        }
+        if (coeffLength != 0)
+        {
+            if (!b.skipAvailableBits(coeffLength))
+            {
+                b.error = "Invalid AC value";
+                return false;
+            }
+            i += 1;
+        }
+    }
+    return true;
+}
 
-        // Decode Huffman data.
-        MCU* mcus = decodeHuffmanData(header);
-        if (mcus == nullptr)
+// Check the blocks of coding unit i of a scan, in the order decodeUnit decodes them. When
+// previousDCs is not nullptr, their DC coefficients are read as well and added to it, and when dc
+// is not nullptr too, those of the blocks that contain pixels are stored in dc, dequantized by
+// quantization.
+bool skipUnit(const Header* const header,
+              const Scan& scan,
+              const ScanUnits& units,
+              const uint i,
+              BitReader& b,
+              int* const previousDCs,
+              const uint* const* const quantization,
+              DCPlanes* const dc)
+{
+    const uint unitRow = i / units.wide;
+    const uint unitColumn = i % units.wide;
+    for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
+    {
+        const uint component = scan.componentIDs[j];
+        const ColorComponent& c = header->colorComponents[component];
+        uint v = c.verticalSamplingFactor.to_ulong();
+        uint h = c.horizontalSamplingFactor.to_ulong();
+        if (scan.numComponents.to_ulong() == 1)
         {
-            delete header;
-            continue;
+            v = 1;
+            h = 1;
+        }
+        for (uint y = 0; y < v; ++y)
+        {
+            for (uint x = 0; x < h; ++x)
+            {
+                if (!skipMCUComponent(b,
+                                      scan.huffmanDCTables[j],
+                                      scan.huffmanACTables[j],
+                                      (previousDCs != nullptr) ? &previousDCs[j] : nullptr))
+                {
+                    return false;
+                }
+                const uint column = unitColumn * h + x;
+                const uint row = unitRow * v + y;
+                if (dc != nullptr && column < dc->width[component] && row < dc->height[component])
+                {
+                    dc->planes[component][row * dc->width[component] + column] =
+                        previousDCs[j] * static_cast<int>(quantization[j][0]);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Walk the Huffman data of a scan, reading only its DC coefficients, and add a checkpoint every
+// interval coding units, so that later decodes can start in the middle of a restart interval. The
+// file offset of each new checkpoint is found by counting the stuffed bytes since the checkpoint
+// before it.
+bool findCheckpoints(const Header* const header, Scan& scan, const uint interval)
+{
+    for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+    {
+        generateCodes(scan.huffmanDCTables[i]);
+        generateCodes(scan.huffmanACTables[i]);
+    }
+
+    BitReader b(scan.huffmanData);
+    const ScanUnits units = getScanUnits(header, scan);
+    int previousDCs[3] = {0};
+
+    // The checkpoints of the scan, and at most one more every interval units.
+    std::vector<Checkpoint> checkpoints;
+    checkpoints.reserve(scan.checkpoints.size()
+                        + (units.wide * units.high + interval - 1) / interval);
+    uint next = 0;
+    Checkpoint previous;
+    for (uint i = 0; i < units.high * units.wide; ++i)
+    {
+        if (next < scan.checkpoints.size() && scan.checkpoints[next].unit == i)
+        {
+            previous = scan.checkpoints[next];
+            checkpoints.push_back(previous);
+            next += 1;
+            b.seek(previous.offset, previous.bit);
+            previousDCs[0] = previous.previousDCs[0];
+            previousDCs[1] = previous.previousDCs[1];
+            previousDCs[2] = previous.previousDCs[2];
+        }
+        else if (scan.restartInterval != 0 && i % scan.restartInterval == 0)
+        {
+            previousDCs[0] = 0;
+            previousDCs[1] = 0;
+            previousDCs[2] = 0;
+            b.align();
+        }
+        else if (i % interval == 0)
+        {
+            Checkpoint checkpoint;
+            checkpoint.unit = i;
+            checkpoint.offset = b.position();
+            checkpoint.bit = b.bit();
+            checkpoint.fileOffset = previous.fileOffset + (checkpoint.offset - previous.offset);
+            for (uint j = previous.offset; j < checkpoint.offset && j < scan.huffmanData.size();
+                 ++j)
+            {
+                if (scan.huffmanData[j] == 0xFF)
+                {
+                    checkpoint.fileOffset += 1;
+                }
+            }
+            checkpoint.previousDCs[0] = previousDCs[0];
+            checkpoint.previousDCs[1] = previousDCs[1];
+            checkpoint.previousDCs[2] = previousDCs[2];
+            previous = checkpoint;
+            checkpoints.push_back(checkpoint);
+        }
+        // Only the DC predictions are needed at a checkpoint, so the AC coefficients are skipped.
+        if (!skipUnit(header, scan, units, i, b, previousDCs, nullptr, nullptr))
+        {
+            setError(header, StatusCode::InvalidData, b.error);
+            return false;
         }
+    }
+    scan.checkpoints = std::move(checkpoints);
+    return true;
+}
+
+// Progress of checkJPG through the compressed data of the scan being read. Offsets are into the
+// part of the scan's data that has not been dropped yet.
+struct ScanCheck
+{
+    uint scan = static_cast<uint>(-1);
+    bool active = false;
+    // The first coding unit not checked yet, and the data it starts at.
+    Checkpoint state;
+    // The unit whose restart has been handled, and the next checkpoint to restart at.
+    uint restarted = static_cast<uint>(-1);
+    uint nextCheckpoint = 0;
+    // A position in the data whose file offset is known, before every offset still needed.
+    Checkpoint origin;
+    // When DC coefficients are read, their predictions at the first unit not checked yet, and the
+    // quantization table of each scan component.
+    int previousDCs[3] = {0};
+    const uint* quantization[3] = {nullptr, nullptr, nullptr};
+};
 
-        // Write BMP file
-        const std::size_t pos = filename.find_first_of('.');
-        const std::string outFilename = (pos == std::string::npos) ? (filename + ".bmp")
-                                                                   : (filename.substr(0, pos)
-                                                                      + ".bmp");
-        writeBMP(header, mcus, outFilename);
+// Return the file offset of a byte of a scan's data, counting the stuffed 0x00 byte after every
+// 0xFF since the nearest position whose file offset is known.
+uint64_t checkedFileOffset(const Scan& scan, const ScanCheck& check, const uint offset)
+{
+    Checkpoint anchor = check.origin;
+    for (const Checkpoint& checkpoint : scan.checkpoints)
+    {
+        if (checkpoint.offset <= offset && checkpoint.offset >= anchor.offset)
+        {
+            anchor = checkpoint;
+        }
+    }
+    uint64_t fileOffset = anchor.fileOffset + (offset - anchor.offset);
+    for (uint j = anchor.offset; j < offset && j < scan.huffmanData.size(); ++j)
+    {
+        if (scan.huffmanData[j] == 0xFF)
+        {
+            fileOffset += 1;
+        }
+    }
+    return fileOffset;
+}
 
+// Check the coding units of the last scan whose data has been read, restarting at the checkpoints
+// of restart markers exactly like decodeScan does, and then drop the data before the first unit
+// still to be checked. Until the scan has ended, running out of data only means waiting for more.
+// When dc is not nullptr, the DC coefficients of the scan's components are read into it.
+bool checkScanData(Header* const header,
+                   ScanCheck& check,
+                   const bool ended,
+                   ErrorLocation& location,
+                   DCPlanes* const dc)
+{
+    Scan& scan = header->scans.back();
+    if (check.scan != header->scans.size() - 1)
+    {
+        for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+        {
+            generateCodes(scan.huffmanDCTables[i]);
+            generateCodes(scan.huffmanACTables[i]);
+        }
+        check = ScanCheck();
+        check.scan = header->scans.size() - 1;
+        check.active = true;
+        check.origin = scan.checkpoints[0];
+        if (dc != nullptr)
+        {
+            const uint hMax = header->horizontalSamplingFactor.to_ulong();
+            const uint vMax = header->verticalSamplingFactor.to_ulong();
+            for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
+            {
+                const uint component = scan.componentIDs[j];
+                const ColorComponent& c = header->colorComponents[component];
+                const uint h = c.horizontalSamplingFactor.to_ulong();
+                const uint v = c.verticalSamplingFactor.to_ulong();
+                dc->width[component] = ((header->width * h + hMax - 1) / hMax + 7) / 8;
+                dc->height[component] = ((header->height * v + vMax - 1) / vMax + 7) / 8;
+                dc->planes[component].assign(dc->width[component] * dc->height[component], 0);
+            }
+            getScanQuantization(header, scan, check.quantization);
+        }
+    }
+
+    BitReader b(scan.huffmanData);
+    const ScanUnits units = getScanUnits(header, scan);
+    b.seek(check.state.offset, check.state.bit);
+    for (uint i = check.state.unit; i < units.wide * units.high; ++i)
+    {
+        if (check.restarted != i)
+        {
+            if (check.nextCheckpoint < scan.checkpoints.size()
+                && scan.checkpoints[check.nextCheckpoint].unit == i)
+            {
+                const Checkpoint& checkpoint = scan.checkpoints[check.nextCheckpoint++];
+                b.seek(checkpoint.offset, checkpoint.bit);
+                std::copy(checkpoint.previousDCs, checkpoint.previousDCs + 3, check.previousDCs);
+            }
+            else if (scan.restartInterval != 0 && i % scan.restartInterval == 0)
+            {
+                // Its restart marker may be in data not read yet.
+                if (!ended)
+                {
+                    break;
+                }
+                b.align();
+                std::fill(check.previousDCs, check.previousDCs + 3, 0);
+            }
+            check.restarted = i;
+            check.state.offset = b.position();
+            check.state.bit = b.bit();
+        }
+        // A unit cut short by the end of the data so far is checked again from its start.
+        int previousDCs[3];
+        std::copy(check.previousDCs, check.previousDCs + 3, previousDCs);
+        if (!skipUnit(header,
+                      scan,
+                      units,
+                      i,
+                      b,
+                      (dc != nullptr) ? previousDCs : nullptr,
+                      check.quantization,
+                      dc))
+        {
+            if (ended || b.position() < scan.huffmanData.size())
+            {
+                setError(header, StatusCode::InvalidData, b.error);
+                header->valid = false;
+                location.inScan = true;
+                location.scan = check.scan;
+                location.unit = i;
+                location.bitOffset = checkedFileOffset(scan, check, b.position()) * 8 + b.bit();
+                check.active = false;
+                return false;
+            }
+            break;
+        }
+        std::copy(previousDCs, previousDCs + 3, check.previousDCs);
+        check.state.unit = i + 1;
+        check.state.offset = b.position();
+        check.state.bit = b.bit();
+    }
+    if (ended)
+    {
+        check.active = false;
+    }
+
+    // Nothing before the first unit still to be checked, or the next checkpoint, is needed again.
+    uint start = check.state.offset;
+    if (check.nextCheckpoint < scan.checkpoints.size())
+    {
+        start = std::min(start, scan.checkpoints[check.nextCheckpoint].offset);
+    }
+    check.origin.fileOffset = checkedFileOffset(scan, check, start);
+    check.origin.offset = 0;
+    scan.huffmanData.erase(scan.huffmanData.begin(), scan.huffmanData.begin() + start);
+    scan.checkpoints.erase(scan.checkpoints.begin(),
+                           scan.checkpoints.begin() + check.nextCheckpoint);
+    for (Checkpoint& checkpoint : scan.checkpoints)
+    {
+        checkpoint.offset -= start;
+    }
+    check.nextCheckpoint = 0;
+    check.state.offset -= start;
+    return true;
+}
+
+// Check that a JPG can be decoded without decoding it: its markers are parsed and the Huffman codes
+// of all of its compressed data are read, but no coefficients are stored and nothing is
+// reconstructed. The compressed data is dropped as soon as it has been checked, so memory use does
+// not depend on the size of the image. Return nullptr if the header cannot be allocated, and
+// otherwise a header whose status describes the first error, and location, when not null, where
+// it was found.
+Header* checkJPG(std::istream& input, ErrorLocation* const location)
+{
+    ErrorLocation found;
+    ScanCheck check;
+    const ScanDataConsumer consume = [&check, &found](Header* const header, const bool ended)
+    {
+        return checkScanData(header, check, ended, found, nullptr);
+    };
+    Header* header = parseJPG(input, nullptr, false, false, &found, consume);
+    if (header == nullptr)
+    {
+        return nullptr;
+    }
+    if (header->valid)
+    {
+        found = ErrorLocation();
+    }
+    else if (check.active)
+    {
+        // The data of a scan ended before all of it was checked.
+        found.inScan = true;
+        found.scan = check.scan;
+        found.unit = check.state.unit;
+        found.bitOffset = checkedFileOffset(header->scans.back(), check, check.state.offset) * 8
+                          + check.state.bit;
+    }
+    if (location != nullptr)
+    {
+        *location = found;
+    }
+    return header;
+}
+
+// Read the DC coefficient of every block of a JPG into dc while checking it like checkJPG: the AC
+// coefficients are skipped rather than decoded, no MCUs are allocated and nothing is
+// reconstructed, and the compressed data is dropped as soon as it has been read. Return nullptr
+// if the header cannot be allocated, and otherwise a header whose status describes any error.
+Header* readDCValues(std::istream& input, DCPlanes& dc)
+{
+    dc = DCPlanes();
+    ErrorLocation location;
+    ScanCheck check;
+    const ScanDataConsumer consume = [&check, &location, &dc](Header* const header,
+                                                              const bool ended)
+    {
+        return checkScanData(header, check, ended, location, &dc);
+    };
+    return parseJPG(input, nullptr, false, false, nullptr, consume);
+}
+
+// Decode all the Huffman data and fill all MCUs. If dequantized is true the coefficients are
+// dequantized as they are decoded, which saves the separate pass of dequantize over the MCUs.
+MCU* decodeHuffmanData(Header* const header, const bool dequantized)
+{
+    const uint blockHeight = (header->mcuBottom - header->mcuTop)
+                             * header->verticalSamplingFactor.to_ulong();
+    const uint blockWidth = (header->mcuRight - header->mcuLeft)
+                            * header->horizontalSamplingFactor.to_ulong();
+    MCU* mcus = new (std::nothrow) MCU[blockHeight * blockWidth];
+    if (mcus == nullptr)
+    {
+        setError(header, StatusCode::MemoryError, "Memory error");
+        return nullptr;
+    }
+    if (!decodeHuffmanData(header, mcus, dequantized))
+    {
         delete[] mcus;
-        delete header;
+        return nullptr;
+    }
+    return mcus;
+}
+
+// The fewest blocks worth starting a thread of decodeHuffmanData for, about a millisecond of
+// decoding.
+const std::size_t minBlocksPerThread = 4096;
+
+// The most threads decodeHuffmanData may split an image between when called from this thread, 0
+// for one per hardware thread.
+thread_local uint maxDecodeThreads = 0;
+
+// Limit the threads decodeHuffmanData uses when called from this thread. Threads that already
+// decode several images at once, such as the workers of decodeBatch, set 1.
+void setDecodeThreads(const uint threads)
+{
+    maxDecodeThreads = threads;
+}
+
+// Decode into MCUs the caller provides, one for every block of the crop region's MCUs. Every
+// coefficient of the blocks that hold pixels is written, so the MCUs may hold an earlier image.
+bool decodeHuffmanData(Header* const header, MCU* const mcus, const bool dequantized)
+{
+    StageTimer timer(header->statistics.stageSeconds[HuffmanDecodeStage]);
+    for (Scan& scan : header->scans)
+    {
+        for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+        {
+            generateCodes(scan.huffmanDCTables[i]);
+            generateCodes(scan.huffmanACTables[i]);
+        }
+    }
+
+    // Every scan codes different components, and decoding can start at any checkpoint of a scan,
+    // so the checkpoints the crop region needs are split between threads, weighed by the blocks
+    // decoded from each. Only images with enough blocks for every thread to outweigh starting it
+    // are split.
+    struct Range
+    {
+        const Scan* scan;
+        uint first, last;
+    };
+    std::vector<std::vector<std::size_t>> scanBlocks;
+    std::size_t totalBlocks = 0;
+    for (const Scan& scan : header->scans)
+    {
+        const ScanUnits units = getScanUnits(header, scan);
+        uint unitBlocks = 1;
+        if (scan.numComponents.to_ulong() != 1)
+        {
+            unitBlocks = 0;
+            for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
+            {
+                const ColorComponent& c = header->colorComponents[scan.componentIDs[j]];
+                unitBlocks += c.horizontalSamplingFactor.to_ulong()
+                              * c.verticalSamplingFactor.to_ulong();
+            }
+        }
+        std::vector<std::size_t> blocks(scan.checkpoints.size(), 0);
+        for (uint k = 0; k < scan.checkpoints.size(); ++k)
+        {
+            const uint first = scan.checkpoints[k].unit;
+            const uint end = std::min((k + 1 < scan.checkpoints.size())
+                                          ? scan.checkpoints[k + 1].unit
+                                          : units.high * units.wide,
+                                      units.bottom * units.wide);
+            if (first < end && intervalNeeded(units, first, end - first))
+            {
+                blocks[k] = static_cast<std::size_t>(end - first) * unitBlocks;
+                totalBlocks += blocks[k];
+            }
+        }
+        scanBlocks.push_back(std::move(blocks));
+    }
+    const uint hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t threads = std::max<std::size_t>(
+        1,
+        std::min<std::size_t>((maxDecodeThreads != 0) ? maxDecodeThreads : hardwareThreads,
+                              totalBlocks / minBlocksPerThread));
+
+    std::vector<Range> ranges;
+    const std::size_t perThread = (totalBlocks + threads - 1) / threads;
+    for (uint i = 0; i < header->scans.size(); ++i)
+    {
+        const std::vector<std::size_t>& blocks = scanBlocks[i];
+        std::size_t rangeBlocks = 0;
+        uint first = 0;
+        for (uint k = 0; k < blocks.size(); ++k)
+        {
+            rangeBlocks += blocks[k];
+            if (rangeBlocks != 0 && (rangeBlocks >= perThread || k + 1 == blocks.size()))
+            {
+                ranges.push_back({&header->scans[i], first, k + 1});
+                rangeBlocks = 0;
+                first = k + 1;
+            }
+        }
+    }
+
+    Status status;
+    if (threads == 1 || ranges.size() == 1)
+    {
+        for (const Range& range : ranges)
+        {
+            status = decodeScan(header, *range.scan, mcus, range.first, range.last, dequantized);
+            if (!status.ok())
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        std::vector<std::future<Status>> results;
+        for (const Range& range : ranges)
+        {
+            results.push_back(std::async(std::launch::async,
+                                         decodeScan,
+                                         header,
+                                         std::cref(*range.scan),
+                                         mcus,
+                                         range.first,
+                                         range.last,
+                                         dequantized));
+        }
+        for (std::future<Status>& result : results)
+        {
+            const Status rangeStatus = result.get();
+            if (status.ok())
+            {
+                status = rangeStatus;
+            }
+        }
+    }
+    if (!status.ok())
+    {
+        setError(header, status.code, status.message);
+        return false;
+    }
+    return true;
+}
+
+// Multiply every stored coefficient by the corresponding entry of its quantization table.
+void dequantize(const Header* const header, MCU* const mcus)
+{
+    StageTimer timer(header->statistics.stageSeconds[DequantizeStage]);
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint blockHeight = (header->mcuBottom - header->mcuTop) * vMax;
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * hMax;
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        const QuantizationTable& qTable
+            = header->quantizationTables[c.quantizationTableID.to_ulong()];
+        const uint hStep = hMax / c.horizontalSamplingFactor.to_ulong();
+        const uint vStep = vMax / c.verticalSamplingFactor.to_ulong();
+        for (uint y = 0; y < blockHeight; y += vStep)
+        {
+            for (uint x = 0; x < blockWidth; x += hStep)
+            {
+                int* const component = mcus[y * blockWidth + x][i];
+                for (uint k = 0; k < 64; ++k)
+                {
+                    component[k] *= qTable.table[k];
+                }
+            }
+        }
+    }
+}
+
+// Convert the coefficients of every stored block into sample values.
+void inverseDCT(const Header* const header, MCU* const mcus)
+{
+    inverseDCT(header, mcus, 0, header->mcuBottom - header->mcuTop);
+}
+
+// Convert the coefficients of the stored blocks in the MCU rows [firstRow, lastRow) of the crop
+// region into sample values.
+void inverseDCT(const Header* const header,
+                MCU* const mcus,
+                const uint firstRow,
+                const uint lastRow)
+{
+    StageTimer timer(header->statistics.stageSeconds[InverseDCTStage]);
+    const Kernels& kernels = getKernels();
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * hMax;
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        const uint hStep = hMax / c.horizontalSamplingFactor.to_ulong();
+        const uint vStep = vMax / c.verticalSamplingFactor.to_ulong();
+        for (uint y = firstRow * vMax; y < lastRow * vMax; y += vStep)
+        {
+            for (uint x = 0; x < blockWidth; x += hStep)
+            {
+                kernels.inverseDCT(mcus[y * blockWidth + x][i]);
+            }
+        }
+    }
+}
+
+// Convert the samples of every stored block from YCbCr to RGB. Subsampled chroma is upsampled
+// from the top left block of each MCU, so the blocks of an MCU are converted in reverse order to
+// keep that block's Cb and Cr values until they are no longer needed.
+void YCbCrToRGB(const Header* const header, MCU* const mcus)
+{
+    YCbCrToRGB(header, mcus, 0, header->mcuBottom - header->mcuTop);
+}
+
+// Convert the samples of the MCU rows [firstRow, lastRow) of the crop region to RGB.
+void YCbCrToRGB(const Header* const header,
+                MCU* const mcus,
+                const uint firstRow,
+                const uint lastRow)
+{
+    StageTimer timer(header->statistics.stageSeconds[ColorStage]);
+    const Kernels& kernels = getKernels();
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * hMax;
+    int cb[64];
+    int cr[64];
+    for (uint mcuRow = firstRow; mcuRow < lastRow; ++mcuRow)
+    {
+        for (uint mcuColumn = 0; mcuColumn < header->mcuRight - header->mcuLeft; ++mcuColumn)
+        {
+            const MCU& cbcr = mcus[(mcuRow * vMax) * blockWidth + mcuColumn * hMax];
+            for (uint v = vMax - 1; v < vMax; --v)
+            {
+                for (uint h = hMax - 1; h < hMax; --h)
+                {
+                    MCU& mcu = mcus[(mcuRow * vMax + v) * blockWidth + mcuColumn * hMax + h];
+                    if (header->numComponents.to_ulong() == 1)
+                    {
+                        for (uint i = 0; i < 64; ++i)
+                        {
+                            const int gray = std::min(std::max(mcu.y[i] + 128, 0), 255);
+                            mcu.r[i] = gray;
+                            mcu.g[i] = gray;
+                            mcu.b[i] = gray;
+                        }
+                    }
+                    else if (hMax == 1 && vMax == 1)
+                    {
+                        kernels.YCbCrToRGB(mcu, mcu.cb, mcu.cr);
+                    }
+                    else
+                    {
+                        kernels.upsample(cbcr.cb, h, v, hMax, vMax, cb);
+                        kernels.upsample(cbcr.cr, h, v, hMax, vMax, cr);
+                        kernels.YCbCrToRGB(mcu, cb, cr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Basis of the scaled inverse DCT to size samples: sample x is the sum over u < size of
+// coefficient u times basis[x * size + u]. The first size coefficients of an 8 point DCT, scaled
+// by sqrt(size / 8), are those of a size point DCT of the same samples averaged down, so the
+// factors are the c(u) / 2 of the 8 point transform with the cosines of a size point one.
+std::vector<float> getScaledBasis(const uint size)
+{
+    std::vector<float> basis(size * size);
+    for (uint x = 0; x < size; ++x)
+    {
+        for (uint u = 0; u < size; ++u)
+        {
+            const double c = (u == 0) ? 1.0 / std::sqrt(2.0) : 1.0;
+            basis[x * size + u] = c / 2.0 * std::cos((2.0 * x + 1.0) * u * M_PI / (2.0 * size));
+        }
+    }
+    return basis;
+}
+
+// Round to the nearest integer with halfway cases away from 0, inline rather than through
+// std::lround.
+inline int roundSample(const float v)
+{
+    return static_cast<int>(v < 0.0f ? v - 0.5f : v + 0.5f);
+}
+
+// Scaled inverse DCT of the rows, and then the columns, of the lowest size x size coefficients of a
+// block.
+template <uint size>
+void scaledInverseDCTBlock(int* const block, const float* const basis)
+{
+    float rows[size * size];
+    for (uint v = 0; v < size; ++v)
+    {
+        for (uint k = 0; k < size; ++k)
+        {
+            float sum = 0.0f;
+            for (uint u = 0; u < size; ++u)
+            {
+                sum += basis[k * size + u] * block[v * 8 + u];
+            }
+            rows[v * size + k] = sum;
+        }
+    }
+    for (uint j = 0; j < size; ++j)
+    {
+        for (uint k = 0; k < size; ++k)
+        {
+            float sum = 0.0f;
+            for (uint v = 0; v < size; ++v)
+            {
+                sum += basis[j * size + v] * rows[v * size + k];
+            }
+            block[j * 8 + k] = roundSample(sum);
+        }
+    }
+}
+
+// Convert the coefficients of the stored blocks in the MCU rows [firstRow, lastRow) into size x
+// size samples, 1, 2, 4 or 8, in the top left of each block. Only the lowest size x size
+// coefficients are read, so an image is decoded at 1/2, 1/4 or 1/8 of its size for a fraction of
+// the work of the full inverse DCT.
+void scaledInverseDCT(const Header* const header,
+                      MCU* const mcus,
+                      const uint firstRow,
+                      const uint lastRow,
+                      const uint size)
+{
+    if (size == 8)
+    {
+        inverseDCT(header, mcus, firstRow, lastRow);
+        return;
+    }
+    StageTimer timer(header->statistics.stageSeconds[InverseDCTStage]);
+    static const std::vector<float> bases[3] = {getScaledBasis(1),
+                                                getScaledBasis(2),
+                                                getScaledBasis(4)};
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * hMax;
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        const uint hStep = hMax / c.horizontalSamplingFactor.to_ulong();
+        const uint vStep = vMax / c.verticalSamplingFactor.to_ulong();
+        for (uint y = firstRow * vMax; y < lastRow * vMax; y += vStep)
+        {
+            for (uint x = 0; x < blockWidth; x += hStep)
+            {
+                int* const block = mcus[y * blockWidth + x][i];
+                if (size == 1)
+                {
+                    block[0] = roundSample(block[0] * bases[0][0] * bases[0][0]);
+                }
+                else if (size == 2)
+                {
+                    scaledInverseDCTBlock<2>(block, bases[1].data());
+                }
+                else
+                {
+                    scaledInverseDCTBlock<4>(block, bases[2].data());
+                }
+            }
+        }
+    }
+}
+
+// Convert the size x size samples in the top left of the blocks in the MCU rows [firstRow,
+// lastRow) to RGB, after scaledInverseDCT. Subsampled chroma is upsampled the same way as at full
+// size. The samples are gathered 64 at a time into one block for the color kernel, so that the
+// rest of each block is neither converted nor read.
+void scaledYCbCrToRGB(const Header* const header,
+                      MCU* const mcus,
+                      const uint firstRow,
+                      const uint lastRow,
+                      const uint size)
+{
+    if (size == 8)
+    {
+        YCbCrToRGB(header, mcus, firstRow, lastRow);
+        return;
+    }
+    StageTimer timer(header->statistics.stageSeconds[ColorStage]);
+    const Kernels& kernels = getKernels();
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint blockWidth = (header->mcuRight - header->mcuLeft) * hMax;
+    const bool grayscale = header->numComponents.to_ulong() == 1;
+    MCU batch = {};
+    int cb[64] = {0};
+    int cr[64] = {0};
+    MCU* blocks[64];
+    uint samples[64];
+    uint count = 0;
+    const auto convertBatch = [&]()
+    {
+        kernels.YCbCrToRGB(batch, cb, cr);
+        for (uint n = 0; n < count; ++n)
+        {
+            blocks[n]->r[samples[n]] = batch.r[n];
+            blocks[n]->g[samples[n]] = batch.g[n];
+            blocks[n]->b[samples[n]] = batch.b[n];
+        }
+        count = 0;
+    };
+    for (uint mcuRow = firstRow; mcuRow < lastRow; ++mcuRow)
+    {
+        for (uint mcuColumn = 0; mcuColumn < header->mcuRight - header->mcuLeft; ++mcuColumn)
+        {
+            const MCU& cbcr = mcus[(mcuRow * vMax) * blockWidth + mcuColumn * hMax];
+            for (uint v = vMax - 1; v < vMax; --v)
+            {
+                for (uint h = hMax - 1; h < hMax; --h)
+                {
+                    MCU& mcu = mcus[(mcuRow * vMax + v) * blockWidth + mcuColumn * hMax + h];
+                    for (uint y = 0; y < size; ++y)
+                    {
+                        for (uint x = 0; x < size; ++x)
+                        {
+                            const uint i = y * 8 + x;
+                            if (grayscale)
+                            {
+                                const int gray = std::min(std::max(mcu.y[i] + 128, 0), 255);
+                                mcu.r[i] = gray;
+                                mcu.g[i] = gray;
+                                mcu.b[i] = gray;
+                                continue;
+                            }
+                            const uint j = ((v * size + y) / vMax) * 8 + (h * size + x) / hMax;
+                            batch.y[count] = mcu.y[i];
+                            cb[count] = cbcr.cb[j];
+                            cr[count] = cbcr.cr[j];
+                            blocks[count] = &mcu;
+                            samples[count] = i;
+                            // The samples of a block fill a whole part of the batch, so the chroma
+                            // of the top left block is never converted before all of its samples
+                            // have been gathered.
+                            if (++count == 64)
+                            {
+                                convertBatch();
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (count != 0)
+    {
+        convertBatch();
     }
-    return 0;
-}
\ No newline at end of file
+}
+
+// Convert the DC coefficients of an image to RGB pixels, one for each 8x8 block of pixels, rows
+// from top to bottom. This is the image scaledInverseDCT and scaledYCbCrToRGB decode at 1/8 of its
+// size, with the same rounding and chroma upsampling, without any of its MCUs.
+void DCToRGB(const Header* const header, const DCPlanes& dc, unsigned char* const rgb)
+{
+    StageTimer timer(header->statistics.stageSeconds[ColorStage]);
+    const Kernels& kernels = getKernels();
+    const float basis = getScaledBasis(1)[0];
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const uint width = (header->width + 7) / 8;
+    const uint height = (header->height + 7) / 8;
+    const uint numComponents = header->numComponents.to_ulong();
+    // The plane index of each pixel's sample of every component, in component blocks.
+    std::vector<uint> columns[3];
+    for (uint i = 0; i < numComponents; ++i)
+    {
+        const uint h = header->colorComponents[i].horizontalSamplingFactor.to_ulong();
+        columns[i].resize(width);
+        for (uint x = 0; x < width; ++x)
+        {
+            columns[i][x] = std::min(x * h / hMax, dc.width[i] - 1);
+        }
+    }
+
+    MCU batch = {};
+    int cb[64] = {0};
+    int cr[64] = {0};
+    uint count = 0;
+    std::size_t first = 0;
+    const auto convertBatch = [&]()
+    {
+        kernels.YCbCrToRGB(batch, cb, cr);
+        kernels.packPixels(batch.r, batch.g, batch.b, count, rgb + first * 3);
+        first += count;
+        count = 0;
+    };
+    for (uint y = 0; y < height; ++y)
+    {
+        const int* rows[3];
+        for (uint i = 0; i < numComponents; ++i)
+        {
+            const uint v = header->colorComponents[i].verticalSamplingFactor.to_ulong();
+            rows[i] = dc.planes[i].data() + std::min(y * v / vMax, dc.height[i] - 1) * dc.width[i];
+        }
+        for (uint x = 0; x < width; ++x)
+        {
+            const int luma = roundSample(rows[0][columns[0][x]] * basis * basis);
+            if (numComponents == 1)
+            {
+                const unsigned char gray = std::min(std::max(luma + 128, 0), 255);
+                unsigned char* const pixel = rgb + (static_cast<std::size_t>(y) * width + x) * 3;
+                pixel[0] = gray;
+                pixel[1] = gray;
+                pixel[2] = gray;
+                continue;
+            }
+            batch.y[count] = luma;
+            cb[count] = roundSample(rows[1][columns[1][x]] * basis * basis);
+            cr[count] = roundSample(rows[2][columns[2][x]] * basis * basis);
+            if (++count == 64)
+            {
+                convertBatch();
+            }
+        }
+    }
+    if (count != 0)
+    {
+        convertBatch();
+    }
+}
+
+void putInt(unsigned char* const out,
+            const uint v) // Helper function to write a 4-byte integer in little-endian
+{
+    out[0] = (v >> 0) & 0xFF;
+    out[1] = (v >> 8) & 0xFF;
+    out[2] = (v >> 16) & 0xFF;
+    out[3] = (v >> 24) & 0xFF;
+}
+
+void putShort(unsigned char* const out,
+              const uint v) // Helper function to write a 2-byte integer in little-endian
+{
+    out[0] = (v >> 0) & 0xFF;
+    out[1] = (v >> 8) & 0xFF;
+}
+
+// Store the whole bitmap file of the pixels in bmp, for writing to a file.
+void writeBMP(const Header* const header, const MCU* const mcus, std::vector<unsigned char>& bmp)
+{
+    StageTimer timer(header->statistics.stageSeconds[OutputStage]);
+
+    const uint width = header->crop.width;
+    const uint height = header->crop.height;
+    const uint paddingSize = width % 4;
+    const uint size = 14 + 12 + height * width * 3 + paddingSize * height;
+    bmp.assign(size, 0);
+
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    putInt(&bmp[2], size);
+    putInt(&bmp[6], 0);
+    putInt(&bmp[10], 0x1A);
+    putInt(&bmp[14], 12);
+    putShort(&bmp[18], width);
+    putShort(&bmp[20], height);
+    putShort(&bmp[22], 1);
+    putShort(&bmp[24], 24);
+
+    // The MCUs only cover the crop region, starting at the top left MCU of it.
+    const uint blockWidth = (header->mcuRight - header->mcuLeft)
+                            * header->horizontalSamplingFactor.to_ulong();
+    const uint originX = header->mcuLeft * 8 * header->horizontalSamplingFactor.to_ulong();
+    const uint originY = header->mcuTop * 8 * header->verticalSamplingFactor.to_ulong();
+
+    // Rows are written bottom up, each one packed a block row at a time. Only the first and last
+    // blocks of a row can be partly outside of the crop region.
+    const Kernels& kernels = getKernels();
+    for (uint y = height - 1; y < height; --y)
+    {
+        unsigned char* const row = &bmp[26 + (height - 1 - y) * (width * 3 + paddingSize)];
+        const uint imageY = header->crop.y + y - originY;
+        const MCU* const mcuRow = mcus + (imageY / 8) * blockWidth;
+        const uint pixelRow = (imageY % 8) * 8;
+        for (uint x = 0; x < width;)
+        {
+            const uint imageX = header->crop.x + x - originX;
+            const uint count = std::min(8 - imageX % 8, width - x);
+            const MCU& mcu = mcuRow[imageX / 8];
+            const uint pixel = pixelRow + imageX % 8;
+            kernels.packPixels(mcu.b + pixel, mcu.g + pixel, mcu.r + pixel, count, &row[x * 3]);
+            x += count;
+        }
+    }
+}
+
+bool writeBMP(const Header* const header,
+              const MCU* const mcus,
+              const std::string& filename) // This function writes all the
+                                           // pixels in the bitmap file.
+{
+    // Open file
+    std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open())
+    {
+        setError(header, StatusCode::FileError, "Failed opening output file");
+        return false;
+    }
+
+    std::vector<unsigned char> bmp;
+    writeBMP(header, mcus, bmp);
+    StageTimer timer(header->statistics.stageSeconds[OutputStage]);
+    outFile.write(reinterpret_cast<const char*>(bmp.data()), bmp.size());
+    outFile.close();
+    if (!outFile)
+    {
+        setError(header, StatusCode::FileError, "Failed writing output file");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,1058 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "huffman.h"
+#include "kernels.h"
+
+// Quantization tables suggested by the JPEG standard (Annex K.1), in natural order, for a quality
+// of 50.
+const uint standardLuminanceQuantization[64]
+    = { 16,  11,  10,  16,  24,  40,  51,  61,
+        12,  12,  14,  19,  26,  58,  60,  55,
+        14,  13,  16,  24,  40,  57,  69,  56,
+        14,  17,  22,  29,  51,  87,  80,  62,
+        18,  22,  37,  56,  68, 109, 103,  77,
+        24,  35,  55,  64,  81, 104, 113,  92,
+        49,  64,  78,  87, 103, 121, 120, 101,
+        72,  92,  95,  98, 112, 100, 103,  99};
+const uint standardChrominanceQuantization[64]
+    = { 17,  18,  24,  47,  99,  99,  99,  99,
+        18,  21,  26,  66,  99,  99,  99,  99,
+        24,  26,  56,  99,  99,  99,  99,  99,
+        47,  66,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99};
+
+// Scale the standard tables to a quality from 1 to 100 the same way the IJG library does, and use
+// table 0 for luminance and table 1 for chrominance.
+void setQualityQuantizationTables(Header* const header, uint quality)
+{
+    quality = std::min(std::max(quality, 1u), 100u);
+    const uint scale = (quality < 50) ? 5000 / quality : 200 - 2 * quality;
+    for (uint i = 0; i < 4; ++i)
+    {
+        header->quantizationTables[i] = QuantizationTable();
+    }
+    for (uint i = 0; i < 64; ++i)
+    {
+        const uint luminance = (standardLuminanceQuantization[i] * scale + 50) / 100;
+        const uint chrominance = (standardChrominanceQuantization[i] * scale + 50) / 100;
+        header->quantizationTables[0].table[i] = std::min(std::max(luminance, 1u), 255u);
+        header->quantizationTables[1].table[i] = std::min(std::max(chrominance, 1u), 255u);
+    }
+    header->quantizationTables[0].set = true;
+    header->quantizationTables[1].set = header->numComponents.to_ulong() > 1;
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        header->colorComponents[i].quantizationTableID = (i == 0) ? 0 : 1;
+    }
+}
+
+HuffmanTable standardHuffmanTable(const bool acTable, const bool chrominance)
+{
+    const unsigned char* lengths = standardDCLuminanceLengths;
+    const unsigned char* symbols = standardDCSymbols;
+    const HuffmanCodes* codes = &standardDCLuminanceCodes;
+    if (acTable)
+    {
+        lengths = chrominance ? standardACChrominanceLengths : standardACLuminanceLengths;
+        symbols = chrominance ? standardACChrominanceSymbols : standardACLuminanceSymbols;
+        codes = chrominance ? &standardACChrominanceCodes : &standardACLuminanceCodes;
+    }
+    else if (chrominance)
+    {
+        lengths = standardDCChrominanceLengths;
+        codes = &standardDCChrominanceCodes;
+    }
+
+    HuffmanTable hTable;
+    uint allSymbols = 0;
+    for (uint i = 1; i <= 16; ++i)
+    {
+        allSymbols += lengths[i - 1];
+        hTable.offsets[i] = allSymbols;
+    }
+    for (uint i = 0; i < allSymbols; ++i)
+    {
+        hTable.symbols[i] = symbols[i];
+    }
+    // The codes of the standard tables are known at compile time.
+    std::copy(codes->codes, codes->codes + 162, hTable.codes);
+    std::copy(codes->lookup, codes->lookup + 256, hTable.lookup);
+    hTable.generated = true;
+    hTable.set = true;
+    return hTable;
+}
+
+// Use the standard tables, table 0 for luminance and table 1 for chrominance, for every
+// component.
+void setStandardHuffmanTables(Header* const header)
+{
+    for (uint i = 0; i < 4; ++i)
+    {
+        header->huffmanDCTables[i] = HuffmanTable();
+        header->huffmanACTables[i] = HuffmanTable();
+    }
+    header->huffmanDCTables[0] = standardHuffmanTable(false, false);
+    header->huffmanACTables[0] = standardHuffmanTable(true, false);
+    header->huffmanDCTables[1] = standardHuffmanTable(false, true);
+    header->huffmanACTables[1] = standardHuffmanTable(true, true);
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        header->colorComponents[i].huffmanDCTableID = (i == 0) ? 0 : 1;
+        header->colorComponents[i].huffmanACTableID = (i == 0) ? 0 : 1;
+    }
+}
+
+// Huffman codes and their lengths, indexed by symbol, for encoding.
+struct HuffmanEncoder
+{
+    uint codes[256] = {0};
+    uint lengths[256] = {0};
+};
+
+HuffmanEncoder buildHuffmanEncoder(HuffmanTable& hTable)
+{
+    generateCodes(hTable);
+    HuffmanEncoder encoder;
+    for (uint i = 0; i < 16; ++i)
+    {
+        for (uint j = hTable.offsets[i].to_ulong(); j < hTable.offsets[i + 1].to_ulong(); ++j)
+        {
+            encoder.codes[hTable.symbols[j].to_ulong()] = hTable.codes[j];
+            encoder.lengths[hTable.symbols[j].to_ulong()] = i + 1;
+        }
+    }
+    return encoder;
+}
+
+// Helper class to write bits to a byte vector, stuffing a 0x00 after every 0xFF byte. Bits are
+// collected in a 64-bit buffer and written 32 at a time, and the words without a 0xFF byte, which
+// are most of them, are appended whole rather than a byte at a time.
+class BitWriter
+{
+private:
+    uint64_t buffer = 0;
+    uint bufferedBits = 0;
+    std::vector<unsigned char>& data;
+
+    void writeByte(const unsigned char b)
+    {
+        data.push_back(b);
+        if (b == 0xFF)
+        {
+            data.push_back(0x00);
+        }
+    }
+
+    void writeWord(const uint32_t word)
+    {
+        // A byte of the word is 0xFF exactly when that byte of its complement is 0.
+        const uint32_t complement = ~word;
+        if (((complement - 0x01010101u) & ~complement & 0x80808080u) != 0)
+        {
+            for (int shift = 24; shift >= 0; shift -= 8)
+            {
+                writeByte((word >> shift) & 0xFF);
+            }
+            return;
+        }
+        const std::size_t size = data.size();
+        data.resize(size + 4);
+        data[size] = word >> 24;
+        data[size + 1] = (word >> 16) & 0xFF;
+        data[size + 2] = (word >> 8) & 0xFF;
+        data[size + 3] = word & 0xFF;
+    }
+
+public:
+    // Description of the first coefficient that could not be written, if any.
+    const char* error = nullptr;
+
+    BitWriter(std::vector<unsigned char>& d) : data(d)
+    {
+    }
+
+    // Write the lowest length bits of bits, most significant bit first. length is at most 32.
+    void writeBits(const uint bits, const uint length)
+    {
+        buffer = (buffer << length) | (bits & ((1ull << length) - 1));
+        bufferedBits += length;
+        if (bufferedBits >= 32)
+        {
+            bufferedBits -= 32;
+            writeWord(static_cast<uint32_t>(buffer >> bufferedBits));
+        }
+    }
+
+    // Write the buffered bits, padding the last byte with 1 bits so it can be followed by a
+    // marker.
+    void flush()
+    {
+        if (bufferedBits % 8 != 0)
+        {
+            const uint padding = 8 - bufferedBits % 8;
+            buffer = (buffer << padding) | ((1u << padding) - 1);
+            bufferedBits += padding;
+        }
+        while (bufferedBits >= 8)
+        {
+            bufferedBits -= 8;
+            writeByte((buffer >> bufferedBits) & 0xFF);
+        }
+    }
+};
+
+// Return the number of bits needed for the magnitude of a coefficient.
+uint coefficientLength(const int coeff)
+{
+    const uint magnitude = (coeff < 0) ? -coeff : coeff;
+#if defined(__GNUC__)
+    return (magnitude == 0) ? 0 : 32 - __builtin_clz(magnitude);
+#else
+    uint length = 0;
+    for (uint m = magnitude; m != 0; m >>= 1)
+    {
+        length += 1;
+    }
+    return length;
+#endif
+}
+
+// Write the Huffman codes of an MCU component. This is the reverse of decodeMCUComponent.
+bool encodeMCUComponent(BitWriter& b,
+                        const int* const component,
+                        int& previousDC,
+                        const HuffmanEncoder& dcTable,
+                        const HuffmanEncoder& acTable)
+{
+    const int difference = component[0] - previousDC;
+    previousDC = component[0];
+    uint length = coefficientLength(difference);
+    if (length > 11)
+    {
+        b.error = "DC coefficient length greater than 11";
+        return false;
+    }
+    // Negative values are written as their ones' complement, in the same write as their code.
+    uint value = (difference < 0 ? difference - 1 : difference) & ((1u << length) - 1);
+    b.writeBits((dcTable.codes[length] << length) | value, dcTable.lengths[length] + length);
+
+    uint numZeroes = 0;
+    for (uint i = 1; i < 64; ++i)
+    {
+        const int coeff = component[zigZagMap[i]];
+        if (coeff == 0)
+        {
+            numZeroes += 1;
+            continue;
+        }
+        // Symbol 0xF0 means skip 16 0's.
+        for (; numZeroes >= 16; numZeroes -= 16)
+        {
+            b.writeBits(acTable.codes[0xF0], acTable.lengths[0xF0]);
+        }
+        length = coefficientLength(coeff);
+        if (length > 10)
+        {
+            b.error = "AC coefficient length greater than 10";
+            return false;
+        }
+        const uint symbol = (numZeroes << 4) | length;
+        value = (coeff < 0 ? coeff - 1 : coeff) & ((1u << length) - 1);
+        b.writeBits((acTable.codes[symbol] << length) | value, acTable.lengths[symbol] + length);
+        numZeroes = 0;
+    }
+    // Symbol 0x00 means fill remainder of component with 0.
+    if (numZeroes != 0)
+    {
+        b.writeBits(acTable.codes[0x00], acTable.lengths[0x00]);
+    }
+    return true;
+}
+
+void putMarker(std::vector<unsigned char>& out, const byte marker)
+{
+    out.push_back(0xFF);
+    out.push_back(marker.to_ulong());
+}
+
+// Helper function to write a 2-byte integer in big-endian
+void putShortBigEndian(std::vector<unsigned char>& out, const uint v)
+{
+    out.push_back((v >> 8) & 0xFF);
+    out.push_back((v >> 0) & 0xFF);
+}
+
+void writeQuantizationTables(std::vector<unsigned char>& out, const Header* const header)
+{
+    for (uint i = 0; i < 4; ++i)
+    {
+        const QuantizationTable& qTable = header->quantizationTables[i];
+        if (!qTable.set)
+        {
+            continue;
+        }
+        bool sixteenBit = false;
+        for (uint j = 0; j < 64; ++j)
+        {
+            sixteenBit = sixteenBit || qTable.table[j] > 255;
+        }
+        putMarker(out, DQT);
+        putShortBigEndian(out, 2 + 1 + (sixteenBit ? 128 : 64));
+        out.push_back((sixteenBit ? 0x10 : 0x00) | i);
+        for (uint j = 0; j < 64; ++j)
+        {
+            if (sixteenBit)
+            {
+                putShortBigEndian(out, qTable.table[zigZagMap[j]]);
+            }
+            else
+            {
+                out.push_back(qTable.table[zigZagMap[j]]);
+            }
+        }
+    }
+}
+
+void writeStartOfFrame(std::vector<unsigned char>& out, const Header* const header)
+{
+    putMarker(out, SOF0);
+    putShortBigEndian(out, 8 + 3 * header->numComponents.to_ulong());
+    out.push_back(8);
+    putShortBigEndian(out, header->height);
+    putShortBigEndian(out, header->width);
+    out.push_back(header->numComponents.to_ulong());
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        out.push_back(i + 1);
+        out.push_back((c.horizontalSamplingFactor.to_ulong() << 4)
+                      | c.verticalSamplingFactor.to_ulong());
+        out.push_back(c.quantizationTableID.to_ulong());
+    }
+}
+
+void writeHuffmanTable(std::vector<unsigned char>& out,
+                       const HuffmanTable& hTable,
+                       const bool acTable,
+                       const uint tableID)
+{
+    const uint allSymbols = hTable.offsets[16].to_ulong();
+    putMarker(out, DHT);
+    putShortBigEndian(out, 2 + 17 + allSymbols);
+    out.push_back((acTable ? 0x10 : 0x00) | tableID);
+    for (uint i = 1; i <= 16; ++i)
+    {
+        out.push_back(hTable.offsets[i].to_ulong() - hTable.offsets[i - 1].to_ulong());
+    }
+    for (uint i = 0; i < allSymbols; ++i)
+    {
+        out.push_back(hTable.symbols[i].to_ulong());
+    }
+}
+
+void writeStartOfScan(std::vector<unsigned char>& out, const Header* const header)
+{
+    putMarker(out, SOS);
+    putShortBigEndian(out, 6 + 2 * header->numComponents.to_ulong());
+    out.push_back(header->numComponents.to_ulong());
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        out.push_back(i + 1);
+        out.push_back((c.huffmanDCTableID.to_ulong() << 4) | c.huffmanACTableID.to_ulong());
+    }
+    out.push_back(0);
+    out.push_back(63);
+    out.push_back(0);
+}
+
+// Append the markers that come before the compressed data of a baseline JPG with one interleaved
+// scan: SOI, the tables, SOF0, DRI when there is a restart interval and SOS.
+void writeHeaders(std::vector<unsigned char>& out, const Header* const header)
+{
+    putMarker(out, SOI);
+    writeQuantizationTables(out, header);
+    writeStartOfFrame(out, header);
+    for (uint i = 0; i < 4; ++i)
+    {
+        if (header->huffmanDCTables[i].set)
+        {
+            writeHuffmanTable(out, header->huffmanDCTables[i], false, i);
+        }
+        if (header->huffmanACTables[i].set)
+        {
+            writeHuffmanTable(out, header->huffmanACTables[i], true, i);
+        }
+    }
+    if (header->restartInterval != 0)
+    {
+        putMarker(out, DRI);
+        putShortBigEndian(out, 4);
+        putShortBigEndian(out, header->restartInterval);
+    }
+    writeStartOfScan(out, header);
+}
+
+// Build the Huffman encoders of every component, failing when a component uses a table that is
+// not set.
+bool buildComponentEncoders(const Header* const header,
+                            HuffmanEncoder* const dcEncoders,
+                            HuffmanEncoder* const acEncoders)
+{
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        HuffmanTable dcTable = header->huffmanDCTables[c.huffmanDCTableID.to_ulong()];
+        HuffmanTable acTable = header->huffmanACTables[c.huffmanACTableID.to_ulong()];
+        if (!dcTable.set || !acTable.set)
+        {
+            setError(header,
+                     StatusCode::InvalidArgument,
+                     "Color component using uninitialized Huffman table");
+            return false;
+        }
+        dcEncoders[i] = buildHuffmanEncoder(dcTable);
+        acEncoders[i] = buildHuffmanEncoder(acTable);
+    }
+    return true;
+}
+
+// Write the restart marker before MCU i when a restart interval ends there, and reset the DC
+// predictions.
+void writeRestartMarker(const Header* const header,
+                        BitWriter& b,
+                        std::vector<unsigned char>& out,
+                        const uint i,
+                        int* const previousDCs)
+{
+    if (header->restartInterval != 0 && i % header->restartInterval == 0 && i != 0)
+    {
+        b.flush();
+        out.push_back(0xFF);
+        out.push_back(RST0.to_ulong() + (i / header->restartInterval - 1) % 8);
+        previousDCs[0] = 0;
+        previousDCs[1] = 0;
+        previousDCs[2] = 0;
+    }
+}
+
+// Helper function to write a whole JPG to a file.
+bool writeFile(const Header* const header,
+               const std::vector<unsigned char>& jpg,
+               const std::string& filename)
+{
+    std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open())
+    {
+        setError(header, StatusCode::FileError, "Failed opening output file");
+        return false;
+    }
+    outFile.write(reinterpret_cast<const char*>(jpg.data()), jpg.size());
+    outFile.close();
+    if (!outFile)
+    {
+        setError(header, StatusCode::FileError, "Failed writing output file");
+        return false;
+    }
+    return true;
+}
+
+// Build the Huffman table that codes symbols with the given frequencies, 256 of them, in the fewest
+// bits, with no code longer than 16 bits and none made of only 1 bits. This is the procedure of
+// the standard (Annex K.2) as the IJG library implements it.
+HuffmanTable optimalHuffmanTable(const uint* const frequencies)
+{
+    // Symbol 256 is reserved, with the lowest frequency, so that it takes the all 1 bits code.
+    uint64_t weights[257];
+    std::copy(frequencies, frequencies + 256, weights);
+    weights[256] = 1;
+    uint codeLengths[257] = {0};
+    int others[257];
+    std::fill(others, others + 257, -1);
+
+    // Merge the two least frequent trees until one is left, ties going to the larger symbol.
+    while (true)
+    {
+        int c1 = -1;
+        int c2 = -1;
+        uint64_t lowest = UINT64_MAX;
+        for (int i = 0; i <= 256; ++i)
+        {
+            if (weights[i] != 0 && weights[i] <= lowest)
+            {
+                lowest = weights[i];
+                c1 = i;
+            }
+        }
+        lowest = UINT64_MAX;
+        for (int i = 0; i <= 256; ++i)
+        {
+            if (weights[i] != 0 && weights[i] <= lowest && i != c1)
+            {
+                lowest = weights[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0)
+        {
+            break;
+        }
+        weights[c1] += weights[c2];
+        weights[c2] = 0;
+        // Every symbol of both trees is one bit further from the root.
+        codeLengths[c1] += 1;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codeLengths[c1] += 1;
+        }
+        others[c1] = c2;
+        codeLengths[c2] += 1;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codeLengths[c2] += 1;
+        }
+    }
+
+    uint counts[258] = {0};
+    for (uint i = 0; i <= 256; ++i)
+    {
+        if (codeLengths[i] != 0)
+        {
+            counts[codeLengths[i]] += 1;
+        }
+    }
+    // Shorten the codes longer than 16 bits: two of them become one a bit shorter and the prefix
+    // of a longer code moved up from a shorter length.
+    for (uint i = 257; i > 16; --i)
+    {
+        while (counts[i] > 0)
+        {
+            uint j = i - 2;
+            while (counts[j] == 0)
+            {
+                j -= 1;
+            }
+            counts[i] -= 2;
+            counts[i - 1] += 1;
+            counts[j + 1] += 2;
+            counts[j] -= 1;
+        }
+    }
+    // Remove the reserved symbol, which has the longest code.
+    uint longest = 16;
+    while (counts[longest] == 0)
+    {
+        longest -= 1;
+    }
+    counts[longest] -= 1;
+
+    HuffmanTable hTable;
+    for (uint i = 1; i <= 16; ++i)
+    {
+        hTable.offsets[i] = hTable.offsets[i - 1].to_ulong() + counts[i];
+    }
+    // The symbols keep the order of their lengths before shortening.
+    uint allSymbols = 0;
+    for (uint length = 1; length <= 257; ++length)
+    {
+        for (uint i = 0; i < 256; ++i)
+        {
+            if (codeLengths[i] == length)
+            {
+                hTable.symbols[allSymbols++] = i;
+            }
+        }
+    }
+    hTable.set = true;
+    return hTable;
+}
+
+// Count the symbols encodeMCUComponent codes a block with.
+void countMCUComponent(const int* const component,
+                       int& previousDC,
+                       uint* const dcFrequencies,
+                       uint* const acFrequencies)
+{
+    const int difference = component[0] - previousDC;
+    previousDC = component[0];
+    dcFrequencies[std::min(coefficientLength(difference), 15u)] += 1;
+
+    uint numZeroes = 0;
+    for (uint i = 1; i < 64; ++i)
+    {
+        const int coeff = component[zigZagMap[i]];
+        if (coeff == 0)
+        {
+            numZeroes += 1;
+            continue;
+        }
+        for (; numZeroes >= 16; numZeroes -= 16)
+        {
+            acFrequencies[0xF0] += 1;
+        }
+        acFrequencies[(numZeroes << 4) | std::min(coefficientLength(coeff), 15u)] += 1;
+        numZeroes = 0;
+    }
+    if (numZeroes != 0)
+    {
+        acFrequencies[0x00] += 1;
+    }
+}
+
+// The most blocks of an MCU: up to 2 x 2 of luminance and one of each chrominance component.
+const uint maxMCUBlocks = 6;
+
+// Return the number of blocks of MCU i of the scan the encoder writes, storing them in the order
+// they are coded, and the component of each.
+uint getMCUBlocks(const Header* const header,
+                  MCU* const mcus,
+                  const uint i,
+                  const int** const blocks,
+                  uint* const components)
+{
+    const uint mcuRow = i / header->mcuWidth;
+    const uint mcuColumn = i % header->mcuWidth;
+    uint numBlocks = 0;
+    for (uint j = 0; j < header->numComponents.to_ulong(); ++j)
+    {
+        const ColorComponent& c = header->colorComponents[j];
+        const uint v = c.verticalSamplingFactor.to_ulong();
+        const uint h = c.horizontalSamplingFactor.to_ulong();
+        for (uint y = 0; y < v; ++y)
+        {
+            for (uint x = 0; x < h; ++x)
+            {
+                blocks[numBlocks] = componentBlock(header,
+                                                   mcus,
+                                                   j,
+                                                   mcuColumn * h + x,
+                                                   mcuRow * v + y);
+                components[numBlocks] = j;
+                numBlocks += 1;
+            }
+        }
+    }
+    return numBlocks;
+}
+
+// Replace the Huffman tables of the header with the ones that code the quantized coefficients in
+// mcus in the fewest bits. Components that shared a table keep sharing one.
+void optimizeHuffmanTables(Header* const header, MCU* const mcus)
+{
+    std::vector<uint> dcFrequencies(4 * 256, 0);
+    std::vector<uint> acFrequencies(4 * 256, 0);
+    const int* blocks[maxMCUBlocks];
+    uint components[maxMCUBlocks];
+    int previousDCs[3] = {0};
+    for (uint i = 0; i < header->mcuHeight * header->mcuWidth; ++i)
+    {
+        if (header->restartInterval != 0 && i % header->restartInterval == 0)
+        {
+            previousDCs[0] = 0;
+            previousDCs[1] = 0;
+            previousDCs[2] = 0;
+        }
+        const uint numBlocks = getMCUBlocks(header, mcus, i, blocks, components);
+        for (uint k = 0; k < numBlocks; ++k)
+        {
+            const ColorComponent& c = header->colorComponents[components[k]];
+            countMCUComponent(blocks[k],
+                              previousDCs[components[k]],
+                              &dcFrequencies[c.huffmanDCTableID.to_ulong() * 256],
+                              &acFrequencies[c.huffmanACTableID.to_ulong() * 256]);
+        }
+    }
+
+    bool dcUsed[4] = {false};
+    bool acUsed[4] = {false};
+    for (uint j = 0; j < header->numComponents.to_ulong(); ++j)
+    {
+        dcUsed[header->colorComponents[j].huffmanDCTableID.to_ulong()] = true;
+        acUsed[header->colorComponents[j].huffmanACTableID.to_ulong()] = true;
+    }
+    for (uint i = 0; i < 4; ++i)
+    {
+        header->huffmanDCTables[i] = dcUsed[i] ? optimalHuffmanTable(&dcFrequencies[i * 256])
+                                               : HuffmanTable();
+        header->huffmanACTables[i] = acUsed[i] ? optimalHuffmanTable(&acFrequencies[i * 256])
+                                               : HuffmanTable();
+    }
+}
+
+// Code the MCUs [first, last) of the scan into out. Restart intervals are independent of each
+// other, so when first starts one, the result can follow the data of the MCUs before it whichever
+// thread coded them.
+Status encodeMCUs(const Header* const header,
+                  MCU* const mcus,
+                  const HuffmanEncoder* const dcEncoders,
+                  const HuffmanEncoder* const acEncoders,
+                  const uint first,
+                  const uint last,
+                  std::vector<unsigned char>& out)
+{
+    BitWriter b(out);
+    const int* blocks[maxMCUBlocks];
+    uint components[maxMCUBlocks];
+    int previousDCs[3] = {0};
+    for (uint i = first; i < last; ++i)
+    {
+        writeRestartMarker(header, b, out, i, previousDCs);
+        const uint numBlocks = getMCUBlocks(header, mcus, i, blocks, components);
+        for (uint k = 0; k < numBlocks; ++k)
+        {
+            const uint j = components[k];
+            if (!encodeMCUComponent(b, blocks[k], previousDCs[j], dcEncoders[j], acEncoders[j]))
+            {
+                return {StatusCode::InvalidArgument, b.error};
+            }
+        }
+    }
+    b.flush();
+    return Status();
+}
+
+// Return the number of threads to use, one for every hardware thread when threads is 0.
+uint getThreads(const uint threads)
+{
+    return (threads != 0) ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Write the quantized coefficients of a whole image as a baseline JPG with one interleaved scan,
+// using the quantization tables, Huffman tables and restart interval of the header, appending it
+// to jpg. With a restart interval, the intervals are split between up to threads threads, one for
+// every hardware thread when threads is 0, and their data is concatenated.
+bool writeJPG(const Header* const header,
+              MCU* const mcus,
+              std::vector<unsigned char>& jpg,
+              const uint threads)
+{
+    HuffmanEncoder dcEncoders[3];
+    HuffmanEncoder acEncoders[3];
+    if (!buildComponentEncoders(header, dcEncoders, acEncoders))
+    {
+        return false;
+    }
+    writeHeaders(jpg, header);
+
+    const uint numMCUs = header->mcuHeight * header->mcuWidth;
+    const uint numIntervals = (header->restartInterval == 0)
+                                  ? 1
+                                  : (numMCUs + header->restartInterval - 1)
+                                        / header->restartInterval;
+    const uint numRanges = std::min(getThreads(threads), numIntervals);
+    Status status;
+    if (numRanges == 1)
+    {
+        status = encodeMCUs(header, mcus, dcEncoders, acEncoders, 0, numMCUs, jpg);
+    }
+    else
+    {
+        const uint perRange = (numIntervals + numRanges - 1) / numRanges * header->restartInterval;
+        std::vector<std::vector<unsigned char>> data((numMCUs + perRange - 1) / perRange);
+        std::vector<std::future<Status>> results;
+        for (uint i = 0; i < data.size(); ++i)
+        {
+            results.push_back(std::async(std::launch::async,
+                                         encodeMCUs,
+                                         header,
+                                         mcus,
+                                         dcEncoders,
+                                         acEncoders,
+                                         i * perRange,
+                                         std::min((i + 1) * perRange, numMCUs),
+                                         std::ref(data[i])));
+        }
+        for (uint i = 0; i < data.size(); ++i)
+        {
+            const Status rangeStatus = results[i].get();
+            if (status.ok())
+            {
+                status = rangeStatus;
+            }
+            jpg.insert(jpg.end(), data[i].begin(), data[i].end());
+        }
+    }
+    if (!status.ok())
+    {
+        setError(header, status.code, status.message);
+        return false;
+    }
+    putMarker(jpg, EOI);
+    return true;
+}
+
+bool writeJPG(const Header* const header,
+              MCU* const mcus,
+              const std::string& filename,
+              const uint threads)
+{
+    std::vector<unsigned char> jpg;
+    return writeJPG(header, mcus, jpg, threads) && writeFile(header, jpg, filename);
+}
+
+// Set up a header to encode width x height pixels as a baseline JPG with the standard Huffman
+// tables and the quantization tables of a quality from 1 to 100. Subsampling is 400 (grayscale),
+// 444, 422 or 420. The restart interval of the header is kept.
+bool setEncoderHeader(Header* const header,
+                      const uint width,
+                      const uint height,
+                      const uint quality,
+                      const uint subsampling)
+{
+    if (width == 0 || height == 0 || width > 65535 || height > 65535)
+    {
+        setError(header, StatusCode::InvalidArgument, "Invalid image size");
+        return false;
+    }
+    if (subsampling != 400 && subsampling != 444 && subsampling != 422 && subsampling != 420)
+    {
+        setError(header, StatusCode::InvalidArgument, "Invalid subsampling");
+        return false;
+    }
+    if (header->restartInterval > 65535)
+    {
+        setError(header, StatusCode::InvalidArgument, "Invalid restart interval");
+        return false;
+    }
+    header->frameType = SOF0;
+    header->width = width;
+    header->height = height;
+    header->numComponents = (subsampling == 400) ? 1 : 3;
+    header->horizontalSamplingFactor = (subsampling == 422 || subsampling == 420) ? 2 : 1;
+    header->verticalSamplingFactor = (subsampling == 420) ? 2 : 1;
+    header->colorComponents[0].horizontalSamplingFactor = header->horizontalSamplingFactor;
+    header->colorComponents[0].verticalSamplingFactor = header->verticalSamplingFactor;
+    setQualityQuantizationTables(header, quality);
+    setStandardHuffmanTables(header);
+    setFrameGeometry(header);
+    return true;
+}
+
+// Rows of pixels converted to Y, Cb and Cr at full resolution, as many as one row of MCUs covers,
+// and the quantization of every component.
+struct PixelRows
+{
+    uint width = 0, height = 0;
+    std::vector<int> planes[3];
+    // The forward DCT gives 8 times the coefficients, which the reciprocals divide out.
+    float reciprocals[3][64];
+};
+
+bool initPixelRows(const Header* const header, PixelRows& rows)
+{
+    for (uint j = 0; j < header->numComponents.to_ulong(); ++j)
+    {
+        const ColorComponent& c = header->colorComponents[j];
+        const QuantizationTable& qTable = header->quantizationTables[c.quantizationTableID
+                                                                         .to_ulong()];
+        if (!qTable.set)
+        {
+            setError(header,
+                     StatusCode::InvalidArgument,
+                     "Color component using uninitialized quantization table");
+            return false;
+        }
+        for (uint k = 0; k < 64; ++k)
+        {
+            rows.reciprocals[j][k] = 1.0f / (8 * qTable.table[k]);
+        }
+    }
+    rows.width = header->mcuWidth * 8 * header->horizontalSamplingFactor.to_ulong();
+    rows.height = 8 * header->verticalSamplingFactor.to_ulong();
+    for (uint j = 0; j < 3; ++j)
+    {
+        rows.planes[j].resize(rows.width * rows.height);
+    }
+    return true;
+}
+
+// Convert the pixels of a row of MCUs, padding them to whole MCUs by repeating the last column
+// and row of the image.
+void convertMCURow(const Header* const header,
+                   const Kernels& kernels,
+                   const unsigned char* const rgb,
+                   const uint mcuRow,
+                   PixelRows& rows)
+{
+    for (uint y = 0; y < rows.height; ++y)
+    {
+        const uint imageY = std::min(mcuRow * rows.height + y, header->height - 1);
+        int* const planes[3] = {rows.planes[0].data() + y * rows.width,
+                                rows.planes[1].data() + y * rows.width,
+                                rows.planes[2].data() + y * rows.width};
+        kernels.RGBToYCbCr(rgb + std::size_t(imageY) * header->width * 3,
+                           header->width,
+                           planes[0],
+                           planes[1],
+                           planes[2]);
+        for (uint j = 0; j < 3; ++j)
+        {
+            std::fill(planes[j] + header->width, planes[j] + rows.width,
+                      planes[j][header->width - 1]);
+        }
+    }
+}
+
+// Quantize block (x, y) of component j of an MCU of the converted row: its pixels are averaged
+// down to the sampling of the component, transformed and divided by the quantization table.
+void transformBlock(const Header* const header,
+                    const Kernels& kernels,
+                    const PixelRows& rows,
+                    const uint mcuColumn,
+                    const uint j,
+                    const uint x,
+                    const uint y,
+                    int* const block)
+{
+    const ColorComponent& c = header->colorComponents[j];
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    // Every sample of the component averages hFactor x vFactor pixels.
+    const uint hFactor = hMax / c.horizontalSamplingFactor.to_ulong();
+    const uint vFactor = header->verticalSamplingFactor.to_ulong()
+                         / c.verticalSamplingFactor.to_ulong();
+    const int* const pixels = rows.planes[j].data() + y * 8 * vFactor * rows.width
+                              + mcuColumn * 8 * hMax + x * 8 * hFactor;
+    kernels.downsample(pixels, rows.width, hFactor, vFactor, block);
+    kernels.forwardDCT(block);
+    kernels.quantize(block, rows.reciprocals[j]);
+}
+
+// Encode RGB pixels, 3 bytes per pixel with rows from top to bottom, as a baseline JPG of the
+// frame set up by setEncoderHeader, appending it to jpg. The image is encoded one row of MCUs at a
+// time: its pixels are converted and every block is quantized and Huffman coded before the next
+// row is converted.
+bool encodePixels(const Header* const header,
+                  const unsigned char* const rgb,
+                  std::vector<unsigned char>& jpg)
+{
+    HuffmanEncoder dcEncoders[3];
+    HuffmanEncoder acEncoders[3];
+    PixelRows rows;
+    if (!buildComponentEncoders(header, dcEncoders, acEncoders) || !initPixelRows(header, rows))
+    {
+        return false;
+    }
+
+    const Kernels& kernels = getKernels();
+    writeHeaders(jpg, header);
+    BitWriter b(jpg);
+    int previousDCs[3] = {0};
+    int block[64];
+    for (uint mcuRow = 0; mcuRow < header->mcuHeight; ++mcuRow)
+    {
+        convertMCURow(header, kernels, rgb, mcuRow, rows);
+        for (uint mcuColumn = 0; mcuColumn < header->mcuWidth; ++mcuColumn)
+        {
+            writeRestartMarker(header, b, jpg, mcuRow * header->mcuWidth + mcuColumn, previousDCs);
+            for (uint j = 0; j < header->numComponents.to_ulong(); ++j)
+            {
+                const ColorComponent& c = header->colorComponents[j];
+                for (uint y = 0; y < c.verticalSamplingFactor.to_ulong(); ++y)
+                {
+                    for (uint x = 0; x < c.horizontalSamplingFactor.to_ulong(); ++x)
+                    {
+                        transformBlock(header, kernels, rows, mcuColumn, j, x, y, block);
+                        if (!encodeMCUComponent(b,
+                                                block,
+                                                previousDCs[j],
+                                                dcEncoders[j],
+                                                acEncoders[j]))
+                        {
+                            setError(header, StatusCode::InvalidArgument, b.error);
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    b.flush();
+    putMarker(jpg, EOI);
+    return true;
+}
+
+// Quantize the MCU rows [first, last) of the pixels into mcus.
+void transformMCURows(const Header* const header,
+                      const unsigned char* const rgb,
+                      MCU* const mcus,
+                      const uint first,
+                      const uint last)
+{
+    PixelRows rows;
+    initPixelRows(header, rows);
+    const Kernels& kernels = getKernels();
+    for (uint mcuRow = first; mcuRow < last; ++mcuRow)
+    {
+        convertMCURow(header, kernels, rgb, mcuRow, rows);
+        for (uint mcuColumn = 0; mcuColumn < header->mcuWidth; ++mcuColumn)
+        {
+            for (uint j = 0; j < header->numComponents.to_ulong(); ++j)
+            {
+                const ColorComponent& c = header->colorComponents[j];
+                const uint v = c.verticalSamplingFactor.to_ulong();
+                const uint h = c.horizontalSamplingFactor.to_ulong();
+                for (uint y = 0; y < v; ++y)
+                {
+                    for (uint x = 0; x < h; ++x)
+                    {
+                        int* const block = componentBlock(header,
+                                                          mcus,
+                                                          j,
+                                                          mcuColumn * h + x,
+                                                          mcuRow * v + y);
+                        transformBlock(header, kernels, rows, mcuColumn, j, x, y, block);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Quantize RGB pixels into MCUs, for writeJPG to code once the tables are final, such as after
+// optimizeHuffmanTables. The rows of MCUs are split between up to threads threads, one for every
+// hardware thread when threads is 0. Return nullptr, with the status of the header set, on error.
+MCU* transformPixels(const Header* const header, const unsigned char* const rgb, const uint threads)
+{
+    PixelRows rows;
+    if (!initPixelRows(header, rows))
+    {
+        return nullptr;
+    }
+    MCU* mcus = new (std::nothrow) MCU[header->blockHeightReal * header->blockWidthReal];
+    if (mcus == nullptr)
+    {
+        setError(header, StatusCode::MemoryError, "Memory error");
+        return nullptr;
+    }
+    const uint numRanges = std::min(getThreads(threads), header->mcuHeight);
+    const uint perRange = (header->mcuHeight + numRanges - 1) / numRanges;
+    std::vector<std::future<void>> results;
+    for (uint first = perRange; first < header->mcuHeight; first += perRange)
+    {
+        results.push_back(std::async(std::launch::async,
+                                     transformMCURows,
+                                     header,
+                                     rgb,
+                                     mcus,
+                                     first,
+                                     std::min(first + perRange, header->mcuHeight)));
+    }
+    transformMCURows(header, rgb, mcus, 0, std::min(perRange, header->mcuHeight));
+    for (std::future<void>& result : results)
+    {
+        result.get();
+    }
+    return mcus;
+}
@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "decoder.h"
+#include "kernels.h"
+
+RestartIndex::~RestartIndex()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    if (mapping != nullptr)
+    {
+        munmap(mapping, mappingSize);
+    }
+#endif
+}
+
+// Point the header, scans and entries of an index at its data, checking that the data holds a
+// complete index.
+Status mapRestartIndex(RestartIndex* const index, const char* const data, const std::size_t size)
+{
+    if (size < sizeof(RestartIndexHeader))
+    {
+        return makeError(StatusCode::IndexError, "Restart index invalid");
+    }
+    index->header = reinterpret_cast<const RestartIndexHeader*>(data);
+    if (std::memcmp(index->header->magic, restartIndexMagic, 4) != 0
+        || index->header->version != restartIndexVersion)
+    {
+        return makeError(StatusCode::IndexError, "Restart index invalid");
+    }
+    const std::size_t scansSize = index->header->numScans * sizeof(RestartIndexScan);
+    const std::size_t entriesSize = index->header->numEntries * sizeof(RestartIndexEntry);
+    if (size != sizeof(RestartIndexHeader) + scansSize + entriesSize)
+    {
+        return makeError(StatusCode::IndexError, "Restart index invalid");
+    }
+    index->scans = reinterpret_cast<const RestartIndexScan*>(data + sizeof(RestartIndexHeader));
+    index->entries = reinterpret_cast<const RestartIndexEntry*>(data + sizeof(RestartIndexHeader)
+                                                                + scansSize);
+    // The entries of every scan lie within the index, and its data within the JPG, whose size is
+    // checked when it is read.
+    for (uint i = 0; i < index->header->numScans; ++i)
+    {
+        const RestartIndexScan& scan = index->scans[i];
+        if (scan.numEntries == 0
+            || static_cast<uint64_t>(scan.firstEntry) + scan.numEntries > index->header->numEntries
+            || scan.end > index->header->fileSize)
+        {
+            return makeError(StatusCode::IndexError, "Restart index invalid");
+        }
+    }
+    return Status();
+}
+
+// Build a restart index from the checkpoints of a JPG's scans. These are the starts of its restart
+// intervals, plus a checkpoint every interval coding units when interval is not 0, which allows
+// random access into images without restart markers.
+RestartIndex* buildRestartIndex(Header* const header,
+                                const std::string& filename,
+                                const uint interval)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!inFile.is_open())
+    {
+        setError(header, StatusCode::FileError, "Error opening input file");
+        return nullptr;
+    }
+
+    if (interval != 0)
+    {
+        for (Scan& scan : header->scans)
+        {
+            if (!findCheckpoints(header, scan, interval))
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    RestartIndex* index = new (std::nothrow) RestartIndex;
+    if (index == nullptr)
+    {
+        setError(header, StatusCode::MemoryError, "Memory error");
+        return nullptr;
+    }
+
+    uint numEntries = 0;
+    for (const Scan& scan : header->scans)
+    {
+        numEntries += scan.checkpoints.size();
+    }
+    index->buffer.resize(sizeof(RestartIndexHeader)
+                         + header->scans.size() * sizeof(RestartIndexScan)
+                         + numEntries * sizeof(RestartIndexEntry));
+
+    RestartIndexHeader indexHeader = {};
+    std::memcpy(indexHeader.magic, restartIndexMagic, 4);
+    indexHeader.version = restartIndexVersion;
+    indexHeader.fileSize = inFile.tellg();
+    indexHeader.numScans = header->scans.size();
+    indexHeader.numEntries = numEntries;
+    std::memcpy(index->buffer.data(), &indexHeader, sizeof(indexHeader));
+
+    char* scans = index->buffer.data() + sizeof(RestartIndexHeader);
+    char* entries = scans + header->scans.size() * sizeof(RestartIndexScan);
+    uint entry = 0;
+    for (uint i = 0; i < header->scans.size(); ++i)
+    {
+        const Scan& scan = header->scans[i];
+        RestartIndexScan indexScan = {};
+        indexScan.end = scan.endFileOffset;
+        indexScan.firstEntry = entry;
+        indexScan.numEntries = scan.checkpoints.size();
+        std::memcpy(scans + i * sizeof(RestartIndexScan), &indexScan, sizeof(indexScan));
+
+        for (uint j = 0; j < scan.checkpoints.size(); ++j, ++entry)
+        {
+            const Checkpoint& checkpoint = scan.checkpoints[j];
+            RestartIndexEntry indexEntry = {};
+            indexEntry.offset = checkpoint.fileOffset;
+            indexEntry.unit = checkpoint.unit;
+            indexEntry.bit = checkpoint.bit;
+            indexEntry.previousDCs[0] = checkpoint.previousDCs[0];
+            indexEntry.previousDCs[1] = checkpoint.previousDCs[1];
+            indexEntry.previousDCs[2] = checkpoint.previousDCs[2];
+            std::memcpy(entries + entry * sizeof(RestartIndexEntry),
+                        &indexEntry,
+                        sizeof(indexEntry));
+        }
+    }
+
+    const Status status = mapRestartIndex(index, index->buffer.data(), index->buffer.size());
+    if (!status.ok())
+    {
+        setError(header, status.code, status.message);
+        delete index;
+        return nullptr;
+    }
+    return index;
+}
+
+Status writeRestartIndex(const RestartIndex* const index, const std::string& filename)
+{
+    std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Failed opening output file");
+    }
+    const std::size_t size = sizeof(RestartIndexHeader)
+                             + index->header->numScans * sizeof(RestartIndexScan)
+                             + index->header->numEntries * sizeof(RestartIndexEntry);
+    outFile.write(reinterpret_cast<const char*>(index->header), size);
+    outFile.close();
+    if (!outFile)
+    {
+        return makeError(StatusCode::FileError, "Failed writing output file");
+    }
+    return Status();
+}
+
+void setStatus(Status* const status, const Status& result)
+{
+    if (status != nullptr)
+    {
+        *status = result;
+    }
+}
+
+// Load a saved restart index. Where possible the file is memory-mapped rather than read, so
+// opening the index of a large image costs nothing until its entries are used.
+RestartIndex* loadRestartIndex(const std::string& filename, Status* const status)
+{
+    RestartIndex* index = new (std::nothrow) RestartIndex;
+    if (index == nullptr)
+    {
+        setStatus(status, makeError(StatusCode::MemoryError, "Memory error"));
+        return nullptr;
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        setStatus(status, makeError(StatusCode::FileError, "Error opening restart index"));
+        delete index;
+        return nullptr;
+    }
+    struct stat fileStatus;
+    if (fstat(fd, &fileStatus) != 0 || fileStatus.st_size == 0)
+    {
+        setStatus(status, makeError(StatusCode::IndexError, "Restart index invalid"));
+        close(fd);
+        delete index;
+        return nullptr;
+    }
+    void* mapping = mmap(nullptr, fileStatus.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        setStatus(status, makeError(StatusCode::FileError, "Error opening restart index"));
+        delete index;
+        return nullptr;
+    }
+    index->mapping = mapping;
+    index->mappingSize = fileStatus.st_size;
+    const char* data = static_cast<const char*>(mapping);
+    const std::size_t size = fileStatus.st_size;
+#else
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!inFile.is_open())
+    {
+        setStatus(status, makeError(StatusCode::FileError, "Error opening restart index"));
+        delete index;
+        return nullptr;
+    }
+    index->buffer.resize(inFile.tellg());
+    inFile.seekg(0);
+    inFile.read(index->buffer.data(), index->buffer.size());
+    const char* data = index->buffer.data();
+    const std::size_t size = index->buffer.size();
+#endif
+
+    const Status mapped = mapRestartIndex(index, data, size);
+    if (!mapped.ok())
+    {
+        setStatus(status, mapped);
+        delete index;
+        return nullptr;
+    }
+    return index;
+}
+
+// Read the compressed data between the index entries that cover the crop region into the scans of
+// a header that was read with the same index, and make each entry a checkpoint to start decoding
+// from. Data outside of the region is never read from the file.
+bool readIndexedHuffmanData(const std::string& filename,
+                            Header* const header,
+                            const RestartIndex* const index)
+{
+    StageTimer timer(header->statistics.stageSeconds[EntropyExtractionStage]);
+    if (index->header->numScans != header->scans.size())
+    {
+        setError(header, StatusCode::IndexError, "Restart index does not match file");
+        return false;
+    }
+
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        setError(header, StatusCode::FileError, "Error opening input file");
+        return false;
+    }
+
+    const Kernels& kernels = getKernels();
+    std::vector<char> data;
+    for (uint i = 0; i < header->scans.size(); ++i)
+    {
+        Scan& scan = header->scans[i];
+        const RestartIndexScan& indexScan = index->scans[i];
+        const RestartIndexEntry* const entries = index->entries + indexScan.firstEntry;
+        const ScanUnits units = getScanUnits(header, scan);
+
+        scan.huffmanData.clear();
+        scan.checkpoints.clear();
+        for (uint j = 0; j < indexScan.numEntries; ++j)
+        {
+            const bool lastEntry = j + 1 == indexScan.numEntries;
+            const uint first = entries[j].unit;
+            const uint end = lastEntry ? units.wide * units.high : entries[j + 1].unit;
+            // An entry that does not start on a byte boundary shares its first byte with the
+            // entry before it. That byte, and the 0x00 that may follow it, is read by both.
+            uint64_t endOffset = indexScan.end;
+            if (!lastEntry)
+            {
+                endOffset = std::min(indexScan.end, entries[j + 1].offset + 2);
+            }
+            if (end <= first || endOffset < entries[j].offset || entries[j].bit > 7
+                || (!lastEntry && entries[j + 1].unit <= first))
+            {
+                setError(header, StatusCode::IndexError, "Restart index does not match file");
+                return false;
+            }
+
+            Checkpoint checkpoint;
+            checkpoint.unit = first;
+            checkpoint.offset = scan.huffmanData.size();
+            checkpoint.bit = entries[j].bit;
+            checkpoint.fileOffset = entries[j].offset;
+            checkpoint.previousDCs[0] = entries[j].previousDCs[0];
+            checkpoint.previousDCs[1] = entries[j].previousDCs[1];
+            checkpoint.previousDCs[2] = entries[j].previousDCs[2];
+            scan.checkpoints.push_back(checkpoint);
+            if (!intervalNeeded(units, first, end - first))
+            {
+                continue;
+            }
+
+            data.resize(endOffset - entries[j].offset);
+            inFile.seekg(entries[j].offset);
+            inFile.read(data.data(), data.size());
+            if (!inFile)
+            {
+                setError(header, StatusCode::InvalidData, "File ended prematurely");
+                return false;
+            }
+            // Remove byte stuffing; a restart interval ends at its restart marker.
+            const unsigned char* const bytes = reinterpret_cast<const unsigned char*>(data.data());
+            for (std::size_t k = 0; k < data.size(); ++k)
+            {
+                const std::size_t length = kernels.findMarker(bytes + k, data.size() - k);
+                scan.huffmanData.insert(scan.huffmanData.end(), bytes + k, bytes + k + length);
+                k += length;
+                if (k == data.size())
+                {
+                    break;
+                }
+                if (k + 1 < data.size() && data[k + 1] == 0x00)
+                {
+                    scan.huffmanData.push_back(0xFF);
+                    JPEG_COUNT(header->statistics.counters.stuffedBytesRemoved, 1);
+                    ++k;
+                    continue;
+                }
+                if (k + 1 < data.size() && static_cast<unsigned char>(data[k + 1]) >= 0xD0
+                    && static_cast<unsigned char>(data[k + 1]) <= 0xD7)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,2732 @@
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+#include "asyncio.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "jpegdec.h"
+#include "kernels.h"
+
+// A read-only stream buffer over a block of memory, so that a JPG in memory is parsed in place.
+class MemoryBuffer : public std::streambuf
+{
+public:
+    MemoryBuffer(const unsigned char* const data, const std::size_t size)
+    {
+        char* const begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+        setg(begin, begin, begin + size);
+    }
+
+protected:
+    pos_type seekoff(const off_type offset,
+                     const std::ios_base::seekdir direction,
+                     const std::ios_base::openmode which) override
+    {
+        char* base = gptr();
+        if (direction == std::ios_base::beg)
+        {
+            base = eback();
+        }
+        else if (direction == std::ios_base::end)
+        {
+            base = egptr();
+        }
+        if (!(which & std::ios_base::in) || offset < eback() - base || offset > egptr() - base)
+        {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), base + offset, egptr());
+        return pos_type(gptr() - eback());
+    }
+
+    pos_type seekpos(const pos_type position, const std::ios_base::openmode which) override
+    {
+        return seekoff(off_type(position), std::ios_base::beg, which);
+    }
+};
+
+void setImageInfo(const Header* const header, ImageInfo& info)
+{
+    info.width = header->width;
+    info.height = header->height;
+    info.numComponents = header->numComponents.to_ulong();
+    info.horizontalSamplingFactor = header->horizontalSamplingFactor.to_ulong();
+    info.verticalSamplingFactor = header->verticalSamplingFactor.to_ulong();
+    info.restartInterval = header->restartInterval;
+}
+
+Status probeJPG(std::istream& input, ImageInfo& info)
+{
+    Header* header = readJPGHeader(input);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    const Status status = header->status;
+    if (status.ok())
+    {
+        setImageInfo(header, info);
+    }
+    delete header;
+    return status;
+}
+
+Status probeJPG(const std::string& filename, ImageInfo& info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return probeJPG(inFile, info);
+}
+
+Status probeJPG(const unsigned char* const data, const std::size_t size, ImageInfo& info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return probeJPG(input, info);
+}
+
+Status validateJPG(std::istream& input, ErrorLocation* const location)
+{
+    Header* header = checkJPG(input, location);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    const Status status = header->status;
+    delete header;
+    return status;
+}
+
+Status validateJPG(const std::string& filename, ErrorLocation* const location)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return validateJPG(inFile, location);
+}
+
+Status validateJPG(const unsigned char* const data,
+                   const std::size_t size,
+                   ErrorLocation* const location)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return validateJPG(input, location);
+}
+
+// Copy row y of the decoded region from the MCUs, which only cover the MCUs of that region.
+void copyRow(const Header* const header, const MCU* const mcus, const uint y, unsigned char* rgb)
+{
+    const uint blockWidth = (header->mcuRight - header->mcuLeft)
+                            * header->horizontalSamplingFactor.to_ulong();
+    const uint originX = header->mcuLeft * 8 * header->horizontalSamplingFactor.to_ulong();
+    const uint originY = header->mcuTop * 8 * header->verticalSamplingFactor.to_ulong();
+    const uint imageY = header->crop.y + y - originY;
+    const MCU* const row = mcus + (imageY / 8) * blockWidth;
+    const uint pixelRow = (imageY % 8) * 8;
+    const Kernels& kernels = getKernels();
+    for (uint x = 0; x < header->crop.width;)
+    {
+        const uint imageX = header->crop.x + x - originX;
+        const uint count = std::min(8 - imageX % 8, header->crop.width - x);
+        const MCU& mcu = row[imageX / 8];
+        const uint pixel = pixelRow + imageX % 8;
+        kernels.packPixels(mcu.r + pixel, mcu.g + pixel, mcu.b + pixel, count, rgb + x * 3);
+        x += count;
+    }
+}
+
+// Decode a JPG whose markers and compressed data have been read into header, passing the rows of
+// its crop region to callback.
+Status decodeRows(Header* const header,
+                  const RowCallback& callback,
+                  const Crop* const crop,
+                  ImageInfo* const info)
+{
+    if (!header->valid || (crop != nullptr && !setCrop(header, *crop)))
+    {
+        return header->status;
+    }
+    if (info != nullptr)
+    {
+        setImageInfo(header, *info);
+    }
+
+    MCU* mcus = decodeHuffmanData(header, true);
+    if (mcus == nullptr)
+    {
+        return header->status;
+    }
+    inverseDCT(header, mcus);
+    YCbCrToRGB(header, mcus);
+
+    Status status;
+    std::vector<unsigned char> row(header->crop.width * 3);
+    for (uint y = 0; y < header->crop.height; ++y)
+    {
+        copyRow(header, mcus, y, row.data());
+        if (!callback(y, row.data(), header->crop.width, header->crop.height))
+        {
+            status = makeError(StatusCode::InvalidArgument, "Decoding stopped by row callback");
+            break;
+        }
+    }
+
+    delete[] mcus;
+    return status;
+}
+
+Status decodeJPG(std::istream& input,
+                 const RowCallback& callback,
+                 const Crop* const crop,
+                 ImageInfo* const info)
+{
+    Header* header = readJPG(input);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    const Status status = decodeRows(header, callback, crop, info);
+    delete header;
+    return status;
+}
+
+Status decodeJPG(const unsigned char* const data,
+                 const std::size_t size,
+                 const RowCallback& callback,
+                 const Crop* const crop,
+                 ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeJPG(input, callback, crop, info);
+}
+
+// A row callback that stores the rows in pixels, sizing pixels when the first row arrives.
+RowCallback storeRows(std::vector<unsigned char>& pixels)
+{
+    return [&pixels](const uint y,
+                     const unsigned char* const rgb,
+                     const uint width,
+                     const uint height)
+    {
+        const std::size_t rowSize = static_cast<std::size_t>(width) * 3;
+        if (y == 0)
+        {
+            pixels.resize(rowSize * height);
+        }
+        std::copy(rgb, rgb + rowSize, pixels.data() + y * rowSize);
+        return true;
+    };
+}
+
+// Decode into pixels through the row callback.
+Status decodeToBuffer(std::istream& input,
+                      std::vector<unsigned char>& pixels,
+                      const Crop* const crop,
+                      ImageInfo* const info)
+{
+    return decodeJPG(input, storeRows(pixels), crop, info);
+}
+
+Status decodeJPG(const std::string& filename,
+                 std::vector<unsigned char>& pixels,
+                 const Crop* const crop,
+                 ImageInfo* const info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return decodeToBuffer(inFile, pixels, crop, info);
+}
+
+Status decodeJPG(const unsigned char* const data,
+                 const std::size_t size,
+                 std::vector<unsigned char>& pixels,
+                 const Crop* const crop,
+                 ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeToBuffer(input, pixels, crop, info);
+}
+
+// Read a whole JPG and decode its compressed data to coefficients, dequantized or not.
+Status decodeCoefficients(std::istream& input,
+                          Header*& header,
+                          MCU*& mcus,
+                          const bool dequantized = true)
+{
+    mcus = nullptr;
+    header = readJPG(input);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    if (header->valid)
+    {
+        mcus = decodeHuffmanData(header, dequantized);
+    }
+    return header->status;
+}
+
+// Copy the samples of every component in the MCU rows [firstRow, lastRow), which have been
+// through the inverse DCT, to its plane.
+void copyPlaneRows(const Header* const header,
+                   MCU* const mcus,
+                   const uint firstRow,
+                   const uint lastRow,
+                   PlanarImage& image)
+{
+    for (uint i = 0; i < image.numComponents; ++i)
+    {
+        const uint v = header->colorComponents[i].verticalSamplingFactor.to_ulong();
+        const uint last = std::min(lastRow * v * 8, image.height[i]);
+        for (uint y = firstRow * v * 8; y < last; ++y)
+        {
+            unsigned char* const plane = image.planes[i].data() + y * image.width[i];
+            for (uint x = 0; x < image.width[i]; x += 8)
+            {
+                const int* const block = componentBlock(header, mcus, i, x / 8, y / 8)
+                                         + (y % 8) * 8;
+                const uint count = std::min(8u, image.width[i] - x);
+                for (uint k = 0; k < count; ++k)
+                {
+                    plane[x + k] = std::min(std::max(block[k] + 128, 0), 255);
+                }
+            }
+        }
+    }
+}
+
+// Decode the planes of a JPG whose markers and compressed data have been read into header.
+Status decodePlanar(Header* const header, PlanarImage& image)
+{
+    MCU* mcus = header->valid ? decodeHuffmanData(header, true) : nullptr;
+    if (mcus == nullptr)
+    {
+        return header->status;
+    }
+
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    image.numComponents = header->numComponents.to_ulong();
+    for (uint i = 0; i < 3; ++i)
+    {
+        const uint h = header->colorComponents[i].horizontalSamplingFactor.to_ulong();
+        const uint v = header->colorComponents[i].verticalSamplingFactor.to_ulong();
+        image.width[i] = i < image.numComponents ? (header->width * h + hMax - 1) / hMax : 0;
+        image.height[i] = i < image.numComponents ? (header->height * v + vMax - 1) / vMax : 0;
+        image.planes[i].resize(static_cast<std::size_t>(image.width[i]) * image.height[i]);
+    }
+    // Each row of MCUs is copied right after its inverse DCT, while it is still in the cache.
+    for (uint row = 0; row < header->mcuHeight; ++row)
+    {
+        inverseDCT(header, mcus, row, row + 1);
+        copyPlaneRows(header, mcus, row, row + 1, image);
+    }
+
+    delete[] mcus;
+    return Status();
+}
+
+Status decodePlanar(std::istream& input, PlanarImage& image)
+{
+    Header* header = readJPG(input);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    const Status status = decodePlanar(header, image);
+    delete header;
+    return status;
+}
+
+Status decodePlanar(const std::string& filename, PlanarImage& image)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return decodePlanar(inFile, image);
+}
+
+Status decodePlanar(const unsigned char* const data, const std::size_t size, PlanarImage& image)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodePlanar(input, image);
+}
+
+// The two source pixels an output pixel of a bilinear resize is interpolated between, and the
+// weight of the second.
+struct ResizeTap
+{
+    uint first = 0, second = 0;
+    float weight = 0.0f;
+};
+
+std::vector<ResizeTap> getResizeTaps(const uint sourceSize, const uint size)
+{
+    std::vector<ResizeTap> taps(size);
+    const float scale = static_cast<float>(sourceSize) / size;
+    for (uint i = 0; i < size; ++i)
+    {
+        // The centers of the first and last pixels line up with those of the source.
+        const float position = std::max((i + 0.5f) * scale - 0.5f, 0.0f);
+        taps[i].first = std::min(static_cast<uint>(position), sourceSize - 1);
+        taps[i].second = std::min(taps[i].first + 1, sourceSize - 1);
+        taps[i].weight = std::min(position - taps[i].first, 1.0f);
+    }
+    return taps;
+}
+
+// Resample row y of the RGB pixels in the MCUs to the columns of the tensor, as one row of red,
+// one of green and one of blue.
+void sampleTensorRow(const Header* const header,
+                     const MCU* const mcus,
+                     const uint y,
+                     const std::vector<ResizeTap>& columns,
+                     const bool resized,
+                     float* const out)
+{
+    const MCU* const row = mcus + (y / 8) * header->blockWidthReal;
+    const uint pixelRow = (y % 8) * 8;
+    const uint width = columns.size();
+    float* const red = out;
+    float* const green = out + width;
+    float* const blue = out + 2 * width;
+    for (uint x = 0; x < width; ++x)
+    {
+        const ResizeTap& tap = columns[x];
+        const MCU& first = row[tap.first / 8];
+        const uint i = pixelRow + tap.first % 8;
+        if (!resized)
+        {
+            red[x] = first.r[i];
+            green[x] = first.g[i];
+            blue[x] = first.b[i];
+            continue;
+        }
+        const MCU& second = row[tap.second / 8];
+        const uint j = pixelRow + tap.second % 8;
+        red[x] = first.r[i] + (second.r[j] - first.r[i]) * tap.weight;
+        green[x] = first.g[i] + (second.g[j] - first.g[i]) * tap.weight;
+        blue[x] = first.b[i] + (second.b[j] - first.b[i]) * tap.weight;
+    }
+}
+
+Status decodeTensor(std::istream& input,
+                    const TensorOptions& options,
+                    float* const tensor,
+                    const std::size_t tensorSize,
+                    ImageInfo* const info)
+{
+    if (tensor == nullptr || options.std[0] == 0.0f || options.std[1] == 0.0f
+        || options.std[2] == 0.0f)
+    {
+        return makeError(StatusCode::InvalidArgument, "Tensor options invalid");
+    }
+    Header* header;
+    MCU* mcus;
+    const Status status = decodeCoefficients(input, header, mcus);
+    if (mcus == nullptr)
+    {
+        delete header;
+        return status;
+    }
+    if (info != nullptr)
+    {
+        setImageInfo(header, *info);
+    }
+
+    const uint width = options.width != 0 ? options.width : header->width;
+    const uint height = options.height != 0 ? options.height : header->height;
+    if (static_cast<std::size_t>(width) * height * 3 > tensorSize)
+    {
+        delete[] mcus;
+        delete header;
+        return makeError(StatusCode::InvalidArgument, "Tensor buffer too small");
+    }
+    const std::vector<ResizeTap> columns = getResizeTaps(header->width, width);
+    const std::vector<ResizeTap> rows = getResizeTaps(header->height, height);
+    const bool resized = width != header->width || height != header->height;
+    float scale[3], bias[3];
+    for (uint c = 0; c < 3; ++c)
+    {
+        scale[c] = 1.0f / (255.0f * options.std[c]);
+        bias[c] = -options.mean[c] / options.std[c];
+    }
+
+    // Each row of MCUs is converted to RGB, and every row of the tensor that only depends on the
+    // rows converted so far is written, while they are still in the cache.
+    std::vector<float> first(width * 3), second(width * 3);
+    const std::size_t planeSize = static_cast<std::size_t>(width) * height;
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    uint y = 0;
+    for (uint row = 0; row < header->mcuHeight && y < height; ++row)
+    {
+        inverseDCT(header, mcus, row, row + 1);
+        YCbCrToRGB(header, mcus, row, row + 1);
+        const uint available = std::min((row + 1) * vMax * 8, header->height);
+        for (; y < height; ++y)
+        {
+            const float weight = rows[y].weight;
+            if ((weight != 0.0f ? rows[y].second : rows[y].first) >= available)
+            {
+                break;
+            }
+            sampleTensorRow(header, mcus, rows[y].first, columns, resized, first.data());
+            if (weight != 0.0f)
+            {
+                sampleTensorRow(header, mcus, rows[y].second, columns, resized, second.data());
+                for (uint i = 0; i < width * 3; ++i)
+                {
+                    first[i] += (second[i] - first[i]) * weight;
+                }
+            }
+            for (uint c = 0; c < 3; ++c)
+            {
+                const float* const channel = first.data() + c * width;
+                if (options.layout == TensorLayout::CHW)
+                {
+                    float* const out = tensor + c * planeSize + static_cast<std::size_t>(y) * width;
+                    for (uint x = 0; x < width; ++x)
+                    {
+                        out[x] = channel[x] * scale[c] + bias[c];
+                    }
+                }
+                else
+                {
+                    float* const out = tensor + static_cast<std::size_t>(y) * width * 3 + c;
+                    for (uint x = 0; x < width; ++x)
+                    {
+                        out[x * 3] = channel[x] * scale[c] + bias[c];
+                    }
+                }
+            }
+        }
+    }
+
+    delete[] mcus;
+    delete header;
+    return Status();
+}
+
+Status decodeTensor(const std::string& filename,
+                    const TensorOptions& options,
+                    float* const tensor,
+                    const std::size_t tensorSize,
+                    ImageInfo* const info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return decodeTensor(inFile, options, tensor, tensorSize, info);
+}
+
+Status decodeTensor(const unsigned char* const data,
+                    const std::size_t size,
+                    const TensorOptions& options,
+                    float* const tensor,
+                    const std::size_t tensorSize,
+                    ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeTensor(input, options, tensor, tensorSize, info);
+}
+
+// The source pixels of each output pixel of a resize: output pixel i is the sum of
+// weights[i * taps + k] times source pixel first[i] + k, for every k < taps.
+struct FilterWeights
+{
+    uint taps = 0;
+    std::vector<uint> first;
+    std::vector<float> weights;
+};
+
+double lanczos3(const double x)
+{
+    if (x == 0.0)
+    {
+        return 1.0;
+    }
+    if (std::abs(x) >= 3.0)
+    {
+        return 0.0;
+    }
+    const double px = M_PI * x;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+// Each output pixel covers scale source pixels around its center, or one source pixel when the
+// image is enlarged. The area filter weighs each source pixel by how much of it is covered, and
+// Lanczos3 by its distance from the center in units of the covered width. The weights of each
+// output pixel are normalized to sum to 1, which also accounts for the pixels past the edges.
+FilterWeights getFilterWeights(const uint sourceSize, const uint size, const ResizeFilter filter)
+{
+    const double scale = static_cast<double>(sourceSize) / size;
+    const double width = std::max(scale, 1.0);
+    const double support = (filter == ResizeFilter::Area) ? width / 2.0 : 3.0 * width;
+    FilterWeights result;
+    for (uint i = 0; i < size; ++i)
+    {
+        const double center = (i + 0.5) * scale;
+        const uint taps = std::ceil(center + support) - std::floor(center - support);
+        result.taps = std::min(std::max(result.taps, taps), sourceSize);
+    }
+    result.first.resize(size);
+    result.weights.resize(static_cast<std::size_t>(size) * result.taps);
+    std::vector<double> weights(result.taps);
+    for (uint i = 0; i < size; ++i)
+    {
+        const double center = (i + 0.5) * scale;
+        const double lowest = std::max(std::floor(center - support), 0.0);
+        const uint first = std::min(static_cast<uint>(lowest), sourceSize - result.taps);
+        double sum = 0.0;
+        for (uint k = 0; k < result.taps; ++k)
+        {
+            const double position = first + k;
+            if (filter == ResizeFilter::Area)
+            {
+                weights[k] = std::max(std::min(position + 1.0, center + width / 2.0)
+                                          - std::max(position, center - width / 2.0),
+                                      0.0);
+            }
+            else
+            {
+                weights[k] = lanczos3((position + 0.5 - center) / width);
+            }
+            sum += weights[k];
+        }
+        result.first[i] = first;
+        for (uint k = 0; k < result.taps; ++k)
+        {
+            result.weights[static_cast<std::size_t>(i) * result.taps + k] = weights[k] / sum;
+        }
+    }
+    return result;
+}
+
+// Filter a row of RGB pixels to the width of the output.
+void filterRow(const float* const in, const FilterWeights& columns, float* const out)
+{
+    for (uint x = 0; x < columns.first.size(); ++x)
+    {
+        const float* const weights = columns.weights.data()
+                                     + static_cast<std::size_t>(x) * columns.taps;
+        const float* const pixels = in + columns.first[x] * 3;
+        float red = 0.0f, green = 0.0f, blue = 0.0f;
+        for (uint k = 0; k < columns.taps; ++k)
+        {
+            red += weights[k] * pixels[k * 3];
+            green += weights[k] * pixels[k * 3 + 1];
+            blue += weights[k] * pixels[k * 3 + 2];
+        }
+        out[x * 3] = red;
+        out[x * 3 + 1] = green;
+        out[x * 3 + 2] = blue;
+    }
+}
+
+// Decode a JPG whose markers and compressed data have been read into header, resized.
+Status decodeResized(Header* const header,
+                     const ResizeOptions& options,
+                     const RowCallback& callback,
+                     ImageInfo* const info)
+{
+    if (!header->valid)
+    {
+        return header->status;
+    }
+    // Only one row of MCUs is held at a time. Every scan keeps a checkpoint of where it stopped
+    // for the row before and resumes decoding there.
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    MCU* const mcus = new (std::nothrow) MCU[static_cast<std::size_t>(header->mcuWidth) * hMax
+                                             * vMax];
+    if (mcus == nullptr)
+    {
+        return makeError(StatusCode::MemoryError, "Memory error");
+    }
+    std::vector<Checkpoint> scanStates(header->scans.size());
+    for (Scan& scan : header->scans)
+    {
+        for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+        {
+            generateCodes(scan.huffmanDCTables[i]);
+            generateCodes(scan.huffmanACTables[i]);
+        }
+    }
+    if (info != nullptr)
+    {
+        setImageInfo(header, *info);
+    }
+
+    uint width = options.width, height = options.height;
+    if (width == 0 && height == 0)
+    {
+        width = header->width;
+        height = header->height;
+    }
+    else if (width == 0)
+    {
+        width = std::max<long>(std::lround(static_cast<double>(header->width) * height
+                                           / header->height),
+                               1);
+    }
+    else if (height == 0)
+    {
+        height = std::max<long>(std::lround(static_cast<double>(header->height) * width
+                                            / header->width),
+                                1);
+    }
+
+    // The smallest scale of the inverse DCT whose image is at least as large as the output.
+    uint size = 8;
+    while (size > 1 && (header->width * (size / 2) + 7) / 8 >= width
+           && (header->height * (size / 2) + 7) / 8 >= height)
+    {
+        size /= 2;
+    }
+    const uint sourceWidth = (header->width * size + 7) / 8;
+    const uint sourceHeight = (header->height * size + 7) / 8;
+    const FilterWeights columns = getFilterWeights(sourceWidth, width, options.filter);
+    const FilterWeights rows = getFilterWeights(sourceHeight, height, options.filter);
+
+    // Each row of the scaled image is filtered to the output width as soon as its row of MCUs is
+    // converted to RGB, into a ring that holds the last rows.taps of them. Each output row is
+    // filtered from the ring once the last row it depends on is in it.
+    const Kernels& kernels = getKernels();
+    const std::size_t rowSize = static_cast<std::size_t>(width) * 3;
+    std::vector<float> source(sourceWidth * 3);
+    std::vector<float> ring(rows.taps * rowSize);
+    std::vector<float> sum(rowSize);
+    std::vector<unsigned char> rgb(rowSize);
+    Status result;
+    uint y = 0;
+    uint sourceY = 0;
+    for (uint row = 0; row < header->mcuHeight && y < height && result.ok(); ++row)
+    {
+        Crop crop;
+        crop.y = row * 8 * vMax;
+        crop.width = header->width;
+        crop.height = std::min(8 * vMax, header->height - crop.y);
+        setCrop(header, crop);
+        for (uint i = 0; i < header->scans.size() && result.ok(); ++i)
+        {
+            const Scan& scan = header->scans[i];
+            const ScanUnits units = getScanUnits(header, scan);
+            const uint last = std::min(units.bottom, units.high) * units.wide;
+            Status status = decodeScanUnits(header, scan, mcus, scanStates[i], last, true);
+            if (status.ok() && scanStates[i].unit < last)
+            {
+                status = {StatusCode::InvalidData, "Scan ended before all of its data"};
+            }
+            if (!status.ok())
+            {
+                setError(header, status.code, status.message);
+                result = header->status;
+            }
+        }
+        if (!result.ok())
+        {
+            break;
+        }
+        scaledInverseDCT(header, mcus, 0, 1, size);
+        scaledYCbCrToRGB(header, mcus, 0, 1, size);
+        const uint firstY = row * vMax * size;
+        const uint available = std::min((row + 1) * vMax * size, sourceHeight);
+        for (; sourceY < available && y < height && result.ok(); ++sourceY)
+        {
+            const MCU* const blocks = mcus + ((sourceY - firstY) / size) * header->blockWidthReal;
+            const uint pixelRow = (sourceY % size) * 8;
+            for (uint x = 0; x < sourceWidth; ++x)
+            {
+                const MCU& mcu = blocks[x / size];
+                const uint i = pixelRow + x % size;
+                source[x * 3] = mcu.r[i];
+                source[x * 3 + 1] = mcu.g[i];
+                source[x * 3 + 2] = mcu.b[i];
+            }
+            filterRow(source.data(), columns, ring.data() + (sourceY % rows.taps) * rowSize);
+
+            for (; y < height && rows.first[y] + rows.taps <= sourceY + 1; ++y)
+            {
+                std::fill(sum.begin(), sum.end(), 0.0f);
+                for (uint k = 0; k < rows.taps; ++k)
+                {
+                    const float weight = rows.weights[static_cast<std::size_t>(y) * rows.taps + k];
+                    if (weight != 0.0f)
+                    {
+                        const float* const in = ring.data()
+                                                + ((rows.first[y] + k) % rows.taps) * rowSize;
+                        kernels.addWeightedRow(in, weight, rowSize, sum.data());
+                    }
+                }
+                for (std::size_t i = 0; i < rowSize; ++i)
+                {
+                    rgb[i] = static_cast<unsigned char>(std::min(std::max(sum[i], 0.0f), 255.0f)
+                                                        + 0.5f);
+                }
+                if (!callback(y, rgb.data(), width, height))
+                {
+                    result = makeError(StatusCode::InvalidArgument,
+                                       "Decoding stopped by row callback");
+                    break;
+                }
+            }
+        }
+    }
+
+    delete[] mcus;
+    return result;
+}
+
+Status decodeResized(std::istream& input,
+                     const ResizeOptions& options,
+                     const RowCallback& callback,
+                     ImageInfo* const info)
+{
+    Header* header = readJPG(input);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    const Status status = decodeResized(header, options, callback, info);
+    delete header;
+    return status;
+}
+
+Status decodeResized(const unsigned char* const data,
+                     const std::size_t size,
+                     const ResizeOptions& options,
+                     const RowCallback& callback,
+                     ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeResized(input, options, callback, info);
+}
+
+Status decodeResized(const std::string& filename,
+                     const ResizeOptions& options,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* const info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return decodeResized(inFile, options, storeRows(pixels), info);
+}
+
+Status decodeResized(const unsigned char* const data,
+                     const std::size_t size,
+                     const ResizeOptions& options,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeResized(input, options, storeRows(pixels), info);
+}
+
+// The bin of a pixel in a histogram of 16 levels of each channel.
+uint colorBin(const unsigned char* const pixel)
+{
+    return uint(pixel[0] >> 4) << 8 | uint(pixel[1] >> 4) << 4 | uint(pixel[2] >> 4);
+}
+
+// Set the average and dominant colors of a summary from its preview.
+void summarizeColors(ImageSummary& summary)
+{
+    const std::size_t count = summary.preview.size() / 3;
+    uint64_t sums[3] = {0, 0, 0};
+    std::vector<uint> bins(4096, 0);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const unsigned char* const pixel = summary.preview.data() + i * 3;
+        sums[0] += pixel[0];
+        sums[1] += pixel[1];
+        sums[2] += pixel[2];
+        bins[colorBin(pixel)] += 1;
+    }
+    const uint dominant = std::max_element(bins.begin(), bins.end()) - bins.begin();
+    uint64_t dominantSums[3] = {0, 0, 0};
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const unsigned char* const pixel = summary.preview.data() + i * 3;
+        if (colorBin(pixel) == dominant)
+        {
+            dominantSums[0] += pixel[0];
+            dominantSums[1] += pixel[1];
+            dominantSums[2] += pixel[2];
+        }
+    }
+    for (uint c = 0; c < 3; ++c)
+    {
+        summary.averageColor[c] = (sums[c] + count / 2) / count;
+        summary.dominantColor[c] = (dominantSums[c] + bins[dominant] / 2) / bins[dominant];
+    }
+}
+
+// Resize the DC coefficients of the luma to 32x32 with the area filter, and compare the lowest
+// 8x8 frequencies of their DCT to the median of them.
+uint64_t perceptualHash(const DCPlanes& dc)
+{
+    const uint size = 32;
+    const uint width = dc.width[0];
+    const uint height = dc.height[0];
+    const FilterWeights columns = getFilterWeights(width, size, ResizeFilter::Area);
+    const FilterWeights rows = getFilterWeights(height, size, ResizeFilter::Area);
+    std::vector<double> narrowed(static_cast<std::size_t>(height) * size);
+    for (uint y = 0; y < height; ++y)
+    {
+        const int* const in = dc.planes[0].data() + static_cast<std::size_t>(y) * width;
+        for (uint x = 0; x < size; ++x)
+        {
+            double sum = 0.0;
+            for (uint k = 0; k < columns.taps; ++k)
+            {
+                sum += columns.weights[x * columns.taps + k] * in[columns.first[x] + k];
+            }
+            narrowed[static_cast<std::size_t>(y) * size + x] = sum;
+        }
+    }
+    double luma[size * size];
+    for (uint y = 0; y < size; ++y)
+    {
+        for (uint x = 0; x < size; ++x)
+        {
+            double sum = 0.0;
+            for (uint k = 0; k < rows.taps; ++k)
+            {
+                sum += rows.weights[y * rows.taps + k]
+                       * narrowed[static_cast<std::size_t>(rows.first[y] + k) * size + x];
+            }
+            luma[y * size + x] = sum;
+        }
+    }
+
+    // Only the lowest 8 of the 32 frequencies are needed in each direction.
+    double cosines[8 * size];
+    for (uint u = 0; u < 8; ++u)
+    {
+        for (uint x = 0; x < size; ++x)
+        {
+            cosines[u * size + x] = std::cos((2.0 * x + 1.0) * u * M_PI / (2.0 * size));
+        }
+    }
+    double rowFrequencies[size * 8];
+    for (uint y = 0; y < size; ++y)
+    {
+        for (uint u = 0; u < 8; ++u)
+        {
+            double sum = 0.0;
+            for (uint x = 0; x < size; ++x)
+            {
+                sum += luma[y * size + x] * cosines[u * size + x];
+            }
+            rowFrequencies[y * 8 + u] = sum;
+        }
+    }
+    double coefficients[64];
+    for (uint v = 0; v < 8; ++v)
+    {
+        for (uint u = 0; u < 8; ++u)
+        {
+            double sum = 0.0;
+            for (uint y = 0; y < size; ++y)
+            {
+                sum += rowFrequencies[y * 8 + u] * cosines[v * size + y];
+            }
+            coefficients[v * 8 + u] = sum;
+        }
+    }
+
+    double sorted[64];
+    std::copy(coefficients, coefficients + 64, sorted);
+    std::sort(sorted, sorted + 64);
+    const double median = (sorted[31] + sorted[32]) / 2.0;
+    uint64_t hash = 0;
+    for (uint i = 0; i < 64; ++i)
+    {
+        if (coefficients[i] > median)
+        {
+            hash |= uint64_t(1) << i;
+        }
+    }
+    return hash;
+}
+
+Status summarizeJPG(std::istream& input, ImageSummary& summary, ImageInfo* const info)
+{
+    summary = ImageSummary();
+    DCPlanes dc;
+    Header* header = readDCValues(input, dc);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    const Status status = header->status;
+    if (!status.ok())
+    {
+        delete header;
+        return status;
+    }
+    if (info != nullptr)
+    {
+        setImageInfo(header, *info);
+    }
+    summary.previewWidth = (header->width + 7) / 8;
+    summary.previewHeight = (header->height + 7) / 8;
+    summary.preview.resize(static_cast<std::size_t>(summary.previewWidth) * summary.previewHeight
+                           * 3);
+    DCToRGB(header, dc, summary.preview.data());
+    delete header;
+
+    summarizeColors(summary);
+    summary.hash = perceptualHash(dc);
+    return status;
+}
+
+Status summarizeJPG(const std::string& filename, ImageSummary& summary, ImageInfo* const info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return summarizeJPG(inFile, summary, info);
+}
+
+Status summarizeJPG(const unsigned char* const data,
+                    const std::size_t size,
+                    ImageSummary& summary,
+                    ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return summarizeJPG(input, summary, info);
+}
+
+uint hashDistance(const uint64_t a, const uint64_t b)
+{
+    return std::bitset<64>(a ^ b).count();
+}
+
+// Walk the marker segments up to the frame header, parsing the first EXIF segment and skipping
+// over all others.
+Status readExif(std::istream& input, Exif& exif)
+{
+    exif = Exif();
+    if (input.get() != 0xFF || input.get() != static_cast<int>(SOI.to_ulong()))
+    {
+        return makeError(StatusCode::InvalidData, "Missing SOI marker");
+    }
+    while (true)
+    {
+        int marker = input.get();
+        if (marker != 0xFF)
+        {
+            if (!input)
+            {
+                return makeError(StatusCode::InvalidData, "File ended prematurely");
+            }
+            return makeError(StatusCode::InvalidData, "Expected a marker");
+        }
+        // Any number of 0xFF fill bytes may precede a marker.
+        while (marker == 0xFF)
+        {
+            marker = input.get();
+        }
+        if (!input)
+        {
+            return makeError(StatusCode::InvalidData, "File ended prematurely");
+        }
+        const byte current = marker;
+        if ((current.to_ulong() >= SOF0.to_ulong() && current.to_ulong() <= SOF15.to_ulong()
+             && current != DHT && current != JPG && current != DAC)
+            || current == SOS || current == EOI)
+        {
+            return Status();
+        }
+        if (current == TEM || (current.to_ulong() >= RST0.to_ulong()
+                               && current.to_ulong() <= RST7.to_ulong()))
+        {
+            continue;
+        }
+
+        const std::streamoff start = input.tellg();
+        const uint length = (input.get() << 8) + input.get();
+        if (!input || length < 2)
+        {
+            return makeError(StatusCode::InvalidData, "Marker segment invalid");
+        }
+        if (current == APP1)
+        {
+            std::vector<unsigned char> data(length - 2);
+            input.read(reinterpret_cast<char*>(data.data()), data.size());
+            if (!input)
+            {
+                return makeError(StatusCode::InvalidData, "File ended prematurely");
+            }
+            if (parseExif(data.data(), data.size(), start < 0 ? 0 : start + 2, exif))
+            {
+                return Status();
+            }
+            continue;
+        }
+        input.ignore(length - 2);
+    }
+}
+
+Status readExif(const std::string& filename, Exif& exif)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return readExif(inFile, exif);
+}
+
+Status readExif(const unsigned char* const data, const std::size_t size, Exif& exif)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return readExif(input, exif);
+}
+
+// Decode the thumbnail of exif if it is at least minWidth x minHeight pixels and the decoder
+// supports it, returning false otherwise.
+bool decodeThumbnail(const Exif& exif,
+                     const uint minWidth,
+                     const uint minHeight,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* const info)
+{
+    ImageInfo thumbnailInfo;
+    if (exif.thumbnail.empty()
+        || !probeJPG(exif.thumbnail.data(), exif.thumbnail.size(), thumbnailInfo).ok()
+        || thumbnailInfo.width < minWidth || thumbnailInfo.height < minHeight)
+    {
+        return false;
+    }
+    return decodeJPG(exif.thumbnail.data(), exif.thumbnail.size(), pixels, nullptr, info).ok();
+}
+
+Status decodePreview(const std::string& filename,
+                     const uint minWidth,
+                     const uint minHeight,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* const info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    Exif exif;
+    const Status status = readExif(inFile, exif);
+    if (!status.ok())
+    {
+        return status;
+    }
+    if (decodeThumbnail(exif, minWidth, minHeight, pixels, info))
+    {
+        return Status();
+    }
+    inFile.clear();
+    inFile.seekg(0);
+    return decodeToBuffer(inFile, pixels, nullptr, info);
+}
+
+Status decodePreview(const unsigned char* const data,
+                     const std::size_t size,
+                     const uint minWidth,
+                     const uint minHeight,
+                     std::vector<unsigned char>& pixels,
+                     ImageInfo* const info)
+{
+    Exif exif;
+    const Status status = readExif(data, size, exif);
+    if (!status.ok())
+    {
+        return status;
+    }
+    if (decodeThumbnail(exif, minWidth, minHeight, pixels, info))
+    {
+        return Status();
+    }
+    return decodeJPG(data, size, pixels, nullptr, info);
+}
+
+enum class IncrementalPhase
+{
+    Signature, // Waiting for the SOI marker
+    Markers,   // Reading marker segments
+    ScanData,  // Reading the compressed data of the last scan
+    Done,      // The EOI marker has been read, or decoding failed
+};
+
+struct IncrementalState
+{
+    RowCallback callback;
+    IncrementalPhase phase = IncrementalPhase::Signature;
+    Status status;
+    Header* header = nullptr;
+    MCU* mcus = nullptr;
+    ImageInfo info;
+    bool headerRead = false;
+
+    // Data pushed but not consumed yet. A marker segment is only read once all of it is here.
+    std::vector<unsigned char> data;
+
+    // Position reached in the last scan, and the number of MCU rows every component has been
+    // decoded for. Each component is coded in exactly one scan.
+    Checkpoint scanState;
+    uint componentRows[3] = {0};
+    uint rowsReconstructed = 0;
+    uint rowsDecoded = 0;
+    std::vector<unsigned char> row;
+};
+
+// Prepare for the compressed data of the scan whose header was just read.
+bool startScan(IncrementalState& s)
+{
+    Header* const header = s.header;
+    Scan& scan = header->scans.back();
+    for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+    {
+        generateCodes(scan.huffmanDCTables[i]);
+        generateCodes(scan.huffmanACTables[i]);
+    }
+    if (s.mcus == nullptr)
+    {
+        s.mcus = new (std::nothrow) MCU[header->blockHeightReal * header->blockWidthReal];
+        if (s.mcus == nullptr)
+        {
+            s.status = makeError(StatusCode::MemoryError, "Memory error");
+            return false;
+        }
+        setImageInfo(header, s.info);
+        s.headerRead = true;
+        s.row.resize(header->width * 3);
+    }
+    s.scanState = Checkpoint();
+    return true;
+}
+
+// Move the compressed data of the last scan from the pushed data into the scan, removing byte
+// stuffing and restart markers. Return true if the marker that ends the scan has been reached; it
+// is left in the pushed data.
+bool extractScanData(IncrementalState& s)
+{
+    const Kernels& kernels = getKernels();
+    Scan& scan = s.header->scans.back();
+    const unsigned char* const data = s.data.data();
+    const std::size_t size = s.data.size();
+    std::size_t position = 0;
+    bool ended = false;
+    while (position < size)
+    {
+        const std::size_t length = kernels.findMarker(data + position, size - position);
+        scan.huffmanData.insert(scan.huffmanData.end(), data + position, data + position + length);
+        position += length;
+        if (position + 1 >= size)
+        {
+            break;
+        }
+        const byte next = data[position + 1];
+        if (next == 0x00)
+        {
+            scan.huffmanData.push_back(0xFF);
+            JPEG_COUNT(s.header->statistics.counters.stuffedBytesRemoved, 1);
+            position += 2;
+        }
+        else if (next.to_ulong() >= RST0.to_ulong() && next.to_ulong() <= RST7.to_ulong())
+        {
+            position += 2;
+        }
+        else if (next == 0xFF)
+        {
+            position += 1;
+        }
+        else
+        {
+            ended = true;
+            break;
+        }
+    }
+    s.data.erase(s.data.begin(), s.data.begin() + position);
+    return ended;
+}
+
+// Reconstruct the MCU rows that every component has been decoded for and pass their pixels to the
+// callback.
+void emitRows(IncrementalState& s)
+{
+    const Header* const header = s.header;
+    uint ready = header->mcuHeight;
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        ready = std::min(ready, s.componentRows[i]);
+    }
+    if (ready <= s.rowsReconstructed)
+    {
+        return;
+    }
+    inverseDCT(header, s.mcus, s.rowsReconstructed, ready);
+    YCbCrToRGB(header, s.mcus, s.rowsReconstructed, ready);
+    s.rowsReconstructed = ready;
+
+    const uint height = std::min(ready * 8 * header->verticalSamplingFactor.to_ulong(),
+                                 static_cast<unsigned long>(header->height));
+    for (; s.rowsDecoded < height; ++s.rowsDecoded)
+    {
+        copyRow(header, s.mcus, s.rowsDecoded, s.row.data());
+        if (!s.callback(s.rowsDecoded, s.row.data(), header->width, header->height))
+        {
+            s.status = makeError(StatusCode::InvalidArgument, "Decoding stopped by row callback");
+            return;
+        }
+    }
+}
+
+// Decode the compressed data of the last scan received so far.
+void decodeScanData(IncrementalState& s)
+{
+    const bool ended = extractScanData(s);
+    const Header* const header = s.header;
+    const Scan& scan = header->scans.back();
+    const ScanUnits units = getScanUnits(header, scan);
+    const uint numUnits = units.wide * units.high;
+    const Status status = decodeScanUnits(header, scan, s.mcus, s.scanState, numUnits, true);
+    if (!status.ok())
+    {
+        setError(header, status.code, status.message);
+        s.status = status;
+        return;
+    }
+    if (ended && s.scanState.unit < numUnits)
+    {
+        setError(header, StatusCode::InvalidData, "Scan ended before all of its data");
+        s.status = header->status;
+        return;
+    }
+
+    // An interleaved scan codes whole MCU rows, and a non-interleaved one the block rows of its
+    // component, of which there are verticalSamplingFactor in every MCU row.
+    for (uint j = 0; j < scan.numComponents.to_ulong(); ++j)
+    {
+        const uint component = scan.componentIDs[j];
+        uint rows = s.scanState.unit / units.wide;
+        if (scan.numComponents.to_ulong() == 1)
+        {
+            rows /= header->colorComponents[component].verticalSamplingFactor.to_ulong();
+        }
+        s.componentRows[component] = (s.scanState.unit == numUnits) ? header->mcuHeight : rows;
+    }
+    emitRows(s);
+    if (ended && s.status.ok())
+    {
+        s.phase = IncrementalPhase::Markers;
+    }
+}
+
+// Read the next marker segment if all of it has been pushed. Return false if more data is needed.
+bool readNextMarker(IncrementalState& s)
+{
+    Header* const header = s.header;
+    if (s.data.size() < 2)
+    {
+        return false;
+    }
+    if (s.data[0] != 0xFF)
+    {
+        setError(header, StatusCode::InvalidData, "Expected a marker");
+        s.status = header->status;
+        return false;
+    }
+    const byte marker = s.data[1];
+    // Any number of 0xFF in a row is allowed and should be ignored
+    if (marker == 0xFF)
+    {
+        s.data.erase(s.data.begin());
+        return true;
+    }
+    if (marker == EOI)
+    {
+        if (header->scans.empty())
+        {
+            setError(header, StatusCode::InvalidData, "EOI detected before SOS");
+        }
+        else
+        {
+            validateHeader(header);
+        }
+        s.status = header->status;
+        s.phase = IncrementalPhase::Done;
+        return false;
+    }
+
+    // Only TEM, SOI and the restart markers have no segment, and only TEM is valid here.
+    std::size_t length = 2;
+    const bool standalone = marker == TEM || marker == SOI
+                            || (marker.to_ulong() >= RST0.to_ulong()
+                                && marker.to_ulong() <= RST7.to_ulong());
+    if (!standalone)
+    {
+        if (s.data.size() < 4)
+        {
+            return false;
+        }
+        length += (s.data[2] << 8) + s.data[3];
+        if (s.data.size() < length)
+        {
+            return false;
+        }
+    }
+    MemoryBuffer buffer(s.data.data() + 2, length - 2);
+    std::istream input(&buffer);
+    readMarker(input, header, marker);
+    s.data.erase(s.data.begin(), s.data.begin() + length);
+    if (!header->valid)
+    {
+        s.status = header->status;
+        return false;
+    }
+    if (marker == SOS)
+    {
+        if (!startScan(s))
+        {
+            return false;
+        }
+        s.phase = IncrementalPhase::ScanData;
+    }
+    return true;
+}
+
+IncrementalDecoder::IncrementalDecoder(const RowCallback& callback)
+    : state(new IncrementalState)
+{
+    state->callback = callback;
+    state->header = new (std::nothrow) Header;
+    if (state->header == nullptr)
+    {
+        state->status = makeError(StatusCode::MemoryError, "Memory error");
+    }
+}
+
+IncrementalDecoder::~IncrementalDecoder()
+{
+    delete[] state->mcus;
+    delete state->header;
+    delete state;
+}
+
+Status IncrementalDecoder::push(const unsigned char* const data, const std::size_t size)
+{
+    IncrementalState& s = *state;
+    if (!s.status.ok() || s.phase == IncrementalPhase::Done)
+    {
+        return s.status;
+    }
+    s.data.insert(s.data.end(), data, data + size);
+    while (s.status.ok())
+    {
+        if (s.phase == IncrementalPhase::Signature)
+        {
+            if (s.data.size() < 2)
+            {
+                break;
+            }
+            if (s.data[0] != 0xFF || s.data[1] != SOI.to_ulong())
+            {
+                setError(s.header, StatusCode::InvalidData, "Missing SOI marker");
+                s.status = s.header->status;
+                break;
+            }
+            s.data.erase(s.data.begin(), s.data.begin() + 2);
+            s.phase = IncrementalPhase::Markers;
+        }
+        else if (s.phase == IncrementalPhase::Markers)
+        {
+            if (!readNextMarker(s))
+            {
+                break;
+            }
+        }
+        else if (s.phase == IncrementalPhase::ScanData)
+        {
+            decodeScanData(s);
+            if (s.phase == IncrementalPhase::ScanData)
+            {
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (!s.status.ok())
+    {
+        s.phase = IncrementalPhase::Done;
+    }
+    return s.status;
+}
+
+Status IncrementalDecoder::finish()
+{
+    if (state->status.ok() && state->phase != IncrementalPhase::Done)
+    {
+        setError(state->header, StatusCode::InvalidData, "File ended prematurely");
+        state->status = state->header->status;
+        state->phase = IncrementalPhase::Done;
+    }
+    return state->status;
+}
+
+bool IncrementalDecoder::headerRead() const
+{
+    return state->headerRead;
+}
+
+const ImageInfo& IncrementalDecoder::info() const
+{
+    return state->info;
+}
+
+uint IncrementalDecoder::rowsDecoded() const
+{
+    return state->rowsDecoded;
+}
+
+struct MotionJPEGState
+{
+    std::istream* input = nullptr;
+    Status status;
+    uint framesDecoded = 0;
+
+    // The header of the last frame, whose scans keep their buffers for the next one, and MCUs for
+    // the largest frame so far.
+    Header* header = nullptr;
+    MCU* mcus = nullptr;
+    std::size_t numMCUs = 0;
+
+    // Huffman tables of earlier frames, with their codes generated, the most recent first.
+    std::vector<HuffmanTable> tables;
+};
+
+const uint maxCachedHuffmanTables = 8;
+
+// Give the tables of every scan of a frame the codes of an equal table of an earlier frame, or
+// generate them and remember the table for later frames.
+void useCachedHuffmanCodes(MotionJPEGState& s, Header* const header)
+{
+    for (Scan& scan : header->scans)
+    {
+        for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+        {
+            for (HuffmanTable* const hTable : {&scan.huffmanDCTables[i], &scan.huffmanACTables[i]})
+            {
+                const auto cached = std::find_if(s.tables.begin(),
+                                                 s.tables.end(),
+                                                 [hTable](const HuffmanTable& table)
+                                                 {
+                                                     return sameHuffmanTable(table, *hTable);
+                                                 });
+                if (cached != s.tables.end())
+                {
+                    *hTable = *cached;
+                    continue;
+                }
+                generateCodes(*hTable);
+                if (s.tables.size() == maxCachedHuffmanTables)
+                {
+                    s.tables.pop_back();
+                }
+                s.tables.insert(s.tables.begin(), *hTable);
+            }
+        }
+    }
+}
+
+// Decode the frame that starts at the current position of the stream into pixels.
+Status decodeFrame(MotionJPEGState& s, std::vector<unsigned char>& pixels, ImageInfo* const info)
+{
+    Header* const header = readJPGFrame(*s.input, s.header);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    s.header = header;
+    if (!header->valid)
+    {
+        return header->status;
+    }
+
+    useCachedHuffmanCodes(s, header);
+    const std::size_t numMCUs = header->blockHeightReal * header->blockWidthReal;
+    if (numMCUs > s.numMCUs)
+    {
+        delete[] s.mcus;
+        s.numMCUs = 0;
+        s.mcus = new (std::nothrow) MCU[numMCUs];
+        if (s.mcus == nullptr)
+        {
+            return makeError(StatusCode::MemoryError, "Memory error");
+        }
+        s.numMCUs = numMCUs;
+    }
+    if (!decodeHuffmanData(header, s.mcus, true))
+    {
+        return header->status;
+    }
+    inverseDCT(header, s.mcus);
+    YCbCrToRGB(header, s.mcus);
+
+    const std::size_t rowSize = static_cast<std::size_t>(header->width) * 3;
+    pixels.resize(rowSize * header->height);
+    for (uint y = 0; y < header->height; ++y)
+    {
+        copyRow(header, s.mcus, y, pixels.data() + y * rowSize);
+    }
+    if (info != nullptr)
+    {
+        setImageInfo(header, *info);
+    }
+    return Status();
+}
+
+MotionJPEGDecoder::MotionJPEGDecoder(std::istream& input) : state(new MotionJPEGState)
+{
+    state->input = &input;
+}
+
+MotionJPEGDecoder::~MotionJPEGDecoder()
+{
+    delete state->header;
+    delete[] state->mcus;
+    delete state;
+}
+
+bool MotionJPEGDecoder::nextFrame(std::vector<unsigned char>& pixels, ImageInfo* const info)
+{
+    MotionJPEGState& s = *state;
+    std::istream& input = *s.input;
+    // Frames may be separated by padding, and after a frame that failed to decode the stream can
+    // be anywhere in it, so decoding continues at the next SOI marker.
+    input.clear();
+    while (true)
+    {
+        const int current = input.get();
+        if (current == std::istream::traits_type::eof())
+        {
+            s.status = Status();
+            return false;
+        }
+        if (current == 0xFF && input.peek() == static_cast<int>(SOI.to_ulong()))
+        {
+            input.unget();
+            break;
+        }
+    }
+
+    s.status = decodeFrame(s, pixels, info);
+    if (!s.status.ok())
+    {
+        return false;
+    }
+    ++s.framesDecoded;
+    return true;
+}
+
+const Status& MotionJPEGDecoder::status() const
+{
+    return state->status;
+}
+
+uint MotionJPEGDecoder::framesDecoded() const
+{
+    return state->framesDecoded;
+}
+
+Status encodeJPG(const unsigned char* const rgb,
+                 const uint width,
+                 const uint height,
+                 const EncodeOptions& options,
+                 std::vector<unsigned char>& jpg)
+{
+    jpg.clear();
+    if (rgb == nullptr)
+    {
+        return makeError(StatusCode::InvalidArgument, "Null argument");
+    }
+    Header header;
+    header.restartInterval = options.restartInterval;
+    if (!setEncoderHeader(&header, width, height, options.quality, options.subsampling))
+    {
+        return header.status;
+    }
+    // Only the one pass encoder does without storing the coefficients of the whole image.
+    if (!options.optimizeHuffmanTables && options.threads == 1)
+    {
+        if (!encodePixels(&header, rgb, jpg))
+        {
+            jpg.clear();
+            return header.status;
+        }
+        return Status();
+    }
+    MCU* mcus = transformPixels(&header, rgb, options.threads);
+    if (mcus == nullptr)
+    {
+        return header.status;
+    }
+    if (options.optimizeHuffmanTables)
+    {
+        optimizeHuffmanTables(&header, mcus);
+    }
+    const bool written = writeJPG(&header, mcus, jpg, options.threads);
+    delete[] mcus;
+    if (!written)
+    {
+        jpg.clear();
+        return header.status;
+    }
+    return Status();
+}
+
+Status encodeJPG(const unsigned char* const rgb,
+                 const uint width,
+                 const uint height,
+                 const EncodeOptions& options,
+                 const std::string& filename)
+{
+    std::vector<unsigned char> jpg;
+    const Status status = encodeJPG(rgb, width, height, options, jpg);
+    if (!status.ok())
+    {
+        return status;
+    }
+    std::ofstream outFile = std::ofstream(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Failed opening output file");
+    }
+    outFile.write(reinterpret_cast<const char*>(jpg.data()), jpg.size());
+    outFile.close();
+    if (!outFile)
+    {
+        return makeError(StatusCode::FileError, "Failed writing output file");
+    }
+    return Status();
+}
+
+Status optimizeJPG(std::istream& input, std::vector<unsigned char>& jpg)
+{
+    jpg.clear();
+    Header* header;
+    MCU* mcus;
+    const Status status = decodeCoefficients(input, header, mcus, false);
+    if (mcus == nullptr)
+    {
+        delete header;
+        return status;
+    }
+    optimizeHuffmanTables(header, mcus);
+    const bool written = writeJPG(header, mcus, jpg, 0);
+    const Status writeStatus = header->status;
+    delete[] mcus;
+    delete header;
+    if (!written)
+    {
+        jpg.clear();
+        return writeStatus;
+    }
+    return Status();
+}
+
+Status optimizeJPG(const std::string& filename, std::vector<unsigned char>& jpg)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return optimizeJPG(inFile, jpg);
+}
+
+Status optimizeJPG(const unsigned char* const data,
+                   const std::size_t size,
+                   std::vector<unsigned char>& jpg)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return optimizeJPG(input, jpg);
+}
+
+// Files of a batch between being read and being written.
+struct BatchState
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    // Files read, waiting for a decoding thread.
+    std::deque<IOCompletion> reads;
+    uint started = 0, finished = 0;
+    bool stopping = false;
+    std::vector<Status> statuses;
+};
+
+void finishBatchFile(BatchState& state, const uint64_t index, const Status& status)
+{
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.statuses[index] = status;
+    state.finished += 1;
+    state.changed.notify_all();
+}
+
+// Decode the files of a batch as they are read, and submit their BMP files for writing.
+void runBatchDecoder(BatchState& state, AsyncFileIO& io, const std::vector<std::string>& outputs)
+{
+    // The images of the batch are decoded in parallel already.
+    setDecodeThreads(1);
+    while (true)
+    {
+        IOCompletion read;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.changed.wait(lock, [&state]() { return state.stopping || !state.reads.empty(); });
+            if (state.reads.empty())
+            {
+                return;
+            }
+            read = std::move(state.reads.front());
+            state.reads.pop_front();
+        }
+
+        MemoryBuffer buffer(read.data.data(), read.data.size());
+        std::istream input(&buffer);
+        Header* header = readJPG(input);
+        if (header == nullptr)
+        {
+            finishBatchFile(state, read.tag, {StatusCode::MemoryError, "Memory error"});
+            continue;
+        }
+        MCU* mcus = header->valid ? decodeHuffmanData(header, true) : nullptr;
+        if (mcus == nullptr)
+        {
+            finishBatchFile(state, read.tag, header->status);
+            delete header;
+            continue;
+        }
+        inverseDCT(header, mcus);
+        YCbCrToRGB(header, mcus);
+        std::vector<unsigned char> bmp;
+        writeBMP(header, mcus, bmp);
+        delete[] mcus;
+        delete header;
+        // The input is released before the write is submitted, which may wait for room.
+        read.data = std::vector<unsigned char>();
+        io.write(outputs[read.tag], std::move(bmp), read.tag);
+    }
+}
+
+std::vector<Status> decodeBatch(const std::vector<std::string>& inputs,
+                                const std::vector<std::string>& outputs,
+                                const BatchOptions& options)
+{
+    BatchState state;
+    state.statuses.resize(inputs.size());
+    if (outputs.size() != inputs.size())
+    {
+        std::fill(state.statuses.begin(),
+                  state.statuses.end(),
+                  makeError(StatusCode::InvalidArgument, "Every input needs an output"));
+        return state.statuses;
+    }
+    const uint queueDepth = std::max(1u, options.queueDepth);
+    AsyncFileIO io(
+        [&state](IOCompletion& completion)
+        {
+            if (completion.write || !completion.status.ok())
+            {
+                finishBatchFile(state, completion.tag, completion.status);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.reads.push_back(std::move(completion));
+            state.changed.notify_all();
+        },
+        queueDepth);
+
+    const uint threads = (options.threads != 0) ? options.threads
+                                                : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> decoders;
+    for (uint i = 0; i < threads; ++i)
+    {
+        decoders.push_back(std::thread(runBatchDecoder, std::ref(state), std::ref(io),
+                                       std::cref(outputs)));
+    }
+    // Up to queueDepth files are between being read and written at once, which bounds the
+    // memory of the batch whether the disk or the decoders are slower.
+    for (uint i = 0; i < inputs.size(); ++i)
+    {
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.changed.wait(lock,
+                               [&state, queueDepth]()
+                               { return state.started - state.finished < queueDepth; });
+            state.started += 1;
+        }
+        io.read(inputs[i], i);
+    }
+    {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.changed.wait(lock, [&state]() { return state.finished == state.started; });
+        state.stopping = true;
+        state.changed.notify_all();
+    }
+    for (std::thread& decoder : decoders)
+    {
+        decoder.join();
+    }
+    io.wait();
+    return state.statuses;
+}
+
+uint64_t rotateLeft(const uint64_t x, const uint bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+void sipRound(uint64_t v[4])
+{
+    v[0] += v[1];
+    v[1] = rotateLeft(v[1], 13);
+    v[1] ^= v[0];
+    v[0] = rotateLeft(v[0], 32);
+    v[2] += v[3];
+    v[3] = rotateLeft(v[3], 16);
+    v[3] ^= v[2];
+    v[0] += v[3];
+    v[3] = rotateLeft(v[3], 21);
+    v[3] ^= v[0];
+    v[2] += v[1];
+    v[1] = rotateLeft(v[1], 17);
+    v[1] ^= v[2];
+    v[2] = rotateLeft(v[2], 32);
+}
+
+// SipHash-2-4 of a block of memory with its 128-bit output, under a secret key, so that JPGs
+// whose hashes collide can neither be found without the key nor be expected by chance.
+void hashBytes(const unsigned char* const data,
+               const std::size_t size,
+               const uint64_t key[2],
+               uint64_t hash[2])
+{
+    uint64_t v[4] = {key[0] ^ 0x736F6D6570736575ull,
+                     key[1] ^ 0x646F72616E646F83ull,
+                     key[0] ^ 0x6C7967656E657261ull,
+                     key[1] ^ 0x7465646279746573ull};
+    const std::size_t words = size / 8;
+    for (std::size_t i = 0; i < words; ++i)
+    {
+        uint64_t m;
+        std::memcpy(&m, data + i * 8, 8);
+        v[3] ^= m;
+        sipRound(v);
+        sipRound(v);
+        v[0] ^= m;
+    }
+    uint64_t last = static_cast<uint64_t>(size) << 56;
+    for (std::size_t i = words * 8; i < size; ++i)
+    {
+        last |= static_cast<uint64_t>(data[i]) << ((i % 8) * 8);
+    }
+    v[3] ^= last;
+    sipRound(v);
+    sipRound(v);
+    v[0] ^= last;
+    v[2] ^= 0xEE;
+    for (uint i = 0; i < 4; ++i)
+    {
+        sipRound(v);
+    }
+    hash[0] = v[0] ^ v[1] ^ v[2] ^ v[3];
+    v[1] ^= 0xDD;
+    for (uint i = 0; i < 4; ++i)
+    {
+        sipRound(v);
+    }
+    hash[1] = v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+enum class CachedDecode
+{
+    Header,
+    Pixels,
+    Resized,
+    Planar,
+};
+
+// A JPG and the options it was decoded with: the crop region as x, y, width and height after a
+// flag that there is one, or the size and filter of a resize.
+struct CacheKey
+{
+    uint64_t hash[2] = {0};
+    std::size_t size = 0;
+    CachedDecode decode = CachedDecode::Header;
+    uint options[5] = {0};
+
+    bool operator==(const CacheKey& other) const
+    {
+        return hash[0] == other.hash[0] && hash[1] == other.hash[1] && size == other.size
+               && decode == other.decode && std::equal(options, options + 5, other.options);
+    }
+};
+
+struct CacheKeyHash
+{
+    std::size_t operator()(const CacheKey& key) const
+    {
+        uint64_t h = key.hash[0] ^ static_cast<uint64_t>(key.decode);
+        for (const uint option : key.options)
+        {
+            h = (h ^ option) * 0x100000001B3ull;
+        }
+        return static_cast<std::size_t>(h);
+    }
+};
+
+struct CachedImage
+{
+    std::vector<unsigned char> pixels;
+    PlanarImage planar;
+    ImageInfo info;
+};
+
+// An entry of the image cache or of the header cache.
+struct CacheEntry
+{
+    CacheKey key;
+    std::size_t bytes = 0;
+    std::shared_ptr<const CachedImage> image;
+    std::shared_ptr<const Header> header;
+};
+
+// Entries from the most to the least recently used, and the entry of every key.
+struct LRUCache
+{
+    std::size_t budget = 0, bytes = 0;
+    std::list<CacheEntry> entries;
+    std::unordered_map<CacheKey, std::list<CacheEntry>::iterator, CacheKeyHash> index;
+};
+
+struct DecodeCacheState
+{
+    std::mutex mutex;
+    LRUCache images, headers;
+    CacheCounters counters;
+    // The key of hashBytes, drawn for every cache.
+    uint64_t hashKey[2] = {0};
+};
+
+// Find the entry of a key and make it the most recently used, or return nullptr.
+const CacheEntry* findEntry(LRUCache& cache, const CacheKey& key)
+{
+    const auto found = cache.index.find(key);
+    if (found == cache.index.end())
+    {
+        return nullptr;
+    }
+    cache.entries.splice(cache.entries.begin(), cache.entries, found->second);
+    return &*found->second;
+}
+
+// Add an entry as the most recently used, removing the least recently used ones until the cache is
+// within its budget again and counting them in evictions. An entry larger than the budget, or
+// whose key another thread has added first, is not added.
+void insertEntry(LRUCache& cache, const CacheEntry& entry, [[maybe_unused]] uint64_t& evictions)
+{
+    if (entry.bytes > cache.budget || cache.index.count(entry.key) != 0)
+    {
+        return;
+    }
+    while (cache.bytes + entry.bytes > cache.budget)
+    {
+        cache.bytes -= cache.entries.back().bytes;
+        cache.index.erase(cache.entries.back().key);
+        cache.entries.pop_back();
+        JPEG_COUNT(evictions, 1);
+    }
+    cache.entries.push_front(entry);
+    cache.index[entry.key] = cache.entries.begin();
+    cache.bytes += entry.bytes;
+}
+
+void clearEntries(LRUCache& cache)
+{
+    cache.entries.clear();
+    cache.index.clear();
+    cache.bytes = 0;
+}
+
+// Memory held by a header, most of which is the compressed data of its scans.
+std::size_t headerBytes(const Header& header)
+{
+    std::size_t bytes = sizeof(Header) + header.exif.thumbnail.capacity();
+    for (const Scan& scan : header.scans)
+    {
+        bytes += sizeof(Scan) + scan.huffmanData.capacity()
+                 + scan.checkpoints.capacity() * sizeof(Checkpoint);
+    }
+    return bytes;
+}
+
+std::size_t imageBytes(const CachedImage& image)
+{
+    return sizeof(CachedImage) + image.pixels.size() + image.planar.planes[0].size()
+           + image.planar.planes[1].size() + image.planar.planes[2].size();
+}
+
+// Read the header of a JPG in memory, or copy it from the header cache and read the compressed
+// data of its scans from data again. The cached headers have the codes of their Huffman tables
+// generated, and hold no compressed data, which would be a second copy of the JPG. Return nullptr
+// if the header cannot be allocated.
+Header* readCachedHeader(DecodeCacheState& s,
+                         const unsigned char* const data,
+                         const std::size_t size,
+                         const CacheKey& key)
+{
+    std::shared_ptr<const Header> cached;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        const CacheEntry* const entry = findEntry(s.headers, key);
+        if (entry != nullptr)
+        {
+            cached = entry->header;
+        }
+        JPEG_COUNT(s.counters.headerHits, cached != nullptr);
+        JPEG_COUNT(s.counters.headerMisses, cached == nullptr);
+    }
+    if (cached != nullptr)
+    {
+        Header* const header = new (std::nothrow) Header(*cached);
+        if (header == nullptr)
+        {
+            return nullptr;
+        }
+        header->statistics = DecodeStatistics();
+        // Scans that do not fit data only come from another JPG than the cached one, which is
+        // then read below.
+        if (readScanData(header, data, size))
+        {
+            return header;
+        }
+        delete header;
+    }
+
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    Header* const header = readJPG(input);
+    if (header == nullptr || !header->valid)
+    {
+        return header;
+    }
+    for (Scan& scan : header->scans)
+    {
+        for (uint i = 0; i < scan.numComponents.to_ulong(); ++i)
+        {
+            generateCodes(scan.huffmanDCTables[i]);
+            generateCodes(scan.huffmanACTables[i]);
+        }
+    }
+    // The compressed data is moved aside while the header is copied for the cache.
+    std::vector<std::vector<unsigned char>> scanData(header->scans.size());
+    for (uint i = 0; i < header->scans.size(); ++i)
+    {
+        scanData[i] = std::move(header->scans[i].huffmanData);
+        header->scans[i].huffmanData.clear();
+    }
+    CacheEntry entry;
+    entry.key = key;
+    entry.bytes = headerBytes(*header);
+    if (entry.bytes <= s.headers.budget)
+    {
+        entry.header = std::make_shared<const Header>(*header);
+    }
+    for (uint i = 0; i < header->scans.size(); ++i)
+    {
+        header->scans[i].huffmanData = std::move(scanData[i]);
+    }
+    if (entry.header != nullptr)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        insertEntry(s.headers, entry, s.counters.headerEvictions);
+    }
+    return header;
+}
+
+// Find the image a JPG in memory decodes to with the options of key, or decode it from its header
+// with decode and cache it.
+Status decodeCached(DecodeCacheState& s,
+                    const unsigned char* const data,
+                    const std::size_t size,
+                    CacheKey key,
+                    const std::function<Status(Header*, CachedImage&)>& decode,
+                    std::shared_ptr<const CachedImage>& image)
+{
+    hashBytes(data, size, s.hashKey, key.hash);
+    key.size = size;
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        JPEG_COUNT(s.counters.bytesHashed, size);
+        const CacheEntry* const entry = findEntry(s.images, key);
+        if (entry != nullptr)
+        {
+            image = entry->image;
+        }
+        JPEG_COUNT(s.counters.hits, image != nullptr);
+        JPEG_COUNT(s.counters.misses, image == nullptr);
+    }
+    if (image != nullptr)
+    {
+        return Status();
+    }
+
+    CacheKey headerKey;
+    headerKey.hash[0] = key.hash[0];
+    headerKey.hash[1] = key.hash[1];
+    headerKey.size = size;
+    Header* const header = readCachedHeader(s, data, size, headerKey);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    std::shared_ptr<CachedImage> decoded = std::make_shared<CachedImage>();
+    const Status status = decode(header, *decoded);
+    delete header;
+    if (!status.ok())
+    {
+        return status;
+    }
+
+    CacheEntry entry;
+    entry.key = key;
+    entry.bytes = imageBytes(*decoded);
+    entry.image = decoded;
+    image = decoded;
+    std::lock_guard<std::mutex> lock(s.mutex);
+    insertEntry(s.images, entry, s.counters.evictions);
+    return Status();
+}
+
+DecodeCache::DecodeCache(const std::size_t memoryBudget, const std::size_t headerBudget)
+    : state(new DecodeCacheState)
+{
+    state->images.budget = memoryBudget;
+    state->headers.budget = headerBudget;
+    std::random_device random;
+    for (uint64_t& word : state->hashKey)
+    {
+        word = (static_cast<uint64_t>(random()) << 32) | random();
+    }
+}
+
+DecodeCache::~DecodeCache()
+{
+    delete state;
+}
+
+Status DecodeCache::decodeJPG(const unsigned char* const data,
+                              const std::size_t size,
+                              std::vector<unsigned char>& pixels,
+                              const Crop* const crop,
+                              ImageInfo* const info)
+{
+    CacheKey key;
+    key.decode = CachedDecode::Pixels;
+    if (crop != nullptr)
+    {
+        key.options[0] = 1;
+        key.options[1] = crop->x;
+        key.options[2] = crop->y;
+        key.options[3] = crop->width;
+        key.options[4] = crop->height;
+    }
+    const auto decode = [crop](Header* const header, CachedImage& image)
+    {
+        return decodeRows(header, storeRows(image.pixels), crop, &image.info);
+    };
+    std::shared_ptr<const CachedImage> image;
+    const Status status = decodeCached(*state, data, size, key, decode, image);
+    if (status.ok())
+    {
+        pixels = image->pixels;
+        if (info != nullptr)
+        {
+            *info = image->info;
+        }
+    }
+    return status;
+}
+
+Status DecodeCache::decodeResized(const unsigned char* const data,
+                                  const std::size_t size,
+                                  const ResizeOptions& options,
+                                  std::vector<unsigned char>& pixels,
+                                  ImageInfo* const info)
+{
+    CacheKey key;
+    key.decode = CachedDecode::Resized;
+    key.options[0] = options.width;
+    key.options[1] = options.height;
+    key.options[2] = static_cast<uint>(options.filter);
+    const auto decode = [&options](Header* const header, CachedImage& image)
+    {
+        return ::decodeResized(header, options, storeRows(image.pixels), &image.info);
+    };
+    std::shared_ptr<const CachedImage> image;
+    const Status status = decodeCached(*state, data, size, key, decode, image);
+    if (status.ok())
+    {
+        pixels = image->pixels;
+        if (info != nullptr)
+        {
+            *info = image->info;
+        }
+    }
+    return status;
+}
+
+Status DecodeCache::decodePlanar(const unsigned char* const data,
+                                 const std::size_t size,
+                                 PlanarImage& planar)
+{
+    CacheKey key;
+    key.decode = CachedDecode::Planar;
+    const auto decode = [](Header* const header, CachedImage& image)
+    {
+        return ::decodePlanar(header, image.planar);
+    };
+    std::shared_ptr<const CachedImage> image;
+    const Status status = decodeCached(*state, data, size, key, decode, image);
+    if (status.ok())
+    {
+        planar = image->planar;
+    }
+    return status;
+}
+
+void DecodeCache::clear()
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    clearEntries(state->images);
+    clearEntries(state->headers);
+}
+
+std::size_t DecodeCache::memoryUsed() const
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->images.bytes + state->headers.bytes;
+}
+
+CacheCounters DecodeCache::counters() const
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->counters;
+}
+
+// Coding units of a scan between the checkpoints a decode in tiles of columns MCUs needs, or in
+// bands as wide as the image when columns is the width of the image in MCUs.
+uint checkpointInterval(const Header* const header, const Scan& scan, const uint columns)
+{
+    if (columns >= header->mcuWidth)
+    {
+        return getScanUnits(header, scan).wide;
+    }
+    if (scan.numComponents.to_ulong() == 1)
+    {
+        return columns
+               * header->colorComponents[scan.componentIDs[0]].horizontalSamplingFactor.to_ulong();
+    }
+    return columns;
+}
+
+// Whether the restart intervals of a scan already let decoding start every interval coding units.
+bool checkpointsNeeded(const Scan& scan, const uint interval)
+{
+    return scan.restartInterval == 0 || scan.restartInterval > interval;
+}
+
+// Bytes a plan holds at once, which includes the output when storesPixels is true.
+std::size_t planBytes(const Header* const header, const DecodePlan& plan, const bool storesPixels)
+{
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const std::size_t mcuBytes = sizeof(MCU) * hMax * vMax;
+    std::size_t bytes = headerBytes(*header) + static_cast<std::size_t>(plan.width) * 3;
+    if (storesPixels)
+    {
+        bytes += static_cast<std::size_t>(plan.width) * plan.height * 3;
+    }
+    if (plan.strategy == DecodeStrategy::Tiled)
+    {
+        bytes += plan.tileColumns * mcuBytes + static_cast<std::size_t>(header->width) * 24 * vMax;
+    }
+    else
+    {
+        bytes += static_cast<std::size_t>(plan.bandRows) * header->mcuWidth * mcuBytes;
+    }
+    if (plan.bandRows < header->mcuHeight || plan.tileColumns < header->mcuWidth)
+    {
+        for (const Scan& scan : header->scans)
+        {
+            const ScanUnits units = getScanUnits(header, scan);
+            const uint interval = checkpointInterval(header, scan, plan.tileColumns);
+            // findCheckpoints builds the new checkpoints next to those the scan already has.
+            if (checkpointsNeeded(scan, interval))
+            {
+                bytes += (scan.checkpoints.size()
+                          + (static_cast<std::size_t>(units.wide) * units.high + interval - 1)
+                                / interval)
+                         * sizeof(Checkpoint);
+            }
+        }
+    }
+    return bytes;
+}
+
+// Choose the first strategy that keeps a decode within the budget: the whole image, the largest
+// bands or the widest tiles at full size, and then the largest bands at a smaller size when
+// scaling is allowed. Return false if none does.
+bool planDecode(const Header* const header,
+                const BudgetOptions& options,
+                const bool storesPixels,
+                DecodePlan& plan)
+{
+    const auto fits = [&](DecodePlan& candidate)
+    {
+        candidate.plannedBytes = planBytes(header, candidate, storesPixels);
+        return options.memoryBudget == 0 || candidate.plannedBytes <= options.memoryBudget;
+    };
+    plan = DecodePlan();
+    plan.width = header->width;
+    plan.height = header->height;
+    plan.bandRows = header->mcuHeight;
+    plan.tileColumns = header->mcuWidth;
+    if (fits(plan))
+    {
+        return true;
+    }
+    plan.strategy = DecodeStrategy::RowStreaming;
+    for (plan.bandRows = header->mcuHeight - 1; plan.bandRows > 0; --plan.bandRows)
+    {
+        if (fits(plan))
+        {
+            return true;
+        }
+    }
+    plan.strategy = DecodeStrategy::Tiled;
+    plan.bandRows = 1;
+    for (plan.tileColumns = header->mcuWidth - 1; plan.tileColumns > 0; --plan.tileColumns)
+    {
+        if (fits(plan))
+        {
+            return true;
+        }
+    }
+    if (!options.allowScaling)
+    {
+        return false;
+    }
+    plan.strategy = DecodeStrategy::Scaled;
+    plan.tileColumns = header->mcuWidth;
+    for (plan.scale = 4; plan.scale > 0; plan.scale /= 2)
+    {
+        plan.width = (header->width * plan.scale + 7) / 8;
+        plan.height = (header->height * plan.scale + 7) / 8;
+        for (plan.bandRows = header->mcuHeight; plan.bandRows > 0; --plan.bandRows)
+        {
+            if (fits(plan))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Decode the MCU rows [top, bottom) and columns [left, right) of the image into mcus and convert
+// them to RGB at scale / 8 of their size.
+bool decodeMCURegion(Header* const header,
+                     MCU* const mcus,
+                     const uint top,
+                     const uint bottom,
+                     const uint left,
+                     const uint right,
+                     const uint scale)
+{
+    const uint mcuPixelWidth = 8 * header->horizontalSamplingFactor.to_ulong();
+    const uint mcuPixelHeight = 8 * header->verticalSamplingFactor.to_ulong();
+    Crop crop;
+    crop.x = left * mcuPixelWidth;
+    crop.y = top * mcuPixelHeight;
+    crop.width = std::min(right * mcuPixelWidth, header->width) - crop.x;
+    crop.height = std::min(bottom * mcuPixelHeight, header->height) - crop.y;
+    if (!setCrop(header, crop) || !decodeHuffmanData(header, mcus, true))
+    {
+        return false;
+    }
+    scaledInverseDCT(header, mcus, 0, bottom - top, scale);
+    scaledYCbCrToRGB(header, mcus, 0, bottom - top, scale);
+    return true;
+}
+
+// Decode a JPG whose header has been read the way plan says, and set the peak bytes of the plan.
+Status runDecodePlan(Header* const header,
+                     DecodePlan& plan,
+                     const RowCallback& callback,
+                     const bool storesPixels)
+{
+    const uint hMax = header->horizontalSamplingFactor.to_ulong();
+    const uint vMax = header->verticalSamplingFactor.to_ulong();
+    const bool tiled = plan.strategy == DecodeStrategy::Tiled;
+    const uint bandRows = plan.bandRows;
+    const uint columns = plan.tileColumns;
+    plan.peakBytes = headerBytes(*header);
+    // Bands and tiles start decoding at the checkpoint before them rather than at the start of
+    // the scan.
+    if (bandRows < header->mcuHeight || columns < header->mcuWidth)
+    {
+        for (Scan& scan : header->scans)
+        {
+            const uint interval = checkpointInterval(header, scan, columns);
+            if (!checkpointsNeeded(scan, interval))
+            {
+                continue;
+            }
+            // The checkpoints the scan had are freed once the new ones are complete.
+            const std::size_t previousBytes = scan.checkpoints.capacity() * sizeof(Checkpoint);
+            if (!findCheckpoints(header, scan, interval))
+            {
+                return header->status;
+            }
+            plan.peakBytes = std::max(plan.peakBytes, headerBytes(*header) + previousBytes);
+        }
+    }
+
+    const std::size_t numMCUs = static_cast<std::size_t>(bandRows) * columns * hMax * vMax;
+    MCU* const mcus = new (std::nothrow) MCU[numMCUs];
+    if (mcus == nullptr)
+    {
+        return makeError(StatusCode::MemoryError, "Memory error");
+    }
+    // A tiled decode assembles every MCU row of pixels from its tiles before passing it on.
+    const std::size_t rowSize = static_cast<std::size_t>(header->width) * 3;
+    std::vector<unsigned char> band(tiled ? rowSize * 8 * vMax : 0);
+    std::vector<unsigned char> row(static_cast<std::size_t>(plan.width) * 3);
+    // From here on the header, the MCUs and the rows are held until the end, and the output from
+    // the first row.
+    std::size_t decodeBytes = headerBytes(*header) + numMCUs * sizeof(MCU) + band.capacity()
+                              + row.capacity();
+    if (storesPixels)
+    {
+        decodeBytes += static_cast<std::size_t>(plan.width) * plan.height * 3;
+    }
+    plan.peakBytes = std::max(plan.peakBytes, decodeBytes);
+    Status status;
+    uint y = 0;
+    for (uint top = 0; top < header->mcuHeight && status.ok(); top += bandRows)
+    {
+        const uint bottom = std::min(top + bandRows, header->mcuHeight);
+        const uint firstY = top * vMax * plan.scale;
+        const uint lastY = std::min(bottom * vMax * plan.scale, plan.height);
+        if (tiled)
+        {
+            for (uint left = 0; left < header->mcuWidth && status.ok(); left += columns)
+            {
+                if (!decodeMCURegion(header,
+                                     mcus,
+                                     top,
+                                     bottom,
+                                     left,
+                                     std::min(left + columns, header->mcuWidth),
+                                     8))
+                {
+                    status = header->status;
+                    break;
+                }
+                for (uint i = 0; i < header->crop.height; ++i)
+                {
+                    copyRow(header, mcus, i, band.data() + i * rowSize + header->crop.x * 3);
+                }
+            }
+        }
+        else if (!decodeMCURegion(header, mcus, top, bottom, 0, header->mcuWidth, plan.scale))
+        {
+            status = header->status;
+        }
+        for (; y < lastY && status.ok(); ++y)
+        {
+            const unsigned char* pixels = row.data();
+            if (tiled)
+            {
+                pixels = band.data() + (y - firstY) * rowSize;
+            }
+            else if (plan.scale == 8)
+            {
+                copyRow(header, mcus, y - firstY, row.data());
+            }
+            else
+            {
+                const MCU* const blocks = mcus + (y - firstY) / plan.scale * header->blockWidthReal;
+                const uint pixelRow = (y % plan.scale) * 8;
+                for (uint x = 0; x < plan.width; ++x)
+                {
+                    const MCU& mcu = blocks[x / plan.scale];
+                    const uint i = pixelRow + x % plan.scale;
+                    row[x * 3] = static_cast<unsigned char>(mcu.r[i]);
+                    row[x * 3 + 1] = static_cast<unsigned char>(mcu.g[i]);
+                    row[x * 3 + 2] = static_cast<unsigned char>(mcu.b[i]);
+                }
+            }
+            if (!callback(y, pixels, plan.width, plan.height))
+            {
+                status = makeError(StatusCode::InvalidArgument, "Decoding stopped by row callback");
+            }
+        }
+    }
+    delete[] mcus;
+    return status;
+}
+
+// Decode a JPG with decodeWithBudget, counting the output against the budget when storesPixels is
+// true.
+Status decodeBudgeted(std::istream& input,
+                      const BudgetOptions& options,
+                      const RowCallback& callback,
+                      const bool storesPixels,
+                      DecodePlan* const plan,
+                      ImageInfo* const info)
+{
+    // The compressed data is read into the header, so a stream too large for the budget is not
+    // read at all.
+    const std::streampos start = input.tellg();
+    if (options.memoryBudget != 0 && start != std::streampos(-1))
+    {
+        input.seekg(0, std::ios::end);
+        const std::streamoff remaining = input.tellg() - start;
+        input.clear();
+        input.seekg(start);
+        if (remaining > 0
+            && sizeof(Header) + static_cast<std::size_t>(remaining) > options.memoryBudget)
+        {
+            return makeError(StatusCode::MemoryError, "Image does not fit in the memory budget");
+        }
+    }
+
+    Header* header = readJPG(input);
+    if (header == nullptr)
+    {
+        return Status{StatusCode::MemoryError, "Memory error"};
+    }
+    if (!header->valid)
+    {
+        const Status status = header->status;
+        delete header;
+        return status;
+    }
+    DecodePlan chosen;
+    if (!planDecode(header, options, storesPixels, chosen))
+    {
+        delete header;
+        return makeError(StatusCode::MemoryError, "Image does not fit in the memory budget");
+    }
+    if (info != nullptr)
+    {
+        setImageInfo(header, *info);
+    }
+    const Status status = runDecodePlan(header, chosen, callback, storesPixels);
+    if (plan != nullptr)
+    {
+        *plan = chosen;
+    }
+    delete header;
+    return status;
+}
+
+Status decodeWithBudget(std::istream& input,
+                        const BudgetOptions& options,
+                        const RowCallback& callback,
+                        DecodePlan* const plan,
+                        ImageInfo* const info)
+{
+    return decodeBudgeted(input, options, callback, false, plan, info);
+}
+
+Status decodeWithBudget(const unsigned char* const data,
+                        const std::size_t size,
+                        const BudgetOptions& options,
+                        const RowCallback& callback,
+                        DecodePlan* const plan,
+                        ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeBudgeted(input, options, callback, false, plan, info);
+}
+
+Status decodeWithBudget(const std::string& filename,
+                        const BudgetOptions& options,
+                        std::vector<unsigned char>& pixels,
+                        DecodePlan* const plan,
+                        ImageInfo* const info)
+{
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return makeError(StatusCode::FileError, "Error opening input file");
+    }
+    return decodeBudgeted(inFile, options, storeRows(pixels), true, plan, info);
+}
+
+Status decodeWithBudget(const unsigned char* const data,
+                        const std::size_t size,
+                        const BudgetOptions& options,
+                        std::vector<unsigned char>& pixels,
+                        DecodePlan* const plan,
+                        ImageInfo* const info)
+{
+    MemoryBuffer buffer(data, size);
+    std::istream input(&buffer);
+    return decodeBudgeted(input, options, storeRows(pixels), true, plan, info);
+}
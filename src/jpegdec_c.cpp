@@ -0,0 +1,666 @@
+#include <cstring>
+#include <fstream>
+
+#include "jpegdec.h"
+#include "jpegdec_c.h"
+
+thread_local std::string lastErrorMessage;
+
+// Remember the message of a failed status for jpegdec_error_message and return its code.
+int returnStatus(const Status& status)
+{
+    if (!status.ok())
+    {
+        lastErrorMessage = status.message;
+    }
+    return static_cast<int>(status.code);
+}
+
+int returnProbe(const Status& status, const ImageInfo& imageInfo, jpegdec_info* const info)
+{
+    if (status.ok())
+    {
+        info->width = imageInfo.width;
+        info->height = imageInfo.height;
+        info->num_components = imageInfo.numComponents;
+    }
+    return returnStatus(status);
+}
+
+int jpegdec_probe_file(const char* const filename, jpegdec_info* const info)
+{
+    if (filename == nullptr || info == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    ImageInfo imageInfo;
+    return returnProbe(probeJPG(std::string(filename), imageInfo), imageInfo, info);
+}
+
+int jpegdec_probe_memory(const unsigned char* const data,
+                         const size_t size,
+                         jpegdec_info* const info)
+{
+    if (data == nullptr || info == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    ImageInfo imageInfo;
+    return returnProbe(probeJPG(data, size, imageInfo), imageInfo, info);
+}
+
+int returnValidation(const Status& status,
+                     const ErrorLocation& errorLocation,
+                     jpegdec_error_location* const location)
+{
+    if (location != nullptr)
+    {
+        location->marker = errorLocation.marker;
+        location->marker_offset = errorLocation.markerOffset;
+        location->in_scan = errorLocation.inScan;
+        location->scan = errorLocation.scan;
+        location->unit = errorLocation.unit;
+        location->bit_offset = errorLocation.bitOffset;
+    }
+    return returnStatus(status);
+}
+
+int jpegdec_validate_file(const char* const filename, jpegdec_error_location* const location)
+{
+    if (filename == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    ErrorLocation errorLocation;
+    return returnValidation(validateJPG(std::string(filename), &errorLocation),
+                            errorLocation,
+                            location);
+}
+
+int jpegdec_validate_memory(const unsigned char* const data,
+                            const size_t size,
+                            jpegdec_error_location* const location)
+{
+    if (data == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    ErrorLocation errorLocation;
+    return returnValidation(validateJPG(data, size, &errorLocation), errorLocation, location);
+}
+
+// Decode straight into the caller's buffer, failing before the first row if it is too small.
+int decodeToPixels(const std::function<Status(const RowCallback&)>& decode,
+                   unsigned char* const pixels,
+                   const size_t pixelsSize)
+{
+    bool tooSmall = false;
+    const RowCallback storeRow = [&](const uint y,
+                                     const unsigned char* const rgb,
+                                     const uint width,
+                                     const uint height)
+    {
+        const size_t rowSize = static_cast<size_t>(width) * 3;
+        if (rowSize * height > pixelsSize)
+        {
+            tooSmall = true;
+            return false;
+        }
+        std::memcpy(pixels + y * rowSize, rgb, rowSize);
+        return true;
+    };
+    const Status status = decode(storeRow);
+    if (tooSmall)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Pixel buffer too small"});
+    }
+    return returnStatus(status);
+}
+
+int jpegdec_decode_file(const char* const filename,
+                        unsigned char* const pixels,
+                        const size_t pixels_size)
+{
+    if (filename == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return returnStatus({StatusCode::FileError, "Error opening input file"});
+    }
+    const auto decodeFile = [&inFile](const RowCallback& callback)
+    {
+        return decodeJPG(inFile, callback);
+    };
+    return decodeToPixels(decodeFile, pixels, pixels_size);
+}
+
+int jpegdec_decode_memory(const unsigned char* const data,
+                          const size_t size,
+                          unsigned char* const pixels,
+                          const size_t pixels_size)
+{
+    if (data == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    const auto decodeMemory = [data, size](const RowCallback& callback)
+    {
+        return decodeJPG(data, size, callback);
+    };
+    return decodeToPixels(decodeMemory, pixels, pixels_size);
+}
+
+TensorOptions getTensorOptions(const jpegdec_tensor_options* const options)
+{
+    TensorOptions tensorOptions;
+    tensorOptions.width = options->width;
+    tensorOptions.height = options->height;
+    for (uint c = 0; c < 3; ++c)
+    {
+        tensorOptions.mean[c] = options->mean[c];
+        tensorOptions.std[c] = options->std[c];
+    }
+    tensorOptions.layout = options->layout == JPEGDEC_LAYOUT_HWC ? TensorLayout::HWC
+                                                                 : TensorLayout::CHW;
+    return tensorOptions;
+}
+
+int jpegdec_decode_tensor_file(const char* const filename,
+                               const jpegdec_tensor_options* const options,
+                               float* const tensor,
+                               const size_t tensor_size)
+{
+    if (filename == nullptr || options == nullptr || tensor == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    return returnStatus(
+        decodeTensor(std::string(filename), getTensorOptions(options), tensor, tensor_size));
+}
+
+int jpegdec_decode_tensor_memory(const unsigned char* const data,
+                                 const size_t size,
+                                 const jpegdec_tensor_options* const options,
+                                 float* const tensor,
+                                 const size_t tensor_size)
+{
+    if (data == nullptr || options == nullptr || tensor == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    return returnStatus(decodeTensor(data, size, getTensorOptions(options), tensor, tensor_size));
+}
+
+ResizeOptions getResizeOptions(const unsigned int width,
+                               const unsigned int height,
+                               const int filter)
+{
+    ResizeOptions options;
+    options.width = width;
+    options.height = height;
+    options.filter = filter == JPEGDEC_FILTER_LANCZOS3 ? ResizeFilter::Lanczos3
+                                                       : ResizeFilter::Area;
+    return options;
+}
+
+int jpegdec_decode_resized_file(const char* const filename,
+                                const unsigned int width,
+                                const unsigned int height,
+                                const int filter,
+                                unsigned char* const pixels,
+                                const size_t pixels_size)
+{
+    if (filename == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return returnStatus({StatusCode::FileError, "Error opening input file"});
+    }
+    const ResizeOptions options = getResizeOptions(width, height, filter);
+    const auto decodeFile = [&inFile, &options](const RowCallback& callback)
+    {
+        return decodeResized(inFile, options, callback);
+    };
+    return decodeToPixels(decodeFile, pixels, pixels_size);
+}
+
+int jpegdec_decode_resized_memory(const unsigned char* const data,
+                                  const size_t size,
+                                  const unsigned int width,
+                                  const unsigned int height,
+                                  const int filter,
+                                  unsigned char* const pixels,
+                                  const size_t pixels_size)
+{
+    if (data == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    const ResizeOptions options = getResizeOptions(width, height, filter);
+    const auto decodeMemory = [data, size, &options](const RowCallback& callback)
+    {
+        return decodeResized(data, size, options, callback);
+    };
+    return decodeToPixels(decodeMemory, pixels, pixels_size);
+}
+
+void setDecodePlan(const DecodePlan& decodePlan, jpegdec_decode_plan* const plan)
+{
+    if (plan != nullptr)
+    {
+        plan->strategy = static_cast<int>(decodePlan.strategy);
+        plan->width = decodePlan.width;
+        plan->height = decodePlan.height;
+        plan->band_rows = decodePlan.bandRows;
+        plan->tile_columns = decodePlan.tileColumns;
+        plan->planned_bytes = decodePlan.plannedBytes;
+        plan->peak_bytes = decodePlan.peakBytes;
+    }
+}
+
+int jpegdec_decode_budget_file(const char* const filename,
+                               const size_t memory_budget,
+                               const int allow_scaling,
+                               unsigned char* const pixels,
+                               const size_t pixels_size,
+                               jpegdec_decode_plan* const plan)
+{
+    if (filename == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open())
+    {
+        return returnStatus({StatusCode::FileError, "Error opening input file"});
+    }
+    BudgetOptions options;
+    options.memoryBudget = memory_budget;
+    options.allowScaling = allow_scaling != 0;
+    DecodePlan decodePlan;
+    const auto decodeFile = [&inFile, &options, &decodePlan](const RowCallback& callback)
+    {
+        return decodeWithBudget(inFile, options, callback, &decodePlan);
+    };
+    const int code = decodeToPixels(decodeFile, pixels, pixels_size);
+    setDecodePlan(decodePlan, plan);
+    return code;
+}
+
+int jpegdec_decode_budget_memory(const unsigned char* const data,
+                                 const size_t size,
+                                 const size_t memory_budget,
+                                 const int allow_scaling,
+                                 unsigned char* const pixels,
+                                 const size_t pixels_size,
+                                 jpegdec_decode_plan* const plan)
+{
+    if (data == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    BudgetOptions options;
+    options.memoryBudget = memory_budget;
+    options.allowScaling = allow_scaling != 0;
+    DecodePlan decodePlan;
+    const auto decodeMemory = [data, size, &options, &decodePlan](const RowCallback& callback)
+    {
+        return decodeWithBudget(data, size, options, callback, &decodePlan);
+    };
+    const int code = decodeToPixels(decodeMemory, pixels, pixels_size);
+    setDecodePlan(decodePlan, plan);
+    return code;
+}
+
+int returnSummary(const Status& status,
+                  const ImageSummary& imageSummary,
+                  jpegdec_summary* const summary,
+                  unsigned char* const preview,
+                  const size_t previewSize)
+{
+    if (!status.ok())
+    {
+        return returnStatus(status);
+    }
+    summary->preview_width = imageSummary.previewWidth;
+    summary->preview_height = imageSummary.previewHeight;
+    std::memcpy(summary->average_color, imageSummary.averageColor, 3);
+    std::memcpy(summary->dominant_color, imageSummary.dominantColor, 3);
+    summary->hash = imageSummary.hash;
+    if (preview != nullptr)
+    {
+        if (imageSummary.preview.size() > previewSize)
+        {
+            return returnStatus({StatusCode::InvalidArgument, "Pixel buffer too small"});
+        }
+        std::memcpy(preview, imageSummary.preview.data(), imageSummary.preview.size());
+    }
+    return returnStatus(status);
+}
+
+int jpegdec_summarize_file(const char* const filename,
+                           jpegdec_summary* const summary,
+                           unsigned char* const preview,
+                           const size_t preview_size)
+{
+    if (filename == nullptr || summary == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    ImageSummary imageSummary;
+    return returnSummary(summarizeJPG(std::string(filename), imageSummary),
+                         imageSummary,
+                         summary,
+                         preview,
+                         preview_size);
+}
+
+int jpegdec_summarize_memory(const unsigned char* const data,
+                             const size_t size,
+                             jpegdec_summary* const summary,
+                             unsigned char* const preview,
+                             const size_t preview_size)
+{
+    if (data == nullptr || summary == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    ImageSummary imageSummary;
+    return returnSummary(summarizeJPG(data, size, imageSummary),
+                         imageSummary,
+                         summary,
+                         preview,
+                         preview_size);
+}
+
+unsigned int jpegdec_hash_distance(const unsigned long long a, const unsigned long long b)
+{
+    return hashDistance(a, b);
+}
+
+int returnExif(const Status& status, const Exif& imageExif, jpegdec_exif* const exif)
+{
+    if (status.ok())
+    {
+        exif->present = imageExif.present;
+        exif->orientation = imageExif.orientation;
+        exif->thumbnail_offset = imageExif.thumbnailOffset;
+        exif->thumbnail_size = imageExif.thumbnail.size();
+    }
+    return returnStatus(status);
+}
+
+int jpegdec_read_exif_file(const char* const filename, jpegdec_exif* const exif)
+{
+    if (filename == nullptr || exif == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    Exif imageExif;
+    return returnExif(readExif(std::string(filename), imageExif), imageExif, exif);
+}
+
+int jpegdec_read_exif_memory(const unsigned char* const data,
+                             const size_t size,
+                             jpegdec_exif* const exif)
+{
+    if (data == nullptr || exif == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    Exif imageExif;
+    return returnExif(readExif(data, size, imageExif), imageExif, exif);
+}
+
+// Helper function to copy a JPG the library wrote to the caller's buffer.
+int returnJPG(const std::vector<unsigned char>& data,
+              unsigned char* const jpg,
+              const size_t jpgSize,
+              size_t* const written)
+{
+    if (data.size() > jpgSize)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Output buffer too small"});
+    }
+    std::memcpy(jpg, data.data(), data.size());
+    *written = data.size();
+    return returnStatus(Status());
+}
+
+// Helper function to check the arguments of the encoder, which are unsigned in the C++ interface.
+bool encodeOptions(const int quality, const int subsampling, EncodeOptions& options)
+{
+    if (quality < 1 || quality > 100 || subsampling < 0)
+    {
+        return false;
+    }
+    options.quality = quality;
+    options.subsampling = subsampling;
+    return true;
+}
+
+int jpegdec_encode_file(const unsigned char* const pixels,
+                        const unsigned int width,
+                        const unsigned int height,
+                        const int quality,
+                        const int subsampling,
+                        const char* const filename)
+{
+    if (pixels == nullptr || filename == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    EncodeOptions options;
+    if (!encodeOptions(quality, subsampling, options))
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Invalid encoding options"});
+    }
+    return returnStatus(encodeJPG(pixels, width, height, options, std::string(filename)));
+}
+
+int jpegdec_encode_memory(const unsigned char* const pixels,
+                          const unsigned int width,
+                          const unsigned int height,
+                          const int quality,
+                          const int subsampling,
+                          unsigned char* const jpg,
+                          const size_t jpg_size,
+                          size_t* const written)
+{
+    if (pixels == nullptr || jpg == nullptr || written == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    EncodeOptions options;
+    if (!encodeOptions(quality, subsampling, options))
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Invalid encoding options"});
+    }
+    std::vector<unsigned char> data;
+    const Status status = encodeJPG(pixels, width, height, options, data);
+    if (!status.ok())
+    {
+        return returnStatus(status);
+    }
+    return returnJPG(data, jpg, jpg_size, written);
+}
+
+int jpegdec_optimize_file(const char* const filename, const char* const output_filename)
+{
+    if (filename == nullptr || output_filename == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    std::vector<unsigned char> data;
+    const Status status = optimizeJPG(std::string(filename), data);
+    if (!status.ok())
+    {
+        return returnStatus(status);
+    }
+    std::ofstream outFile = std::ofstream(output_filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open())
+    {
+        return returnStatus({StatusCode::FileError, "Failed opening output file"});
+    }
+    outFile.write(reinterpret_cast<const char*>(data.data()), data.size());
+    outFile.close();
+    if (!outFile)
+    {
+        return returnStatus({StatusCode::FileError, "Failed writing output file"});
+    }
+    return returnStatus(status);
+}
+
+int jpegdec_optimize_memory(const unsigned char* const data,
+                            const size_t size,
+                            unsigned char* const jpg,
+                            const size_t jpg_size,
+                            size_t* const written)
+{
+    if (data == nullptr || jpg == nullptr || written == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    std::vector<unsigned char> optimized;
+    const Status status = optimizeJPG(data, size, optimized);
+    if (!status.ok())
+    {
+        return returnStatus(status);
+    }
+    return returnJPG(optimized, jpg, jpg_size, written);
+}
+
+struct jpegdec_decoder
+{
+    IncrementalDecoder decoder;
+
+    explicit jpegdec_decoder(const RowCallback& callback) : decoder(callback)
+    {
+    }
+};
+
+jpegdec_decoder* jpegdec_decoder_create(const jpegdec_row_callback callback, void* const user_data)
+{
+    if (callback == nullptr)
+    {
+        returnStatus({StatusCode::InvalidArgument, "Null argument"});
+        return nullptr;
+    }
+    const RowCallback rowCallback = [callback, user_data](const uint y,
+                                                          const unsigned char* const rgb,
+                                                          const uint width,
+                                                          const uint height)
+    {
+        return callback(y, rgb, width, height, user_data) != 0;
+    };
+    jpegdec_decoder* decoder = new (std::nothrow) jpegdec_decoder(rowCallback);
+    if (decoder == nullptr)
+    {
+        returnStatus({StatusCode::MemoryError, "Memory error"});
+    }
+    return decoder;
+}
+
+int jpegdec_decoder_push(jpegdec_decoder* const decoder,
+                         const unsigned char* const data,
+                         const size_t size)
+{
+    if (decoder == nullptr || (data == nullptr && size != 0))
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    return returnStatus(decoder->decoder.push(data, size));
+}
+
+int jpegdec_decoder_finish(jpegdec_decoder* const decoder)
+{
+    if (decoder == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    return returnStatus(decoder->decoder.finish());
+}
+
+void jpegdec_decoder_destroy(jpegdec_decoder* const decoder)
+{
+    delete decoder;
+}
+
+struct jpegdec_cache
+{
+    DecodeCache cache;
+
+    jpegdec_cache(const size_t memoryBudget, const size_t headerBudget)
+        : cache(memoryBudget, headerBudget)
+    {
+    }
+};
+
+jpegdec_cache* jpegdec_cache_create(const size_t memory_budget, const size_t header_budget)
+{
+    jpegdec_cache* cache = new (std::nothrow) jpegdec_cache(memory_budget, header_budget);
+    if (cache == nullptr)
+    {
+        returnStatus({StatusCode::MemoryError, "Memory error"});
+    }
+    return cache;
+}
+
+int jpegdec_cache_decode_memory(jpegdec_cache* const cache,
+                                const unsigned char* const data,
+                                const size_t size,
+                                unsigned char* const pixels,
+                                const size_t pixels_size)
+{
+    if (cache == nullptr || data == nullptr || pixels == nullptr)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Null argument"});
+    }
+    std::vector<unsigned char> decoded;
+    const Status status = cache->cache.decodeJPG(data, size, decoded);
+    if (!status.ok())
+    {
+        return returnStatus(status);
+    }
+    if (decoded.size() > pixels_size)
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Pixel buffer too small"});
+    }
+    std::memcpy(pixels, decoded.data(), decoded.size());
+    return returnStatus(Status());
+}
+
+void jpegdec_cache_destroy(jpegdec_cache* const cache)
+{
+    delete cache;
+}
+
+const char* jpegdec_error_message(void)
+{
+    return lastErrorMessage.c_str();
+}
+
+int jpegdec_set_cpu_level(const char* const level)
+{
+    CpuLevel cpuLevel;
+    if (level == nullptr || !parseCpuLevel(level, cpuLevel))
+    {
+        return returnStatus({StatusCode::InvalidArgument, "Unknown CPU level"});
+    }
+    if (!setCpuLevel(cpuLevel))
+    {
+        return returnStatus({StatusCode::Unsupported, "CPU level not supported by the processor"});
+    }
+    return returnStatus(Status());
+}
+
+const char* jpegdec_cpu_level(void)
+{
+    return cpuLevelName(getCpuLevel());
+}
@@ -0,0 +1,1005 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+
+#include "kernels.h"
+#include "status.h"
+
+// The x86 kernels are compiled with the target attributes of GCC and Clang, so that the rest of
+// the library is built for the baseline instruction set and the kernels are only called on
+// processors that support them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPEG_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE inline
+#endif
+
+// Factors of the AAN (Arai, Agui and Nakajima) inverse DCT.
+const float idctM0 = 2.0 * std::cos(1.0 / 16.0 * 2.0 * M_PI);
+const float idctM1 = 2.0 * std::cos(2.0 / 16.0 * 2.0 * M_PI);
+const float idctM3 = 2.0 * std::cos(2.0 / 16.0 * 2.0 * M_PI);
+const float idctM5 = 2.0 * std::cos(3.0 / 16.0 * 2.0 * M_PI);
+const float idctM2 = idctM0 - idctM5;
+const float idctM4 = idctM0 + idctM5;
+
+const float idctS0 = std::cos(0.0 / 16.0 * M_PI) / std::sqrt(8);
+const float idctS1 = std::cos(1.0 / 16.0 * M_PI) / 2.0;
+const float idctS2 = std::cos(2.0 / 16.0 * M_PI) / 2.0;
+const float idctS3 = std::cos(3.0 / 16.0 * M_PI) / 2.0;
+const float idctS4 = std::cos(4.0 / 16.0 * M_PI) / 2.0;
+const float idctS5 = std::cos(5.0 / 16.0 * M_PI) / 2.0;
+const float idctS6 = std::cos(6.0 / 16.0 * M_PI) / 2.0;
+const float idctS7 = std::cos(7.0 / 16.0 * M_PI) / 2.0;
+
+// One 8-point inverse DCT. T is float, or a vector of floats that transforms several columns or
+// rows at once with exactly the same arithmetic, which keeps every level's output identical.
+template <typename T>
+KERNEL_INLINE void inverseDCT8(const T* const in, T* const out)
+{
+    const T g0 = in[0] * idctS0;
+    const T g1 = in[4] * idctS4;
+    const T g2 = in[2] * idctS2;
+    const T g3 = in[6] * idctS6;
+    const T g4 = in[5] * idctS5;
+    const T g5 = in[1] * idctS1;
+    const T g6 = in[7] * idctS7;
+    const T g7 = in[3] * idctS3;
+
+    const T f4 = g4 - g7;
+    const T f5 = g5 + g6;
+    const T f6 = g5 - g6;
+    const T f7 = g4 + g7;
+
+    const T e2 = g2 - g3;
+    const T e3 = g2 + g3;
+    const T e5 = f5 - f7;
+    const T e7 = f5 + f7;
+    const T e8 = f4 + f6;
+
+    const T d2 = e2 * idctM1;
+    const T d4 = f4 * idctM2;
+    const T d5 = e5 * idctM3;
+    const T d6 = f6 * idctM4;
+    const T d8 = e8 * idctM5;
+
+    const T c0 = g0 + g1;
+    const T c1 = g0 - g1;
+    const T c2 = d2 - e3;
+    const T c4 = d4 + d8;
+    const T c5 = d5 + e7;
+    const T c6 = d6 - d8;
+    const T c8 = c5 - c6;
+
+    const T b0 = c0 + e3;
+    const T b1 = c1 + c2;
+    const T b2 = c1 - c2;
+    const T b3 = c0 - e3;
+    const T b4 = c4 - c8;
+    const T b5 = c8;
+    const T b6 = c6 - e7;
+    const T b7 = e7;
+
+    out[0] = b0 + b7;
+    out[1] = b1 + b6;
+    out[2] = b2 + b5;
+    out[3] = b3 + b4;
+    out[4] = b3 - b4;
+    out[5] = b2 - b5;
+    out[6] = b1 - b6;
+    out[7] = b0 - b7;
+}
+
+// Inverse DCT of the columns and then the rows of a block.
+void inverseDCTScalar(int* const block)
+{
+    float intermediate[64];
+    float result[64];
+    for (uint pass = 0; pass < 2; ++pass)
+    {
+        // The first pass reads columns of the coefficients, the second reads rows of the
+        // intermediate results.
+        for (uint i = 0; i < 8; ++i)
+        {
+            const uint base = (pass == 0) ? i : i * 8;
+            const uint stride = (pass == 0) ? 8 : 1;
+            float in[8];
+            float out[8];
+            for (uint j = 0; j < 8; ++j)
+            {
+                const uint index = base + j * stride;
+                in[j] = (pass == 0) ? block[index] : intermediate[index];
+            }
+            inverseDCT8(in, out);
+            float* const destination = (pass == 0) ? intermediate : result;
+            for (uint j = 0; j < 8; ++j)
+            {
+                destination[base + j * stride] = out[j];
+            }
+        }
+    }
+    for (uint i = 0; i < 64; ++i)
+    {
+        block[i] = static_cast<int>(std::lround(result[i]));
+    }
+}
+
+// Factors of the integer forward DCT of Loeffler, Ligtenberg and Moschytz, as in the IJG library,
+// with fdctConstBits fractional bits. The first pass keeps fdctPassBits more bits than its input,
+// which the second pass removes, and the result is 8 times the DCT coefficients.
+const int fdctConstBits = 13;
+const int fdctPassBits = 2;
+const int fdct0_298631336 = 2446;
+const int fdct0_390180644 = 3196;
+const int fdct0_541196100 = 4433;
+const int fdct0_765366865 = 6270;
+const int fdct0_899976223 = 7373;
+const int fdct1_175875602 = 9633;
+const int fdct1_501321110 = 12299;
+const int fdct1_847759065 = 15137;
+const int fdct1_961570560 = 16069;
+const int fdct2_053119869 = 16819;
+const int fdct2_562915447 = 20995;
+const int fdct3_072711026 = 25172;
+
+// One 8-point forward DCT of the first or second pass. T is int, or a vector of ints that
+// transforms several columns or rows at once with exactly the same arithmetic.
+template <typename T, bool first>
+KERNEL_INLINE void forwardDCT8(const T* const in, T* const out)
+{
+    const int shift = first ? fdctConstBits - fdctPassBits : fdctConstBits + fdctPassBits;
+    const int half = 1 << (shift - 1);
+
+    const T tmp0 = in[0] + in[7];
+    const T tmp7 = in[0] - in[7];
+    const T tmp1 = in[1] + in[6];
+    const T tmp6 = in[1] - in[6];
+    const T tmp2 = in[2] + in[5];
+    const T tmp5 = in[2] - in[5];
+    const T tmp3 = in[3] + in[4];
+    const T tmp4 = in[3] - in[4];
+
+    const T tmp10 = tmp0 + tmp3;
+    const T tmp13 = tmp0 - tmp3;
+    const T tmp11 = tmp1 + tmp2;
+    const T tmp12 = tmp1 - tmp2;
+
+    if (first)
+    {
+        // Multiplied rather than shifted, as the sums may be negative.
+        out[0] = (tmp10 + tmp11) * (1 << fdctPassBits);
+        out[4] = (tmp10 - tmp11) * (1 << fdctPassBits);
+    }
+    else
+    {
+        out[0] = (tmp10 + tmp11 + (1 << (fdctPassBits - 1))) >> fdctPassBits;
+        out[4] = (tmp10 - tmp11 + (1 << (fdctPassBits - 1))) >> fdctPassBits;
+    }
+
+    const T z1 = (tmp12 + tmp13) * fdct0_541196100;
+    out[2] = (z1 + tmp13 * fdct0_765366865 + half) >> shift;
+    out[6] = (z1 - tmp12 * fdct1_847759065 + half) >> shift;
+
+    // The odd part.
+    const T z5 = (tmp4 + tmp6 + tmp5 + tmp7) * fdct1_175875602;
+    const T o1 = (tmp4 + tmp7) * -fdct0_899976223;
+    const T o2 = (tmp5 + tmp6) * -fdct2_562915447;
+    const T o3 = (tmp4 + tmp6) * -fdct1_961570560 + z5;
+    const T o4 = (tmp5 + tmp7) * -fdct0_390180644 + z5;
+    out[7] = (tmp4 * fdct0_298631336 + o1 + o3 + half) >> shift;
+    out[5] = (tmp5 * fdct2_053119869 + o2 + o4 + half) >> shift;
+    out[3] = (tmp6 * fdct3_072711026 + o2 + o3 + half) >> shift;
+    out[1] = (tmp7 * fdct1_501321110 + o1 + o4 + half) >> shift;
+}
+
+// Forward DCT of the columns and then the rows of a block.
+void forwardDCTScalar(int* const block)
+{
+    int intermediate[64];
+    for (uint i = 0; i < 8; ++i)
+    {
+        int in[8];
+        int out[8];
+        for (uint j = 0; j < 8; ++j)
+        {
+            in[j] = block[j * 8 + i];
+        }
+        forwardDCT8<int, true>(in, out);
+        for (uint j = 0; j < 8; ++j)
+        {
+            intermediate[j * 8 + i] = out[j];
+        }
+    }
+    for (uint i = 0; i < 8; ++i)
+    {
+        forwardDCT8<int, false>(intermediate + i * 8, block + i * 8);
+    }
+}
+
+int clampSample(const float v)
+{
+    return std::min(std::max(static_cast<int>(std::lround(v)), 0), 255);
+}
+
+void YCbCrToRGBScalar(MCU& mcu, const int* const cb, const int* const cr)
+{
+    for (uint i = 0; i < 64; ++i)
+    {
+        const float lum = mcu.y[i];
+        const float blue = cb[i];
+        const float red = cr[i];
+        mcu.r[i] = clampSample(lum + 1.402f * red + 128);
+        mcu.g[i] = clampSample(lum - 0.344136f * blue - 0.714136f * red + 128);
+        mcu.b[i] = clampSample(lum + 1.772f * blue + 128);
+    }
+}
+
+void upsampleScalar(const int* const chroma,
+                    const uint h,
+                    const uint v,
+                    const uint hMax,
+                    const uint vMax,
+                    int* const out)
+{
+    for (uint y = 0; y < 8; ++y)
+    {
+        for (uint x = 0; x < 8; ++x)
+        {
+            out[y * 8 + x] = chroma[((v * 8 + y) / vMax) * 8 + (h * 8 + x) / hMax];
+        }
+    }
+}
+
+std::size_t findMarkerScalar(const unsigned char* const data, const std::size_t size)
+{
+    std::size_t i = 0;
+    while (i < size && data[i] != 0xFF)
+    {
+        ++i;
+    }
+    return i;
+}
+
+void packPixelsScalar(const int* const first,
+                      const int* const second,
+                      const int* const third,
+                      const uint count,
+                      unsigned char* const out)
+{
+    for (uint i = 0; i < count; ++i)
+    {
+        out[i * 3 + 0] = first[i];
+        out[i * 3 + 1] = second[i];
+        out[i * 3 + 2] = third[i];
+    }
+}
+
+void addWeightedRowScalar(const float* const in,
+                          const float weight,
+                          const uint count,
+                          float* const out)
+{
+    for (uint i = 0; i < count; ++i)
+    {
+        out[i] += in[i] * weight;
+    }
+}
+
+// The conversion of the IJG library in 16 fractional bits, with Y less 128 so that all three are
+// centered on 0 like the samples of the inverse DCT.
+void RGBToYCbCrScalar(const unsigned char* const rgb,
+                      const uint count,
+                      int* const y,
+                      int* const cb,
+                      int* const cr)
+{
+    for (uint i = 0; i < count; ++i)
+    {
+        const int r = rgb[i * 3];
+        const int g = rgb[i * 3 + 1];
+        const int b = rgb[i * 3 + 2];
+        y[i] = ((19595 * r + 38470 * g + 7471 * b + 32768) >> 16) - 128;
+        cb[i] = (-11059 * r - 21709 * g + 32768 * b + 32767) >> 16;
+        cr[i] = (32768 * r - 27439 * g - 5329 * b + 32767) >> 16;
+    }
+}
+
+// Each output is the sum of its h x v samples plus half their number, divided by their number
+// and rounded down.
+void downsampleScalar(const int* const in,
+                      const uint stride,
+                      const uint h,
+                      const uint v,
+                      int* const out)
+{
+    const int count = h * v;
+    for (uint y = 0; y < 8; ++y)
+    {
+        for (uint x = 0; x < 8; ++x)
+        {
+            int sum = count / 2;
+            for (uint j = 0; j < v; ++j)
+            {
+                for (uint i = 0; i < h; ++i)
+                {
+                    sum += in[(y * v + j) * stride + x * h + i];
+                }
+            }
+            out[y * 8 + x] = (sum >= 0) ? sum / count : -((count - 1 - sum) / count);
+        }
+    }
+}
+
+void quantizeScalar(int* const block, const float* const reciprocals)
+{
+    for (uint i = 0; i < 64; ++i)
+    {
+        block[i] = static_cast<int>(std::lround(static_cast<float>(block[i]) * reciprocals[i]));
+    }
+}
+
+#ifdef JPEG_X86_KERNELS
+
+// Vectors of ints with the arithmetic operators of GCC's vector extensions, for the templated
+// integer kernels.
+typedef int IntLanes4 __attribute__((vector_size(16)));
+typedef int IntLanes8 __attribute__((vector_size(32)));
+
+// Round to the nearest integer with halfway cases away from 0, like std::lround. The fraction
+// x - trunc(x) is exact in single precision.
+__attribute__((target("sse2"))) KERNEL_INLINE __m128i roundSSE2(const __m128 x)
+{
+    const __m128i truncated = _mm_cvttps_epi32(x);
+    const __m128 fraction = _mm_sub_ps(x, _mm_cvtepi32_ps(truncated));
+    const __m128i up = _mm_castps_si128(_mm_cmpge_ps(fraction, _mm_set1_ps(0.5f)));
+    const __m128i down = _mm_castps_si128(_mm_cmple_ps(fraction, _mm_set1_ps(-0.5f)));
+    return _mm_add_epi32(_mm_sub_epi32(truncated, up), down);
+}
+
+__attribute__((target("avx2"))) KERNEL_INLINE __m256i roundAVX2(const __m256 x)
+{
+    const __m256i truncated = _mm256_cvttps_epi32(x);
+    const __m256 fraction = _mm256_sub_ps(x, _mm256_cvtepi32_ps(truncated));
+    const __m256i up = _mm256_castps_si256(_mm256_cmp_ps(fraction,
+                                                         _mm256_set1_ps(0.5f),
+                                                         _CMP_GE_OQ));
+    const __m256i down = _mm256_castps_si256(_mm256_cmp_ps(fraction,
+                                                           _mm256_set1_ps(-0.5f),
+                                                           _CMP_LE_OQ));
+    return _mm256_add_epi32(_mm256_sub_epi32(truncated, up), down);
+}
+
+// Four columns of the block at a time, as the left and right halves of its rows.
+__attribute__((target("sse2"))) void inverseDCTSSE2(int* const block)
+{
+    __m128 left[8], right[8];
+    __m128 leftOut[8], rightOut[8];
+    for (uint j = 0; j < 8; ++j)
+    {
+        const __m128i* const row = reinterpret_cast<const __m128i*>(block + j * 8);
+        left[j] = _mm_cvtepi32_ps(_mm_loadu_si128(row));
+        right[j] = _mm_cvtepi32_ps(_mm_loadu_si128(row + 1));
+    }
+    inverseDCT8(left, leftOut);
+    inverseDCT8(right, rightOut);
+
+    // Transpose each 4x4 quarter so that the lanes run over rows, then transform the rows of the
+    // top and bottom halves of the block and transpose back.
+    for (uint half = 0; half < 2; ++half)
+    {
+        __m128 in[8], out[8];
+        for (uint j = 0; j < 4; ++j)
+        {
+            in[j] = leftOut[half * 4 + j];
+            in[j + 4] = rightOut[half * 4 + j];
+        }
+        _MM_TRANSPOSE4_PS(in[0], in[1], in[2], in[3]);
+        _MM_TRANSPOSE4_PS(in[4], in[5], in[6], in[7]);
+        inverseDCT8(in, out);
+        _MM_TRANSPOSE4_PS(out[0], out[1], out[2], out[3]);
+        _MM_TRANSPOSE4_PS(out[4], out[5], out[6], out[7]);
+        for (uint j = 0; j < 4; ++j)
+        {
+            __m128i* const row = reinterpret_cast<__m128i*>(block + (half * 4 + j) * 8);
+            _mm_storeu_si128(row, roundSSE2(out[j]));
+            _mm_storeu_si128(row + 1, roundSSE2(out[j + 4]));
+        }
+    }
+}
+
+__attribute__((target("avx2"))) KERNEL_INLINE void transpose8x8(__m256* const rows)
+{
+    const __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+    const __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+    const __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+    const __m256 t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+    const __m256 t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+    const __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    rows[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+    rows[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+    rows[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+    rows[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+    rows[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+    rows[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+    rows[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+    rows[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+
+// All eight columns, and then all eight rows, at a time.
+__attribute__((target("avx2"))) void inverseDCTAVX2(int* const block)
+{
+    __m256 rows[8], columns[8];
+    for (uint j = 0; j < 8; ++j)
+    {
+        const __m256i* const row = reinterpret_cast<const __m256i*>(block + j * 8);
+        rows[j] = _mm256_cvtepi32_ps(_mm256_loadu_si256(row));
+    }
+    inverseDCT8(rows, columns);
+    transpose8x8(columns);
+    inverseDCT8(columns, rows);
+    transpose8x8(rows);
+    for (uint j = 0; j < 8; ++j)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(block + j * 8), roundAVX2(rows[j]));
+    }
+}
+
+// Samples are clamped before rounding, which gives the same result as clamping after it.
+__attribute__((target("sse2"))) void YCbCrToRGBSSE2(MCU& mcu,
+                                                    const int* const cb,
+                                                    const int* const cr)
+{
+    const __m128 low = _mm_setzero_ps();
+    const __m128 high = _mm_set1_ps(255.0f);
+    for (uint i = 0; i < 64; i += 4)
+    {
+        const __m128 lum = _mm_cvtepi32_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(mcu.y + i)));
+        const __m128 blue = _mm_cvtepi32_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(cb + i)));
+        const __m128 red = _mm_cvtepi32_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(cr + i)));
+        const __m128 r = lum + 1.402f * red + 128.0f;
+        const __m128 g = lum - 0.344136f * blue - 0.714136f * red + 128.0f;
+        const __m128 b = lum + 1.772f * blue + 128.0f;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mcu.r + i),
+                         roundSSE2(_mm_min_ps(_mm_max_ps(r, low), high)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mcu.g + i),
+                         roundSSE2(_mm_min_ps(_mm_max_ps(g, low), high)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mcu.b + i),
+                         roundSSE2(_mm_min_ps(_mm_max_ps(b, low), high)));
+    }
+}
+
+__attribute__((target("avx2"))) void YCbCrToRGBAVX2(MCU& mcu,
+                                                    const int* const cb,
+                                                    const int* const cr)
+{
+    const __m256 low = _mm256_setzero_ps();
+    const __m256 high = _mm256_set1_ps(255.0f);
+    for (uint i = 0; i < 64; i += 8)
+    {
+        const __m256 lum = _mm256_cvtepi32_ps(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mcu.y + i)));
+        const __m256 blue = _mm256_cvtepi32_ps(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cb + i)));
+        const __m256 red = _mm256_cvtepi32_ps(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cr + i)));
+        const __m256 r = lum + 1.402f * red + 128.0f;
+        const __m256 g = lum - 0.344136f * blue - 0.714136f * red + 128.0f;
+        const __m256 b = lum + 1.772f * blue + 128.0f;
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mcu.r + i),
+                            roundAVX2(_mm256_min_ps(_mm256_max_ps(r, low), high)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mcu.g + i),
+                            roundAVX2(_mm256_min_ps(_mm256_max_ps(g, low), high)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(mcu.b + i),
+                            roundAVX2(_mm256_min_ps(_mm256_max_ps(b, low), high)));
+    }
+}
+
+// Sampling factors are 1 or 2, so a row of the output is either a row of the chroma block or the
+// duplicated samples of half of one.
+__attribute__((target("sse2"))) void upsampleSSE2(const int* const chroma,
+                                                  const uint h,
+                                                  const uint v,
+                                                  const uint hMax,
+                                                  const uint vMax,
+                                                  int* const out)
+{
+    if (hMax > 2)
+    {
+        upsampleScalar(chroma, h, v, hMax, vMax, out);
+        return;
+    }
+    for (uint y = 0; y < 8; ++y)
+    {
+        const __m128i* const row = reinterpret_cast<const __m128i*>(
+            chroma + ((v * 8 + y) / vMax) * 8 + (h * 8) / hMax);
+        __m128i* const destination = reinterpret_cast<__m128i*>(out + y * 8);
+        if (hMax == 1)
+        {
+            _mm_storeu_si128(destination, _mm_loadu_si128(row));
+            _mm_storeu_si128(destination + 1, _mm_loadu_si128(row + 1));
+            continue;
+        }
+        const __m128i samples = _mm_loadu_si128(row);
+        _mm_storeu_si128(destination, _mm_unpacklo_epi32(samples, samples));
+        _mm_storeu_si128(destination + 1, _mm_unpackhi_epi32(samples, samples));
+    }
+}
+
+__attribute__((target("sse2"))) std::size_t findMarkerSSE2(const unsigned char* const data,
+                                                           const std::size_t size)
+{
+    const __m128i marker = _mm_set1_epi8(static_cast<char>(0xFF));
+    std::size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const uint mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, marker));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findMarkerScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2"))) std::size_t findMarkerAVX2(const unsigned char* const data,
+                                                           const std::size_t size)
+{
+    const __m256i marker = _mm256_set1_epi8(static_cast<char>(0xFF));
+    std::size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, marker));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + findMarkerSSE2(data + i, size - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) std::size_t findMarkerAVX512(
+    const unsigned char* const data,
+    const std::size_t size)
+{
+    const __m512i marker = _mm512_set1_epi8(static_cast<char>(0xFF));
+    std::size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        const __m512i bytes = _mm512_loadu_si512(data + i);
+        const __mmask64 mask = _mm512_cmpeq_epi8_mask(bytes, marker);
+        if (mask != 0)
+        {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+    return i + findMarkerAVX2(data + i, size - i);
+}
+
+// Eight pixels at a time, the samples of a block row, with the bytes of the first two channels
+// and of the third channel shuffled into place.
+__attribute__((target("ssse3"))) void packPixelsSSSE3(const int* const first,
+                                                      const int* const second,
+                                                      const int* const third,
+                                                      const uint count,
+                                                      unsigned char* const out)
+{
+    if (count != 8)
+    {
+        packPixelsScalar(first, second, third, count, out);
+        return;
+    }
+    const __m128i* const a = reinterpret_cast<const __m128i*>(first);
+    const __m128i* const b = reinterpret_cast<const __m128i*>(second);
+    const __m128i* const c = reinterpret_cast<const __m128i*>(third);
+    const __m128i ab = _mm_packus_epi16(
+        _mm_packs_epi32(_mm_loadu_si128(a), _mm_loadu_si128(a + 1)),
+        _mm_packs_epi32(_mm_loadu_si128(b), _mm_loadu_si128(b + 1)));
+    const __m128i cc = _mm_packus_epi16(
+        _mm_packs_epi32(_mm_loadu_si128(c), _mm_loadu_si128(c + 1)),
+        _mm_setzero_si128());
+    const __m128i lowAB = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i lowC = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i highAB = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1);
+    const __m128i highC = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1,
+                                        -1);
+    const __m128i low = _mm_or_si128(_mm_shuffle_epi8(ab, lowAB), _mm_shuffle_epi8(cc, lowC));
+    const __m128i high = _mm_or_si128(_mm_shuffle_epi8(ab, highAB), _mm_shuffle_epi8(cc, highC));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), low);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), high);
+}
+
+// The product is rounded before the sum, as in the scalar kernel, rather than fused with it.
+__attribute__((target("sse2"))) void addWeightedRowSSE2(const float* const in,
+                                                        const float weight,
+                                                        const uint count,
+                                                        float* const out)
+{
+    const __m128 w = _mm_set1_ps(weight);
+    uint i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(out + i,
+                      _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), w)));
+    }
+    addWeightedRowScalar(in + i, weight, count - i, out + i);
+}
+
+__attribute__((target("avx2"))) void addWeightedRowAVX2(const float* const in,
+                                                        const float weight,
+                                                        const uint count,
+                                                        float* const out)
+{
+    const __m256 w = _mm256_set1_ps(weight);
+    uint i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_ps(out + i,
+                         _mm256_add_ps(_mm256_loadu_ps(out + i),
+                                       _mm256_mul_ps(_mm256_loadu_ps(in + i), w)));
+    }
+    addWeightedRowSSE2(in + i, weight, count - i, out + i);
+}
+
+// Four columns of the block at a time, and then four rows, as in inverseDCTSSE2.
+__attribute__((target("sse2"))) void forwardDCTSSE2(int* const block)
+{
+    IntLanes4 left[8], right[8];
+    IntLanes4 leftOut[8], rightOut[8];
+    for (uint j = 0; j < 8; ++j)
+    {
+        const __m128i* const row = reinterpret_cast<const __m128i*>(block + j * 8);
+        left[j] = reinterpret_cast<IntLanes4>(_mm_loadu_si128(row));
+        right[j] = reinterpret_cast<IntLanes4>(_mm_loadu_si128(row + 1));
+    }
+    forwardDCT8<IntLanes4, true>(left, leftOut);
+    forwardDCT8<IntLanes4, true>(right, rightOut);
+
+    for (uint half = 0; half < 2; ++half)
+    {
+        __m128 in[8];
+        IntLanes4 lanes[8], out[8];
+        for (uint j = 0; j < 4; ++j)
+        {
+            in[j] = reinterpret_cast<__m128>(leftOut[half * 4 + j]);
+            in[j + 4] = reinterpret_cast<__m128>(rightOut[half * 4 + j]);
+        }
+        _MM_TRANSPOSE4_PS(in[0], in[1], in[2], in[3]);
+        _MM_TRANSPOSE4_PS(in[4], in[5], in[6], in[7]);
+        for (uint j = 0; j < 8; ++j)
+        {
+            lanes[j] = reinterpret_cast<IntLanes4>(in[j]);
+        }
+        forwardDCT8<IntLanes4, false>(lanes, out);
+        for (uint j = 0; j < 8; ++j)
+        {
+            in[j] = reinterpret_cast<__m128>(out[j]);
+        }
+        _MM_TRANSPOSE4_PS(in[0], in[1], in[2], in[3]);
+        _MM_TRANSPOSE4_PS(in[4], in[5], in[6], in[7]);
+        for (uint j = 0; j < 4; ++j)
+        {
+            __m128i* const row = reinterpret_cast<__m128i*>(block + (half * 4 + j) * 8);
+            _mm_storeu_si128(row, _mm_castps_si128(in[j]));
+            _mm_storeu_si128(row + 1, _mm_castps_si128(in[j + 4]));
+        }
+    }
+}
+
+// All eight columns, and then all eight rows, at a time.
+__attribute__((target("avx2"))) void forwardDCTAVX2(int* const block)
+{
+    IntLanes8 rows[8], columns[8];
+    __m256 transposed[8];
+    for (uint j = 0; j < 8; ++j)
+    {
+        const __m256i* const row = reinterpret_cast<const __m256i*>(block + j * 8);
+        rows[j] = reinterpret_cast<IntLanes8>(_mm256_loadu_si256(row));
+    }
+    forwardDCT8<IntLanes8, true>(rows, columns);
+    for (uint j = 0; j < 8; ++j)
+    {
+        transposed[j] = reinterpret_cast<__m256>(columns[j]);
+    }
+    transpose8x8(transposed);
+    for (uint j = 0; j < 8; ++j)
+    {
+        columns[j] = reinterpret_cast<IntLanes8>(transposed[j]);
+    }
+    forwardDCT8<IntLanes8, false>(columns, rows);
+    for (uint j = 0; j < 8; ++j)
+    {
+        transposed[j] = reinterpret_cast<__m256>(rows[j]);
+    }
+    transpose8x8(transposed);
+    for (uint j = 0; j < 8; ++j)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(block + j * 8),
+                            _mm256_castps_si256(transposed[j]));
+    }
+}
+
+// Eight pixels at a time, their 24 bytes shuffled into a channel each and widened to ints.
+__attribute__((target("avx2"))) void RGBToYCbCrAVX2(const unsigned char* const rgb,
+                                                    const uint count,
+                                                    int* const y,
+                                                    int* const cb,
+                                                    int* const cr)
+{
+    const __m128i lowR = _mm_setr_epi8(0, 3, 6, 9, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i highR = _mm_setr_epi8(-1, -1, -1, -1, -1, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1,
+                                        -1);
+    const __m128i lowG = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1);
+    const __m128i highG = _mm_setr_epi8(-1, -1, -1, -1, -1, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1,
+                                        -1);
+    const __m128i lowB = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       -1);
+    const __m128i highB = _mm_setr_epi8(-1, -1, -1, -1, -1, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1,
+                                        -1);
+    uint i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + i * 3));
+        const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb + i * 3 + 8));
+        const IntLanes8 r = reinterpret_cast<IntLanes8>(_mm256_cvtepu8_epi32(
+            _mm_or_si128(_mm_shuffle_epi8(low, lowR), _mm_shuffle_epi8(high, highR))));
+        const IntLanes8 g = reinterpret_cast<IntLanes8>(_mm256_cvtepu8_epi32(
+            _mm_or_si128(_mm_shuffle_epi8(low, lowG), _mm_shuffle_epi8(high, highG))));
+        const IntLanes8 b = reinterpret_cast<IntLanes8>(_mm256_cvtepu8_epi32(
+            _mm_or_si128(_mm_shuffle_epi8(low, lowB), _mm_shuffle_epi8(high, highB))));
+        const IntLanes8 lum = ((r * 19595 + g * 38470 + b * 7471 + 32768) >> 16) - 128;
+        const IntLanes8 blue = (r * -11059 - g * 21709 + b * 32768 + 32767) >> 16;
+        const IntLanes8 red = (r * 32768 - g * 27439 - b * 5329 + 32767) >> 16;
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), reinterpret_cast<__m256i>(lum));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(cb + i), reinterpret_cast<__m256i>(blue));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(cr + i), reinterpret_cast<__m256i>(red));
+    }
+    RGBToYCbCrScalar(rgb + i * 3, count - i, y + i, cb + i, cr + i);
+}
+
+// Factors are 1 or 2, so the sums are divided with a shift, which rounds down like the scalar
+// kernel. Horizontal pairs are split into even and odd samples and added.
+__attribute__((target("sse2"))) void downsampleSSE2(const int* const in,
+                                                    const uint stride,
+                                                    const uint h,
+                                                    const uint v,
+                                                    int* const out)
+{
+    if (h > 2 || v > 2)
+    {
+        downsampleScalar(in, stride, h, v, out);
+        return;
+    }
+    const int shift = (h - 1) + (v - 1);
+    const __m128i bias = _mm_set1_epi32((1 << shift) >> 1);
+    for (uint y = 0; y < 8; ++y)
+    {
+        const __m128i* const first = reinterpret_cast<const __m128i*>(in + y * v * stride);
+        const __m128i* const second = reinterpret_cast<const __m128i*>(in + (y * v + v - 1)
+                                                                            * stride);
+        __m128i sums[4];
+        for (uint j = 0; j < 2 * h; ++j)
+        {
+            sums[j] = _mm_loadu_si128(first + j);
+            if (v == 2)
+            {
+                sums[j] = _mm_add_epi32(sums[j], _mm_loadu_si128(second + j));
+            }
+        }
+        for (uint j = 0; j < 2; ++j)
+        {
+            __m128i sum = sums[j];
+            if (h == 2)
+            {
+                const __m128 a = _mm_castsi128_ps(sums[j * 2]);
+                const __m128 b = _mm_castsi128_ps(sums[j * 2 + 1]);
+                sum = _mm_add_epi32(
+                    _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                    _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + y * 8 + j * 4),
+                             _mm_srai_epi32(_mm_add_epi32(sum, bias), shift));
+        }
+    }
+}
+
+__attribute__((target("sse2"))) void quantizeSSE2(int* const block, const float* const reciprocals)
+{
+    for (uint i = 0; i < 64; i += 4)
+    {
+        __m128i* const coefficients = reinterpret_cast<__m128i*>(block + i);
+        const __m128 scaled = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(coefficients)),
+                                         _mm_loadu_ps(reciprocals + i));
+        _mm_storeu_si128(coefficients, roundSSE2(scaled));
+    }
+}
+
+__attribute__((target("avx2"))) void quantizeAVX2(int* const block, const float* const reciprocals)
+{
+    for (uint i = 0; i < 64; i += 8)
+    {
+        __m256i* const coefficients = reinterpret_cast<__m256i*>(block + i);
+        const __m256 scaled = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256(coefficients)),
+                                            _mm256_loadu_ps(reciprocals + i));
+        _mm256_storeu_si256(coefficients, roundAVX2(scaled));
+    }
+}
+
+#endif
+
+const Kernels scalarKernels = {inverseDCTScalar,
+                               YCbCrToRGBScalar,
+                               upsampleScalar,
+                               findMarkerScalar,
+                               packPixelsScalar,
+                               addWeightedRowScalar,
+                               RGBToYCbCrScalar,
+                               downsampleScalar,
+                               forwardDCTScalar,
+                               quantizeScalar};
+
+#ifdef JPEG_X86_KERNELS
+const Kernels sse2Kernels = {inverseDCTSSE2,
+                             YCbCrToRGBSSE2,
+                             upsampleSSE2,
+                             findMarkerSSE2,
+                             packPixelsScalar,
+                             addWeightedRowSSE2,
+                             RGBToYCbCrScalar,
+                             downsampleSSE2,
+                             forwardDCTSSE2,
+                             quantizeSSE2};
+const Kernels ssse3Kernels = {inverseDCTSSE2,
+                              YCbCrToRGBSSE2,
+                              upsampleSSE2,
+                              findMarkerSSE2,
+                              packPixelsSSSE3,
+                              addWeightedRowSSE2,
+                              RGBToYCbCrScalar,
+                              downsampleSSE2,
+                              forwardDCTSSE2,
+                              quantizeSSE2};
+const Kernels avx2Kernels = {inverseDCTAVX2,
+                             YCbCrToRGBAVX2,
+                             upsampleSSE2,
+                             findMarkerAVX2,
+                             packPixelsSSSE3,
+                             addWeightedRowAVX2,
+                             RGBToYCbCrAVX2,
+                             downsampleSSE2,
+                             forwardDCTAVX2,
+                             quantizeAVX2};
+const Kernels avx512Kernels = {inverseDCTAVX2,
+                               YCbCrToRGBAVX2,
+                               upsampleSSE2,
+                               findMarkerAVX512,
+                               packPixelsSSSE3,
+                               addWeightedRowAVX2,
+                               RGBToYCbCrAVX2,
+                               downsampleSSE2,
+                               forwardDCTAVX2,
+                               quantizeAVX2};
+#endif
+
+const char* const cpuLevelNames[] = {"scalar", "sse2", "ssse3", "avx2", "avx512"};
+
+CpuLevel detectCpuLevel()
+{
+#ifdef JPEG_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        return CpuLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return CpuLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return CpuLevel::SSSE3;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return CpuLevel::SSE2;
+    }
+#endif
+    return CpuLevel::Scalar;
+}
+
+// The detected level, lowered to the one named by JPEG_CPU_LEVEL if it is set.
+CpuLevel initialCpuLevel()
+{
+    const CpuLevel detected = detectCpuLevel();
+    const char* const name = std::getenv("JPEG_CPU_LEVEL");
+    if (name == nullptr)
+    {
+        return detected;
+    }
+    CpuLevel level;
+    if (!parseCpuLevel(name, level))
+    {
+        logMessage(LogLevel::Warning, "Unknown JPEG_CPU_LEVEL, using the detected level");
+        return detected;
+    }
+    return std::min(level, detected);
+}
+
+std::atomic<CpuLevel>& activeCpuLevel()
+{
+    static std::atomic<CpuLevel> level(initialCpuLevel());
+    return level;
+}
+
+CpuLevel getCpuLevel()
+{
+    return activeCpuLevel().load(std::memory_order_relaxed);
+}
+
+bool setCpuLevel(const CpuLevel level)
+{
+    if (level > detectCpuLevel())
+    {
+        return false;
+    }
+    activeCpuLevel().store(level, std::memory_order_relaxed);
+    return true;
+}
+
+const char* cpuLevelName(const CpuLevel level)
+{
+    return cpuLevelNames[static_cast<uint>(level)];
+}
+
+bool parseCpuLevel(const std::string& name, CpuLevel& level)
+{
+    for (uint i = 0; i <= static_cast<uint>(CpuLevel::AVX512); ++i)
+    {
+        if (name == cpuLevelNames[i])
+        {
+            level = static_cast<CpuLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+const Kernels& getKernels()
+{
+    switch (getCpuLevel())
+    {
+#ifdef JPEG_X86_KERNELS
+    case CpuLevel::AVX512:
+        return avx512Kernels;
+    case CpuLevel::AVX2:
+        return avx2Kernels;
+    case CpuLevel::SSSE3:
+        return ssse3Kernels;
+    case CpuLevel::SSE2:
+        return sse2Kernels;
+#endif
+    default:
+        return scalarKernels;
+    }
+}
@@ -0,0 +1,42 @@
+#include <iostream>
+
+#include "status.h"
+
+LogCallback logCallback = nullptr;
+void* logUserData = nullptr;
+LogLevel logMinimumLevel = LogLevel::None;
+
+void setLogCallback(const LogCallback callback, void* const userData, const LogLevel minimumLevel)
+{
+    logCallback = callback;
+    logUserData = userData;
+    logMinimumLevel = (callback == nullptr) ? LogLevel::None : minimumLevel;
+}
+
+bool logEnabled(const LogLevel level)
+{
+    return level >= logMinimumLevel && level != LogLevel::None;
+}
+
+void printLogMessage(const LogLevel level, const char* const message, void*)
+{
+    if (level == LogLevel::Error)
+    {
+        std::cout << "Error - ";
+    }
+    std::cout << message << "\n";
+}
+
+void logMessage(const LogLevel level, const char* const message)
+{
+    if (logEnabled(level))
+    {
+        logCallback(level, message, logUserData);
+    }
+}
+
+Status makeError(const StatusCode code, const std::string& message)
+{
+    logMessage(LogLevel::Error, message.c_str());
+    return {code, message};
+}
@@ -0,0 +1,182 @@
+#include <algorithm>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "transform.h"
+
+// Every transform is a transpose, followed by mirroring the columns and/or the rows.
+struct TransformSteps
+{
+    bool transpose;
+    bool flipX;
+    bool flipY;
+};
+
+TransformSteps getTransformSteps(const Transform transform)
+{
+    switch (transform)
+    {
+    case Transform::FlipHorizontal:
+        return {false, true, false};
+    case Transform::FlipVertical:
+        return {false, false, true};
+    case Transform::Transpose:
+        return {true, false, false};
+    case Transform::Rotate90:
+        return {true, true, false};
+    case Transform::Rotate180:
+        return {false, true, true};
+    case Transform::Rotate270:
+        return {true, false, true};
+    default:
+        return {false, false, false};
+    }
+}
+
+// Rotate, flip and/or crop an image losslessly by rearranging the quantized coefficients returned
+// by decodeHuffmanData, without dequantizing or transforming them. Mirroring a block negates its
+// odd frequencies in that direction, and transposing a block transposes its coefficients. Only
+// whole MCUs can be moved, so a mirrored edge that is not a whole MCU is trimmed off, and the crop
+// region is extended up and left to the MCU grid. Return the header of the transformed image,
+// which uses the standard Huffman tables, and store its coefficients in transformedMCUs. On failure
+// return nullptr and record the error in the status of the original header.
+Header* transformCoefficients(const Header* const header,
+                              MCU* const mcus,
+                              const Transform transform,
+                              const Crop* const crop,
+                              MCU** const transformedMCUs)
+{
+    const TransformSteps steps = getTransformSteps(transform);
+
+    Header* result = new (std::nothrow) Header;
+    if (result == nullptr)
+    {
+        setError(header, StatusCode::MemoryError, "Memory error");
+        return nullptr;
+    }
+    result->frameType = SOF0;
+    result->numComponents = header->numComponents;
+    result->restartInterval = header->restartInterval;
+    result->width = steps.transpose ? header->height : header->width;
+    result->height = steps.transpose ? header->width : header->height;
+    result->horizontalSamplingFactor = steps.transpose ? header->verticalSamplingFactor
+                                                       : header->horizontalSamplingFactor;
+    result->verticalSamplingFactor = steps.transpose ? header->horizontalSamplingFactor
+                                                     : header->verticalSamplingFactor;
+    for (uint i = 0; i < header->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header->colorComponents[i];
+        result->colorComponents[i] = c;
+        result->colorComponents[i].horizontalSamplingFactor = steps.transpose
+                                                                  ? c.verticalSamplingFactor
+                                                                  : c.horizontalSamplingFactor;
+        result->colorComponents[i].verticalSamplingFactor = steps.transpose
+                                                                ? c.horizontalSamplingFactor
+                                                                : c.verticalSamplingFactor;
+    }
+    for (uint i = 0; i < 4; ++i)
+    {
+        result->quantizationTables[i] = header->quantizationTables[i];
+        if (steps.transpose)
+        {
+            for (uint j = 0; j < 64; ++j)
+            {
+                result->quantizationTables[i].table[j]
+                    = header->quantizationTables[i].table[(j % 8) * 8 + j / 8];
+            }
+        }
+    }
+    setStandardHuffmanTables(result);
+
+    // Trim partial MCUs off the edges that are mirrored.
+    const uint mcuPixelWidth = 8 * result->horizontalSamplingFactor.to_ulong();
+    const uint mcuPixelHeight = 8 * result->verticalSamplingFactor.to_ulong();
+    if (steps.flipX)
+    {
+        result->width -= result->width % mcuPixelWidth;
+    }
+    if (steps.flipY)
+    {
+        result->height -= result->height % mcuPixelHeight;
+    }
+    if (result->width == 0 || result->height == 0)
+    {
+        setError(header, StatusCode::InvalidArgument, "Image too small to transform");
+        delete result;
+        return nullptr;
+    }
+    setFrameGeometry(result);
+    // Size in MCUs of the transformed image before cropping.
+    const uint fullMCUWidth = result->mcuWidth;
+    const uint fullMCUHeight = result->mcuHeight;
+
+    uint mcuX = 0;
+    uint mcuY = 0;
+    if (crop != nullptr)
+    {
+        if (crop->width == 0 || crop->height == 0 || crop->x >= result->width
+            || crop->y >= result->height)
+        {
+            setError(header, StatusCode::InvalidArgument, "Crop region outside of image");
+            delete result;
+            return nullptr;
+        }
+        mcuX = crop->x / mcuPixelWidth;
+        mcuY = crop->y / mcuPixelHeight;
+        const uint x = mcuX * mcuPixelWidth;
+        const uint y = mcuY * mcuPixelHeight;
+        result->width = std::min(crop->x + crop->width, result->width) - x;
+        result->height = std::min(crop->y + crop->height, result->height) - y;
+        setFrameGeometry(result);
+    }
+
+    *transformedMCUs = new (std::nothrow) MCU[result->blockHeightReal * result->blockWidthReal];
+    if (*transformedMCUs == nullptr)
+    {
+        setError(header, StatusCode::MemoryError, "Memory error");
+        delete result;
+        return nullptr;
+    }
+
+    for (uint i = 0; i < result->numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = result->colorComponents[i];
+        const uint h = c.horizontalSamplingFactor.to_ulong();
+        const uint v = c.verticalSamplingFactor.to_ulong();
+        for (uint y = 0; y < result->mcuHeight * v; ++y)
+        {
+            for (uint x = 0; x < result->mcuWidth * h; ++x)
+            {
+                // Position of the block in the transposed image, and then in the original.
+                uint tx = x + mcuX * h;
+                uint ty = y + mcuY * v;
+                if (steps.flipX)
+                {
+                    tx = fullMCUWidth * h - 1 - tx;
+                }
+                if (steps.flipY)
+                {
+                    ty = fullMCUHeight * v - 1 - ty;
+                }
+                const int* const source = steps.transpose
+                                              ? componentBlock(header, mcus, i, ty, tx)
+                                              : componentBlock(header, mcus, i, tx, ty);
+                int* const destination = componentBlock(result, *transformedMCUs, i, x, y);
+                for (uint row = 0; row < 8; ++row)
+                {
+                    for (uint column = 0; column < 8; ++column)
+                    {
+                        int coeff = steps.transpose ? source[column * 8 + row]
+                                                    : source[row * 8 + column];
+                        if ((steps.flipX && column % 2 == 1) != (steps.flipY && row % 2 == 1))
+                        {
+                            coeff = -coeff;
+                        }
+                        destination[row * 8 + column] = coeff;
+                    }
+                }
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,120 @@
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "asyncio.h"
+#include "testing.h"
+
+// Asynchronous file I/O: callbacks that submit more requests at full queue depth, alone, while
+// another thread submits as well, or many at once, must not deadlock, and every request must
+// finish.
+
+const std::string sample = samplePath("gorilla.jpg");
+
+// Read the sample a number of times, each read submitted by the callback of the one before.
+void testChainedReads(const uint queueDepth)
+{
+    const uint64_t reads = 50;
+    std::atomic<uint64_t> finished(0), failed(0);
+    AsyncFileIO* io = nullptr;
+    AsyncFileIO asyncIO(
+        [&](IOCompletion& completion)
+        {
+            if (!completion.status.ok() || completion.data.empty())
+            {
+                failed += 1;
+            }
+            finished += 1;
+            if (completion.tag + 1 < reads)
+            {
+                io->read(sample, completion.tag + 1);
+            }
+        },
+        queueDepth);
+    io = &asyncIO;
+    asyncIO.read(sample, 0);
+    asyncIO.wait();
+    check(finished == reads, "every chained read finishes");
+    check(failed == 0, "chained reads succeed");
+}
+
+// Callbacks submit two reads for every one that finishes, up to a limit, while the main thread
+// keeps submitting its own, so that both wait for the same places in flight.
+void testFanOutWithSubmitter(const uint queueDepth)
+{
+    const uint64_t limit = 200;
+    std::atomic<uint64_t> submitted(0), finished(0);
+    AsyncFileIO* io = nullptr;
+    AsyncFileIO asyncIO(
+        [&](IOCompletion&)
+        {
+            finished += 1;
+            for (int i = 0; i < 2; ++i)
+            {
+                if (submitted.fetch_add(1) < limit)
+                {
+                    io->read(sample, 1);
+                }
+                else
+                {
+                    submitted -= 1;
+                }
+            }
+        },
+        queueDepth);
+    io = &asyncIO;
+    for (int i = 0; i < 100; ++i)
+    {
+        submitted += 1;
+        asyncIO.read(sample, 0);
+    }
+    asyncIO.wait();
+    check(finished == submitted, "every fanned out read finishes");
+}
+
+// The callback of the first read submits many more at once, far over the queue depth, and all of
+// them must finish rather than overflow the completions the kernel keeps.
+void testBurstOverDepth(const uint queueDepth)
+{
+    const uint64_t burst = 64;
+    std::atomic<uint64_t> finished(0), failed(0);
+    AsyncFileIO* io = nullptr;
+    AsyncFileIO asyncIO(
+        [&](IOCompletion& completion)
+        {
+            if (!completion.status.ok() || completion.data.empty())
+            {
+                failed += 1;
+            }
+            finished += 1;
+            if (completion.tag == 0)
+            {
+                for (uint64_t i = 1; i <= burst; ++i)
+                {
+                    io->read(sample, i);
+                }
+            }
+        },
+        queueDepth);
+    io = &asyncIO;
+    asyncIO.read(sample, 0);
+    asyncIO.wait();
+    check(finished == burst + 1, "every read of a burst over the queue depth finishes");
+    check(failed == 0, "reads of a burst over the queue depth succeed");
+}
+
+int main()
+{
+    for (const uint queueDepth : {1u, 2u, 8u})
+    {
+        testChainedReads(queueDepth);
+        testFanOutWithSubmitter(queueDepth);
+        testBurstOverDepth(queueDepth);
+    }
+    {
+        AsyncFileIO asyncIO([](IOCompletion&) {}, 1);
+        std::printf("backend: %s\n", asyncIO.backend());
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <vector>
+
+#include "jpegdec.h"
+#include "testing.h"
+
+// decodeWithBudget: every strategy gives the pixels of a plain decode, or of a plain decode of the
+// scaled size, and the most bytes a decode holds at once, checkpoints included, stays within what
+// its plan expected and within the budget.
+
+int main()
+{
+    for (const char* const name : {"gorilla.jpg", "243919.jpg"})
+    {
+        const std::vector<unsigned char> jpg = readSample(name);
+        std::vector<unsigned char> expected;
+        check(decodeJPG(jpg.data(), jpg.size(), expected).ok(), "decodeJPG succeeds");
+
+        BudgetOptions options;
+        options.allowScaling = true;
+        DecodePlan whole;
+        std::vector<unsigned char> pixels;
+        check(decodeWithBudget(jpg.data(), jpg.size(), options, pixels, &whole).ok(),
+              "an unlimited budget decodes");
+        check(whole.strategy == DecodeStrategy::FullFrame, "an unlimited budget decodes whole");
+
+        bool tiled = false;
+        for (std::size_t divisor = 1; divisor <= 256; divisor *= 2)
+        {
+            // With the output stored and scaling allowed, and with rows passed to a callback at
+            // full size, which keeps the output out of the budget and tiles the smallest ones.
+            options.memoryBudget = whole.plannedBytes / divisor;
+            options.allowScaling = true;
+            DecodePlan plan;
+            pixels.clear();
+            if (decodeWithBudget(jpg.data(), jpg.size(), options, pixels, &plan).ok())
+            {
+                check(plan.peakBytes <= plan.plannedBytes, "the peak stays within the plan");
+                check(plan.plannedBytes <= options.memoryBudget, "the plan fits the budget");
+                check(plan.scale != 8 || pixels == expected,
+                      "decoding at full size gives the decoded pixels");
+                check(pixels.size() == std::size_t(plan.width) * plan.height * 3,
+                      "a decode gives every pixel of its size");
+            }
+
+            options.allowScaling = false;
+            std::vector<unsigned char> rows(expected.size());
+            const RowCallback storeRow = [&rows](const uint y,
+                                                 const unsigned char* const rgb,
+                                                 const uint width,
+                                                 uint)
+            {
+                std::copy(rgb, rgb + width * 3, rows.data() + std::size_t(y) * width * 3);
+                return true;
+            };
+            if (decodeWithBudget(jpg.data(), jpg.size(), options, storeRow, &plan).ok())
+            {
+                tiled = tiled || plan.strategy == DecodeStrategy::Tiled;
+                check(plan.peakBytes <= plan.plannedBytes, "the peak stays within the plan");
+                check(plan.plannedBytes <= options.memoryBudget, "the plan fits the budget");
+                check(rows == expected, "every strategy gives the decoded pixels");
+            }
+        }
+        check(tiled, "a small budget decodes in tiles");
+    }
+    return failures == 0 ? 0 : 1;
+}
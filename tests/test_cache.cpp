@@ -0,0 +1,70 @@
+#include <vector>
+
+#include "instrumentation.h"
+#include "jpegdec.h"
+#include "testing.h"
+
+// DecodeCache: cached decodes give the same pixels as decoding, the cache stays within its
+// budgets, cached headers leave out the compressed data, and, when the library counts them, hits,
+// misses and evictions are counted.
+
+int main()
+{
+    const std::vector<unsigned char> first = readSample("gorilla.jpg");
+    const std::vector<unsigned char> second = readSample("243919.jpg");
+    check(!first.empty() && !second.empty(), "the samples are read");
+
+    std::vector<unsigned char> expected, pixels;
+    ImageInfo info;
+    check(decodeJPG(first.data(), first.size(), expected, nullptr, &info).ok(),
+          "decodeJPG succeeds");
+
+    const Crop crop = {8, 8, info.width / 2, info.height / 2};
+    std::vector<unsigned char> cropped;
+    check(decodeJPG(first.data(), first.size(), cropped, &crop).ok(), "a crop decodes");
+
+    // A budget for the image and its crop only, so that decoding another image evicts the
+    // least recently used of them.
+    const std::size_t budget = expected.size() + cropped.size() + 4096;
+    DecodeCache cache(budget);
+    check(cache.decodeJPG(first.data(), first.size(), pixels).ok() && pixels == expected,
+          "a miss gives the decoded pixels");
+    pixels.clear();
+    check(cache.decodeJPG(first.data(), first.size(), pixels).ok() && pixels == expected,
+          "a hit gives the decoded pixels");
+    pixels.clear();
+    check(cache.decodeJPG(first.data(), first.size(), pixels, &crop).ok() && pixels == cropped,
+          "a crop from a cached header gives the decoded pixels");
+
+    check(cache.decodeJPG(second.data(), second.size(), pixels).ok(), "the second image decodes");
+    check(cache.memoryUsed() <= budget + (32 << 20),
+          "the cache stays within its budgets");
+    pixels.clear();
+    check(cache.decodeJPG(first.data(), first.size(), pixels).ok() && pixels == expected,
+          "an evicted image decodes again");
+
+    if (instrumentationEnabled)
+    {
+        const CacheCounters counters = cache.counters();
+        check(counters.hits == 1, "one image hit");
+        check(counters.misses == 4, "four image misses");
+        check(counters.headerHits == 2, "the crop and the evicted image hit the header cache");
+        check(counters.headerMisses == 2, "two header misses");
+        check(counters.evictions >= 1, "the first image is evicted");
+        check(counters.bytesHashed == 4 * first.size() + second.size(), "every JPG is hashed");
+    }
+
+    cache.clear();
+    check(cache.memoryUsed() == 0, "clear removes every entry");
+
+    // Without room for images, only the header is kept, and without a copy of the compressed
+    // data, which a hit reads from the JPG passed in again.
+    DecodeCache headers(0);
+    check(headers.decodeJPG(first.data(), first.size(), pixels).ok(), "a header is cached");
+    check(headers.memoryUsed() > 0 && headers.memoryUsed() < first.size(),
+          "the cached header holds no compressed data");
+    pixels.clear();
+    check(headers.decodeJPG(first.data(), first.size(), pixels).ok() && pixels == expected,
+          "a header hit gives the decoded pixels");
+    return failures == 0 ? 0 : 1;
+}
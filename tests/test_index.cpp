@@ -0,0 +1,67 @@
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+#include "testing.h"
+
+// Restart indices: an index built for a JPG loads again, and a corrupted one fails to load with
+// an index error rather than being read out of bounds.
+
+// Write data as an index file and load it, returning the status.
+Status loadIndexData(const std::vector<char>& data)
+{
+    const std::string filename = "test_index.idx";
+    std::ofstream(filename, std::ios::binary).write(data.data(), data.size());
+    Status status;
+    RestartIndex* const index = loadRestartIndex(filename, &status);
+    delete index;
+    return status;
+}
+
+int main()
+{
+    const std::string filename = samplePath("gorilla.jpg");
+    Header* const header = readJPG(filename);
+    check(header != nullptr && header->valid, "readJPG succeeds");
+    if (header == nullptr || !header->valid)
+    {
+        delete header;
+        return 1;
+    }
+    RestartIndex* const index = buildRestartIndex(header, filename, 16);
+    check(index != nullptr, "buildRestartIndex succeeds");
+    if (index == nullptr)
+    {
+        delete header;
+        return 1;
+    }
+    const std::vector<char> data = index->buffer;
+    delete index;
+    delete header;
+    check(loadIndexData(data).ok(), "an index built for a JPG loads");
+
+    // A range of entries that wraps around 32 bits.
+    std::vector<char> corrupted = data;
+    RestartIndexScan scan;
+    std::memcpy(&scan, corrupted.data() + sizeof(RestartIndexHeader), sizeof(scan));
+    scan.firstEntry = 0xFFFFFFFF;
+    scan.numEntries = 1;
+    std::memcpy(corrupted.data() + sizeof(RestartIndexHeader), &scan, sizeof(scan));
+    check(loadIndexData(corrupted).code == StatusCode::IndexError,
+          "entries beyond the index are an index error");
+
+    // A scan that ends beyond the end of the JPG.
+    corrupted = data;
+    std::memcpy(&scan, corrupted.data() + sizeof(RestartIndexHeader), sizeof(scan));
+    scan.end = ~uint64_t(0);
+    std::memcpy(corrupted.data() + sizeof(RestartIndexHeader), &scan, sizeof(scan));
+    check(loadIndexData(corrupted).code == StatusCode::IndexError,
+          "a scan beyond the JPG is an index error");
+
+    corrupted.assign(data.begin(), data.end() - 1);
+    check(loadIndexData(corrupted).code == StatusCode::IndexError,
+          "a truncated index is an index error");
+    return failures == 0 ? 0 : 1;
+}
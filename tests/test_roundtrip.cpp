@@ -0,0 +1,103 @@
+#include <cmath>
+#include <vector>
+
+#include "jpegdec.h"
+#include "kernels.h"
+#include "testing.h"
+
+// Encode synthetic images, decode them again, and check that the pixels come back close to the
+// original ones, and exactly the same on every kernel level the processor supports.
+
+// Smooth gradients with a sharp edge, of a size that does not fill its MCUs.
+std::vector<unsigned char> syntheticImage(const uint width, const uint height)
+{
+    std::vector<unsigned char> rgb(width * height * 3);
+    for (uint y = 0; y < height; ++y)
+    {
+        for (uint x = 0; x < width; ++x)
+        {
+            unsigned char* const pixel = &rgb[(y * width + x) * 3];
+            pixel[0] = x * 255 / width;
+            pixel[1] = y * 255 / height;
+            pixel[2] = x < width / 2 ? 40 : 200;
+        }
+    }
+    return rgb;
+}
+
+double psnr(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+{
+    double squares = 0;
+    for (std::size_t i = 0; i < a.size(); ++i)
+    {
+        const double difference = double(a[i]) - double(b[i]);
+        squares += difference * difference;
+    }
+    if (squares == 0)
+    {
+        return 100;
+    }
+    return 10 * std::log10(255.0 * 255.0 * a.size() / squares);
+}
+
+// Encode and decode an image, returning the decoded pixels, or none on failure.
+std::vector<unsigned char> roundTrip(const std::vector<unsigned char>& rgb,
+                                     const uint width,
+                                     const uint height,
+                                     const EncodeOptions& options)
+{
+    std::vector<unsigned char> jpg, pixels;
+    if (!encodeJPG(rgb.data(), width, height, options, jpg).ok())
+    {
+        check(false, "encodeJPG succeeds");
+        return pixels;
+    }
+    ImageInfo info;
+    if (!decodeJPG(jpg.data(), jpg.size(), pixels, nullptr, &info).ok())
+    {
+        check(false, "decodeJPG succeeds");
+        pixels.clear();
+        return pixels;
+    }
+    check(info.width == width && info.height == height, "the size of the image comes back");
+    check(pixels.size() == rgb.size(), "every pixel is decoded");
+    return pixels;
+}
+
+int main()
+{
+    const uint width = 67, height = 45;
+    const std::vector<unsigned char> rgb = syntheticImage(width, height);
+    const CpuLevel detected = detectCpuLevel();
+    for (const uint subsampling : {444u, 422u, 420u})
+    {
+        EncodeOptions options;
+        options.quality = 90;
+        options.subsampling = subsampling;
+        setCpuLevel(CpuLevel::Scalar);
+        const std::vector<unsigned char> scalar = roundTrip(rgb, width, height, options);
+        if (scalar.size() != rgb.size())
+        {
+            continue;
+        }
+        check(psnr(rgb, scalar) > 30, "the decoded image is close to the original");
+        for (const CpuLevel level : {CpuLevel::SSE2, CpuLevel::SSSE3, CpuLevel::AVX2,
+                                     CpuLevel::AVX512})
+        {
+            if (level <= detected && setCpuLevel(level))
+            {
+                check(roundTrip(rgb, width, height, options) == scalar,
+                      "every kernel level gives the same pixels");
+            }
+        }
+        setCpuLevel(detected);
+        // Huffman tables built for the image, and restart intervals coded on several threads,
+        // change the size of the JPG but not its pixels.
+        options.optimizeHuffmanTables = true;
+        options.restartInterval = 2;
+        options.threads = 4;
+        check(roundTrip(rgb, width, height, options) == scalar,
+              "optimized tables and threads give the same pixels");
+    }
+    return failures == 0 ? 0 : 1;
+}
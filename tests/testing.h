@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Shared by the tests, each a program that reports every check that fails and returns non-zero
+// if any did. Sample images are found through JPEG_TEST_SAMPLES.
+
+inline int failures = 0;
+
+inline void check(const bool condition, const char* const what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures += 1;
+    }
+}
+
+inline std::string samplePath(const char* const name)
+{
+    return std::string(JPEG_TEST_SAMPLES) + "/" + name;
+}
+
+inline std::vector<unsigned char> readSample(const char* const name)
+{
+    std::ifstream file(samplePath(name), std::ios::binary);
+    return std::vector<unsigned char>(std::istreambuf_iterator<char>(file),
+                                      std::istreambuf_iterator<char>());
+}
@@ -0,0 +1,962 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "asyncio.h"
+#include "decoder.h"
+#include "encoder.h"
+#include "jpegdec.h"
+#include "kernels.h"
+
+// Measure how fast every stage of the decoder, and the encoder, run over a corpus of images:
+//     jpeg_bench [--warmup N] [--reps N] [--size WIDTHxHEIGHT] [--cpu LEVEL] [--json]
+//                [--no-synthetic] [--mjpeg FILE] [files...]
+// The corpus is the given files, or the images in samples/ when there are none, plus synthetic
+// images of the given size at several qualities and subsamplings. --cpu selects the kernels of a
+// lower instruction set level than the detected one (scalar, sse2, ssse3, avx2 or avx512).
+// Every image is also encoded again from its decoded pixels, at quality 75 with 4:2:0 subsampling.
+// Finally the whole corpus is decoded to BMP files as one batch, with asynchronous file I/O, and
+// decoded from memory through a DecodeCache: once when it misses, once for a crop region that
+// finds only the parsed header, and once more when it finds the pixels. The largest image is
+// decoded within memory budgets of 1, 1/4 and 1/16 of what decoding it whole takes.
+// Sustained frame rates are measured for the Motion JPEG stream given by --mjpeg, and for a
+// synthetic stream whose frames leave out their Huffman tables.
+
+#ifndef JPEG_BENCH_SAMPLES
+#define JPEG_BENCH_SAMPLES "samples"
+#endif
+
+const char* const stageNames[] = {"readJPG",
+                                  "decodeHuffmanData",
+                                  "inverseDCT",
+                                  "YCbCrToRGB",
+                                  "writeBMP"};
+const uint numStages = sizeof(stageNames) / sizeof(stageNames[0]);
+
+struct Image
+{
+    std::string name;
+    std::string filename;
+    std::uintmax_t fileSize = 0;
+    uint width = 0, height = 0;
+    uint numMCUs = 0;
+    std::vector<double> seconds[numStages];
+    // Times of encoding the decoded pixels, the size of the JPG and its number of MCUs.
+    std::vector<double> encodeSeconds;
+    std::size_t encodedSize = 0;
+    uint encodedMCUs = 0;
+    bool valid = true;
+    std::string error;
+};
+
+struct Stream
+{
+    std::string name;
+    std::string filename;
+    std::uintmax_t fileSize = 0;
+    uint frames = 0;
+    double megapixels = 0.0;
+    std::vector<double> seconds;
+    bool valid = true;
+    std::string error;
+};
+
+struct Batch
+{
+    std::vector<std::string> inputs, outputs;
+    std::uintmax_t bytes = 0;
+    double megapixels = 0.0;
+    std::vector<double> seconds;
+    bool valid = true;
+};
+
+struct CacheBench
+{
+    std::vector<std::vector<unsigned char>> files;
+    double megapixels = 0.0;
+    std::vector<double> missSeconds, headerHitSeconds, hitSeconds;
+    bool valid = true;
+};
+
+struct BudgetRun
+{
+    std::size_t budget = 0;
+    DecodePlan plan;
+    std::vector<double> seconds;
+    bool valid = true;
+};
+
+const char* const strategyNames[] = {"full frame", "row streaming", "tiled", "scaled"};
+
+struct Statistics
+{
+    double min = 0.0;
+    double median = 0.0;
+    double mean = 0.0;
+    double stddev = 0.0;
+};
+
+Statistics getStatistics(std::vector<double> samples)
+{
+    Statistics s;
+    if (samples.empty())
+    {
+        return s;
+    }
+    std::sort(samples.begin(), samples.end());
+    const std::size_t n = samples.size();
+    s.min = samples[0];
+    s.median = (n % 2 == 1) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+    for (const double sample : samples)
+    {
+        s.mean += sample;
+    }
+    s.mean /= n;
+    for (const double sample : samples)
+    {
+        s.stddev += (sample - s.mean) * (sample - s.mean);
+    }
+    s.stddev = (n > 1) ? std::sqrt(s.stddev / (n - 1)) : 0.0;
+    return s;
+}
+
+// Write a synthetic image with a smooth gradient and pseudo-random detail that falls off with
+// frequency, quantized with the tables for the quality. Higher qualities leave more non-zero
+// coefficients. Subsampling is 400 (grayscale), 444, 422 or 420.
+bool writeSyntheticJPG(const std::string& filename,
+                       const uint width,
+                       const uint height,
+                       const uint quality,
+                       const uint subsampling)
+{
+    Header header;
+    if (!setEncoderHeader(&header, width, height, quality, subsampling))
+    {
+        std::cout << "Error - " << header.status.message << "\n";
+        return false;
+    }
+
+    MCU* mcus = new (std::nothrow) MCU[header.blockHeightReal * header.blockWidthReal];
+    if (mcus == nullptr)
+    {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+
+    uint seed = 12345;
+    for (uint i = 0; i < header.numComponents.to_ulong(); ++i)
+    {
+        const ColorComponent& c = header.colorComponents[i];
+        const uint h = c.horizontalSamplingFactor.to_ulong();
+        const uint v = c.verticalSamplingFactor.to_ulong();
+        const uint* const table = header.quantizationTables[c.quantizationTableID.to_ulong()].table;
+        for (uint y = 0; y < header.mcuHeight * v; ++y)
+        {
+            for (uint x = 0; x < header.mcuWidth * h; ++x)
+            {
+                int* const block = componentBlock(&header, mcus, i, x, y);
+                const double dc = 600.0 * std::sin(x * 0.05 + i) * std::cos(y * 0.07 - i);
+                block[0] = static_cast<int>(std::lround(dc / table[0]));
+                for (uint k = 1; k < 64; ++k)
+                {
+                    seed = seed * 1103515245 + 12345;
+                    const double noise = static_cast<int>((seed >> 16) & 0x7FFF) / 16384.0 - 1.0;
+                    const double ac = 400.0 * noise / (1 + k);
+                    block[zigZagMap[k]] = static_cast<int>(ac / table[zigZagMap[k]]);
+                }
+            }
+        }
+    }
+
+    const bool written = writeJPG(&header, mcus, filename);
+    if (!written)
+    {
+        std::cout << "Error - " << header.status.message << "\n";
+    }
+    delete[] mcus;
+    return written;
+}
+
+// Remove the DHT segments of a JPG, as Motion JPEG frames that use the standard tables do.
+std::string removeHuffmanTables(const std::string& jpg)
+{
+    std::string frame = jpg.substr(0, 2);
+    std::size_t i = 2;
+    while (i + 4 <= jpg.size() && static_cast<unsigned char>(jpg[i + 1]) != SOS.to_ulong())
+    {
+        const std::size_t length = (static_cast<unsigned char>(jpg[i + 2]) << 8)
+                                   + static_cast<unsigned char>(jpg[i + 3]);
+        if (static_cast<unsigned char>(jpg[i + 1]) != DHT.to_ulong())
+        {
+            frame.append(jpg, i, length + 2);
+        }
+        i += length + 2;
+    }
+    frame.append(jpg, i, std::string::npos);
+    return frame;
+}
+
+// Write a Motion JPEG stream of the same synthetic frame repeated, without Huffman tables.
+bool writeSyntheticMJPEG(const std::string& filename,
+                         const std::string& frameFilename,
+                         const uint frames)
+{
+    std::ifstream frameFile(frameFilename, std::ios::in | std::ios::binary);
+    const std::string frame = removeHuffmanTables(
+        std::string(std::istreambuf_iterator<char>(frameFile), std::istreambuf_iterator<char>()));
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    for (uint i = 0; i < frames; ++i)
+    {
+        outFile.write(frame.data(), frame.size());
+    }
+    outFile.close();
+    if (!frameFile || !outFile)
+    {
+        std::cout << "Error - Failed writing " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Decode every frame of a stream once, adding the time to its samples when record is true.
+bool decodeStream(Stream& stream, const bool record)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::ifstream inFile(stream.filename, std::ios::in | std::ios::binary);
+    MotionJPEGDecoder decoder(inFile);
+    std::vector<unsigned char> pixels;
+    ImageInfo info;
+    double megapixels = 0.0;
+    while (decoder.nextFrame(pixels, &info))
+    {
+        megapixels += static_cast<double>(info.width) * info.height / 1e6;
+    }
+    const double seconds
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!decoder.status().ok() || decoder.framesDecoded() == 0)
+    {
+        stream.error = decoder.status().ok() ? "No frames" : decoder.status().message;
+        return false;
+    }
+    stream.frames = decoder.framesDecoded();
+    stream.megapixels = megapixels;
+    if (record)
+    {
+        stream.seconds.push_back(seconds);
+    }
+    return true;
+}
+
+// Decode an image once, adding the time of each stage to its samples when record is true.
+bool decodeImage(Image& image, const std::string& bmpFilename, const bool record)
+{
+    double seconds[numStages];
+    uint stage = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const auto lap = [&]()
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        seconds[stage++] = std::chrono::duration<double>(now - start).count();
+        start = now;
+    };
+
+    Header* header = readJPG(image.filename);
+    lap();
+    if (header == nullptr || header->valid == false)
+    {
+        image.error = (header == nullptr) ? "Memory error" : header->status.message;
+        delete header;
+        return false;
+    }
+    MCU* mcus = decodeHuffmanData(header, true);
+    lap();
+    if (mcus == nullptr)
+    {
+        image.error = header->status.message;
+        delete header;
+        return false;
+    }
+    inverseDCT(header, mcus);
+    lap();
+    YCbCrToRGB(header, mcus);
+    lap();
+    writeBMP(header, mcus, bmpFilename);
+    lap();
+
+    image.width = header->width;
+    image.height = header->height;
+    image.numMCUs = header->mcuWidth * header->mcuHeight;
+    delete[] mcus;
+    delete header;
+
+    if (record)
+    {
+        for (uint i = 0; i < numStages; ++i)
+        {
+            image.seconds[i].push_back(seconds[i]);
+        }
+    }
+    return true;
+}
+
+// Encode the decoded pixels of an image once, adding the time to its samples when record is true.
+bool encodeImage(Image& image, const std::vector<unsigned char>& pixels, const bool record)
+{
+    EncodeOptions options;
+    options.quality = 75;
+    options.subsampling = 420;
+    std::vector<unsigned char> jpg;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const Status status = encodeJPG(pixels.data(), image.width, image.height, options, jpg);
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    if (!status.ok())
+    {
+        image.error = status.message;
+        return false;
+    }
+    image.encodedSize = jpg.size();
+    image.encodedMCUs = ((image.width + 15) / 16) * ((image.height + 15) / 16);
+    if (record)
+    {
+        image.encodeSeconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    return true;
+}
+
+void printText(const std::vector<Image>& images, const uint warmup, const uint reps)
+{
+    std::printf("%u warmup and %u timed runs per image, times are medians, %s kernels\n",
+                warmup,
+                reps,
+                cpuLevelName(getCpuLevel()));
+    for (const Image& image : images)
+    {
+        if (!image.valid)
+        {
+            std::printf("\n%s: failed to decode: %s\n", image.name.c_str(), image.error.c_str());
+            continue;
+        }
+        std::printf("\n%s: %ux%u, %ju bytes, %u MCUs\n",
+                    image.name.c_str(),
+                    image.width,
+                    image.height,
+                    image.fileSize,
+                    image.numMCUs);
+        std::printf("  %-18s %10s %10s %10s %10s %10s\n",
+                    "stage",
+                    "ms",
+                    "stddev",
+                    "MB/s",
+                    "MP/s",
+                    "ns/MCU");
+        std::vector<double> total(reps, 0.0);
+        for (uint i = 0; i <= numStages; ++i)
+        {
+            if (i < numStages)
+            {
+                for (uint j = 0; j < reps; ++j)
+                {
+                    total[j] += image.seconds[i][j];
+                }
+            }
+            const Statistics s = getStatistics((i < numStages) ? image.seconds[i] : total);
+            std::printf("  %-18s %10.3f %10.3f %10.1f %10.1f %10.1f\n",
+                        (i < numStages) ? stageNames[i] : "total",
+                        s.median * 1e3,
+                        s.stddev * 1e3,
+                        image.fileSize / s.median / 1e6,
+                        static_cast<double>(image.width) * image.height / s.median / 1e6,
+                        s.median * 1e9 / image.numMCUs);
+        }
+        // The encoder writes encodedSize bytes of 4:2:0 MCUs.
+        if (!image.encodeSeconds.empty())
+        {
+            const Statistics s = getStatistics(image.encodeSeconds);
+            std::printf("  %-18s %10.3f %10.3f %10.1f %10.1f %10.1f\n",
+                        "encode",
+                        s.median * 1e3,
+                        s.stddev * 1e3,
+                        image.encodedSize / s.median / 1e6,
+                        static_cast<double>(image.width) * image.height / s.median / 1e6,
+                        s.median * 1e9 / image.encodedMCUs);
+        }
+    }
+}
+
+// Decode a batch once, adding the time to its samples when record is true.
+bool decodeBatchOnce(Batch& batch, const bool record)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::vector<Status> statuses = decodeBatch(batch.inputs, batch.outputs);
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    for (const Status& status : statuses)
+    {
+        if (!status.ok())
+        {
+            return false;
+        }
+    }
+    if (record)
+    {
+        batch.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    return true;
+}
+
+// Decode the corpus through an empty cache three times, adding the times to its samples when
+// record is true.
+bool decodeCachedOnce(CacheBench& bench, const bool record)
+{
+    DecodeCache cache;
+    std::vector<unsigned char> pixels;
+    double seconds[3] = {0.0, 0.0, 0.0};
+    for (const std::vector<unsigned char>& file : bench.files)
+    {
+        ImageInfo info;
+        for (uint i = 0; i < 3; ++i)
+        {
+            Crop crop;
+            crop.width = (info.width + 1) / 2;
+            crop.height = (info.height + 1) / 2;
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            const Status status = cache.decodeJPG(file.data(),
+                                                  file.size(),
+                                                  pixels,
+                                                  i == 1 ? &crop : nullptr,
+                                                  &info);
+            const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            if (!status.ok())
+            {
+                return false;
+            }
+            seconds[i] += std::chrono::duration<double>(end - start).count();
+        }
+    }
+    if (record)
+    {
+        bench.missSeconds.push_back(seconds[0]);
+        bench.headerHitSeconds.push_back(seconds[1]);
+        bench.hitSeconds.push_back(seconds[2]);
+    }
+    return true;
+}
+
+// Decode an image within the budget of a run, adding the time to its samples when record is true.
+bool decodeWithinBudget(const Image& image, BudgetRun& run, const bool record)
+{
+    BudgetOptions options;
+    options.memoryBudget = run.budget;
+    const RowCallback ignoreRows = [](uint, const unsigned char*, uint, uint)
+    {
+        return true;
+    };
+    std::ifstream inFile(image.filename, std::ios::in | std::ios::binary);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const Status status = decodeWithBudget(inFile, options, ignoreRows, &run.plan);
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    if (record)
+    {
+        run.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    return status.ok();
+}
+
+void printBudgetText(const Image* const image, const std::vector<BudgetRun>& runs)
+{
+    if (image == nullptr)
+    {
+        return;
+    }
+    std::printf("\n%s within memory budgets\n", image->name.c_str());
+    std::printf("  %12s %-14s %6s %6s %12s %10s %10s\n",
+                "budget",
+                "strategy",
+                "rows",
+                "tiles",
+                "peak bytes",
+                "ms",
+                "MP/s");
+    for (const BudgetRun& run : runs)
+    {
+        if (!run.valid)
+        {
+            std::printf("  %12zu failed to decode\n", run.budget);
+            continue;
+        }
+        const Statistics s = getStatistics(run.seconds);
+        std::printf("  %12zu %-14s %6u %6u %12zu %10.3f %10.1f\n",
+                    run.budget,
+                    strategyNames[static_cast<int>(run.plan.strategy)],
+                    run.plan.bandRows,
+                    run.plan.tileColumns,
+                    run.plan.peakBytes,
+                    s.median * 1e3,
+                    static_cast<double>(image->width) * image->height / 1e6 / s.median);
+    }
+}
+
+// The backend AsyncFileIO uses on this system.
+std::string asyncIOBackend()
+{
+    AsyncFileIO io([](IOCompletion&) {}, 1);
+    return io.backend();
+}
+
+void printBatchText(const Batch& batch)
+{
+    if (batch.inputs.empty())
+    {
+        return;
+    }
+    if (!batch.valid)
+    {
+        std::printf("\nbatch: failed to decode\n");
+        return;
+    }
+    const Statistics s = getStatistics(batch.seconds);
+    std::printf("\nbatch of %zu files, %.1f megapixels, %ju bytes, %s I/O\n",
+                batch.inputs.size(),
+                batch.megapixels,
+                batch.bytes,
+                asyncIOBackend().c_str());
+    std::printf("  %10s %10s %10s %10s %10s\n", "ms", "stddev", "files/s", "MB/s", "MP/s");
+    std::printf("  %10.3f %10.3f %10.1f %10.1f %10.1f\n",
+                s.median * 1e3,
+                s.stddev * 1e3,
+                batch.inputs.size() / s.median,
+                batch.bytes / s.median / 1e6,
+                batch.megapixels / s.median);
+}
+
+void printCacheText(const CacheBench& bench)
+{
+    if (bench.files.empty())
+    {
+        return;
+    }
+    if (!bench.valid)
+    {
+        std::printf("\ncache: failed to decode\n");
+        return;
+    }
+    std::printf("\ncache of %zu images, %.1f megapixels\n", bench.files.size(), bench.megapixels);
+    std::printf("  %-12s %10s %10s %10s\n", "lookup", "ms", "stddev", "MP/s");
+    const char* const names[] = {"miss", "header hit", "hit"};
+    const std::vector<double>* const samples[] = {&bench.missSeconds,
+                                                  &bench.headerHitSeconds,
+                                                  &bench.hitSeconds};
+    for (uint i = 0; i < 3; ++i)
+    {
+        const Statistics s = getStatistics(*samples[i]);
+        std::printf("  %-12s %10.3f %10.3f %10.1f\n",
+                    names[i],
+                    s.median * 1e3,
+                    s.stddev * 1e3,
+                    // The header hits decode a quarter of every image.
+                    bench.megapixels / (i == 1 ? 4 : 1) / s.median);
+    }
+}
+
+void printStreamsText(const std::vector<Stream>& streams)
+{
+    for (const Stream& stream : streams)
+    {
+        if (!stream.valid)
+        {
+            std::printf("\n%s: failed to decode: %s\n", stream.name.c_str(), stream.error.c_str());
+            continue;
+        }
+        const Statistics s = getStatistics(stream.seconds);
+        std::printf("\n%s: %u frames, %.1f megapixels, %ju bytes\n",
+                    stream.name.c_str(),
+                    stream.frames,
+                    stream.megapixels,
+                    stream.fileSize);
+        std::printf("  %10s %10s %10s %10s %10s\n", "ms", "stddev", "frames/s", "MB/s", "MP/s");
+        std::printf("  %10.3f %10.3f %10.1f %10.1f %10.1f\n",
+                    s.median * 1e3,
+                    s.stddev * 1e3,
+                    stream.frames / s.median,
+                    stream.fileSize / s.median / 1e6,
+                    stream.megapixels / s.median);
+    }
+}
+
+void printJSON(const std::vector<Image>& images,
+               const std::vector<Stream>& streams,
+               const Batch& batch,
+               const CacheBench& cache,
+               const std::vector<BudgetRun>& budgetRuns,
+               const uint warmup,
+               const uint reps)
+{
+    std::printf("{\n  \"warmup\": %u,\n  \"reps\": %u,\n  \"cpuLevel\": \"%s\",\n"
+                "  \"images\": [",
+                warmup,
+                reps,
+                cpuLevelName(getCpuLevel()));
+    for (uint i = 0; i < images.size(); ++i)
+    {
+        const Image& image = images[i];
+        std::printf("%s\n    {\n      \"name\": \"%s\",\n      \"valid\": %s",
+                    (i == 0) ? "" : ",",
+                    image.name.c_str(),
+                    image.valid ? "true" : "false");
+        if (!image.valid)
+        {
+            std::printf(",\n      \"error\": \"%s\"\n    }", image.error.c_str());
+            continue;
+        }
+        std::printf(",\n      \"width\": %u,\n      \"height\": %u,\n      \"bytes\": %ju,\n"
+                    "      \"mcus\": %u,\n      \"stages\": [",
+                    image.width,
+                    image.height,
+                    image.fileSize,
+                    image.numMCUs);
+        for (uint j = 0; j < numStages; ++j)
+        {
+            const Statistics s = getStatistics(image.seconds[j]);
+            std::printf("%s\n        {\"name\": \"%s\", \"min_ms\": %.4f, \"median_ms\": %.4f, "
+                        "\"mean_ms\": %.4f, \"stddev_ms\": %.4f, \"mb_per_s\": %.2f, "
+                        "\"mp_per_s\": %.2f, \"ns_per_mcu\": %.1f}",
+                        (j == 0) ? "" : ",",
+                        stageNames[j],
+                        s.min * 1e3,
+                        s.median * 1e3,
+                        s.mean * 1e3,
+                        s.stddev * 1e3,
+                        image.fileSize / s.median / 1e6,
+                        static_cast<double>(image.width) * image.height / s.median / 1e6,
+                        s.median * 1e9 / image.numMCUs);
+        }
+        std::printf("\n      ]");
+        if (!image.encodeSeconds.empty())
+        {
+            const Statistics s = getStatistics(image.encodeSeconds);
+            std::printf(",\n      \"encode\": {\"bytes\": %zu, \"mcus\": %u, \"min_ms\": %.4f, "
+                        "\"median_ms\": %.4f, \"mean_ms\": %.4f, \"stddev_ms\": %.4f, "
+                        "\"mb_per_s\": %.2f, \"mp_per_s\": %.2f, \"ns_per_mcu\": %.1f}",
+                        image.encodedSize,
+                        image.encodedMCUs,
+                        s.min * 1e3,
+                        s.median * 1e3,
+                        s.mean * 1e3,
+                        s.stddev * 1e3,
+                        image.encodedSize / s.median / 1e6,
+                        static_cast<double>(image.width) * image.height / s.median / 1e6,
+                        s.median * 1e9 / image.encodedMCUs);
+        }
+        std::printf("\n    }");
+    }
+    std::printf("\n  ],\n  \"streams\": [");
+    for (uint i = 0; i < streams.size(); ++i)
+    {
+        const Stream& stream = streams[i];
+        std::printf("%s\n    {\n      \"name\": \"%s\",\n      \"valid\": %s",
+                    (i == 0) ? "" : ",",
+                    stream.name.c_str(),
+                    stream.valid ? "true" : "false");
+        if (!stream.valid)
+        {
+            std::printf(",\n      \"error\": \"%s\"\n    }", stream.error.c_str());
+            continue;
+        }
+        const Statistics s = getStatistics(stream.seconds);
+        std::printf(",\n      \"frames\": %u,\n      \"megapixels\": %.3f,\n"
+                    "      \"bytes\": %ju,\n      \"median_ms\": %.4f,\n"
+                    "      \"stddev_ms\": %.4f,\n      \"frames_per_s\": %.2f,\n"
+                    "      \"mp_per_s\": %.2f\n    }",
+                    stream.frames,
+                    stream.megapixels,
+                    stream.fileSize,
+                    s.median * 1e3,
+                    s.stddev * 1e3,
+                    stream.frames / s.median,
+                    stream.megapixels / s.median);
+    }
+    std::printf("\n  ]");
+    if (!batch.inputs.empty())
+    {
+        const Statistics s = getStatistics(batch.seconds);
+        std::printf(",\n  \"batch\": {\"files\": %zu, \"valid\": %s, \"io\": \"%s\", "
+                    "\"bytes\": %ju, \"median_ms\": %.4f, \"stddev_ms\": %.4f, "
+                    "\"files_per_s\": %.2f, \"mp_per_s\": %.2f}",
+                    batch.inputs.size(),
+                    batch.valid ? "true" : "false",
+                    asyncIOBackend().c_str(),
+                    batch.bytes,
+                    s.median * 1e3,
+                    s.stddev * 1e3,
+                    batch.valid ? batch.inputs.size() / s.median : 0.0,
+                    batch.valid ? batch.megapixels / s.median : 0.0);
+    }
+    if (!cache.files.empty())
+    {
+        std::printf(",\n  \"cache\": {\"images\": %zu, \"valid\": %s, \"miss_ms\": %.4f, "
+                    "\"header_hit_ms\": %.4f, \"hit_ms\": %.4f}",
+                    cache.files.size(),
+                    cache.valid ? "true" : "false",
+                    getStatistics(cache.missSeconds).median * 1e3,
+                    getStatistics(cache.headerHitSeconds).median * 1e3,
+                    getStatistics(cache.hitSeconds).median * 1e3);
+    }
+    if (!budgetRuns.empty())
+    {
+        std::printf(",\n  \"budget\": [");
+        for (std::size_t i = 0; i < budgetRuns.size(); ++i)
+        {
+            const BudgetRun& run = budgetRuns[i];
+            std::printf("%s\n    {\"budget\": %zu, \"valid\": %s, \"strategy\": \"%s\", "
+                        "\"band_rows\": %u, \"tile_columns\": %u, \"peak_bytes\": %zu, "
+                        "\"median_ms\": %.4f}",
+                        i == 0 ? "" : ",",
+                        run.budget,
+                        run.valid ? "true" : "false",
+                        strategyNames[static_cast<int>(run.plan.strategy)],
+                        run.plan.bandRows,
+                        run.plan.tileColumns,
+                        run.plan.peakBytes,
+                        getStatistics(run.seconds).median * 1e3);
+        }
+        std::printf("\n  ]");
+    }
+    std::printf("\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    uint warmup = 1;
+    uint reps = 5;
+    uint width = 2048, height = 1536;
+    bool json = false;
+    bool synthetic = true;
+    CpuLevel level;
+    std::vector<std::string> filenames;
+    std::vector<Stream> streams;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string option(argv[i]);
+        const bool hasValue = i + 1 < argc;
+        if (option == "--warmup" && hasValue && std::sscanf(argv[i + 1], "%u", &warmup) == 1)
+        {
+            ++i;
+        }
+        else if (option == "--reps" && hasValue && std::sscanf(argv[i + 1], "%u", &reps) == 1
+                 && reps > 0)
+        {
+            ++i;
+        }
+        else if (option == "--size" && hasValue
+                 && std::sscanf(argv[i + 1], "%ux%u", &width, &height) == 2 && width > 0
+                 && height > 0 && width <= 65535 && height <= 65535)
+        {
+            ++i;
+        }
+        else if (option == "--cpu" && hasValue && parseCpuLevel(argv[i + 1], level))
+        {
+            if (!setCpuLevel(level))
+            {
+                std::cout << "Error - CPU level " << argv[i + 1] << " is not supported\n";
+                return 1;
+            }
+            ++i;
+        }
+        else if (option == "--mjpeg" && hasValue)
+        {
+            Stream stream;
+            stream.name = std::filesystem::path(argv[i + 1]).filename().string();
+            stream.filename = argv[i + 1];
+            streams.push_back(stream);
+            ++i;
+        }
+        else if (option == "--json")
+        {
+            json = true;
+        }
+        else if (option == "--no-synthetic")
+        {
+            synthetic = false;
+        }
+        else if (option.rfind("--", 0) == 0)
+        {
+            std::cout << "Error - Invalid arguments\n";
+            return 1;
+        }
+        else
+        {
+            filenames.push_back(option);
+        }
+    }
+
+    std::vector<Image> images;
+    std::error_code error;
+    if (filenames.empty())
+    {
+        for (const auto& entry : std::filesystem::directory_iterator(JPEG_BENCH_SAMPLES, error))
+        {
+            if (entry.path().extension() == ".jpg")
+            {
+                filenames.push_back(entry.path().string());
+            }
+        }
+        std::sort(filenames.begin(), filenames.end());
+    }
+    for (const std::string& filename : filenames)
+    {
+        Image image;
+        image.name = std::filesystem::path(filename).filename().string();
+        image.filename = filename;
+        images.push_back(image);
+    }
+
+    const std::filesystem::path directory = std::filesystem::temp_directory_path() / "jpeg_bench";
+    std::filesystem::create_directories(directory, error);
+    std::vector<std::string> syntheticFilenames;
+    if (synthetic)
+    {
+        for (const uint subsampling : {400u, 444u, 422u, 420u})
+        {
+            for (const uint quality : {50u, 75u, 95u})
+            {
+                Image image;
+                image.name = "synthetic_" + std::to_string(width) + "x" + std::to_string(height)
+                             + "_" + std::to_string(subsampling) + "_q" + std::to_string(quality);
+                image.filename = (directory / (image.name + ".jpg")).string();
+                if (!writeSyntheticJPG(image.filename, width, height, quality, subsampling))
+                {
+                    return 1;
+                }
+                syntheticFilenames.push_back(image.filename);
+                images.push_back(image);
+            }
+        }
+
+        // 30 frames of the 4:2:0 image at quality 75.
+        Stream stream;
+        stream.name = "synthetic_" + std::to_string(width) + "x" + std::to_string(height)
+                      + "_420_q75.mjpg";
+        stream.filename = (directory / stream.name).string();
+        if (!writeSyntheticMJPEG(stream.filename, images[images.size() - 2].filename, 30))
+        {
+            return 1;
+        }
+        syntheticFilenames.push_back(stream.filename);
+        streams.push_back(stream);
+    }
+
+    const std::string bmpFilename = (directory / "output.bmp").string();
+    for (Image& image : images)
+    {
+        image.fileSize = std::filesystem::file_size(image.filename, error);
+        for (uint i = 0; i < warmup + reps && image.valid; ++i)
+        {
+            image.valid = decodeImage(image, bmpFilename, i >= warmup);
+        }
+        std::vector<unsigned char> pixels;
+        if (image.valid && decodeJPG(image.filename, pixels).ok())
+        {
+            for (uint i = 0; i < warmup + reps && image.valid; ++i)
+            {
+                image.valid = encodeImage(image, pixels, i >= warmup);
+            }
+        }
+    }
+    Batch batch;
+    for (const Image& image : images)
+    {
+        if (image.valid)
+        {
+            batch.inputs.push_back(image.filename);
+            batch.outputs.push_back(
+                (directory / ("batch_" + std::to_string(batch.outputs.size()) + ".bmp")).string());
+            batch.bytes += image.fileSize;
+            batch.megapixels += static_cast<double>(image.width) * image.height / 1e6;
+        }
+    }
+    for (uint i = 0; i < warmup + reps && batch.valid && !batch.inputs.empty(); ++i)
+    {
+        batch.valid = decodeBatchOnce(batch, i >= warmup);
+    }
+    CacheBench cache;
+    for (const Image& image : images)
+    {
+        std::ifstream inFile(image.filename, std::ios::in | std::ios::binary);
+        if (image.valid && inFile.is_open())
+        {
+            cache.files.emplace_back(std::istreambuf_iterator<char>(inFile),
+                                     std::istreambuf_iterator<char>());
+            cache.megapixels += static_cast<double>(image.width) * image.height / 1e6;
+        }
+    }
+    for (uint i = 0; i < warmup + reps && cache.valid && !cache.files.empty(); ++i)
+    {
+        cache.valid = decodeCachedOnce(cache, i >= warmup);
+    }
+    // Budgets are fractions of the peak bytes of decoding the largest image whole.
+    const Image* largest = nullptr;
+    for (const Image& image : images)
+    {
+        if (image.valid
+            && (largest == nullptr
+                || static_cast<uint64_t>(image.width) * image.height
+                       > static_cast<uint64_t>(largest->width) * largest->height))
+        {
+            largest = &image;
+        }
+    }
+    std::vector<BudgetRun> budgetRuns;
+    BudgetRun whole;
+    if (largest != nullptr && decodeWithinBudget(*largest, whole, false))
+    {
+        for (const std::size_t divisor : {1, 4, 16})
+        {
+            BudgetRun run;
+            run.budget = whole.plan.peakBytes / divisor;
+            for (uint i = 0; i < warmup + reps && run.valid; ++i)
+            {
+                run.valid = decodeWithinBudget(*largest, run, i >= warmup);
+            }
+            budgetRuns.push_back(run);
+        }
+    }
+    for (Stream& stream : streams)
+    {
+        stream.fileSize = std::filesystem::file_size(stream.filename, error);
+        for (uint i = 0; i < warmup + reps && stream.valid; ++i)
+        {
+            stream.valid = decodeStream(stream, i >= warmup);
+        }
+    }
+
+    if (json)
+    {
+        printJSON(images, streams, batch, cache, budgetRuns, warmup, reps);
+    }
+    else
+    {
+        printText(images, warmup, reps);
+        printStreamsText(streams);
+        printBatchText(batch);
+        printCacheText(cache);
+        printBudgetText(budgetRuns.empty() ? nullptr : largest, budgetRuns);
+    }
+
+    for (const std::string& filename : syntheticFilenames)
+    {
+        std::filesystem::remove(filename, error);
+    }
+    std::filesystem::remove(bmpFilename, error);
+    for (const std::string& filename : batch.outputs)
+    {
+        std::filesystem::remove(filename, error);
+    }
+    std::filesystem::remove(directory, error);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "decoder.h"
+
+// Build the restart index of each JPG given, saved as <filename>.idx, for decoding crop regions
+// and decoding on many threads with main --index.
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+    setLogCallback(printLogMessage, nullptr, LogLevel::Error);
+    int result = 0;
+    uint interval = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        // --checkpoints N also records the decoder state every N MCUs, for files without restart
+        // markers.
+        if (std::string(argv[i]) == "--checkpoints")
+        {
+            if (i + 1 >= argc || std::sscanf(argv[i + 1], "%u", &interval) != 1)
+            {
+                std::cout << "Error - Invalid arguments\n";
+                return 1;
+            }
+            ++i;
+            continue;
+        }
+        const std::string filename(argv[i]);
+        Header* header = readJPG(filename);
+        if (header == nullptr)
+        {
+            result = 1;
+            continue;
+        }
+        if (header->valid == false)
+        {
+            delete header;
+            result = 1;
+            continue;
+        }
+
+        RestartIndex* index = buildRestartIndex(header, filename, interval);
+        if (index == nullptr || !writeRestartIndex(index, filename + ".idx").ok())
+        {
+            result = 1;
+        }
+        else
+        {
+            std::cout << filename << ": " << index->header->numEntries << " entries\n";
+        }
+
+        delete index;
+        delete header;
+    }
+    return result;
+}
@@ -0,0 +1,104 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "decoder.h"
+#include "encoder.h"
+#include "transform.h"
+
+// Losslessly rotate, flip and/or crop a JPG:
+//     jpeg_transform [--rotate 90|180|270] [--flip horizontal|vertical] [--transpose]
+//                    [--crop x,y,width,height] [--optimize] input.jpg output.jpg
+// --optimize codes the result with Huffman tables built for it, which alone makes a JPG smaller.
+// Restart intervals are coded on every hardware thread.
+int main(int argc, char* argv[])
+{
+    Transform transform = Transform::None;
+    bool cropped = false;
+    bool optimized = false;
+    Crop crop;
+    int i = 1;
+    for (; i + 2 < argc; i += 2)
+    {
+        const std::string option(argv[i]);
+        const std::string value(argv[i + 1]);
+        if (option == "--rotate" && (value == "90" || value == "180" || value == "270"))
+        {
+            transform = (value == "90")    ? Transform::Rotate90
+                        : (value == "180") ? Transform::Rotate180
+                                           : Transform::Rotate270;
+        }
+        else if (option == "--flip" && (value == "horizontal" || value == "vertical"))
+        {
+            transform = (value == "horizontal") ? Transform::FlipHorizontal
+                                                : Transform::FlipVertical;
+        }
+        else if (option == "--transpose")
+        {
+            transform = Transform::Transpose;
+            i -= 1;
+        }
+        else if (option == "--optimize")
+        {
+            optimized = true;
+            i -= 1;
+        }
+        else if (option == "--crop"
+                 && std::sscanf(value.c_str(), "%u,%u,%u,%u", &crop.x, &crop.y, &crop.width,
+                                &crop.height)
+                        == 4)
+        {
+            cropped = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (i + 2 != argc)
+    {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    setLogCallback(printLogMessage, nullptr, LogLevel::Error);
+    Header* header = readJPG(argv[i]);
+    if (header == nullptr)
+    {
+        return 1;
+    }
+    if (header->valid == false)
+    {
+        delete header;
+        return 1;
+    }
+
+    MCU* mcus = decodeHuffmanData(header);
+    if (mcus == nullptr)
+    {
+        delete header;
+        return 1;
+    }
+
+    MCU* transformedMCUs = nullptr;
+    Header* transformed = transformCoefficients(header,
+                                                mcus,
+                                                transform,
+                                                cropped ? &crop : nullptr,
+                                                &transformedMCUs);
+    int result = 1;
+    if (transformed != nullptr && optimized)
+    {
+        optimizeHuffmanTables(transformed, transformedMCUs);
+    }
+    if (transformed != nullptr && writeJPG(transformed, transformedMCUs, argv[i + 1], 0))
+    {
+        result = 0;
+    }
+
+    delete[] transformedMCUs;
+    delete transformed;
+    delete[] mcus;
+    delete header;
+    return result;
+}
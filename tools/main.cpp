@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+#include "jpegdec.h"
+
+// The BMP file a JPG is decoded to: the same name with the extension .bmp.
+std::string bmpFilename(const std::string& filename)
+{
+    const std::size_t pos = filename.find_last_of('.');
+    return (pos == std::string::npos) ? (filename + ".bmp") : (filename.substr(0, pos) + ".bmp");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+    setLogCallback(printLogMessage, nullptr, LogLevel::Error);
+    bool cropped = false;
+    bool indexed = false;
+    bool statistics = false;
+    bool validating = false;
+    bool verbose = false;
+    bool batch = false;
+    std::vector<std::string> batchInputs;
+    std::vector<std::string> batchOutputs;
+    Crop crop;
+    for (int i = 1; i < argc; ++i)
+    {
+        // --crop x,y,width,height applies to every file after it.
+        if (std::string(argv[i]) == "--crop")
+        {
+            if (i + 1 >= argc
+                || std::sscanf(argv[i + 1], "%u,%u,%u,%u", &crop.x, &crop.y, &crop.width,
+                               &crop.height)
+                       != 4)
+            {
+                std::cout << "Error - Invalid arguments\n";
+                return 1;
+            }
+            cropped = true;
+            ++i;
+            continue;
+        }
+        // --index reads every file after it through the restart index saved next to it by
+        // jpeg_index.
+        if (std::string(argv[i]) == "--index")
+        {
+            indexed = true;
+            continue;
+        }
+        // --verbose prints the markers read and the header of every file after it.
+        if (std::string(argv[i]) == "--verbose")
+        {
+            setLogCallback(printLogMessage, nullptr, LogLevel::Debug);
+            verbose = true;
+            continue;
+        }
+        // --statistics prints the stage timings and counters of every file after it, when the
+        // decoder is built with instrumentation.
+        if (std::string(argv[i]) == "--statistics")
+        {
+            statistics = true;
+            continue;
+        }
+        // --validate checks every file after it without decoding it or writing a BMP, and prints
+        // where the error of each file that cannot be decoded was found.
+        if (std::string(argv[i]) == "--validate")
+        {
+            validating = true;
+            continue;
+        }
+        // --batch decodes every file after it together, reading and writing the files
+        // asynchronously while they are decoded on every hardware thread. The options that apply
+        // to single files are ignored for them.
+        if (std::string(argv[i]) == "--batch")
+        {
+            batch = true;
+            continue;
+        }
+        const std::string filename(argv[i]);
+        if (batch)
+        {
+            batchInputs.push_back(filename);
+            batchOutputs.push_back(bmpFilename(filename));
+            continue;
+        }
+        if (validating)
+        {
+            std::ifstream inFile = std::ifstream(filename, std::ios::in | std::ios::binary);
+            if (!inFile.is_open())
+            {
+                makeError(StatusCode::FileError, "Error opening input file");
+                continue;
+            }
+            ErrorLocation location;
+            Header* header = checkJPG(inFile, &location);
+            if (header != nullptr && !header->valid)
+            {
+                std::printf("Error location - marker 0x%X at byte %llu",
+                            location.marker,
+                            static_cast<unsigned long long>(location.markerOffset));
+                if (location.inScan)
+                {
+                    std::printf(", scan %u, unit %u, bit %llu",
+                                location.scan,
+                                location.unit,
+                                static_cast<unsigned long long>(location.bitOffset));
+                }
+                std::printf("\n");
+            }
+            delete header;
+            continue;
+        }
+        RestartIndex* index = nullptr;
+        if (indexed)
+        {
+            index = loadRestartIndex(filename + ".idx");
+            if (index == nullptr)
+            {
+                continue;
+            }
+        }
+        Header* header = readJPG(filename, index);
+        if (header == nullptr)
+        {
+            delete index;
+            continue;
+        }
+        if (header->valid == false)
+        {
+            delete header;
+            delete index;
+            continue;
+        }
+
+        if (verbose)
+        {
+            printHeader(header);
+        }
+
+        if ((cropped && !setCrop(header, crop))
+            || (index != nullptr && !readIndexedHuffmanData(filename, header, index)))
+        {
+            delete header;
+            delete index;
+            continue;
+        }
+        delete index;
+
+        // Decode and dequantize Huffman data.
+        MCU* mcus = decodeHuffmanData(header, true);
+        if (mcus == nullptr)
+        {
+            delete header;
+            continue;
+        }
+
+        inverseDCT(header, mcus);
+        YCbCrToRGB(header, mcus);
+
+        // Write BMP file
+        writeBMP(header, mcus, bmpFilename(filename));
+        if (statistics)
+        {
+            printStatistics(header);
+        }
+
+        delete[] mcus;
+        delete header;
+    }
+    // Errors are logged as each file fails, and any of them fails the batch.
+    const std::vector<Status> statuses = decodeBatch(batchInputs, batchOutputs);
+    for (const Status& status : statuses)
+    {
+        if (!status.ok())
+        {
+            return 1;
+        }
+    }
+    return 0;
+}